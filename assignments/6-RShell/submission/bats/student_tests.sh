@@ -119,7 +119,123 @@ EOF
     rm -f test_output.txt
 }
 
+@test "Local mode: Builtin output redirection" {
+    rm -f bi_dragon.txt bi_rc.txt
+    run ./dsh <<EOF
+dragon > bi_dragon.txt
+false
+rc > bi_rc.txt
+rc >> bi_rc.txt
+cd /nonexistent_dir > bi_cd.txt
+rc
+exit
+EOF
+    [ "$status" -eq 0 ]
+    [[ "$output" != *"@%%%%"* ]]
+    grep -q "@%%%%" bi_dragon.txt
+    [ "$(cat bi_rc.txt | tr '\n' ' ')" = "1 1 " ]
+    [ ! -s bi_cd.txt ]
+    [[ "$output" == *"cd: /nonexistent_dir:"* ]]
+    rm -f bi_dragon.txt bi_rc.txt bi_cd.txt
+}
+
+@test "Local mode: hash builtin remembers command paths" {
+    run ./dsh <<EOF
+ls
+ls
+hash
+hash -r
+hash
+hash nosuchcommand
+exit
+EOF
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"hits"*"2"*"/ls"* ]]
+    [[ "$output" == *"hash table empty"* ]]
+    [[ "$output" == *"hash: nosuchcommand: not found"* ]]
+}
+
+@test "Local mode: hashed script without a #! line runs under /bin/sh" {
+    printf 'echo "no shebang: $1"\n' > test_dir/noshebang_cmd
+    chmod +x test_dir/noshebang_cmd
+    PATH="$PWD/test_dir:$PATH" run ./dsh <<EOF
+noshebang_cmd one
+noshebang_cmd two
+exit
+EOF
+    echo "$output"
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"no shebang: one"*"no shebang: two"* ]]
+    [[ "$output" != *"could not execute"* ]]
+}
+
+@test "Local mode: time prefix reports per-stage usage" {
+    rm -f stats_test.jsonl
+    DSH_STATS_FILE=stats_test.jsonl run ./dsh <<EOF
+time echo timed | wc -l
+exit
+EOF
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"maxrss-kb"* ]]
+    [[ "$output" == *"0"*"echo"* ]]
+    [[ "$output" == *"1"*"wc"* ]]
+    [[ "$output" == *"total"* ]]
+    grep -q '"argv":\["wc","-l"\]' stats_test.jsonl
+    rm -f stats_test.jsonl
+}
+
+@test "Local mode: line editor recalls and persists history" {
+    if ! command -v script > /dev/null; then
+        skip "needs script(1) to run dsh on a pseudo terminal"
+    fi
+    rm -f hist_test.txt
+
+    # up arrow re-runs the last line, ^R finds it by substring.  Keys are
+    # paced so none of them reach the tty while it is in cooked mode.
+    run bash -c "(for k in 'echo first\\r' '\\033[A\\r' '\\022fir\\r' 'exit\\r'; do
+                    sleep 0.3; printf \"\$k\"; done; sleep 0.3) | \
+        DSH_HISTFILE=hist_test.txt TERM=xterm script -qec ./dsh /dev/null"
+
+    [ "$status" -eq 0 ]
+    [ "$(echo "$output" | tr -d '\r' | grep -c '^first$')" -eq 3 ]
+    [[ "$output" == *"reverse-i-search"* ]]
+    [ "$(cat hist_test.txt)" = "$(printf 'echo first\nexit')" ]
+    rm -f hist_test.txt
+}
+
+@test "Local mode: coproc keeps a worker between requests" {
+    run ./dsh <<EOF
+coproc up sed -u "s/a/A/g"
+coproc -s up banana
+coproc -s up papaya
+coproc -l
+coproc -k up
+coproc -s up again
+exit
+EOF
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"bAnAnA"* ]]
+    [[ "$output" == *"pApAyA"* ]]
+    [[ "$output" == *"up"*"2"*"sed -u s/a/A/g"* ]]
+    [[ "$output" == *"coproc: up: no such coprocess"* ]]
+}
+
 # Server mode tests
+@test "Local mode: export and unset change what later commands see" {
+    run ./dsh <<EOF
+export TESTVAR=local_env_test
+printenv TESTVAR
+unset TESTVAR
+printenv TESTVAR
+rc
+exit
+EOF
+    echo "$output"
+    [ "$status" -eq 0 ]
+    [ "$(echo "$output" | grep -c "local_env_test")" -eq 1 ]
+    [[ "$output" == *"dsh4> 1"* ]]
+}
+
 @test "Server mode: Start server" {
     # Skip this test as it's verified by subsequent tests
     skip "Server functionality tested by subsequent tests"
@@ -347,6 +463,462 @@ EOF
     [ "${#output}" -gt 5000 ]
 }
 
+@test "Remote shell: Binary output passes through framing" {
+    SERVER_PID=$(start_server 5032)
+
+    # 0x04 used to be the end-of-reply marker, and NULs cut C strings short
+    printf 'printf "one\\004two\\000three\\n"\necho done\nexit\n' | \
+        timeout 5s ./dsh -c -p 5032 > binary_client.out
+
+    kill $SERVER_PID 2>/dev/null || true
+    wait $SERVER_PID 2>/dev/null || true
+
+    run tr '\004\000' '#@' < binary_client.out
+    rm -f binary_client.out
+
+    echo "$output"
+    [[ "$output" == *"one#two@three"* ]]
+    [[ "$output" == *"done"* ]]
+}
+
+@test "Remote shell: Background commands run concurrently on one connection" {
+    SERVER_PID=$(start_server 5033)
+
+    start=$(date +%s)
+    run timeout 10s ./dsh -c -p 5033 <<EOF
+sleep 1 &
+sleep 1 &
+sh -c "sleep 1; echo late; exit 3" &
+echo foreground
+exit
+EOF
+    elapsed=$(( $(date +%s) - start ))
+
+    kill $SERVER_PID 2>/dev/null || true
+    wait $SERVER_PID 2>/dev/null || true
+
+    echo "$output"
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"foreground"*"late"* ]]
+    [[ "$output" == *"[1] done, exit 0"* ]]
+    [[ "$output" == *"[3] done, exit 3"* ]]
+    [[ "$output" == *"exiting..."* ]]
+    [ "$elapsed" -lt 3 ]
+}
+
+@test "Remote shell: stdout, stderr and exit status stay separate" {
+    SERVER_PID=$(start_server 5034)
+
+    # No exit at the end, so the client exits with the last status
+    rc=0
+    printf 'ls /nonexistent_dir\nsh -c "echo to-err >&2; echo to-out; exit 7"\n' | \
+        timeout 5s ./dsh -c -p 5034 > remote_test_out.txt 2> remote_test_err.txt || rc=$?
+
+    kill $SERVER_PID 2>/dev/null || true
+    wait $SERVER_PID 2>/dev/null || true
+
+    cat remote_test_out.txt remote_test_err.txt
+    [ "$rc" -eq 7 ]
+    grep -q "to-out" remote_test_out.txt
+    ! grep -q "to-err\|nonexistent_dir" remote_test_out.txt
+    grep -q "to-err" remote_test_err.txt
+    grep -q "nonexistent_dir" remote_test_err.txt
+}
+
+@test "Remote shell: Pre-forked spawners start commands" {
+    timeout 10s ./dsh -s -p 5035 -f 2 > server_output.log 2>&1 &
+    SERVER_PID=$!
+    sleep 1
+
+    # The spawners were forked at startup, cd afterwards must still apply
+    run timeout 5s ./dsh -c -p 5035 <<EOF
+cd test_dir
+cat inner_file.txt | tr a-z A-Z
+stats
+stop-server
+EOF
+    sleep 0.5
+    wait $SERVER_PID 2>/dev/null || true
+
+    echo "$output"
+    [[ "$output" == *"ANOTHER TEST FILE"* ]]
+    [[ "$output" == *"spawners: 2"* ]]
+    [[ "$output" == *"spawns: 1 by spawners, 0 forked by the server"* ]]
+    [[ "$output" == *"spawn latency: p50"* ]]
+}
+
+@test "Remote shell: commands started by spawners report stale hashed paths" {
+    mkdir -p test_dir/h1 test_dir/h2
+    printf '#!/bin/sh\necho mycmd ran\n' > test_dir/h2/mycmd
+    chmod +x test_dir/h2/mycmd
+    PATH="$PWD/test_dir/h1:$PWD/test_dir/h2:$PATH" timeout 10s ./dsh -s -x -p 5053 -f 2 > server_output.log 2>&1 &
+    SERVER_PID=$!
+    sleep 1
+
+    run timeout 5s ./dsh -c -p 5053 <<EOF
+mycmd
+mv test_dir/h2/mycmd test_dir/h1/mycmd
+mycmd
+mycmd
+hash
+stats
+EOF
+    kill $SERVER_PID 2>/dev/null || true
+    wait $SERVER_PID 2>/dev/null || true
+
+    echo "$output"
+    [ "$(echo "$output" | grep -c "mycmd ran")" -eq 3 ]
+    [[ "$output" == *"/h1/mycmd"* ]]
+    [[ "$output" != *"/h2/mycmd"* ]]
+    [[ "$output" == *"by spawners, 0 forked by the server"* ]]
+}
+
+@test "Remote shell: Batch mode pipelines commands in order" {
+    SERVER_PID=$(start_server 5036)
+
+    # Each cat must see the echo right before it, even with 4 in flight
+    {
+        echo "sleep 1 &"
+        for i in $(seq 1 20); do
+            echo "echo $i > remote_test_batch.txt"
+            echo "cat remote_test_batch.txt"
+        done
+        echo "rm remote_test_batch.txt"
+    } > remote_test_in.txt
+
+    SECONDS=0
+    run timeout 5s ./dsh -c -b4 -p 5036 < remote_test_in.txt
+    elapsed=$SECONDS
+
+    kill $SERVER_PID 2>/dev/null || true
+    wait $SERVER_PID 2>/dev/null || true
+
+    echo "$output"
+    [ "$status" -eq 0 ]
+    [ "$(echo "$output" | grep -oE '^dsh4> dsh4> [0-9]+$' | grep -oE '[0-9]+$' | tr '\n' ' ')" = "$(seq 1 20 | tr '\n' ' ')" ]
+    [[ "$output" == *"[1] done, exit 0"* ]]
+    [ "$elapsed" -lt 3 ]
+}
+
+@test "Remote shell: Agent reuses its server connection" {
+    SERVER_PID=$(start_server 5037)
+    timeout 10s ./dsh -a > agent_output.log 2>&1 &
+    AGENT_PID=$!
+    sleep 0.5
+
+    # The single threaded server only talks to one connection, so the
+    # second client gets through only on the one the agent kept
+    run timeout 5s ./dsh -c -A -p 5037 <<EOF
+cd /tmp
+echo first
+EOF
+    first="$output"
+    run timeout 5s ./dsh -c -A -p 5037 <<EOF
+pwd
+EOF
+
+    kill $AGENT_PID $SERVER_PID 2>/dev/null || true
+    wait $AGENT_PID $SERVER_PID 2>/dev/null || true
+
+    echo "$first"
+    echo "$output"
+    cat agent_output.log
+    [[ "$first" == *"first"* ]]
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"/tmp"* ]]
+    grep -q "5037, pooled connection" agent_output.log
+    rm -f agent_output.log
+}
+
+@test "Remote shell: Unix domain sockets" {
+    # A path, which stop-server removes again
+    timeout 10s ./dsh -s -i ./remote_test.sock > server_output.log 2>&1 &
+    SERVER_PID=$!
+    sleep 1
+    [ -S remote_test.sock ]
+
+    run timeout 5s ./dsh -c -i ./remote_test.sock <<EOF
+echo over a path
+stop-server
+EOF
+    wait $SERVER_PID 2>/dev/null || true
+    echo "$output"
+    [[ "$output" == *"over a path"* ]]
+    [ ! -e remote_test.sock ]
+
+    # The abstract namespace, nothing on disk at all
+    timeout 10s ./dsh -s -x -i @dsh-test-$$ > server_output.log 2>&1 &
+    SERVER_PID=$!
+    sleep 1
+
+    run timeout 5s ./dsh -c -i @dsh-test-$$ <<EOF
+echo abstract
+EOF
+    kill $SERVER_PID 2>/dev/null || true
+    wait $SERVER_PID 2>/dev/null || true
+    echo "$output"
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"abstract"* ]]
+}
+
+@test "Remote shell: stop-server drains running commands" {
+    timeout 15s ./dsh -s -x -p 5038 > server_output.log 2>&1 &
+    SERVER_PID=$!
+    sleep 1
+
+    timeout 10s ./dsh -c -p 5038 > remote_test_drain.txt 2>&1 <<EOF &
+sh -c "sleep 1; echo finished anyway"
+EOF
+    CLIENT_PID=$!
+    sleep 0.3
+
+    # The server stops taking clients at once, and exits when the running
+    # command is done instead of waiting for another connection
+    SECONDS=0
+    run timeout 5s ./dsh -c -p 5038 <<EOF
+stop-server
+EOF
+    wait $SERVER_PID 2>/dev/null || true
+    elapsed=$SECONDS
+    wait $CLIENT_PID 2>/dev/null || true
+
+    cat remote_test_drain.txt
+    cat server_output.log
+    grep -q "finished anyway" remote_test_drain.txt
+    grep -q "draining 1 clients" server_output.log
+    [ "$elapsed" -lt 4 ]
+    rm -f remote_test_drain.txt
+}
+
+@test "Remote shell: SO_REUSEPORT acceptors share the port" {
+    timeout 15s ./dsh -s -x -k 3 -p 5039 > server_output.log 2>&1 &
+    SERVER_PID=$!
+    sleep 1
+
+    for i in $(seq 1 12); do
+        echo "echo client $i" | timeout 5s ./dsh -c -p 5039 > /dev/null
+    done
+    run timeout 5s ./dsh -c -p 5039 <<EOF
+stats
+EOF
+
+    kill $SERVER_PID 2>/dev/null || true
+    wait $SERVER_PID 2>/dev/null || true
+
+    echo "$output"
+    [ "$status" -eq 0 ]
+    [ "$(echo "$output" | grep -c '^acceptor [0-9]: [0-9]* connections')" -eq 3 ]
+    [ "$(echo "$output" | awk '/^acceptor/ { n += $3 } END { print n }')" -eq 13 ]
+}
+
+@test "Remote shell: resource limits hold, reject and kill commands" {
+    timeout 20s ./dsh -s -x -p 5040 -L procs=2,total=3,out=64k > server_output.log 2>&1 &
+    SERVER_PID=$!
+    sleep 1
+
+    # A third background sleep waits for one of the first two
+    start=$(date +%s%N)
+    run timeout 10s ./dsh -c -p 5040 <<EOF
+sleep 1 &
+sleep 1 &
+sleep 1 &
+echo held
+EOF
+    elapsed=$(( ($(date +%s%N) - start) / 1000000 ))
+    echo "$output"
+    echo "elapsed ${elapsed}ms"
+    [ "$status" -eq 0 ]
+    [ "$elapsed" -ge 900 ]
+
+    # A two-stage pipeline doesn't fit next to one running stage
+    start=$(date +%s%N)
+    run timeout 10s ./dsh -c -p 5040 <<EOF
+sleep 1 &
+sleep 1 | sleep 1
+EOF
+    elapsed=$(( ($(date +%s%N) - start) / 1000000 ))
+    echo "elapsed ${elapsed}ms"
+    [ "$status" -eq 0 ]
+    [ "$elapsed" -ge 1900 ]
+
+    echo "sleep 2 | sleep 2" | timeout 10s ./dsh -c -p 5040 > /dev/null &
+    sleep 0.5
+    run timeout 10s ./dsh -c -p 5040 <<EOF
+sleep 1 | sleep 1
+sleep 1 | sleep 1 | sleep 1
+yes
+rc
+stats
+EOF
+
+    kill $SERVER_PID 2>/dev/null || true
+    wait $SERVER_PID 2>/dev/null || true
+
+    echo "$output" | grep -v '^y$'
+    [ "$status" -eq 0 ]
+    echo "$output" | grep -q "server is at its process limit"
+    echo "$output" | grep -q "more stages than the process limit"
+    echo "$output" | grep -q "^dsh4> 137$"
+    echo "$output" | grep -q "1 rejected, 1 killed for output"
+}
+
+@test "Remote shell: metrics in stats and on the scrape port" {
+    timeout 15s ./dsh -s -x -p 5044 -M 5045 > server_output.log 2>&1 &
+    SERVER_PID=$!
+    sleep 1
+
+    run timeout 5s ./dsh -c -p 5044 <<EOF
+echo one
+ls | wc -l
+stats
+EOF
+    echo "$output"
+    [ "$status" -eq 0 ]
+    echo "$output" | grep -q "^connections: 1 accepted, 1 open"
+    echo "$output" | grep -q "^commands: 2, [0-9]* bytes in, [0-9]* bytes out"
+    echo "$output" | grep -q "^command duration: p50"
+
+    exec 3<>/dev/tcp/127.0.0.1/5045
+    scrape=$(cat <&3)
+    exec 3<&-
+
+    kill $SERVER_PID 2>/dev/null || true
+    wait $SERVER_PID 2>/dev/null || true
+
+    echo "$scrape"
+    echo "$scrape" | grep -q "^rsh_commands_total 3$"
+    echo "$scrape" | grep -q "^rsh_connections_total 1$"
+    echo "$scrape" | grep -q '^rsh_command_seconds_bucket{le="+Inf"} 3$'
+    echo "$scrape" | grep -q '^rsh_spawns_total{via="spawner"} 2$'
+    # Commands are only echoed with -v
+    grep -c "rdsh-exec" server_output.log | grep -qx 0
+}
+
+@test "Remote shell: compressed output matches uncompressed" {
+    seq 1 200000 > lz_test.txt
+    timeout 15s ./dsh -s -x -p 5046 > server_output.log 2>&1 &
+    SERVER_PID=$!
+    timeout 15s ./dsh -s -e -n 2 -p 5047 > server2_output.log 2>&1 &
+    SERVER2_PID=$!
+    sleep 1
+
+    echo "cat lz_test.txt" | timeout 5s ./dsh -c -p 5046 > raw_out.txt
+    echo "cat lz_test.txt" | timeout 5s ./dsh -c -p 5046 -z > lz_out.txt
+    echo "cat lz_test.txt" | timeout 5s ./dsh -c -p 5047 -z > lz2_out.txt
+
+    kill $SERVER_PID $SERVER2_PID 2>/dev/null || true
+    wait $SERVER_PID $SERVER2_PID 2>/dev/null || true
+
+    cmp raw_out.txt lz_out.txt
+    # Past the banner, which names the port
+    tail -n +2 raw_out.txt | cmp - <(tail -n +2 lz2_out.txt)
+    grep -c "^[0-9]*$" raw_out.txt | grep -qx 199999
+    rm -f lz_test.txt raw_out.txt lz_out.txt lz2_out.txt server2_output.log
+}
+
+@test "Remote shell: put and get copy a file and resume with -c" {
+    head -c 300000 /dev/urandom > xfer_src.bin
+    timeout 15s ./dsh -s -x -p 5048 > server_output.log 2>&1 &
+    SERVER_PID=$!
+    timeout 15s ./dsh -s -e -n 2 -p 5049 > server2_output.log 2>&1 &
+    SERVER2_PID=$!
+    sleep 1
+
+    printf "put xfer_src.bin xfer_put.bin\nget xfer_put.bin xfer_get.bin\n" | \
+        timeout 5s ./dsh -c -p 5048 > xfer_out.txt
+    cmp xfer_src.bin xfer_put.bin
+    cmp xfer_src.bin xfer_get.bin
+
+    # Only the missing part comes over the second time
+    truncate -s 100000 xfer_get.bin
+    echo "get -c xfer_src.bin xfer_get.bin" | timeout 5s ./dsh -c -p 5049 >> xfer_out.txt
+    cmp xfer_src.bin xfer_get.bin
+
+    kill $SERVER_PID $SERVER2_PID 2>/dev/null || true
+    wait $SERVER_PID $SERVER2_PID 2>/dev/null || true
+
+    grep -c "300000 bytes" xfer_out.txt | grep -qx 3
+    grep -q "(100000 resumed)" xfer_out.txt
+    rm -f xfer_src.bin xfer_put.bin xfer_get.bin xfer_out.txt server2_output.log
+}
+
+@test "Remote shell: cd and export stay in their own session" {
+    timeout 15s ./dsh -s -x -p 5050 > server_output.log 2>&1 &
+    SERVER_PID=$!
+    sleep 1
+
+    # The second client runs while the first one sits in /tmp
+    printf "cd /tmp\nexport SESSION_VAR=first\nsleep 1\npwd\nprintenv SESSION_VAR\n" | \
+        timeout 5s ./dsh -c -p 5050 > session1_out.txt &
+    CLIENT_PID=$!
+    sleep 0.5
+    printf "printenv SESSION_VAR\nrc\npwd\n" | timeout 5s ./dsh -c -p 5050 > session2_out.txt
+    wait $CLIENT_PID
+
+    kill $SERVER_PID 2>/dev/null || true
+    wait $SERVER_PID 2>/dev/null || true
+
+    cat session1_out.txt session2_out.txt
+    grep -q " /tmp$" session1_out.txt
+    grep -q " first$" session1_out.txt
+    grep -q " $PWD$" session2_out.txt
+    grep -q " 1$" session2_out.txt
+    grep -c "first" session2_out.txt | grep -qx 0
+    rm -f session1_out.txt session2_out.txt
+}
+
+@test "Remote shell: silent connections are reaped, quiet clients answer PINGs" {
+    timeout 20s ./dsh -s -e -n 2 -p 5051 -T ping=1,dead=1 > server_output.log 2>&1 &
+    SERVER_PID=$!
+    sleep 1
+
+    # Never says HELLO: gets a PING, then the connection is closed
+    exec 3<>/dev/tcp/127.0.0.1/5051
+    sleep 3
+    silent=$(timeout 2s od -An -tx1 <&3)
+    exec 3<&-
+
+    # Sits at the prompt longer than both, answering the PINGs
+    (echo "echo one"; sleep 3; echo "echo two"; echo "stats") | \
+        timeout 8s ./dsh -c -p 5051 > live_out.txt
+
+    kill $SERVER_PID 2>/dev/null || true
+    wait $SERVER_PID 2>/dev/null || true
+
+    echo "$silent"
+    cat live_out.txt
+    [ "$(echo $silent)" = "01 08 00 00 00 00 00 00 00 00 00 00" ]
+    grep -q "^dsh4> one$" live_out.txt
+    grep -q "^dsh4> two$" live_out.txt
+    grep -q "sessions reaped: 1 dead, 0 idle" live_out.txt
+    rm -f live_out.txt
+}
+
+@test "Remote shell: large output reaches a pipe, a file and an append file intact" {
+    timeout 20s ./dsh -s -x -p 5052 > server_output.log 2>&1 &
+    SERVER_PID=$!
+    sleep 1
+
+    head -c 3000000 /dev/urandom > big_out.bin
+    echo "cat big_out.bin" | timeout 10s ./dsh -c -p 5052 | cat > out_pipe.txt
+    echo "cat big_out.bin" | timeout 10s ./dsh -c -p 5052 > out_file.txt
+    echo "first line" > out_append.txt
+    echo "cat big_out.bin" | timeout 10s ./dsh -c -z -p 5052 >> out_append.txt
+
+    kill $SERVER_PID 2>/dev/null || true
+    wait $SERVER_PID 2>/dev/null || true
+
+    # The output follows the banner line and the first prompt
+    for f in out_pipe.txt out_file.txt; do
+        skip_bytes=$(( $(head -n 1 $f | wc -c) + 6 ))
+        tail -c +$(( skip_bytes + 1 )) $f | head -c 3000000 | cmp - big_out.bin
+    done
+    head -n 1 out_append.txt | grep -qx "first line"
+    skip_bytes=$(( $(head -n 2 out_append.txt | wc -c) + 6 ))
+    tail -c +$(( skip_bytes + 1 )) out_append.txt | head -c 3000000 | cmp - big_out.bin
+    rm -f big_out.bin out_pipe.txt out_file.txt out_append.txt
+}
+
 @test "Remote shell: Multiple clients (requires threaded mode)" {
     # Skip if not testing threaded mode
     if [ -z "$TEST_THREADED" ]; then
@@ -401,6 +973,68 @@ EOF
     rm -f client1_output.txt client2_output.txt server_output.log
 }
 
+@test "Remote shell: Event-driven server multiplexes many clients" {
+    timeout 15s ./dsh -s -p 5030 -e -n 2 > server_output.log 2>&1 &
+    SERVER_PID=$!
+    sleep 1
+
+    # 40 clients that each sleep for a second; two event loop threads
+    # have to interleave them to finish in time
+    CLIENT_PIDS=""
+    for i in $(seq 1 40); do
+        printf 'sleep 1\necho "reactor client %s"\nexit\n' $i | \
+            timeout 10s ./dsh -c -p 5030 > reactor_client_$i.txt &
+        CLIENT_PIDS="$CLIENT_PIDS $!"
+    done
+    SECONDS=0
+    wait $CLIENT_PIDS
+    elapsed=$SECONDS
+
+    run timeout 5s ./dsh -c -p 5030 <<EOF
+yes "reactor output" | head -n 20000 | wc -l
+stop-server
+EOF
+    sleep 0.5
+    ! kill -0 $SERVER_PID 2>/dev/null
+    wait $SERVER_PID 2>/dev/null || true
+
+    [ "$(cat reactor_client_*.txt | grep -c 'reactor client')" -eq 40 ]
+    [ "$elapsed" -lt 5 ]
+    [[ "$output" == *"20000"* ]]
+    rm -f reactor_client_*.txt server_output.log
+}
+
+@test "Remote shell: Worker pool server runs sessions as tasks" {
+    timeout 15s ./dsh -s -p 5031 -w -n 4 > server_output.log 2>&1 &
+    SERVER_PID=$!
+    sleep 1
+
+    # 8 clients on 4 workers: two rounds of one second each
+    CLIENT_PIDS=""
+    for i in $(seq 1 8); do
+        printf 'sleep 1\necho "pool client %s"\nexit\n' $i | \
+            timeout 10s ./dsh -c -p 5031 > pool_client_$i.txt &
+        CLIENT_PIDS="$CLIENT_PIDS $!"
+    done
+    SECONDS=0
+    wait $CLIENT_PIDS
+    elapsed=$SECONDS
+
+    run timeout 5s ./dsh -c -p 5031 <<EOF
+stats
+stop-server
+EOF
+    sleep 0.5
+    ! kill -0 $SERVER_PID 2>/dev/null
+    wait $SERVER_PID 2>/dev/null || true
+
+    [ "$(cat pool_client_*.txt | grep -c 'pool client')" -eq 8 ]
+    [ "$elapsed" -lt 5 ]
+    [[ "$output" == *"pool: 4 workers"* ]]
+    [[ "$output" == *"stolen"* ]]
+    rm -f pool_client_*.txt server_output.log
+}
+
 @test "Remote shell: Server stability with rapid client connections" {
     # Start server
     SERVER_PID=$(start_server 5013)
@@ -451,9 +1085,6 @@ EOF
 }
 
 @test "Remote shell: Dragon command" {
-    # Skip this test if dragon command is not properly implemented
-    skip "Dragon command test skipped - verify manually or uncomment in rsh_built_in_cmd function"
-    
     # Start server
     SERVER_PID=$(start_server 5015)
     
@@ -469,7 +1100,7 @@ EOF
     
     # Verify output contains dragon ASCII art
     [ "$status" -eq 0 ]
-    [[ "$output" == *"<>"* ]]  # Part of the dragon ASCII art
+    [[ "$output" == *"@%%%%"* ]]  # Part of the dragon ASCII art
 }
 
 @test "Remote shell: Return code command" {
@@ -582,10 +1213,18 @@ EOF
     # Start server
     SERVER_PID=$(start_server 5020)
     
-    # Run client with timeout
+    # Set in one command, seen by the next one of the same session
+    run timeout 5s ./dsh -c -p 5020 <<EOF
+export TESTVAR=remote_env_test
+printenv TESTVAR
+EOF
+    first="$output"
+    first_status="$status"
+
+    # A new session starts from the server's environment
     run timeout 5s ./dsh -c -p 5020 <<EOF
-export TESTVAR="environment variable test"
-echo \$TESTVAR
+printenv TESTVAR
+rc
 exit
 EOF
     
@@ -594,6 +1233,10 @@ EOF
     wait $SERVER_PID 2>/dev/null || true
     
     # Verify output
-    [ "$status" -eq 0 ]
-    [[ "$output" == *"environment variable test"* ]]
-}
\ No newline at end of file
+    echo "$first"
+    echo "$output"
+    [ "$first_status" -eq 0 ]
+    [[ "$first" == *"dsh4> remote_env_test"* ]]
+    [[ "$output" != *"remote_env_test"* ]]
+    [[ "$output" == *"dsh4> 1"* ]]
+}
@@ -0,0 +1,74 @@
+#!/bin/bash
+#
+# Ratio and speed of output compression (dsh -c -z), first for the codec
+# alone on prose and on log lines, then end to end: the same file cat'ed
+# through the remote shell with and without -z.
+#
+#   usage: bench/compress_bench.sh [server mode flags...]
+#
+#   bench/compress_bench.sh           # single-threaded server
+#   bench/compress_bench.sh -e -n 4   # event-driven server
+#
+# Over loopback the wire is nearly free, so end to end -z mostly shows what
+# compression costs; the ratio says what it would save on a real link.
+# Set DSH to benchmark another build, and PORT if the default one is taken.
+
+MODE_FLAGS="$*"
+DSH=${DSH:-./dsh}
+LZ_BENCH=${LZ_BENCH:-./lz_bench}
+PORT=${PORT:-5490}
+PROSE=${PROSE:-../../../demos/file-stream/war-and-peace.txt}
+LOG=${TMPDIR:-/tmp}/rsh_compress_bench.log
+
+if [ ! -f "$PROSE" ]; then
+    echo "no text to compress at $PROSE, set PROSE"
+    exit 1
+fi
+
+# Synthetic server log, timestamps and request ids keep it from being
+# trivially repetitive
+if [ ! -f "$LOG" ]; then
+    echo "creating synthetic log in $LOG"
+    awk 'BEGIN {
+        srand(281)
+        split("GET POST PUT DELETE", verbs, " ")
+        split("/api/users /api/orders /static/app.js /healthz /login", paths, " ")
+        split("200 200 200 201 304 404 500", codes, " ")
+        for (i = 0; i < 400000; i++) {
+            printf "2024-03-%02d %02d:%02d:%02d.%03d INFO  req=%08x %s %s status=%s bytes=%d ms=%d\n",
+                1 + i / 20000, (i / 3600) % 24, (i / 60) % 60, i % 60, int(rand() * 1000),
+                int(rand() * 4294967295), verbs[1 + int(rand() * 4)], paths[1 + int(rand() * 5)],
+                codes[1 + int(rand() * 7)], int(rand() * 65536), int(rand() * 250)
+        }
+    }' > "$LOG"
+fi
+
+echo "codec alone, one frame at a time:"
+$LZ_BENCH "$PROSE" "$LOG" || exit 1
+
+$DSH -s -i 127.0.0.1 -p $PORT $MODE_FLAGS > /dev/null 2>&1 &
+SERVER_PID=$!
+trap 'kill $SERVER_PID 2>/dev/null' EXIT
+sleep 1
+if ! kill -0 $SERVER_PID 2>/dev/null; then
+    echo "server failed to start on port $PORT"
+    exit 1
+fi
+
+# Repeat the file so each run moves enough data to time
+BIG=${TMPDIR:-/tmp}/rsh_compress_bench.big
+for f in "$PROSE" "$LOG"; do
+    for i in $(seq 16); do cat "$f"; done > "$BIG"
+    mb=$(awk -v b="$(stat -c %s "$BIG")" 'BEGIN { printf "%.1f", b / 1048576 }')
+    for z in "" "-z"; do
+        start=$(date +%s.%N)
+        echo "cat $BIG" | $DSH -c -i 127.0.0.1 -p $PORT $z > /dev/null
+        end=$(date +%s.%N)
+        awk -v f="$(basename "$f")" -v z="${z:-raw}" -v mb=$mb -v t0=$start -v t1=$end \
+            -v mode="${MODE_FLAGS:-single}" 'BEGIN {
+            printf "end to end %-8s %-24s %-3s %7.1f MB in %6.2f s  %8.1f MB/s\n",
+                   mode, f, z, mb, t1 - t0, mb / (t1 - t0)
+        }'
+    done
+done
+rm -f "$BIG"
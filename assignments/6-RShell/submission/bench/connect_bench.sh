@@ -0,0 +1,36 @@
+#!/bin/bash
+#
+# Connection storm against the threaded server with 1, 2 and 4 SO_REUSEPORT
+# acceptors (-k): every command gets a connection of its own, so this is
+# the rate at which the server takes on new clients.  The server's `stats`
+# after each run shows how the kernel spread the connections.
+#
+#   usage: bench/connect_bench.sh [rsh_bench options...]
+#
+#   bench/connect_bench.sh                  # 16 sessions, `true`, 5 s
+#   bench/connect_bench.sh -c 64 -d 10
+#
+# Set ACCEPTORS to pick the -k values, DSH to benchmark another build, and
+# PORT if the default one is taken.
+
+DSH=${DSH:-./dsh}
+BENCH=${BENCH:-./rsh_bench}
+PORT=${PORT:-5483}
+ACCEPTORS=${ACCEPTORS:-"1 2 4"}
+
+for k in $ACCEPTORS; do
+    $DSH -s -x -k $k -i 127.0.0.1 -p $PORT > /dev/null 2>&1 &
+    pid=$!
+    sleep 1
+    if ! kill -0 $pid 2>/dev/null; then
+        echo "server failed to start on port $PORT"
+        exit 1
+    fi
+
+    $BENCH -i 127.0.0.1 -p $PORT -C -c 16 -m true -l "-x -k $k" "$@"
+    echo stats | $DSH -c -i 127.0.0.1 -p $PORT | grep "^acceptor"
+    echo
+
+    kill $pid 2>/dev/null
+    wait $pid 2>/dev/null || true
+done
@@ -0,0 +1,47 @@
+#!/bin/bash
+#
+# Compares round trip latency for small commands over loopback TCP and a
+# Unix socket.  Each client runs `rc`, a builtin the server answers without
+# forking, one at a time (-b1), so the time per command is mostly the
+# transport.
+#
+#   usage: bench/latency_bench.sh [commands] [server mode flags...]
+#
+#   bench/latency_bench.sh 20000        # single-threaded server
+#   bench/latency_bench.sh 20000 -e     # event-driven server
+#
+# Set DSH to benchmark another build and PORT if the default one is taken.
+
+COUNT=${1:-10000}
+shift
+MODE_FLAGS="$*"
+DSH=${DSH:-./dsh}
+PORT=${PORT:-5481}
+SOCK=@dsh-latency-bench-$$
+
+# usage: run_one label address
+run_one() {
+    $DSH -s -i $2 -p $PORT $MODE_FLAGS > /dev/null 2>&1 &
+    local pid=$!
+    sleep 1
+    if ! kill -0 $pid 2>/dev/null; then
+        echo "server failed to start on $2"
+        exit 1
+    fi
+
+    local start=$(date +%s.%N)
+    yes rc | head -n $COUNT | $DSH -c -b1 -i $2 -p $PORT > /dev/null
+    local end=$(date +%s.%N)
+    kill $pid 2>/dev/null
+    wait $pid 2>/dev/null
+
+    awk -v n=$COUNT -v t0=$start -v t1=$end -v label="$1" 'BEGIN {
+        secs = t1 - t0
+        printf "%-12s %7d commands in %6.2f s  %7.1f us/command  %8.0f commands/s\n",
+               label, n, secs, secs * 1e6 / n, n / secs
+    }'
+}
+
+echo "mode ${MODE_FLAGS:-single}"
+run_one "tcp loopback" 127.0.0.1
+run_one "unix socket" $SOCK
@@ -0,0 +1,37 @@
+#!/bin/bash
+#
+# Runs rsh_bench against each server mode in turn and prints its report
+# for every one of them.
+#
+#   usage: bench/load_bench.sh [rsh_bench options...]
+#
+#   bench/load_bench.sh                     # 4 sessions, closed loop, 5 s
+#   bench/load_bench.sh -c 32 -d 10
+#   bench/load_bench.sh -c 8 -r 2000 -m echo:50,cat:50
+#
+# Set MODES to pick the modes (default: single, -x, -e and -w), DSH to
+# benchmark another build, and PORT if the default one is taken.
+
+DSH=${DSH:-./dsh}
+BENCH=${BENCH:-./rsh_bench}
+PORT=${PORT:-5482}
+MODES=${MODES:-"single -x -e -w"}
+
+for mode in $MODES; do
+    flags=$mode
+    [ "$mode" = single ] && flags=
+
+    $DSH -s -i 127.0.0.1 -p $PORT $flags > /dev/null 2>&1 &
+    pid=$!
+    sleep 1
+    if ! kill -0 $pid 2>/dev/null; then
+        echo "server failed to start on port $PORT"
+        exit 1
+    fi
+
+    $BENCH -i 127.0.0.1 -p $PORT -l "$mode" "$@"
+    echo
+
+    kill $pid 2>/dev/null
+    wait $pid 2>/dev/null || true
+done
@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "../dshlib.h"
+#include "../rshlib.h"
+
+/*
+ * lz_bench: ratio and speed of the output compression in rsh_lz.c.
+ *
+ * Compresses a file the way the server compresses command output, one
+ * RSH_FRAME_MAX chunk at a time, then decompresses every chunk and checks
+ * it comes back the same.  Each pass is repeated until it has run for at
+ * least half a second so small files still give stable numbers.
+ *
+ *   usage: lz_bench [-c chunk] file...
+ *
+ *   lz_bench ../../../demos/file-stream/war-and-peace.txt
+ *   lz_bench -c 4096 /var/log/syslog     # smaller frames, as from a tty
+ */
+
+#define LZ_BENCH_MIN_SECS   0.5
+
+static double now_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *read_file(const char *path, long *len) {
+    FILE *f = fopen(path, "rb");
+    struct stat sb;
+    char *data = NULL;
+
+    if (f == NULL || fstat(fileno(f), &sb) < 0) {
+        perror(path);
+        if (f != NULL) fclose(f);
+        return NULL;
+    }
+    *len = sb.st_size;
+    data = malloc(*len + 1);
+    if (data == NULL || (long)fread(data, 1, *len, f) != *len) {
+        perror(path);
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+static int bench_file(const char *path, int chunk) {
+    long len;
+    char *data = read_file(path, &len);
+    if (data == NULL) {
+        return 1;
+    }
+
+    int nchunks = (len + chunk - 1) / chunk;
+    char *packed = malloc((size_t)nchunks * chunk);
+    int *sizes = calloc(nchunks, sizeof(int));
+    char *out = malloc(chunk);
+    if (packed == NULL || sizes == NULL || out == NULL) {
+        fprintf(stderr, "lz_bench: out of memory\n");
+        free(data); free(packed); free(sizes); free(out);
+        return 1;
+    }
+
+    // Compress, a chunk that doesn't shrink is sent raw (size 0 here)
+    long total = 0;
+    int reps = 0;
+    double t0 = now_secs(), t1;
+    do {
+        total = 0;
+        for (int i = 0; i < nchunks; i++) {
+            int n = (i == nchunks - 1) ? len - (long)i * chunk : chunk;
+            sizes[i] = (n < RSH_LZ_MIN) ? 0 :
+                rsh_lz_compress(data + (long)i * chunk, n, packed + (long)i * chunk, n - 1);
+            total += sizes[i] ? sizes[i] : n;
+        }
+        reps++;
+        t1 = now_secs();
+    } while (t1 - t0 < LZ_BENCH_MIN_SECS);
+    double comp_mbs = (double)len * reps / (t1 - t0) / (1024 * 1024);
+
+    // Decompress, and check the round trip on the way
+    reps = 0;
+    t0 = now_secs();
+    do {
+        for (int i = 0; i < nchunks; i++) {
+            int n = (i == nchunks - 1) ? len - (long)i * chunk : chunk;
+            if (sizes[i] == 0) continue;
+            if (rsh_lz_decompress(packed + (long)i * chunk, sizes[i], out, chunk) != n ||
+                    memcmp(out, data + (long)i * chunk, n) != 0) {
+                fprintf(stderr, "lz_bench: %s: chunk %d did not round trip\n", path, i);
+                free(data); free(packed); free(sizes); free(out);
+                return 1;
+            }
+        }
+        reps++;
+        t1 = now_secs();
+    } while (t1 - t0 < LZ_BENCH_MIN_SECS);
+    double decomp_mbs = (double)len * reps / (t1 - t0) / (1024 * 1024);
+
+    const char *name = strrchr(path, '/');
+    printf("%-24s %10ld -> %10ld  ratio %5.2f  compress %7.1f MB/s  decompress %7.1f MB/s\n",
+           name ? name + 1 : path, len, total, (double)len / total, comp_mbs, decomp_mbs);
+
+    free(data); free(packed); free(sizes); free(out);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int chunk = RSH_FRAME_MAX;
+    int argi = 1;
+    int rc = 0;
+
+    if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+        chunk = atoi(argv[2]);
+        argi = 3;
+    }
+    if (argi >= argc || chunk <= 0 || chunk > RSH_FRAME_MAX) {
+        fprintf(stderr, "usage: %s [-c chunk] file...\n", argv[0]);
+        return 2;
+    }
+
+    for (; argi < argc; argi++) {
+        rc |= bench_file(argv[argi], chunk);
+    }
+    return rc;
+}
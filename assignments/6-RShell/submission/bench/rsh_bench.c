@@ -0,0 +1,503 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "../dshlib.h"
+#include "../rshlib.h"
+
+/*
+ * rsh_bench: load generator for the remote shell server.
+ *
+ * Opens N sessions against a running server (any mode, TCP or Unix
+ * socket), each on its own thread, and has them run a mix of commands for
+ * a fixed time.  At the end it prints throughput and latency percentiles
+ * per kind of command.
+ *
+ *   closed loop (default)  each session sends its next command as soon as
+ *                          the previous one ends, so the load is whatever
+ *                          the server can take
+ *   open loop (-r RATE)    commands go out on a fixed schedule, RATE per
+ *                          second over all sessions, up to RSH_MAX_STREAMS
+ *                          at once per session.  Latency is counted from
+ *                          when a command was due, not when it could be
+ *                          sent, so a server that falls behind shows it
+ *                          instead of slowing the benchmark down with it.
+ *   connect storm (-C)     closed loop, but every command on a connection
+ *                          of its own: connect, HELLO, command, close.  The
+ *                          latency is the whole exchange, so this measures
+ *                          how fast the server takes on new clients.
+ *
+ * Latencies go into a log-linear histogram (16 sub-buckets per power of
+ * two, the same idea as HdrHistogram) so p99.9 stays within about 6% no
+ * matter how long the tail.
+ *
+ *   usage: rsh_bench [-i addr] [-p port] [-c sessions] [-d secs] [-r rate]
+ *                    [-C] [-m mix] [-S cat_kb] [-l label]
+ *
+ *   rsh_bench -c 32 -d 10                   # closed loop, default mix
+ *   rsh_bench -c 8 -r 2000 -m echo:50,true:50
+ *   rsh_bench -i @rsh -m cat:100 -S 4096
+ *   rsh_bench -C -c 16 -m true              # connections per second
+ */
+
+#define BENCH_SUB_BITS      4
+#define BENCH_SUB           (1 << BENCH_SUB_BITS)
+#define BENCH_HIST_SZ       ((64 - BENCH_SUB_BITS + 1) * BENCH_SUB)
+
+enum { KIND_ECHO, KIND_TRUE, KIND_CAT, KIND_MAX };
+static const char *kind_names[KIND_MAX] = { "echo", "true", "cat" };
+
+typedef struct bench_hist {
+    uint64_t counts[BENCH_HIST_SZ];
+    uint64_t total;
+    uint64_t max;
+    uint64_t errors;                //nonzero exit status
+    uint64_t bytes;                 //output received
+} bench_hist_t;
+
+typedef struct bench_inflight {
+    uint32_t stream;                //0 if the slot is free
+    int      kind;
+    uint64_t due_ns;
+} bench_inflight_t;
+
+typedef struct bench_session {
+    pthread_t    tid;
+    int          idx;
+    bool         connected;         //got the server's HELLO in time
+    bench_hist_t hist[KIND_MAX];
+} bench_session_t;
+
+static const char *g_addr = RDSH_DEF_CLI_CONNECT;
+static int         g_port = RDSH_DEF_PORT;
+static int         g_sessions = 4;
+static double      g_secs = 5;
+static double      g_rate = 0;                  //0: closed loop
+static bool        g_reconnect = false;         //-C: a connection per command
+static int         g_mix[KIND_MAX] = { 70, 20, 10 };
+static int         g_cat_kb = 256;
+static const char *g_label = "";
+static char        g_cat_cmd[128];
+static uint64_t    g_start_ns, g_end_ns;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int hist_index(uint64_t v) {
+    if (v < BENCH_SUB) return (int)v;
+    int e = 63 - __builtin_clzll(v);
+    int shift = e - BENCH_SUB_BITS;
+    return (shift + 1) * BENCH_SUB + (int)((v >> shift) - BENCH_SUB);
+}
+
+// Highest value that lands in bucket idx
+static uint64_t hist_value(int idx) {
+    if (idx < BENCH_SUB) return idx;
+    int shift = idx / BENCH_SUB - 1;
+    uint64_t sub = idx % BENCH_SUB;
+    return ((BENCH_SUB + sub + 1) << shift) - 1;
+}
+
+static void hist_add(bench_hist_t *h, uint64_t usec) {
+    h->counts[hist_index(usec)]++;
+    h->total++;
+    if (usec > h->max) h->max = usec;
+}
+
+static void hist_merge(bench_hist_t *to, const bench_hist_t *from) {
+    for (int i = 0; i < BENCH_HIST_SZ; i++) {
+        to->counts[i] += from->counts[i];
+    }
+    to->total += from->total;
+    to->errors += from->errors;
+    to->bytes += from->bytes;
+    if (from->max > to->max) to->max = from->max;
+}
+
+static uint64_t hist_percentile(const bench_hist_t *h, double pct) {
+    uint64_t want = (uint64_t)(h->total * pct / 100.0 + 0.5);
+    uint64_t seen = 0;
+
+    if (want == 0) want = 1;
+    for (int i = 0; i < BENCH_HIST_SZ; i++) {
+        seen += h->counts[i];
+        if (seen >= want) {
+            uint64_t v = hist_value(i);
+            return (v < h->max) ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+static int pick_kind(unsigned int *seed) {
+    int total = g_mix[KIND_ECHO] + g_mix[KIND_TRUE] + g_mix[KIND_CAT];
+    int r = rand_r(seed) % total;
+
+    for (int k = 0; k < KIND_MAX; k++) {
+        if (r < g_mix[k]) return k;
+        r -= g_mix[k];
+    }
+    return KIND_ECHO;
+}
+
+static const char *kind_cmd(int kind) {
+    switch (kind) {
+    case KIND_TRUE:
+        return "true";
+    case KIND_CAT:
+        return g_cat_cmd;
+    default:
+        return "echo hello";
+    }
+}
+
+static int bench_connect(void) {
+    struct sockaddr_storage addr;
+
+    int len = rsh_sockaddr(g_addr, g_port, &addr);
+    if (len < 0) return -1;
+
+    int sock = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, len) < 0) {
+        perror("connect");
+        close(sock);
+        return -1;
+    }
+    rsh_sock_nodelay(sock);
+    return sock;
+}
+
+// Waits until sock is readable or the run is over
+static bool wait_readable(int sock, uint64_t until_ns) {
+    uint64_t now = now_ns();
+
+    if (now >= until_ns) return false;
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+    int ms = (int)((until_ns - now + 999999) / 1000000);
+    return poll(&pfd, 1, ms) > 0;
+}
+
+/*
+ * -C: one command per connection, timed from connect() to its END frame.
+ * A refused or dropped connection counts as an error.
+ */
+static void *bench_session_reconnect(void *arg) {
+    bench_session_t *s = arg;
+    rsh_frame_hdr_t hdr;
+    unsigned int seed = (unsigned int)(s->idx * 7919 + 1);
+
+    char *buff = malloc(RSH_FRAME_MAX);
+    if (buff == NULL) {
+        return NULL;
+    }
+
+    while (now_ns() < g_end_ns) {
+        int kind = pick_kind(&seed);
+        const char *cmd = kind_cmd(kind);
+        bench_hist_t *h = &s->hist[kind];
+        uint64_t start = now_ns();
+        bool ok = false;
+
+        int sock = bench_connect();
+        if (sock >= 0 &&
+            rsh_send_frame(sock, RSH_FRAME_HELLO, 0, NULL, 0) == OK &&
+            rsh_recv_frame(sock, &hdr, buff, RSH_FRAME_MAX) == OK && hdr.type == RSH_FRAME_HELLO &&
+            rsh_send_cmd(sock, 1, 0, cmd, strlen(cmd)) == OK) {
+            while (rsh_recv_frame(sock, &hdr, buff, RSH_FRAME_MAX) == OK) {
+                if (hdr.type == RSH_FRAME_END) {
+                    ok = (rsh_end_status(&hdr, buff) == 0);
+                    break;
+                }
+                h->bytes += hdr.len;
+            }
+        }
+        if (sock >= 0) close(sock);
+
+        if (ok) {
+            s->connected = true;
+            hist_add(h, (now_ns() - start) / 1000);
+        } else {
+            h->errors++;
+            usleep(1000);
+        }
+    }
+
+    free(buff);
+    return NULL;
+}
+
+static void *bench_session(void *arg) {
+    bench_session_t *s = arg;
+    bench_inflight_t inflight[RSH_MAX_STREAMS];
+    rsh_frame_hdr_t hdr;
+    unsigned int seed = (unsigned int)(s->idx * 7919 + 1);
+    uint32_t next_stream = 0;
+    int ninflight = 0;
+    int max_inflight = (g_rate > 0) ? RSH_MAX_STREAMS : 1;
+
+    memset(inflight, 0, sizeof(inflight));
+    char *buff = malloc(RSH_FRAME_MAX);
+    int sock = bench_connect();
+    if (buff == NULL || sock < 0) {
+        free(buff);
+        if (sock >= 0) close(sock);
+        return NULL;
+    }
+
+    // A single threaded server answers one session at a time, the others
+    // sit here until it gets to them or the run ends
+    if (rsh_send_frame(sock, RSH_FRAME_HELLO, 0, NULL, 0) != OK ||
+        !wait_readable(sock, g_end_ns) ||
+        rsh_recv_frame(sock, &hdr, buff, RSH_FRAME_MAX) != OK || hdr.type != RSH_FRAME_HELLO ||
+        now_ns() >= g_end_ns) {
+        free(buff);
+        close(sock);
+        return NULL;
+    }
+    s->connected = true;
+
+    // Open loop: sessions take turns, RATE per second between them
+    uint64_t interval = (g_rate > 0) ? (uint64_t)(1e9 * g_sessions / g_rate) : 0;
+    uint64_t next_due = g_start_ns + interval * s->idx / g_sessions;
+    if (next_due < now_ns()) next_due = now_ns();
+
+    while (1) {
+        uint64_t now = now_ns();
+
+        if (now < g_end_ns && ninflight < max_inflight && (g_rate == 0 || now >= next_due)) {
+            int kind = pick_kind(&seed);
+            const char *cmd = kind_cmd(kind);
+            int slot = 0;
+            while (inflight[slot].stream != 0) slot++;
+
+            inflight[slot].stream = ++next_stream;
+            inflight[slot].kind = kind;
+            inflight[slot].due_ns = (g_rate > 0) ? next_due : now;
+            if (rsh_send_cmd(sock, next_stream, 0, cmd, strlen(cmd)) != OK) {
+                break;
+            }
+            ninflight++;
+            next_due += interval;
+            continue;
+        }
+        if (now >= g_end_ns && ninflight == 0) {
+            break;
+        }
+
+        // Replies still due once the run is over are waited for a little
+        uint64_t until = (now < g_end_ns) ? g_end_ns : g_end_ns + 5000000000ULL;
+        if (g_rate > 0 && ninflight < max_inflight && next_due < until) {
+            until = next_due;
+        }
+        if (!wait_readable(sock, until)) {
+            if (now_ns() >= g_end_ns + 5000000000ULL) break;
+            continue;
+        }
+        if (rsh_recv_frame(sock, &hdr, buff, RSH_FRAME_MAX) != OK) {
+            break;
+        }
+
+        int slot = 0;
+        while (slot < RSH_MAX_STREAMS && inflight[slot].stream != hdr.stream) slot++;
+        if (slot == RSH_MAX_STREAMS) {
+            continue;
+        }
+        bench_hist_t *h = &s->hist[inflight[slot].kind];
+        if (hdr.type == RSH_FRAME_STDOUT || hdr.type == RSH_FRAME_STDERR) {
+            h->bytes += hdr.len;
+        } else if (hdr.type == RSH_FRAME_END) {
+            hist_add(h, (now_ns() - inflight[slot].due_ns) / 1000);
+            if (rsh_end_status(&hdr, buff) != 0) h->errors++;
+            inflight[slot].stream = 0;
+            ninflight--;
+        }
+    }
+
+    free(buff);
+    close(sock);
+    return NULL;
+}
+
+static void print_row(const char *name, const bench_hist_t *h, double secs) {
+    printf("%-6s %9lu %9.0f %8.1f %8lu %8lu %8lu %9lu %7lu\n", name,
+           (unsigned long)h->total, h->total / secs, h->bytes / secs / (1024 * 1024),
+           (unsigned long)hist_percentile(h, 50), (unsigned long)hist_percentile(h, 99),
+           (unsigned long)hist_percentile(h, 99.9), (unsigned long)h->max,
+           (unsigned long)h->errors);
+}
+
+static int parse_mix(const char *arg) {
+    char *copy = strdup(arg);
+    char *save = NULL;
+    int total = 0;
+
+    memset(g_mix, 0, sizeof(g_mix));
+    for (char *tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        char *colon = strchr(tok, ':');
+        int weight = colon ? atoi(colon + 1) : 1;
+        if (colon) *colon = '\0';
+
+        int k = 0;
+        while (k < KIND_MAX && strcmp(tok, kind_names[k]) != 0) k++;
+        if (k == KIND_MAX || weight < 0) {
+            fprintf(stderr, "rsh_bench: bad mix entry '%s', use echo, true or cat\n", tok);
+            free(copy);
+            return -1;
+        }
+        g_mix[k] = weight;
+        total += weight;
+    }
+    free(copy);
+    return (total > 0) ? 0 : -1;
+}
+
+// The file `cat` reads; the server must be on this host to see it
+static int make_cat_file(void) {
+    char path[96];
+    struct stat sb;
+
+    snprintf(path, sizeof(path), "%s/rsh_bench_%dk.dat",
+             getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp", g_cat_kb);
+    snprintf(g_cat_cmd, sizeof(g_cat_cmd), "cat %s", path);
+    if (stat(path, &sb) == 0 && sb.st_size == (off_t)g_cat_kb * 1024) {
+        return 0;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    char line[1024];
+    memset(line, 'x', sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\n';
+    for (int i = 0; i < g_cat_kb; i++) {
+        if (write(fd, line, sizeof(line)) != (ssize_t)sizeof(line)) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-i addr] [-p port] [-c sessions] [-d secs] [-r rate] [-m mix]\n", prog);
+    printf("          [-C] [-S cat_kb] [-l label]\n");
+    printf("  -i ADDR       Server IP, socket path or @name (default: %s)\n", RDSH_DEF_CLI_CONNECT);
+    printf("  -p PORT       Server port (default: %d)\n", RDSH_DEF_PORT);
+    printf("  -c SESSIONS   Concurrent sessions (default: 4)\n");
+    printf("  -d SECS       How long to run (default: 5)\n");
+    printf("  -r RATE       Open loop, RATE commands per second over all sessions\n");
+    printf("                (default: closed loop, one command per session at a time)\n");
+    printf("  -C            A new connection for every command (closed loop)\n");
+    printf("  -m MIX        Command weights (default: echo:70,true:20,cat:10)\n");
+    printf("  -S KB         Size of the file `cat` reads (default: 256)\n");
+    printf("  -l LABEL      Shown in the report, e.g. the server mode\n");
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:p:c:d:r:Cm:S:l:h")) != -1) {
+        switch (opt) {
+        case 'i': g_addr = optarg; break;
+        case 'p': g_port = atoi(optarg); break;
+        case 'c': g_sessions = atoi(optarg); break;
+        case 'd': g_secs = atof(optarg); break;
+        case 'r': g_rate = atof(optarg); break;
+        case 'm':
+            if (parse_mix(optarg) < 0) return EXIT_FAILURE;
+            break;
+        case 'S': g_cat_kb = atoi(optarg); break;
+        case 'l': g_label = optarg; break;
+        case 'C': g_reconnect = true; break;
+        case 'h':
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (g_sessions <= 0 || g_secs <= 0 || g_rate < 0 || g_cat_kb <= 0 || g_port <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (g_reconnect) {
+        g_rate = 0;
+    }
+    if (g_mix[KIND_CAT] > 0 && make_cat_file() < 0) {
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    bench_session_t *sessions = calloc(g_sessions, sizeof(bench_session_t));
+    if (sessions == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    g_start_ns = now_ns();
+    g_end_ns = g_start_ns + (uint64_t)(g_secs * 1e9);
+    for (int i = 0; i < g_sessions; i++) {
+        sessions[i].idx = i;
+        if (pthread_create(&sessions[i].tid, NULL,
+                           g_reconnect ? bench_session_reconnect : bench_session, &sessions[i]) != 0) {
+            perror("pthread_create");
+            g_sessions = i;
+            break;
+        }
+    }
+
+    bench_hist_t all[KIND_MAX + 1];
+    int connected = 0;
+    memset(all, 0, sizeof(all));
+    for (int i = 0; i < g_sessions; i++) {
+        pthread_join(sessions[i].tid, NULL);
+        connected += sessions[i].connected;
+        for (int k = 0; k < KIND_MAX; k++) {
+            hist_merge(&all[k], &sessions[i].hist[k]);
+            hist_merge(&all[KIND_MAX], &sessions[i].hist[k]);
+        }
+    }
+    double secs = (now_ns() - g_start_ns) / 1e9;
+
+    printf("%s%s%d/%d sessions, %s, %.1f s, mix echo:%d true:%d cat:%d (%d KB)\n",
+           g_label, *g_label ? ": " : "", connected, g_sessions,
+           g_reconnect ? "connection per command" : (g_rate > 0) ? "open loop" : "closed loop", secs,
+           g_mix[KIND_ECHO], g_mix[KIND_TRUE], g_mix[KIND_CAT], g_cat_kb);
+    if (g_rate > 0) {
+        printf("target rate %.0f commands/s\n", g_rate);
+    }
+    printf("%-6s %9s %9s %8s %8s %8s %8s %9s %7s\n", "cmd", "count", "ops/s", "MB/s",
+           "p50 us", "p99 us", "p999 us", "max us", "errors");
+    for (int k = 0; k < KIND_MAX; k++) {
+        if (all[k].total > 0) print_row(kind_names[k], &all[k], secs);
+    }
+    print_row("all", &all[KIND_MAX], secs);
+
+    free(sessions);
+    return (connected > 0 && all[KIND_MAX].total > 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,58 @@
+#!/bin/bash
+#
+# Streams a large file through the remote shell and reports throughput and
+# the CPU time the server and client spend per GB moved.
+#
+#   usage: bench/stream_bench.sh [size_mb] [server mode flags...]
+#
+#   bench/stream_bench.sh 4096          # single-threaded server, 4 GB
+#   bench/stream_bench.sh 2048 -w -n 4  # worker pool server, 2 GB
+#
+# Set DSH to benchmark another build (e.g. one from before a change), and
+# PORT if the default one is taken.
+
+SIZE_MB=${1:-2048}
+shift
+MODE_FLAGS="$*"
+DSH=${DSH:-./dsh}
+PORT=${PORT:-5480}
+DATA=${TMPDIR:-/tmp}/rsh_stream_bench.dat
+
+# CPU seconds (user + system) used so far by a process
+cpu_secs() {
+    awk -v hz="$(getconf CLK_TCK)" '{ printf "%.2f", ($14 + $15) / hz }' /proc/$1/stat
+}
+
+if [ ! -f "$DATA" ] || [ "$(stat -c %s "$DATA")" -ne $((SIZE_MB * 1024 * 1024)) ]; then
+    echo "creating ${SIZE_MB} MB test file in $DATA"
+    yes "the quick brown fox jumps over the lazy dog 0123456789" | \
+        head -c $((SIZE_MB * 1024 * 1024)) > "$DATA"
+fi
+
+$DSH -s -i 127.0.0.1 -p $PORT $MODE_FLAGS > /dev/null 2>&1 &
+SERVER_PID=$!
+trap 'kill $SERVER_PID 2>/dev/null' EXIT
+sleep 1
+if ! kill -0 $SERVER_PID 2>/dev/null; then
+    echo "server failed to start on port $PORT"
+    exit 1
+fi
+
+svr_cpu0=$(cpu_secs $SERVER_PID)
+start=$(date +%s.%N)
+
+# The client's own CPU comes from bash's `times` in the subshell
+cli_cpu=$( (echo "cat $DATA" | $DSH -c -i 127.0.0.1 -p $PORT > /dev/null; times) | \
+    awk 'NR == 2 { split($1, u, "m"); split($2, s, "m");
+                   printf "%.2f", u[1] * 60 + u[2] + s[1] * 60 + s[2] }')
+
+end=$(date +%s.%N)
+svr_cpu1=$(cpu_secs $SERVER_PID)
+
+awk -v mb=$SIZE_MB -v t0=$start -v t1=$end -v s0=$svr_cpu0 -v s1=$svr_cpu1 -v c=$cli_cpu \
+    -v mode="${MODE_FLAGS:-single}" 'BEGIN {
+    gb = mb / 1024; secs = t1 - t0
+    printf "mode %-10s %8.1f MB in %6.2f s  %8.1f MB/s\n", mode, mb, secs, mb / secs
+    printf "  server cpu %6.2f s  (%.2f s/GB)\n", s1 - s0, (s1 - s0) / gb
+    printf "  client cpu %6.2f s  (%.2f s/GB)\n", c, c / gb
+}'
@@ -1,4 +1,7 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
 
 // EXTRA CREDIT - print the drexel dragon from the readme.md
 // Dragon print data
@@ -63,13 +66,42 @@ const dragon_run_t DRAGON_DATA[] = {
     {7<<2|1}, {1<<2|2}, {1<<2|3}, 
 };
 
-// Dragon print function
-void print_dragon(void) {
+static char  *g_dragon_text = NULL;
+static size_t g_dragon_len = 0;
+static pthread_once_t g_dragon_once = PTHREAD_ONCE_INIT;
+
+// Expands the run-length data once so every print is a single write()
+static void render_dragon(void) {
+    size_t len = 0;
+    for (size_t i = 0; i < sizeof(DRAGON_DATA)/sizeof(dragon_run_t); i++) {
+        len += DRAGON_DATA[i].data >> 2;
+    }
+
+    g_dragon_text = malloc(len);
+    if (g_dragon_text == NULL) return;
+
     for (size_t i = 0; i < sizeof(DRAGON_DATA)/sizeof(dragon_run_t); i++) {
         unsigned char count = DRAGON_DATA[i].data >> 2;
         unsigned char chr_idx = DRAGON_DATA[i].data & 0x3;
         for (unsigned char j = 0; j < count; j++) {
-            putchar(CHARS[chr_idx]);
+            g_dragon_text[g_dragon_len++] = CHARS[chr_idx];
         }
     }
-}
\ No newline at end of file
+}
+
+// Dragon print function, writes to an arbitrary descriptor (file, socket)
+void print_dragon_fd(int fd) {
+    pthread_once(&g_dragon_once, render_dragon);
+
+    size_t off = 0;
+    while (g_dragon_text != NULL && off < g_dragon_len) {
+        ssize_t n = write(fd, g_dragon_text + off, g_dragon_len - off);
+        if (n <= 0) break;
+        off += n;
+    }
+}
+
+void print_dragon(void) {
+    fflush(stdout);
+    print_dragon_fd(STDOUT_FILENO);
+}
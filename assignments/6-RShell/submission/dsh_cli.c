@@ -14,10 +14,11 @@
 #define MODE_LCLI   0       //Local client
 #define MODE_SCLI   1       //Socket client
 #define MODE_SSVR   2       //Socket server
+#define MODE_AGENT  3       //Connection agent for clients
 
 typedef struct cmd_args{
   int   mode;
-  char  ip[16];   //e.g., 192.168.100.101\0
+  char  ip[108];  //e.g., 192.168.100.101\0, or a Unix socket path or @name
   int   port;
   int   threaded_server;
 }cmd_args_t;
@@ -30,30 +31,54 @@ typedef struct cmd_args{
 //with passing optional connection parameters. 
 
 void print_usage(const char *progname) {
-  printf("Usage: %s [-c | -s] [-i IP] [-p PORT] [-x] [-h]\n", progname);
+  printf("Usage: %s [-c | -s | -a] [-i IP] [-p PORT] [-b[WINDOW]] [-A] [-z] [-x | -e | -w] [-n THREADS] [-k ACCEPTORS] [-f SPAWNERS] [-L LIMITS] [-T TIMEOUTS] [-M ADDR] [-v] [-h]\n", progname);
   printf("  Default is to run %s in local mode\n", progname);
   printf("  -c            Run as client\n");
   printf("  -s            Run as server\n");
-  printf("  -i IP         Set IP/Interface address (only valid with -c or -s)\n");
+  printf("  -a            Run as connection agent, keeps server connections\n");
+  printf("                open for clients started with -A\n");
+  printf("  -i IP         Set IP/Interface address (only valid with -c or -s),\n");
+  printf("                a path or @name uses a Unix socket instead of TCP\n");
   printf("  -p PORT       Set port number (only valid with -c or -s)\n");
+  printf("  -b[WINDOW]    Batch mode, send up to WINDOW commands (default: %d)\n", RSH_BATCH_WINDOW);
+  printf("                without waiting for replies (only valid with -c,\n");
+  printf("                the default when stdin is not a terminal)\n");
+  printf("  -A            Connect through the agent (only valid with -c)\n");
+  printf("  -z            Ask the server to compress command output (only valid\n");
+  printf("                with -c)\n");
   printf("  -x            Enable threaded mode (only valid with -s)\n");
+  printf("  -e            Enable event-driven (epoll) mode (only valid with -s)\n");
+  printf("  -w            Enable work-stealing worker pool mode (only valid with -s)\n");
+  printf("  -n THREADS    Threads for -e or -w (default: one per CPU)\n");
+  printf("  -k ACCEPTORS  Accept loops for -x, each with its own SO_REUSEPORT\n");
+  printf("                socket (default: 1)\n");
+  printf("  -f SPAWNERS   Pre-forked processes that fork commands (default: %d,\n", RSH_SPAWNER_DEF);
+  printf("                0 forks them in the server, only valid with -s)\n");
+  printf("  -L LIMITS     Resource limits, e.g. procs=8,total=64,cpu=10,mem=512m,out=16m\n");
+  printf("                (only valid with -s, see rsh_limits.c)\n");
+  printf("  -T TIMEOUTS   Heartbeats and timeouts in seconds, e.g. ping=30,dead=30,idle=600,\n");
+  printf("                keepalive=60 (only valid with -s, see rsh_timer.c)\n");
+  printf("  -M ADDR       Serve metrics in plain text on a local port, a Unix socket\n");
+  printf("                path or @name (only valid with -s)\n");
+  printf("  -v            Print every command the server receives (only valid with -s)\n");
   printf("  -h            Show this help message\n");
   exit(0);
 }
 
 void parse_args(int argc, char *argv[], cmd_args_t *cargs) {
   int opt;
+  int acceptors = 1;
   memset(cargs, 0, sizeof(cmd_args_t));
 
   //defaults
   cargs->mode = MODE_LCLI;
   cargs->port = RDSH_DEF_PORT;
 
-  while ((opt = getopt(argc, argv, "csi:p:xh")) != -1) {
+  while ((opt = getopt(argc, argv, "casi:p:b::Azxewn:k:f:L:T:M:vh")) != -1) {
       switch (opt) {
           case 'c':
               if (cargs->mode != MODE_LCLI) {
-                  fprintf(stderr, "Error: Cannot use both -c and -s\n");
+                  fprintf(stderr, "Error: Use only one of -c, -s and -a\n");
                   exit(EXIT_FAILURE);
               }
               cargs->mode = MODE_SCLI;
@@ -61,12 +86,19 @@ void parse_args(int argc, char *argv[], cmd_args_t *cargs) {
               break;
           case 's':
               if (cargs->mode != MODE_LCLI) {
-                  fprintf(stderr, "Error: Cannot use both -c and -s\n");
+                  fprintf(stderr, "Error: Use only one of -c, -s and -a\n");
                   exit(EXIT_FAILURE);
               }
               cargs->mode = MODE_SSVR;
               strncpy(cargs->ip, RDSH_DEF_SVR_INTFACE, sizeof(cargs->ip) - 1);
               break;
+          case 'a':
+              if (cargs->mode != MODE_LCLI) {
+                  fprintf(stderr, "Error: Use only one of -c, -s and -a\n");
+                  exit(EXIT_FAILURE);
+              }
+              cargs->mode = MODE_AGENT;
+              break;
           case 'i':
               if (cargs->mode == MODE_LCLI) {
                   fprintf(stderr, "Error: -i can only be used with -c or -s\n");
@@ -86,12 +118,131 @@ void parse_args(int argc, char *argv[], cmd_args_t *cargs) {
                   exit(EXIT_FAILURE);
               }
               break;
+          case 'b':
+              if (cargs->mode != MODE_SCLI) {
+                  fprintf(stderr, "Error: -b can only be used with -c\n");
+                  exit(EXIT_FAILURE);
+              }
+              if (optarg != NULL && atoi(optarg) <= 0) {
+                  fprintf(stderr, "Error: -b takes a window of at least 1\n");
+                  exit(EXIT_FAILURE);
+              }
+              set_client_batch(optarg ? atoi(optarg) : RSH_BATCH_WINDOW);
+              break;
+          case 'A':
+              if (cargs->mode != MODE_SCLI) {
+                  fprintf(stderr, "Error: -A can only be used with -c\n");
+                  exit(EXIT_FAILURE);
+              }
+              set_client_agent(true);
+              break;
+          case 'z':
+              if (cargs->mode != MODE_SCLI) {
+                  fprintf(stderr, "Error: -z can only be used with -c\n");
+                  exit(EXIT_FAILURE);
+              }
+              set_client_compress(true);
+              break;
           case 'x':
               if (cargs->mode != MODE_SSVR) {
                   fprintf(stderr, "Error: -x can only be used with -s\n");
                   exit(EXIT_FAILURE);
               }
-              cargs->threaded_server = 1;
+              if (cargs->threaded_server != RSH_SVR_SINGLE && cargs->threaded_server != RSH_SVR_THREADED) {
+                  fprintf(stderr, "Error: Use only one of -x, -e and -w\n");
+                  exit(EXIT_FAILURE);
+              }
+              cargs->threaded_server = RSH_SVR_THREADED;
+              break;
+          case 'e':
+              if (cargs->mode != MODE_SSVR) {
+                  fprintf(stderr, "Error: -e can only be used with -s\n");
+                  exit(EXIT_FAILURE);
+              }
+              if (cargs->threaded_server != RSH_SVR_SINGLE && cargs->threaded_server != RSH_SVR_REACTOR) {
+                  fprintf(stderr, "Error: Use only one of -x, -e and -w\n");
+                  exit(EXIT_FAILURE);
+              }
+              cargs->threaded_server = RSH_SVR_REACTOR;
+              break;
+          case 'w':
+              if (cargs->mode != MODE_SSVR) {
+                  fprintf(stderr, "Error: -w can only be used with -s\n");
+                  exit(EXIT_FAILURE);
+              }
+              if (cargs->threaded_server != RSH_SVR_SINGLE && cargs->threaded_server != RSH_SVR_POOL) {
+                  fprintf(stderr, "Error: Use only one of -x, -e and -w\n");
+                  exit(EXIT_FAILURE);
+              }
+              cargs->threaded_server = RSH_SVR_POOL;
+              break;
+          case 'n':
+              if (cargs->mode != MODE_SSVR) {
+                  fprintf(stderr, "Error: -n can only be used with -s\n");
+                  exit(EXIT_FAILURE);
+              }
+              if (atoi(optarg) <= 0 || atoi(optarg) > RSH_MAX_THREADS) {
+                  fprintf(stderr, "Error: -n takes 1 to %d threads\n", RSH_MAX_THREADS);
+                  exit(EXIT_FAILURE);
+              }
+              set_server_threads(atoi(optarg));
+              break;
+          case 'k':
+              if (cargs->mode != MODE_SSVR) {
+                  fprintf(stderr, "Error: -k can only be used with -s\n");
+                  exit(EXIT_FAILURE);
+              }
+              if (atoi(optarg) <= 0 || atoi(optarg) > RSH_ACCEPTORS_MAX) {
+                  fprintf(stderr, "Error: -k takes 1 to %d acceptors\n", RSH_ACCEPTORS_MAX);
+                  exit(EXIT_FAILURE);
+              }
+              acceptors = atoi(optarg);
+              set_server_acceptors(acceptors);
+              break;
+          case 'f':
+              if (cargs->mode != MODE_SSVR) {
+                  fprintf(stderr, "Error: -f can only be used with -s\n");
+                  exit(EXIT_FAILURE);
+              }
+              if (atoi(optarg) < 0 || atoi(optarg) > RSH_SPAWNER_LIMIT) {
+                  fprintf(stderr, "Error: -f takes 0 to %d spawners\n", RSH_SPAWNER_LIMIT);
+                  exit(EXIT_FAILURE);
+              }
+              set_server_spawners(atoi(optarg));
+              break;
+          case 'L':
+              if (cargs->mode != MODE_SSVR) {
+                  fprintf(stderr, "Error: -L can only be used with -s\n");
+                  exit(EXIT_FAILURE);
+              }
+              if (rsh_limits_parse(optarg) != OK) {
+                  fprintf(stderr, "Error: -L takes key=value pairs, keys are procs, total, cpu, mem and out\n");
+                  exit(EXIT_FAILURE);
+              }
+              break;
+          case 'T':
+              if (cargs->mode != MODE_SSVR) {
+                  fprintf(stderr, "Error: -T can only be used with -s\n");
+                  exit(EXIT_FAILURE);
+              }
+              if (rsh_timeouts_parse(optarg) != OK) {
+                  fprintf(stderr, "Error: -T takes key=seconds pairs, keys are ping, dead, idle and keepalive\n");
+                  exit(EXIT_FAILURE);
+              }
+              break;
+          case 'M':
+              if (cargs->mode != MODE_SSVR) {
+                  fprintf(stderr, "Error: -M can only be used with -s\n");
+                  exit(EXIT_FAILURE);
+              }
+              set_server_metrics(optarg);
+              break;
+          case 'v':
+              if (cargs->mode != MODE_SSVR) {
+                  fprintf(stderr, "Error: -v can only be used with -s\n");
+                  exit(EXIT_FAILURE);
+              }
+              set_server_verbose(1);
               break;
           case 'h':
               print_usage(argv[0]);
@@ -105,6 +256,10 @@ void parse_args(int argc, char *argv[], cmd_args_t *cargs) {
       fprintf(stderr, "Error: -x can only be used with -s\n");
       exit(EXIT_FAILURE);
   }
+  if (acceptors > 1 && cargs->threaded_server != RSH_SVR_THREADED) {
+      fprintf(stderr, "Error: -k can only be used with -x\n");
+      exit(EXIT_FAILURE);
+  }
 }
 
 
@@ -140,10 +295,24 @@ int main(int argc, char *argv[]){
       }
       rc = start_server(cargs.ip, cargs.port, cargs.threaded_server);
       break;
+    case MODE_AGENT: {
+      char path[108];
+      rc = rsh_agent_path(path, sizeof(path), true);
+      if (rc == OK) {
+        rc = rsh_agent_run(path);
+      }
+      break;
+    }
     default:
       printf("error unknown mode\n");
       exit(EXIT_FAILURE);
   }
 
   printf("cmd loop returned %d\n", rc);
+
+  // A remote session exits with the status of its last command
+  if (cargs.mode == MODE_SCLI && rc == OK) {
+    return rsh_client_status();
+  }
+  return 0;
 }
\ No newline at end of file
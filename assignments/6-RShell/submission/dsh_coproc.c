@@ -0,0 +1,306 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "dshlib.h"
+
+/*
+ * Coprocesses: long lived workers that stay connected to the shell by a
+ * pair of pipes so hot loops don't pay fork() + exec() per call.
+ *
+ *      coproc NAME CMD [ARGS...]   start CMD as worker NAME
+ *      coproc -s NAME TEXT...      send TEXT as one request, print the reply
+ *      coproc -l                   list workers (also plain `coproc`)
+ *      coproc -k NAME              close the worker's stdin and reap it
+ *
+ * Framing: a request is written as the text, a newline, and then a line
+ * holding only the end-of-record marker (DSH_COPROC_EOR, ASCII RS).  The
+ * reply is everything the worker writes up to the marker line coming
+ * back.  Line preserving filters that flush per line (sed -u, awk with
+ * fflush(), cat, tr) echo the marker unchanged, so they work as-is; a
+ * grep worker just needs `-e $'\x1e'` added to its patterns.  A worker
+ * that never answers is given up on after DSH_COPROC_TIMEOUT_MS.
+ */
+
+typedef struct coproc {
+    char   name[DSH_COPROC_NAME_MAX];
+    char   cmd[SH_CMD_MAX];
+    pid_t  pid;
+    int    to_fd;                   //worker's stdin
+    int    from_fd;                 //worker's stdout
+    long   requests;
+    char   rbuf[DSH_COPROC_BUFF];   //reply bytes read past the last marker
+    int    rlen;
+} coproc_t;
+
+static coproc_t g_coprocs[DSH_COPROC_MAX];
+
+static coproc_t *coproc_find(const char *name) {
+    for (int i = 0; i < DSH_COPROC_MAX; i++) {
+        if (g_coprocs[i].pid > 0 && strcmp(g_coprocs[i].name, name) == 0) {
+            return &g_coprocs[i];
+        }
+    }
+    return NULL;
+}
+
+static void coproc_reap(coproc_t *cp) {
+    close(cp->to_fd);
+    close(cp->from_fd);
+
+    // Closing stdin ends well behaved filters, give them a moment first
+    for (int i = 0; i < 50; i++) {
+        if (waitpid(cp->pid, NULL, WNOHANG) != 0) {
+            cp->pid = 0;
+            return;
+        }
+        struct timespec ts = {0, 2 * 1000 * 1000};
+        nanosleep(&ts, NULL);
+    }
+    kill(cp->pid, SIGTERM);
+    waitpid(cp->pid, NULL, 0);
+    cp->pid = 0;
+}
+
+static int coproc_start(cmd_buff_t *cmd, int out_fd) {
+    const char *name = cmd->argv[1];
+    int to_pipe[2], from_pipe[2];
+
+    if (cmd->argc < 3) {
+        dprintf(out_fd, "coproc: usage: coproc NAME CMD [ARGS...]\n");
+        return 1;
+    }
+    if (coproc_find(name) != NULL) {
+        dprintf(out_fd, "coproc: %s: already running\n", name);
+        return 1;
+    }
+
+    coproc_t *cp = NULL;
+    for (int i = 0; i < DSH_COPROC_MAX && cp == NULL; i++) {
+        if (g_coprocs[i].pid == 0) cp = &g_coprocs[i];
+    }
+    if (cp == NULL) {
+        dprintf(out_fd, "coproc: limited to %d coprocesses\n", DSH_COPROC_MAX);
+        return 1;
+    }
+
+    // Close-on-exec so ordinary commands never inherit a worker's pipes
+    if (pipe2(to_pipe, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return 1;
+    }
+    if (pipe2(from_pipe, O_CLOEXEC) < 0) {
+        perror("pipe");
+        close(to_pipe[0]);
+        close(to_pipe[1]);
+        return 1;
+    }
+
+    char exe_path[PATH_MAX];
+    cmd_hash_resolve(cmd->argv[2], exe_path, sizeof(exe_path));
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(to_pipe[0]);
+        close(to_pipe[1]);
+        close(from_pipe[0]);
+        close(from_pipe[1]);
+        return 1;
+    } else if (pid == 0) {
+        dup2(to_pipe[0], STDIN_FILENO);
+        dup2(from_pipe[1], STDOUT_FILENO);
+        cmd_hash_exec(exe_path, &cmd->argv[2]);
+        perror(cmd->argv[2]);
+        exit(errno);
+    }
+
+    close(to_pipe[0]);
+    close(from_pipe[1]);
+
+    memset(cp, 0, sizeof(coproc_t));
+    snprintf(cp->name, sizeof(cp->name), "%s", name);
+    for (int i = 2; i < cmd->argc; i++) {
+        size_t used = strlen(cp->cmd);
+        snprintf(cp->cmd + used, sizeof(cp->cmd) - used, "%s%s", (i > 2) ? " " : "", cmd->argv[i]);
+    }
+    cp->pid = pid;
+    cp->to_fd = to_pipe[1];
+    cp->from_fd = from_pipe[0];
+    return 0;
+}
+
+/*
+ * Writes the whole buffer to the worker.  SIGPIPE is held off while we
+ * write so a dead worker shows up as EPIPE instead of killing the shell;
+ * ignoring it outright would be inherited by every command we exec.
+ */
+static int coproc_write(coproc_t *cp, const char *buff, size_t len) {
+    sigset_t pipe_set, old_set;
+    int rc = OK;
+
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &pipe_set, &old_set);
+
+    while (len > 0) {
+        ssize_t n = write(cp->to_fd, buff, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EPIPE) {
+                struct timespec zero = {0, 0};
+                sigtimedwait(&pipe_set, NULL, &zero);
+            }
+            rc = ERR_EXEC_CMD;
+            break;
+        }
+        buff += n;
+        len -= n;
+    }
+
+    sigprocmask(SIG_SETMASK, &old_set, NULL);
+    return rc;
+}
+
+/*
+ * Copies the worker's reply to out_fd up to the end-of-record line.
+ */
+static int coproc_read_reply(coproc_t *cp, int out_fd) {
+    bool bol = true;            //at the beginning of a line
+
+    while (1) {
+        if (cp->rlen == 0 || (cp->rlen == 1 && bol && cp->rbuf[0] == DSH_COPROC_EOR)) {
+            struct pollfd pfd = { .fd = cp->from_fd, .events = POLLIN };
+            int ready = poll(&pfd, 1, DSH_COPROC_TIMEOUT_MS);
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready <= 0) return ERR_EXEC_CMD;
+
+            ssize_t n = read(cp->from_fd, cp->rbuf + cp->rlen, sizeof(cp->rbuf) - cp->rlen);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return ERR_EXEC_CMD;
+            cp->rlen += n;
+        }
+
+        int i;
+        for (i = 0; i < cp->rlen; i++) {
+            if (bol && cp->rbuf[i] == DSH_COPROC_EOR) {
+                if (i + 1 == cp->rlen) break;       //need the next byte
+                if (cp->rbuf[i + 1] == '\n') {
+                    if (i > 0 && write(out_fd, cp->rbuf, i) < 0) return ERR_EXEC_CMD;
+                    cp->rlen -= i + 2;
+                    memmove(cp->rbuf, cp->rbuf + i + 2, cp->rlen);
+                    return OK;
+                }
+            }
+            bol = (cp->rbuf[i] == '\n');
+        }
+
+        // Flush everything before a possible partial marker
+        if (i > 0 && write(out_fd, cp->rbuf, i) < 0) return ERR_EXEC_CMD;
+        cp->rlen -= i;
+        memmove(cp->rbuf, cp->rbuf + i, cp->rlen);
+    }
+}
+
+static int coproc_send(cmd_buff_t *cmd, int out_fd) {
+    if (cmd->argc < 4) {
+        dprintf(out_fd, "coproc: usage: coproc -s NAME TEXT...\n");
+        return 1;
+    }
+
+    coproc_t *cp = coproc_find(cmd->argv[2]);
+    if (cp == NULL) {
+        dprintf(out_fd, "coproc: %s: no such coprocess\n", cmd->argv[2]);
+        return 1;
+    }
+
+    // Request text, then the marker line, in a single write
+    char req[SH_CMD_MAX + 8];
+    int len = 0;
+    for (int i = 3; i < cmd->argc && len < (int)sizeof(req); i++) {
+        len += snprintf(req + len, sizeof(req) - len, "%s%s", (i > 3) ? " " : "", cmd->argv[i]);
+    }
+    if (len > (int)sizeof(req) - 3) len = sizeof(req) - 3;
+    req[len++] = '\n';
+    req[len++] = DSH_COPROC_EOR;
+    req[len++] = '\n';
+
+    if (coproc_write(cp, req, len) != OK || coproc_read_reply(cp, out_fd) != OK) {
+        dprintf(out_fd, "coproc: %s: worker did not answer, stopping it\n", cp->name);
+        coproc_reap(cp);
+        return 1;
+    }
+
+    cp->requests++;
+    return 0;
+}
+
+static int coproc_list(int out_fd) {
+    dprintf(out_fd, "%-16s %8s %10s  %s\n", "name", "pid", "requests", "command");
+    for (int i = 0; i < DSH_COPROC_MAX; i++) {
+        coproc_t *cp = &g_coprocs[i];
+        if (cp->pid == 0) continue;
+
+        // Drop workers that already exited on their own
+        if (waitpid(cp->pid, NULL, WNOHANG) == cp->pid) {
+            close(cp->to_fd);
+            close(cp->from_fd);
+            cp->pid = 0;
+            continue;
+        }
+        dprintf(out_fd, "%-16s %8d %10ld  %s\n", cp->name, (int)cp->pid, cp->requests, cp->cmd);
+    }
+    return 0;
+}
+
+/*
+ * coproc_builtin(cmd, out_fd)
+ *      cmd:     parsed `coproc` command
+ *      out_fd:  where replies, listings and errors are written
+ *
+ *  Returns the exit status of the builtin (0 on success, 1 on failure).
+ */
+int coproc_builtin(cmd_buff_t *cmd, int out_fd) {
+    if (cmd->argc == 1 || strcmp(cmd->argv[1], "-l") == 0) {
+        return coproc_list(out_fd);
+    }
+
+    if (strcmp(cmd->argv[1], "-s") == 0) {
+        return coproc_send(cmd, out_fd);
+    }
+
+    if (strcmp(cmd->argv[1], "-k") == 0) {
+        if (cmd->argc < 3) {
+            dprintf(out_fd, "coproc: usage: coproc -k NAME\n");
+            return 1;
+        }
+        coproc_t *cp = coproc_find(cmd->argv[2]);
+        if (cp == NULL) {
+            dprintf(out_fd, "coproc: %s: no such coprocess\n", cmd->argv[2]);
+            return 1;
+        }
+        coproc_reap(cp);
+        return 0;
+    }
+
+    return coproc_start(cmd, out_fd);
+}
+
+/*
+ * Stops every worker, called when the shell exits.
+ */
+void coproc_shutdown(void) {
+    for (int i = 0; i < DSH_COPROC_MAX; i++) {
+        if (g_coprocs[i].pid > 0) coproc_reap(&g_coprocs[i]);
+    }
+}
@@ -0,0 +1,345 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "dshlib.h"
+
+/*
+ * Command path hash table, modeled after the bash `hash` builtin.
+ *
+ * execvp() walks every directory in $PATH and tries an execve() in each
+ * one until something works.  For a shell that launches the same handful
+ * of commands over and over that is wasted work, so the parent resolves
+ * argv[0] once, remembers the absolute path here, and the child calls
+ * execve() on that path directly.
+ *
+ * The table is thrown away whenever $PATH changes.  If a remembered path
+ * has disappeared the child gets ENOENT from execve(); it reports the
+ * stale name back to the parent through a close-on-exec pipe and falls
+ * back to execvp() so the command still runs.  The parent drains that
+ * pipe on the next lookup and drops the entry.
+ *
+ * The remote shell server calls into this from several threads, so all
+ * table access is serialized with a mutex.  Children never touch the
+ * mutex, they only write to the stale pipe.
+ */
+
+typedef struct cmd_hash_entry {
+    char *name;
+    char *path;
+    int   hits;
+    struct cmd_hash_entry *next;
+} cmd_hash_entry_t;
+
+static cmd_hash_entry_t *g_hash_tbl[CMD_HASH_BUCKETS];
+static int   g_hash_count = 0;
+static char *g_hash_path_env = NULL;        // $PATH the table was built for
+static int   g_hash_stale_pipe[2] = {-1, -1};
+static pthread_mutex_t g_hash_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int cmd_hash_fn(const char *s) {
+    unsigned int h = 2166136261u;           // FNV-1a
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h % CMD_HASH_BUCKETS;
+}
+
+static void cmd_hash_clear_locked(void) {
+    for (int i = 0; i < CMD_HASH_BUCKETS; i++) {
+        cmd_hash_entry_t *e = g_hash_tbl[i];
+        while (e != NULL) {
+            cmd_hash_entry_t *next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            e = next;
+        }
+        g_hash_tbl[i] = NULL;
+    }
+    g_hash_count = 0;
+}
+
+static void cmd_hash_forget_locked(const char *name) {
+    cmd_hash_entry_t **pp = &g_hash_tbl[cmd_hash_fn(name)];
+    while (*pp != NULL) {
+        if (strcmp((*pp)->name, name) == 0) {
+            cmd_hash_entry_t *dead = *pp;
+            *pp = dead->next;
+            free(dead->name);
+            free(dead->path);
+            free(dead);
+            g_hash_count--;
+            return;
+        }
+        pp = &(*pp)->next;
+    }
+}
+
+/*
+ * cmd_hash_init()
+ *
+ *  Opens the stale path pipe.  A process forked now, like the server's
+ *  zygote and spawners, hands its write end on to the commands it starts,
+ *  so the server calls this before forking them.  The local shell leaves
+ *  it to the first lookup.
+ */
+void cmd_hash_init(void) {
+    if (g_hash_stale_pipe[0] >= 0) {
+        return;
+    }
+    if (pipe2(g_hash_stale_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        g_hash_stale_pipe[0] = g_hash_stale_pipe[1] = -1;
+    }
+}
+
+/*
+ * Throws the table away if $PATH is different from the one it was built
+ * with, and drops any entries that children reported as stale.
+ */
+static void cmd_hash_validate_locked(void) {
+    const char *path_env = getenv("PATH");
+    if (path_env == NULL) path_env = "";
+
+    if (g_hash_path_env == NULL || strcmp(g_hash_path_env, path_env) != 0) {
+        cmd_hash_clear_locked();
+        free(g_hash_path_env);
+        g_hash_path_env = strdup(path_env);
+    }
+
+    if (g_hash_stale_pipe[0] < 0) {
+        cmd_hash_init();
+        return;
+    }
+
+    // Names are written one per line, each write is well under PIPE_BUF
+    char buff[PIPE_BUF + 1];
+    ssize_t n;
+    while ((n = read(g_hash_stale_pipe[0], buff, PIPE_BUF)) > 0) {
+        buff[n] = '\0';
+        char *save = NULL;
+        for (char *name = strtok_r(buff, "\n", &save); name != NULL;
+             name = strtok_r(NULL, "\n", &save)) {
+            cmd_hash_forget_locked(name);
+        }
+    }
+}
+
+/*
+ * Walks $PATH looking for an executable regular file called name.  Only
+ * absolute hits are returned since relative $PATH entries depend on the
+ * current directory and can't be cached.
+ */
+static int cmd_hash_search_path(const char *name, char *path, size_t path_sz) {
+    const char *dir = g_hash_path_env;
+
+    while (dir != NULL && *dir != '\0') {
+        const char *end = strchr(dir, ':');
+        size_t dir_len = (end != NULL) ? (size_t)(end - dir) : strlen(dir);
+
+        if (dir_len > 0 && dir[0] == '/' && dir_len + strlen(name) + 2 <= path_sz) {
+            struct stat st;
+            snprintf(path, path_sz, "%.*s/%s", (int)dir_len, dir, name);
+            if (stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+                access(path, X_OK) == 0) {
+                return OK;
+            }
+        }
+        dir = (end != NULL) ? end + 1 : NULL;
+    }
+
+    path[0] = '\0';
+    return ERR_EXEC_CMD;
+}
+
+static cmd_hash_entry_t *cmd_hash_add_locked(const char *name, const char *path) {
+    cmd_hash_entry_t *e = malloc(sizeof(cmd_hash_entry_t));
+    if (e == NULL) return NULL;
+
+    e->name = strdup(name);
+    e->path = strdup(path);
+    if (e->name == NULL || e->path == NULL) {
+        free(e->name);
+        free(e->path);
+        free(e);
+        return NULL;
+    }
+    e->hits = 0;
+
+    unsigned int b = cmd_hash_fn(name);
+    e->next = g_hash_tbl[b];
+    g_hash_tbl[b] = e;
+    g_hash_count++;
+    return e;
+}
+
+/*
+ * cmd_hash_resolve(name, path, path_sz)
+ *      name:     argv[0] of the command about to be run
+ *      path:     receives the absolute path to hand to cmd_hash_exec()
+ *      path_sz:  size of the path buffer
+ *
+ *  Called by the parent before fork().  Names containing a '/' are never
+ *  hashed, just like execvp() never searches for them.
+ *
+ *  Returns:
+ *      OK:            path holds the location of the command
+ *      ERR_EXEC_CMD:  not found (path is set to ""), execvp() will report it
+ */
+int cmd_hash_resolve(const char *name, char *path, size_t path_sz) {
+    path[0] = '\0';
+    if (name == NULL || *name == '\0' || strchr(name, '/') != NULL) {
+        return ERR_EXEC_CMD;
+    }
+
+    pthread_mutex_lock(&g_hash_mutex);
+    cmd_hash_validate_locked();
+
+    for (cmd_hash_entry_t *e = g_hash_tbl[cmd_hash_fn(name)]; e != NULL; e = e->next) {
+        if (strcmp(e->name, name) == 0) {
+            e->hits++;
+            snprintf(path, path_sz, "%s", e->path);
+            pthread_mutex_unlock(&g_hash_mutex);
+            return OK;
+        }
+    }
+
+    int rc = cmd_hash_search_path(name, path, path_sz);
+    if (rc == OK) {
+        cmd_hash_entry_t *e = cmd_hash_add_locked(name, path);
+        if (e != NULL) e->hits = 1;
+    }
+
+    pthread_mutex_unlock(&g_hash_mutex);
+    return rc;
+}
+
+/*
+ * cmd_hash_exec(path, argv)
+ *      path:  result of cmd_hash_resolve(), may be ""
+ *      argv:  NULL terminated argument vector
+ *
+ *  Called in the child after fork().  A file without a #! line is run by
+ *  /bin/sh, as execvp() would.  Only returns if the command could not be
+ *  executed, with errno set the same way execvp() leaves it.
+ */
+void cmd_hash_exec(const char *path, char *const argv[]) {
+    extern char **environ;
+
+    if (path != NULL && path[0] != '\0') {
+        execve(path, argv, environ);
+        if (errno == ENOEXEC) {
+            // No #! line: run it as a shell script, the way execvp() does
+            int argc = 0;
+            while (argv[argc] != NULL) argc++;
+
+            char *sh_argv[argc + 2];
+            sh_argv[0] = "/bin/sh";
+            sh_argv[1] = (char *)path;
+            for (int i = 1; i <= argc; i++) sh_argv[i + 1] = argv[i];
+            execve("/bin/sh", sh_argv, environ);
+            errno = ENOEXEC;
+            return;
+        }
+        if (errno != ENOENT) return;
+
+        // The hashed copy is gone, tell the parent and search $PATH again
+        if (g_hash_stale_pipe[1] >= 0) {
+            char msg[PIPE_BUF];
+            int len = snprintf(msg, sizeof(msg), "%s\n", argv[0]);
+            if (len > 0 && len < (int)sizeof(msg)) {
+                ssize_t unused = write(g_hash_stale_pipe[1], msg, len);
+                (void)unused;
+            }
+        }
+    }
+
+    execvp(argv[0], argv);
+}
+
+/*
+ * Empties the table.  Same as `hash -r`.
+ */
+void cmd_hash_clear(void) {
+    pthread_mutex_lock(&g_hash_mutex);
+    cmd_hash_clear_locked();
+    pthread_mutex_unlock(&g_hash_mutex);
+}
+
+/*
+ * cmd_hash_builtin(cmd, out_fd)
+ *      cmd:     parsed `hash` command
+ *      out_fd:  where the listing and error messages are written
+ *
+ *  Implements the `hash` builtin:
+ *      hash              list remembered commands and their hit counts
+ *      hash -r           forget everything
+ *      hash -d NAME...   forget the named commands
+ *      hash NAME...      look the commands up now and remember them
+ *
+ *  Returns the exit status of the builtin (0 on success, 1 on failure).
+ */
+int cmd_hash_builtin(cmd_buff_t *cmd, int out_fd) {
+    int status = 0;
+
+    if (cmd->argc == 1) {
+        pthread_mutex_lock(&g_hash_mutex);
+        cmd_hash_validate_locked();
+        if (g_hash_count == 0) {
+            dprintf(out_fd, "hash: hash table empty\n");
+        } else {
+            dprintf(out_fd, "hits\tcommand\n");
+            for (int i = 0; i < CMD_HASH_BUCKETS; i++) {
+                for (cmd_hash_entry_t *e = g_hash_tbl[i]; e != NULL; e = e->next) {
+                    dprintf(out_fd, "%4d\t%s\n", e->hits, e->path);
+                }
+            }
+        }
+        pthread_mutex_unlock(&g_hash_mutex);
+        return status;
+    }
+
+    if (strcmp(cmd->argv[1], "-r") == 0) {
+        cmd_hash_clear();
+        return status;
+    }
+
+    if (strcmp(cmd->argv[1], "-d") == 0) {
+        pthread_mutex_lock(&g_hash_mutex);
+        for (int i = 2; i < cmd->argc; i++) {
+            cmd_hash_forget_locked(cmd->argv[i]);
+        }
+        pthread_mutex_unlock(&g_hash_mutex);
+        return status;
+    }
+
+    for (int i = 1; i < cmd->argc; i++) {
+        char path[PATH_MAX];
+        pthread_mutex_lock(&g_hash_mutex);
+        cmd_hash_validate_locked();
+        cmd_hash_forget_locked(cmd->argv[i]);
+        int rc = (strchr(cmd->argv[i], '/') == NULL)
+                     ? cmd_hash_search_path(cmd->argv[i], path, sizeof(path))
+                     : ERR_EXEC_CMD;
+        if (rc == OK) {
+            cmd_hash_add_locked(cmd->argv[i], path);
+        }
+        pthread_mutex_unlock(&g_hash_mutex);
+
+        if (rc != OK) {
+            dprintf(out_fd, "hash: %s: not found\n", cmd->argv[i]);
+            status = 1;
+        }
+    }
+
+    return status;
+}
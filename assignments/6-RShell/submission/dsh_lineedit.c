@@ -0,0 +1,625 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+
+#include "dshlib.h"
+
+/*
+ * Small line editor for the local shell, no readline required.
+ *
+ * When stdin is a terminal the line is read in raw mode one key at a time
+ * and supports the usual emacs style bindings (arrows, ^A ^E ^B ^F ^K ^U
+ * ^W ^L), history navigation with up/down and incremental reverse search
+ * with ^R.  When stdin is not a terminal (scripts, the bats tests) we fall
+ * back to the plain prompt + fgets() loop the shell always had.
+ *
+ * History lives in a ring of DSH_HIST_MAX entries, each identified by a
+ * monotonically increasing sequence number, and is appended to the history
+ * file as lines are entered.  Reverse search is backed by a trigram index:
+ * every 3 byte substring of every entry maps to the list of sequence
+ * numbers that contain it.  A query only has to walk the shortest posting
+ * list of its trigrams and verify candidates with strstr(), so ^R stays
+ * instant even with 100k entries.  Queries shorter than a trigram just
+ * scan backwards, the first hit is almost always close.
+ */
+
+//key codes as read() returns them in raw mode
+#define KEY_CTRL(c)     ((c) & 0x1f)
+#define KEY_ENTER       13
+#define KEY_ESC         27
+#define KEY_BACKSPACE   127
+#define KEY_DEL         0x100       //synthesized from ESC [ 3 ~
+
+#define LE_SEARCH_PROMPT    "(%sreverse-i-search)`%s': %s"
+
+typedef struct tri_posting {
+    uint32_t key;           // 0 means the slot is empty
+    uint32_t len;
+    uint32_t cap;
+    uint32_t *seqs;         // ascending sequence numbers
+} tri_posting_t;
+
+static char   **g_hist = NULL;          // ring, indexed by seq % DSH_HIST_MAX
+static uint32_t g_hist_base = 0;        // oldest live sequence number
+static uint32_t g_hist_next = 0;        // sequence number of the next entry
+static int      g_hist_fd = -1;
+static bool     g_le_interactive = false;
+
+static tri_posting_t *g_tri = NULL;
+static uint32_t g_tri_cap = 0;          // always a power of 2
+static uint32_t g_tri_used = 0;
+
+#define HIST_AT(seq)    g_hist[(seq) % DSH_HIST_MAX]
+
+/**************   trigram index   ***************/
+
+static uint32_t tri_key(const char *s) {
+    return ((uint32_t)(unsigned char)s[0] << 16 |
+            (uint32_t)(unsigned char)s[1] << 8  |
+            (uint32_t)(unsigned char)s[2]) + 1;
+}
+
+static uint32_t tri_slot(uint32_t key, uint32_t cap) {
+    return (key * 2654435761u) & (cap - 1);
+}
+
+static tri_posting_t *tri_find(uint32_t key) {
+    if (g_tri_cap == 0) return NULL;
+    for (uint32_t i = tri_slot(key, g_tri_cap); g_tri[i].key != 0; i = (i + 1) & (g_tri_cap - 1)) {
+        if (g_tri[i].key == key) return &g_tri[i];
+    }
+    return NULL;
+}
+
+static int tri_grow(void) {
+    uint32_t new_cap = (g_tri_cap == 0) ? 4096 : g_tri_cap * 2;
+    tri_posting_t *new_tbl = calloc(new_cap, sizeof(tri_posting_t));
+    if (new_tbl == NULL) return ERR_MEMORY;
+
+    for (uint32_t i = 0; i < g_tri_cap; i++) {
+        if (g_tri[i].key == 0) continue;
+        uint32_t j = tri_slot(g_tri[i].key, new_cap);
+        while (new_tbl[j].key != 0) j = (j + 1) & (new_cap - 1);
+        new_tbl[j] = g_tri[i];
+    }
+    free(g_tri);
+    g_tri = new_tbl;
+    g_tri_cap = new_cap;
+    return OK;
+}
+
+static tri_posting_t *tri_insert(uint32_t key) {
+    tri_posting_t *p = tri_find(key);
+    if (p != NULL) return p;
+
+    // Keep the load factor under 1/2
+    if ((g_tri_used + 1) * 2 > g_tri_cap && tri_grow() != OK) return NULL;
+
+    uint32_t i = tri_slot(key, g_tri_cap);
+    while (g_tri[i].key != 0) i = (i + 1) & (g_tri_cap - 1);
+    g_tri[i].key = key;
+    g_tri_used++;
+    return &g_tri[i];
+}
+
+static void tri_add_line(uint32_t seq, const char *line) {
+    size_t len = strlen(line);
+    for (size_t i = 0; i + 3 <= len; i++) {
+        tri_posting_t *p = tri_insert(tri_key(line + i));
+        if (p == NULL) return;
+        if (p->len > 0 && p->seqs[p->len - 1] == seq) continue;
+
+        if (p->len == p->cap) {
+            // Drop postings for entries that fell off the ring before growing
+            uint32_t dead = 0;
+            while (dead < p->len && p->seqs[dead] < g_hist_base) dead++;
+            if (dead > 0) {
+                memmove(p->seqs, p->seqs + dead, (p->len - dead) * sizeof(uint32_t));
+                p->len -= dead;
+            }
+        }
+        if (p->len == p->cap) {
+            uint32_t new_cap = (p->cap == 0) ? 4 : p->cap * 2;
+            uint32_t *seqs = realloc(p->seqs, new_cap * sizeof(uint32_t));
+            if (seqs == NULL) return;
+            p->seqs = seqs;
+            p->cap = new_cap;
+        }
+        p->seqs[p->len++] = seq;
+    }
+}
+
+/*
+ * Finds the newest history entry older than before that contains query.
+ * Returns its sequence number, or -1 if there is none.
+ */
+static int64_t hist_search(const char *query, uint32_t before) {
+    size_t qlen = strlen(query);
+    if (qlen == 0) return -1;
+    if (before > g_hist_next) before = g_hist_next;
+
+    if (qlen < 3) {
+        for (uint32_t seq = before; seq-- > g_hist_base; ) {
+            if (strstr(HIST_AT(seq), query) != NULL) return seq;
+        }
+        return -1;
+    }
+
+    tri_posting_t *best = NULL;
+    for (size_t i = 0; i + 3 <= qlen; i++) {
+        tri_posting_t *p = tri_find(tri_key(query + i));
+        if (p == NULL) return -1;
+        if (best == NULL || p->len < best->len) best = p;
+    }
+
+    // Binary search for the first posting >= before, then walk back
+    uint32_t lo = 0, hi = best->len;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (best->seqs[mid] < before) lo = mid + 1;
+        else hi = mid;
+    }
+    while (lo-- > 0) {
+        uint32_t seq = best->seqs[lo];
+        if (seq < g_hist_base) break;
+        if (strstr(HIST_AT(seq), query) != NULL) return seq;
+    }
+    return -1;
+}
+
+/**************   history   ***************/
+
+static void hist_push(const char *line) {
+    if (g_hist_next - g_hist_base == DSH_HIST_MAX) {
+        free(HIST_AT(g_hist_base));
+        HIST_AT(g_hist_base) = NULL;
+        g_hist_base++;
+    }
+
+    char *copy = strdup(line);
+    if (copy == NULL) return;
+    HIST_AT(g_hist_next) = copy;
+    tri_add_line(g_hist_next, copy);
+    g_hist_next++;
+}
+
+static const char *hist_file_path(char *path, size_t path_sz) {
+    const char *env = getenv(DSH_HISTFILE_ENV);
+    if (env != NULL) return env;
+
+    const char *home = getenv("HOME");
+    if (home == NULL) return NULL;
+    snprintf(path, path_sz, "%s/%s", home, DSH_HISTFILE_DEF);
+    return path;
+}
+
+/*
+ * Rewrites the history file with just the entries still in the ring so
+ * it does not grow without bound.
+ */
+static void hist_compact(const char *path) {
+    char tmp[PATH_MAX + sizeof(".tmp")];
+    int n = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (n < 0 || (size_t)n >= sizeof(tmp)) return;      //cut short it would be some other file
+
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL) return;
+    for (uint32_t seq = g_hist_base; seq < g_hist_next; seq++) {
+        fprintf(out, "%s\n", HIST_AT(seq));
+    }
+    if (fclose(out) == 0) {
+        rename(tmp, path);
+    } else {
+        unlink(tmp);
+    }
+}
+
+/*
+ * lineedit_init()
+ *
+ *  Loads the history file and opens it for appending.  Does nothing when
+ *  stdin is not a terminal, non-interactive shells keep no history.
+ *
+ *  Returns OK, or ERR_MEMORY if the history ring can't be allocated.
+ */
+int lineedit_init(void) {
+    const char *term = getenv("TERM");
+    g_le_interactive = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO) &&
+                       !(term != NULL && strcmp(term, "dumb") == 0);
+    if (!g_le_interactive || g_hist != NULL) return OK;
+
+    g_hist = calloc(DSH_HIST_MAX, sizeof(char *));
+    if (g_hist == NULL) {
+        g_le_interactive = false;
+        return ERR_MEMORY;
+    }
+
+    char buff[PATH_MAX];
+    const char *path = hist_file_path(buff, sizeof(buff));
+    if (path == NULL) return OK;
+
+    FILE *in = fopen(path, "r");
+    if (in != NULL) {
+        char *line = NULL;
+        size_t line_sz = 0;
+        ssize_t n;
+        while ((n = getline(&line, &line_sz, in)) > 0) {
+            line[strcspn(line, "\n")] = '\0';
+            if (line[0] != '\0') hist_push(line);
+        }
+        free(line);
+        fclose(in);
+
+        if (g_hist_base > 0) hist_compact(path);
+    }
+
+    g_hist_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    return OK;
+}
+
+/*
+ * lineedit_history_add(line)
+ *
+ *  Remembers an entered line and appends it to the history file.  Repeats
+ *  of the previous line are skipped like HISTCONTROL=ignoredups.
+ */
+void lineedit_history_add(const char *line) {
+    if (!g_le_interactive || g_hist == NULL || line[0] == '\0') return;
+    if (g_hist_next > g_hist_base && strcmp(HIST_AT(g_hist_next - 1), line) == 0) return;
+
+    hist_push(line);
+
+    if (g_hist_fd >= 0) {
+        size_t len = strlen(line);
+        char *rec = malloc(len + 1);
+        if (rec != NULL) {
+            memcpy(rec, line, len);
+            rec[len] = '\n';
+            ssize_t unused = write(g_hist_fd, rec, len + 1);
+            (void)unused;
+            free(rec);
+        }
+    }
+}
+
+/*
+ * Frees the history ring and the trigram index.
+ */
+void lineedit_shutdown(void) {
+    if (g_hist != NULL) {
+        for (uint32_t seq = g_hist_base; seq < g_hist_next; seq++) {
+            free(HIST_AT(seq));
+        }
+        free(g_hist);
+        g_hist = NULL;
+    }
+    for (uint32_t i = 0; i < g_tri_cap; i++) {
+        free(g_tri[i].seqs);
+    }
+    free(g_tri);
+    g_tri = NULL;
+    g_tri_cap = g_tri_used = 0;
+    g_hist_base = g_hist_next = 0;
+
+    if (g_hist_fd >= 0) {
+        close(g_hist_fd);
+        g_hist_fd = -1;
+    }
+}
+
+/**************   editing   ***************/
+
+typedef struct le_state {
+    char *buf;
+    int   cap;              // size of buf including the '\0'
+    int   len;
+    int   pos;              // cursor offset into buf
+    const char *prompt;
+    int   plen;
+    uint32_t hist_idx;      // g_hist_next means "the line being typed"
+    char *saved;            // line being typed while browsing history
+} le_state_t;
+
+static int term_cols(void) {
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) < 0 || ws.ws_col == 0) return 80;
+    return ws.ws_col;
+}
+
+static void le_write(const char *s, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, s, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        s += n;
+        len -= n;
+    }
+}
+
+/*
+ * Redraws prompt + line in one write.  Long lines scroll horizontally so
+ * the cursor always stays on screen.
+ */
+static void le_refresh(le_state_t *ls) {
+    char out[SH_CMD_MAX + 256];
+    int cols = term_cols();
+    const char *b = ls->buf;
+    int len = ls->len;
+    int pos = ls->pos;
+
+    while (ls->plen + pos >= cols && pos > 0) {
+        b++;
+        len--;
+        pos--;
+    }
+    while (ls->plen + len > cols && len > pos) len--;
+
+    int n = snprintf(out, sizeof(out), "\r%s%.*s\x1b[0K\r", ls->prompt, len, b);
+    if (ls->plen + pos > 0 && n < (int)sizeof(out)) {
+        n += snprintf(out + n, sizeof(out) - n, "\x1b[%dC", ls->plen + pos);
+    }
+    le_write(out, (n < (int)sizeof(out)) ? (size_t)n : sizeof(out) - 1);
+}
+
+static void le_set(le_state_t *ls, const char *text) {
+    snprintf(ls->buf, ls->cap, "%s", text);
+    ls->len = ls->pos = (int)strlen(ls->buf);
+}
+
+static void le_insert(le_state_t *ls, char c) {
+    if (ls->len + 1 >= ls->cap) return;
+    memmove(ls->buf + ls->pos + 1, ls->buf + ls->pos, ls->len - ls->pos);
+    ls->buf[ls->pos++] = c;
+    ls->buf[++ls->len] = '\0';
+}
+
+static void le_delete(le_state_t *ls, int from, int to) {
+    if (from < 0) from = 0;
+    if (to > ls->len) to = ls->len;
+    if (from >= to) return;
+    memmove(ls->buf + from, ls->buf + to, ls->len - to + 1);
+    ls->len -= to - from;
+    if (ls->pos > to) ls->pos -= to - from;
+    else if (ls->pos > from) ls->pos = from;
+}
+
+static void le_history_move(le_state_t *ls, int dir) {
+    if (g_hist == NULL) return;
+
+    if (dir < 0 && ls->hist_idx > g_hist_base) {
+        if (ls->hist_idx == g_hist_next) {
+            free(ls->saved);
+            ls->saved = strdup(ls->buf);
+        }
+        ls->hist_idx--;
+        le_set(ls, HIST_AT(ls->hist_idx));
+    } else if (dir > 0 && ls->hist_idx < g_hist_next) {
+        ls->hist_idx++;
+        le_set(ls, (ls->hist_idx == g_hist_next)
+                       ? ((ls->saved != NULL) ? ls->saved : "")
+                       : HIST_AT(ls->hist_idx));
+    }
+}
+
+/*
+ * Reads the rest of an escape sequence and maps it to the equivalent
+ * control key, or 0 if we don't handle it.
+ */
+static int le_read_escape(void) {
+    char seq[3];
+    if (read(STDIN_FILENO, &seq[0], 1) != 1) return 0;
+    if (read(STDIN_FILENO, &seq[1], 1) != 1) return 0;
+
+    if (seq[0] == '[' && seq[1] >= '0' && seq[1] <= '9') {
+        if (read(STDIN_FILENO, &seq[2], 1) != 1 || seq[2] != '~') return 0;
+        switch (seq[1]) {
+            case '1': case '7': return KEY_CTRL('A');
+            case '4': case '8': return KEY_CTRL('E');
+            case '3':           return KEY_DEL;
+        }
+        return 0;
+    }
+    if (seq[0] == '[' || seq[0] == 'O') {
+        switch (seq[1]) {
+            case 'A': return KEY_CTRL('P');
+            case 'B': return KEY_CTRL('N');
+            case 'C': return KEY_CTRL('F');
+            case 'D': return KEY_CTRL('B');
+            case 'H': return KEY_CTRL('A');
+            case 'F': return KEY_CTRL('E');
+        }
+    }
+    return 0;
+}
+
+/*
+ * ^R incremental search.  Returns the key that ended the search so the
+ * caller can act on it (enter runs the match, anything else just edits it).
+ */
+static int le_reverse_search(le_state_t *ls) {
+    char query[SH_CMD_MAX] = "";
+    int qlen = 0;
+    int64_t match = -1;
+    char out[SH_CMD_MAX * 2 + 64];
+
+    while (1) {
+        const char *shown = (match >= 0) ? HIST_AT(match) : "";
+        int n = snprintf(out, sizeof(out), "\r" LE_SEARCH_PROMPT "\x1b[0K",
+                         (match < 0 && qlen > 0) ? "failed " : "", query, shown);
+        le_write(out, (n < (int)sizeof(out)) ? (size_t)n : sizeof(out) - 1);
+
+        unsigned char c;            //bytes >= 0x80 must not go negative
+        if (read(STDIN_FILENO, &c, 1) != 1) return KEY_CTRL('C');
+
+        if (c == KEY_CTRL('R')) {
+            int64_t older = hist_search(query, (match >= 0) ? (uint32_t)match : g_hist_next);
+            if (older >= 0) match = older;
+        } else if (c == KEY_BACKSPACE || c == KEY_CTRL('H')) {
+            if (qlen > 0) query[--qlen] = '\0';
+            match = hist_search(query, g_hist_next);
+        } else if (c == KEY_CTRL('G') || c == KEY_CTRL('C')) {
+            return c;
+        } else if (isprint((unsigned char)c)) {
+            if (qlen + 1 < (int)sizeof(query)) {
+                query[qlen++] = c;
+                query[qlen] = '\0';
+            }
+            match = hist_search(query, g_hist_next);
+        } else {
+            if (match >= 0) {
+                le_set(ls, HIST_AT(match));
+                ls->hist_idx = (uint32_t)match;
+            }
+            return (c == KEY_ESC) ? le_read_escape() : c;
+        }
+    }
+}
+
+/*
+ * Raw mode editing loop.  Returns the line in ls->buf, or NULL on ^D at
+ * an empty prompt.
+ */
+static char *le_edit(le_state_t *ls) {
+    le_refresh(ls);
+
+    while (1) {
+        char ch;
+        ssize_t n = read(STDIN_FILENO, &ch, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return (ls->len > 0) ? ls->buf : NULL;
+
+        int c = (unsigned char)ch;
+        if (c == KEY_ESC) c = le_read_escape();
+        if (c == KEY_CTRL('R')) {
+            c = le_reverse_search(ls);
+            if (c == KEY_CTRL('G')) {
+                le_refresh(ls);
+                continue;
+            }
+        }
+
+        switch (c) {
+            case KEY_ENTER:
+            case '\n':
+                return ls->buf;
+            case KEY_CTRL('C'):
+                le_write("^C", 2);
+                le_set(ls, "");
+                return ls->buf;
+            case KEY_CTRL('D'):
+                if (ls->len == 0) return NULL;
+                le_delete(ls, ls->pos, ls->pos + 1);
+                break;
+            case KEY_DEL:
+                le_delete(ls, ls->pos, ls->pos + 1);
+                break;
+            case KEY_BACKSPACE:
+            case KEY_CTRL('H'):
+                le_delete(ls, ls->pos - 1, ls->pos);
+                break;
+            case KEY_CTRL('A'):
+                ls->pos = 0;
+                break;
+            case KEY_CTRL('E'):
+                ls->pos = ls->len;
+                break;
+            case KEY_CTRL('B'):
+                if (ls->pos > 0) ls->pos--;
+                break;
+            case KEY_CTRL('F'):
+                if (ls->pos < ls->len) ls->pos++;
+                break;
+            case KEY_CTRL('K'):
+                le_delete(ls, ls->pos, ls->len);
+                break;
+            case KEY_CTRL('U'):
+                le_delete(ls, 0, ls->pos);
+                break;
+            case KEY_CTRL('W'): {
+                int start = ls->pos;
+                while (start > 0 && ls->buf[start - 1] == ' ') start--;
+                while (start > 0 && ls->buf[start - 1] != ' ') start--;
+                le_delete(ls, start, ls->pos);
+                break;
+            }
+            case KEY_CTRL('L'):
+                le_write("\x1b[H\x1b[2J", 7);
+                break;
+            case KEY_CTRL('P'):
+                le_history_move(ls, -1);
+                break;
+            case KEY_CTRL('N'):
+                le_history_move(ls, 1);
+                break;
+            default:
+                // Keys past 0xff are synthesized ones, not characters
+                if (c <= 0xff && isprint((unsigned char)c)) le_insert(ls, (char)c);
+                break;
+        }
+        le_refresh(ls);
+    }
+}
+
+/*
+ * lineedit_read(prompt, buf, buf_sz)
+ *      prompt:  printed before the line, e.g. SH_PROMPT
+ *      buf:     receives the line without the trailing newline
+ *      buf_sz:  size of buf
+ *
+ *  Drop-in replacement for printf(prompt) + fgets().
+ *
+ *  Returns buf, or NULL at end of input.
+ */
+char *lineedit_read(const char *prompt, char *buf, int buf_sz) {
+    if (!g_le_interactive) {
+        printf("%s", prompt);
+        if (fgets(buf, buf_sz, stdin) == NULL) {
+            return NULL;
+        }
+        buf[strcspn(buf, "\n")] = '\0';
+        return buf;
+    }
+
+    struct termios orig, raw;
+    fflush(stdout);
+    if (tcgetattr(STDIN_FILENO, &orig) < 0) {
+        g_le_interactive = false;
+        return lineedit_read(prompt, buf, buf_sz);
+    }
+
+    raw = orig;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_cflag |= CS8;
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    le_state_t ls = {
+        .buf = buf, .cap = buf_sz, .len = 0, .pos = 0,
+        .prompt = prompt, .plen = (int)strlen(prompt),
+        .hist_idx = g_hist_next, .saved = NULL,
+    };
+    buf[0] = '\0';
+
+    char *line = le_edit(&ls);
+
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &orig);
+    free(ls.saved);
+    if (line != NULL) {
+        le_write("\n", 1);
+    }
+    return line;
+}
@@ -0,0 +1,250 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "dshlib.h"
+
+/*
+ * Per-stage resource accounting for pipelines.
+ *
+ * Every stage is reaped with wait4() so the kernel hands back the child's
+ * rusage (CPU time, max RSS, context switches) for free.  Wall time runs
+ * from the fork() of a stage until it is reaped.  Stages are reaped in
+ * the order they exit, not the order they were started, by polling a
+ * pidfd per stage; otherwise `yes | head` would charge head for all the
+ * time spent waiting on yes.  If pidfds are not available we fall back to
+ * reaping in order.
+ *
+ * The `time` prefix and DSH_STATS print a per-stage table to stderr.  If
+ * DSH_STATS_FILE names a file, one JSON object per pipeline is appended
+ * to it for offline analysis.
+ */
+
+static double ts_diff_ms(const struct timespec *a, const struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) * 1000.0 + (b->tv_nsec - a->tv_nsec) / 1e6;
+}
+
+static double tv_ms(const struct timeval *tv) {
+    return tv->tv_sec * 1000.0 + tv->tv_usec / 1000.0;
+}
+
+/*
+ * Records the start of a pipeline.  Must be called before the first fork.
+ */
+void pipeline_stats_begin(pipeline_stats_t *ps, command_list_t *clist, bool precise) {
+    memset(ps, 0, sizeof(pipeline_stats_t));
+    ps->clist = clist;
+    ps->precise = precise;
+    clock_gettime(CLOCK_MONOTONIC, &ps->start);
+}
+
+/*
+ * Stamps the end of the pipeline.  pipeline_stats_wait() does this for
+ * forked stages, builtins call it directly.
+ */
+void pipeline_stats_finish(pipeline_stats_t *ps) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ps->wall_ms = ts_diff_ms(&ps->start, &now);
+}
+
+/*
+ * pipeline_stats_fork(ps, stage)
+ *
+ *  fork() wrapper that stamps the start time of stage and, in the parent,
+ *  remembers the pid.  The pidfd is only needed to get exact per-stage
+ *  wall times, plain runs skip it.
+ *
+ *  Returns whatever fork() returned.
+ */
+pid_t pipeline_stats_fork(pipeline_stats_t *ps, int stage) {
+    stage_stats_t *st = &ps->stages[stage];
+
+    clock_gettime(CLOCK_MONOTONIC, &st->start);
+    pid_t pid = fork();
+    if (pid <= 0) {
+        return pid;
+    }
+
+    st->pid = pid;
+    st->pidfd = ps->precise ? (int)syscall(SYS_pidfd_open, pid, 0) : -1;
+    if (stage >= ps->num) {
+        ps->num = stage + 1;
+    }
+    return pid;
+}
+
+static void stage_reap(stage_stats_t *st) {
+    struct rusage ru;
+    struct timespec now;
+
+    while (wait4(st->pid, &st->status, 0, &ru) < 0) {
+        if (errno != EINTR) {
+            st->status = -1;
+            memset(&ru, 0, sizeof(ru));
+            break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    st->wall_ms   = ts_diff_ms(&st->start, &now);
+    st->user_ms   = tv_ms(&ru.ru_utime);
+    st->sys_ms    = tv_ms(&ru.ru_stime);
+    st->maxrss_kb = ru.ru_maxrss;
+    st->nvcsw     = ru.ru_nvcsw;
+    st->nivcsw    = ru.ru_nivcsw;
+    st->reaped    = true;
+
+    if (st->pidfd >= 0) {
+        close(st->pidfd);
+        st->pidfd = -1;
+    }
+}
+
+/*
+ * pipeline_stats_wait(ps)
+ *
+ *  Reaps every forked stage, filling in its rusage and wall time.
+ *
+ *  Returns the raw wait status of the last stage in the pipeline.
+ */
+int pipeline_stats_wait(pipeline_stats_t *ps) {
+    struct pollfd pfds[CMD_MAX];
+    int pending = ps->num;
+
+    if (ps->num == 0) {
+        pipeline_stats_finish(ps);
+        return 0;
+    }
+
+    for (int i = 0; i < ps->num; i++) {
+        if (ps->stages[i].pidfd < 0) {
+            // No pidfds, just reap in order
+            for (int j = 0; j < ps->num; j++) {
+                if (!ps->stages[j].reaped) stage_reap(&ps->stages[j]);
+            }
+            pipeline_stats_finish(ps);
+            return ps->stages[ps->num - 1].status;
+        }
+    }
+
+    while (pending > 0) {
+        int n = 0;
+        int idx[CMD_MAX];
+        for (int i = 0; i < ps->num; i++) {
+            if (!ps->stages[i].reaped) {
+                pfds[n].fd = ps->stages[i].pidfd;
+                pfds[n].events = POLLIN;
+                idx[n++] = i;
+            }
+        }
+
+        if (poll(pfds, n, -1) < 0) {
+            if (errno == EINTR) continue;
+            for (int i = 0; i < n; i++) stage_reap(&ps->stages[idx[i]]);
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (pfds[i].revents != 0) {
+                stage_reap(&ps->stages[idx[i]]);
+                pending--;
+            }
+        }
+    }
+
+    pipeline_stats_finish(ps);
+    return ps->stages[ps->num - 1].status;
+}
+
+static int stage_exit_code(const stage_stats_t *st) {
+    if (WIFEXITED(st->status)) return WEXITSTATUS(st->status);
+    if (WIFSIGNALED(st->status)) return 128 + WTERMSIG(st->status);
+    return -1;
+}
+
+/*
+ * pipeline_stats_report(ps, out)
+ *
+ *  Prints the per-stage breakdown, the same table is used for `time` and
+ *  for the always-on DSH_STATS mode.
+ */
+void pipeline_stats_report(pipeline_stats_t *ps, FILE *out) {
+    double user = 0, sys = 0;
+
+    fprintf(out, STATS_HDR_FMT, "stage", "pid", "real-ms", "user-ms", "sys-ms",
+            "maxrss-kb", "vcsw", "ivcsw", "rc", "command");
+    for (int i = 0; i < ps->num; i++) {
+        stage_stats_t *st = &ps->stages[i];
+        fprintf(out, STATS_ROW_FMT, i, (int)st->pid, st->wall_ms, st->user_ms,
+                st->sys_ms, st->maxrss_kb, st->nvcsw, st->nivcsw,
+                stage_exit_code(st), ps->clist->commands[i].argv[0]);
+        user += st->user_ms;
+        sys  += st->sys_ms;
+    }
+    fprintf(out, STATS_TOTAL_FMT, ps->wall_ms, user, sys);
+}
+
+static void json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            fputc('\\', out);
+            fputc(c, out);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/*
+ * pipeline_stats_append_json(ps, path)
+ *
+ *  Appends one JSON object describing the pipeline to path, one line per
+ *  pipeline so the file can be processed with jq or pandas.
+ *
+ *  Returns OK, or ERR_EXEC_CMD if the file could not be written.
+ */
+int pipeline_stats_append_json(pipeline_stats_t *ps, const char *path) {
+    FILE *out = fopen(path, "a");
+    if (out == NULL) {
+        perror(path);
+        return ERR_EXEC_CMD;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    fprintf(out, "{\"ts\":%ld.%03ld,\"pid\":%d,\"wall_ms\":%.3f,\"stages\":[",
+            (long)now.tv_sec, now.tv_nsec / 1000000, (int)getpid(), ps->wall_ms);
+    for (int i = 0; i < ps->num; i++) {
+        stage_stats_t *st = &ps->stages[i];
+        cmd_buff_t *cmd = &ps->clist->commands[i];
+
+        fprintf(out, "%s{\"argv\":[", (i > 0) ? "," : "");
+        for (int a = 0; a < cmd->argc; a++) {
+            if (a > 0) fputc(',', out);
+            json_string(out, cmd->argv[a]);
+        }
+        fprintf(out, "],\"pid\":%d,\"rc\":%d,\"wall_ms\":%.3f,\"user_ms\":%.3f,"
+                     "\"sys_ms\":%.3f,\"maxrss_kb\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld}",
+                (int)st->pid, stage_exit_code(st), st->wall_ms, st->user_ms,
+                st->sys_ms, st->maxrss_kb, st->nvcsw, st->nivcsw);
+    }
+    fprintf(out, "]}\n");
+
+    return (fclose(out) == 0) ? OK : ERR_EXEC_CMD;
+}
@@ -7,6 +7,7 @@
 #include <fcntl.h>
 #include <sys/wait.h>
 #include <errno.h>
+#include <limits.h>
 
 #include "dshlib.h"
 
@@ -23,6 +24,8 @@
 
 #include "dshlib.h"
 
+extern char **environ;
+
 /**** 
  **** FOR REMOTE SHELL USE YOUR SOLUTION FROM SHELL PART 3 HERE
  **** THE MAIN FUNCTION CALLS THIS ONE AS ITS ENTRY POINT TO
@@ -445,51 +448,98 @@ Built_In_Cmds match_command(const char *input) {
         return BI_CMD_CD;
     } else if (strcmp(input, "rc") == 0) {
         return BI_RC;
+    } else if (strcmp(input, HASH_CMD) == 0) {
+        return BI_CMD_HASH;
+    } else if (strcmp(input, COPROC_CMD) == 0) {
+        return BI_CMD_COPROC;
+    } else if (strcmp(input, EXPORT_CMD) == 0) {
+        return BI_CMD_EXPORT;
+    } else if (strcmp(input, UNSET_CMD) == 0) {
+        return BI_CMD_UNSET;
     }
     
     return BI_NOT_BI;
 }
 
 /*
- * Executes a built-in command
+ * exec_built_in_cmd(cmd, ctx)
+ *      cmd:  parsed command
+ *      ctx:  descriptors to use instead of stdin/stdout/stderr, and the
+ *            status of the previous command (for `rc`).  ctx->last_rc is
+ *            replaced with the builtin's own exit status.
+ *
+ *  Builtins never touch the process wide descriptors, so the same code
+ *  serves redirected builtins and remote shell sessions.
+ *
+ *  Returns BI_EXECUTED, BI_CMD_EXIT, or BI_NOT_BI if cmd isn't a builtin.
  */
-Built_In_Cmds exec_built_in_cmd(cmd_buff_t *cmd) {
+Built_In_Cmds exec_built_in_cmd(cmd_buff_t *cmd, bi_ctx_t *ctx) {
     if (cmd == NULL || cmd->argc == 0) return BI_NOT_BI;
     
     Built_In_Cmds cmd_type = match_command(cmd->argv[0]);
     
     switch (cmd_type) {
         case BI_CMD_EXIT:
-            printf("exiting...\n");
+            // The caller says goodbye, it knows where the user is
             return BI_CMD_EXIT;
             
         case BI_CMD_DRAGON:
-            print_dragon();
-            last_return_code = 0;
+            print_dragon_fd(ctx->out_fd);
+            ctx->last_rc = 0;
             return BI_EXECUTED;
             
-        case BI_CMD_CD:
-            if (cmd->argc > 1) {
-                if (chdir(cmd->argv[1]) != 0) {
-                    perror("cd");
-                    last_return_code = errno;
-                } else {
-                    last_return_code = 0;
+        case BI_CMD_CD: {
+            // CD to home directory if no argument
+            const char *dir = (cmd->argc > 1) ? cmd->argv[1] : getenv("HOME");
+            ctx->last_rc = 0;
+            if (dir != NULL && chdir(dir) != 0) {
+                ctx->last_rc = errno;
+                dprintf(ctx->err_fd, "cd: %s: %s\n", dir, strerror(errno));
+            }
+            return BI_EXECUTED;
+        }
+            
+        case BI_RC:
+            dprintf(ctx->out_fd, "%d\n", ctx->last_rc);
+            return BI_EXECUTED;
+            
+        case BI_CMD_HASH:
+            ctx->last_rc = cmd_hash_builtin(cmd, ctx->out_fd);
+            return BI_EXECUTED;
+            
+        case BI_CMD_COPROC:
+            ctx->last_rc = coproc_builtin(cmd, ctx->out_fd);
+            return BI_EXECUTED;
+            
+        case BI_CMD_EXPORT:
+            // The local shell is one process, its own environment is the
+            // session's; `export NAME` alone changes nothing
+            ctx->last_rc = 0;
+            if (cmd->argc == 1) {
+                for (char **env = environ; *env != NULL; env++) {
+                    dprintf(ctx->out_fd, "export %s\n", *env);
                 }
-            } else {
-                // CD to home directory if no argument
-                const char *home = getenv("HOME");
-                if (home && chdir(home) != 0) {
-                    perror("cd");
-                    last_return_code = errno;
-                } else {
-                    last_return_code = 0;
+            }
+            for (int i = 1; i < cmd->argc; i++) {
+                char *eq = strchr(cmd->argv[i], '=');
+                if (eq == NULL) continue;
+                *eq = '\0';
+                if (setenv(cmd->argv[i], eq + 1, 1) != 0) {
+                    dprintf(ctx->err_fd, "export: %s: %s\n", cmd->argv[i], strerror(errno));
+                    ctx->last_rc = 1;
                 }
+                *eq = '=';
             }
             return BI_EXECUTED;
             
-        case BI_RC:
-            printf("%d\n", last_return_code);
+        case BI_CMD_UNSET:
+            ctx->last_rc = 0;
+            for (int i = 1; i < cmd->argc; i++) {
+                if (unsetenv(cmd->argv[i]) != 0) {
+                    dprintf(ctx->err_fd, "unset: %s: %s\n", cmd->argv[i], strerror(errno));
+                    ctx->last_rc = 1;
+                }
+            }
             return BI_EXECUTED;
             
         case BI_NOT_BI:
@@ -498,6 +548,70 @@ Built_In_Cmds exec_built_in_cmd(cmd_buff_t *cmd) {
     }
 }
 
+/*
+ * bi_ctx_open(ctx, cmd, in_fd, out_fd, err_fd)
+ *
+ *  Fills in a builtin context with the given default descriptors, opening
+ *  cmd's redirection targets (if any) in their place.  Nothing is dup'd,
+ *  each redirection costs one open() here and one close() in
+ *  bi_ctx_close().  Errors are reported on err_fd.
+ *
+ *  Returns OK, or ERR_EXEC_CMD if a redirection target couldn't be opened.
+ */
+int bi_ctx_open(bi_ctx_t *ctx, cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd) {
+    return bi_ctx_openat(ctx, cmd, AT_FDCWD, in_fd, out_fd, err_fd);
+}
+
+/*
+ * bi_ctx_openat(ctx, cmd, dir_fd, in_fd, out_fd, err_fd)
+ *
+ *  bi_ctx_open() with relative redirection targets looked up in dir_fd,
+ *  for a remote session that has its own working directory.
+ */
+int bi_ctx_openat(bi_ctx_t *ctx, cmd_buff_t *cmd, int dir_fd, int in_fd, int out_fd, int err_fd) {
+    ctx->in_fd = in_fd;
+    ctx->out_fd = out_fd;
+    ctx->err_fd = err_fd;
+    ctx->own_in = false;
+    ctx->own_out = false;
+    
+    if (cmd->input_file != NULL) {
+        int fd = openat(dir_fd, cmd->input_file, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            dprintf(err_fd, "%s: %s\n", cmd->input_file, strerror(errno));
+            return ERR_EXEC_CMD;
+        }
+        ctx->in_fd = fd;
+        ctx->own_in = true;
+    }
+    
+    if (cmd->output_file != NULL) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+        flags |= cmd->append_mode ? O_APPEND : O_TRUNC;
+        
+        int fd = openat(dir_fd, cmd->output_file, flags, 0644);
+        if (fd < 0) {
+            dprintf(err_fd, "%s: %s\n", cmd->output_file, strerror(errno));
+            bi_ctx_close(ctx);
+            return ERR_EXEC_CMD;
+        }
+        ctx->out_fd = fd;
+        ctx->own_out = true;
+    }
+    
+    return OK;
+}
+
+/*
+ * Closes whatever bi_ctx_open() opened.
+ */
+void bi_ctx_close(bi_ctx_t *ctx) {
+    if (ctx->own_in) close(ctx->in_fd);
+    if (ctx->own_out) close(ctx->out_fd);
+    ctx->own_in = false;
+    ctx->own_out = false;
+}
+
 /*
  * Sets up file redirection for a command
  * Returns 0 on success, -1 on error
@@ -547,62 +661,84 @@ int setup_redirection(cmd_buff_t *cmd) {
     return 0;
 }
 
+/*
+ * Prints and/or logs the resource usage of a finished pipeline
+ */
+static void pipeline_stats_done(pipeline_stats_t *stats, bool report, const char *stats_file) {
+    if (report) {
+        fflush(stdout);
+        pipeline_stats_report(stats, stderr);
+    }
+    if (stats_file != NULL && stats->num > 0) {
+        pipeline_stats_append_json(stats, stats_file);
+    }
+}
+
 /*
  * Executes a pipeline of commands
  */
 int execute_pipeline(command_list_t *clist) {
     if (clist == NULL || clist->num == 0) return WARN_NO_CMDS;
     
-    // For single command, no need for pipes
-    if (clist->num == 1) {
-        // Check if it's a built-in command
-        Built_In_Cmds cmd_type = exec_built_in_cmd(&clist->commands[0]);
+    // `time` prefix: strip it off and report on whatever is left
+    bool timed = false;
+    cmd_buff_t *first = &clist->commands[0];
+    if (first->argc > 0 && strcmp(first->argv[0], TIME_CMD) == 0) {
+        memmove(&first->argv[0], &first->argv[1], first->argc * sizeof(char *));
+        first->argc--;
+        timed = true;
         
-        if (cmd_type == BI_CMD_EXIT) {
-            return OK_EXIT;
-        } else if (cmd_type == BI_EXECUTED) {
+        if (first->argc == 0) {
+            fprintf(stderr, "time: missing command\n");
+            last_return_code = 1;
             return OK;
         }
+    }
+    
+    // Every stage is reaped with wait4(), only pay for exact per-stage wall
+    // times when someone is going to look at them
+    const char *stats_file = getenv(DSH_STATS_FILE_ENV);
+    bool report = timed || getenv(DSH_STATS_ENV) != NULL;
+    pipeline_stats_t stats;
+    pipeline_stats_begin(&stats, clist, report || stats_file != NULL);
+    
+    // For single command, no need for pipes
+    if (clist->num == 1) {
+        cmd_buff_t *cmd = &clist->commands[0];
         
-        // Handle file redirection for built-in commands
-        if (clist->commands[0].input_file != NULL || clist->commands[0].output_file != NULL) {
-            // Save original stdin/stdout
-            int saved_stdin = dup(STDIN_FILENO);
-            int saved_stdout = dup(STDOUT_FILENO);
-            
-            if (saved_stdin < 0 || saved_stdout < 0) {
-                perror("dup");
-                return ERR_EXEC_CMD;
-            }
+        // Built-in commands run in the shell itself; redirection just
+        // hands them a different descriptor
+        if (match_command(cmd->argv[0]) != BI_NOT_BI) {
+            bi_ctx_t ctx;
+            Built_In_Cmds cmd_type = BI_EXECUTED;
             
-            // Set up redirection
-            if (setup_redirection(&clist->commands[0]) < 0) {
-                // Restore original stdin/stdout
-                dup2(saved_stdin, STDIN_FILENO);
-                dup2(saved_stdout, STDOUT_FILENO);
-                close(saved_stdin);
-                close(saved_stdout);
-                return ERR_EXEC_CMD;
-            }
-            
-            // Execute built-in command again with redirection
-            cmd_type = exec_built_in_cmd(&clist->commands[0]);
+            // Keep anything already printf()'d ahead of the builtin's output
+            fflush(stdout);
             
-            // Restore original stdin/stdout
-            dup2(saved_stdin, STDIN_FILENO);
-            dup2(saved_stdout, STDOUT_FILENO);
-            close(saved_stdin);
-            close(saved_stdout);
+            if (bi_ctx_open(&ctx, cmd, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO) != OK) {
+                last_return_code = 1;
+            } else {
+                ctx.last_rc = last_return_code;
+                cmd_type = exec_built_in_cmd(cmd, &ctx);
+                last_return_code = ctx.last_rc;
+                bi_ctx_close(&ctx);
+            }
             
             if (cmd_type == BI_CMD_EXIT) {
                 return OK_EXIT;
-            } else if (cmd_type == BI_EXECUTED) {
-                return OK;
             }
+            pipeline_stats_finish(&stats);
+            pipeline_stats_done(&stats, report, stats_file);
+            return OK;
         }
         
+        // Look the command up in the hash table before forking so the
+        // result is remembered for next time
+        char exe_path[PATH_MAX];
+        cmd_hash_resolve(clist->commands[0].argv[0], exe_path, sizeof(exe_path));
+        
         // Execute the command using fork/exec
-        pid_t pid = fork();
+        pid_t pid = pipeline_stats_fork(&stats, 0);
         
         if (pid < 0) {
             // Fork failed
@@ -618,7 +754,7 @@ int execute_pipeline(command_list_t *clist) {
             }
             
             // Execute command
-            execvp(clist->commands[0].argv[0], clist->commands[0].argv);
+            cmd_hash_exec(exe_path, clist->commands[0].argv);
             
             // If we get here, execvp failed
             switch (errno) {
@@ -640,8 +776,7 @@ int execute_pipeline(command_list_t *clist) {
             exit(errno);
         } else {
             // Parent process
-            int status;
-            waitpid(pid, &status, 0);
+            int status = pipeline_stats_wait(&stats);
             
             if (WIFEXITED(status)) {
                 last_return_code = WEXITSTATUS(status);
@@ -649,6 +784,7 @@ int execute_pipeline(command_list_t *clist) {
                 last_return_code = -1;
             }
             
+            pipeline_stats_done(&stats, report, stats_file);
             return OK;
         }
     }
@@ -674,6 +810,7 @@ int execute_pipeline(command_list_t *clist) {
     }
     
     // Create processes and set up pipes
+    char exe_path[PATH_MAX];
     for (int i = 0; i < clist->num; i++) {
         // Check if the first command is a built-in
         if (i == 0) {
@@ -693,8 +830,11 @@ int execute_pipeline(command_list_t *clist) {
             }
         }
         
+        // Resolve through the hash table, the child inherits exe_path
+        cmd_hash_resolve(clist->commands[i].argv[0], exe_path, sizeof(exe_path));
+        
         // Fork child process
-        child_pids[i] = fork();
+        child_pids[i] = pipeline_stats_fork(&stats, i);
         
         if (child_pids[i] < 0) {
             // Fork failed
@@ -706,13 +846,15 @@ int execute_pipeline(command_list_t *clist) {
                 close(pipe_fds[j][1]);
             }
             
-            // Kill any already created children
+            // Kill any already created children, reaping them closes
+            // their pidfds too
+            int fork_errno = errno;
             for (int j = 0; j < i; j++) {
                 kill(child_pids[j], SIGTERM);
-                waitpid(child_pids[j], NULL, 0);
             }
+            pipeline_stats_wait(&stats);
             
-            last_return_code = errno;
+            last_return_code = fork_errno;
             return ERR_EXEC_CMD;
         } else if (child_pids[i] == 0) {
             // Child process
@@ -745,7 +887,7 @@ int execute_pipeline(command_list_t *clist) {
             }
             
             // Execute command
-            execvp(clist->commands[i].argv[0], clist->commands[i].argv);
+            cmd_hash_exec(exe_path, clist->commands[i].argv);
             
             // If execvp returns, there was an error
             perror(clist->commands[i].argv[0]);
@@ -759,23 +901,17 @@ int execute_pipeline(command_list_t *clist) {
         close(pipe_fds[i][1]);
     }
     
-    // Wait for all child processes
+    // Wait for all child processes, keeping the exit status of the last one
     int last_status = 0;
-    for (int i = 0; i < clist->num; i++) {
-        int status;
-        waitpid(child_pids[i], &status, 0);
-        
-        // Save the exit status of the last command
-        if (i == clist->num - 1) {
-            if (WIFEXITED(status)) {
-                last_status = WEXITSTATUS(status);
-            } else {
-                last_status = -1;
-            }
-        }
+    int status = pipeline_stats_wait(&stats);
+    if (WIFEXITED(status)) {
+        last_status = WEXITSTATUS(status);
+    } else {
+        last_status = -1;
     }
     
     last_return_code = last_status;
+    pipeline_stats_done(&stats, report, stats_file);
     return OK;
 }
 
@@ -787,12 +923,12 @@ int exec_local_cmd_loop() {
     command_list_t cmd_list;
     int result;
     
+    // Line editing and history when attached to a terminal
+    lineedit_init();
+    
     while (1) {
-        // Prompt user for input
-        printf("%s", SH_PROMPT);
-        
-        // Read input
-        if (fgets(cmd_buff, SH_CMD_MAX, stdin) == NULL) {
+        // Prompt user for input and read it
+        if (lineedit_read(SH_PROMPT, cmd_buff, SH_CMD_MAX) == NULL) {
             printf("\n");
             break;
         }
@@ -804,6 +940,7 @@ int exec_local_cmd_loop() {
         if (strlen(cmd_buff) == 0) {
             continue;
         }
+        lineedit_history_add(cmd_buff);
         
         // Check for simple exit command
         if (strcmp(cmd_buff, EXIT_CMD) == 0) {
@@ -842,5 +979,7 @@ int exec_local_cmd_loop() {
         free_cmd_list(&cmd_list);
     }
     
+    coproc_shutdown();
+    lineedit_shutdown();
     return OK;
 }
\ No newline at end of file
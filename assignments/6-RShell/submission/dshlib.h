@@ -2,9 +2,14 @@
     #define __DSHLIB_H__
 
 #include <stdbool.h>  /* Added for bool type */
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
 
 // Dragon Print
 void print_dragon(void);
+void print_dragon_fd(int fd);
 #define DRAGON_CMD "dragon"
 
 //Constants for command structure sizes
@@ -55,6 +60,8 @@ typedef struct command_list{
 
 #define SH_PROMPT       "dsh4> "
 #define EXIT_CMD        "exit"
+#define EXPORT_CMD      "export"
+#define UNSET_CMD       "unset"
 #define RC_SC           99
 #define EXIT_SC         100
 
@@ -84,12 +91,96 @@ typedef enum {
     BI_CMD_CD,
     BI_CMD_RC,              //extra credit command
     BI_CMD_STOP_SVR,        //new command "stop-server"
+    BI_CMD_HASH,            //command path cache "hash"
+    BI_CMD_COPROC,          //persistent worker "coproc"
+    BI_CMD_STATS,           //server statistics "stats" (remote only)
+    BI_CMD_EXPORT,          //set an environment variable "export"
+    BI_CMD_UNSET,           //drop an environment variable "unset"
     BI_NOT_BI,
     BI_EXECUTED,
     BI_RC,
 } Built_In_Cmds;
+
+//descriptors a builtin reads from and writes to; redirection opens the
+//file once and points the context at it instead of dup2()ing over the
+//shell's own stdin/stdout, so builtins can also run on a server thread
+typedef struct bi_ctx {
+    int  in_fd;
+    int  out_fd;
+    int  err_fd;
+    int  last_rc;           //in: status of the previous command, out: ours
+    bool own_in;            //in_fd/out_fd were opened by bi_ctx_open()
+    bool own_out;
+} bi_ctx_t;
+
 Built_In_Cmds match_command(const char *input); 
-Built_In_Cmds exec_built_in_cmd(cmd_buff_t *cmd);
+Built_In_Cmds exec_built_in_cmd(cmd_buff_t *cmd, bi_ctx_t *ctx);
+int  bi_ctx_open(bi_ctx_t *ctx, cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd);
+int  bi_ctx_openat(bi_ctx_t *ctx, cmd_buff_t *cmd, int dir_fd, int in_fd, int out_fd, int err_fd);
+void bi_ctx_close(bi_ctx_t *ctx);
+
+//command path hash (see dsh_hash.c)
+#define HASH_CMD            "hash"
+#define CMD_HASH_BUCKETS    64
+void cmd_hash_init(void);
+int  cmd_hash_resolve(const char *name, char *path, size_t path_sz);
+void cmd_hash_exec(const char *path, char *const argv[]);
+void cmd_hash_clear(void);
+int  cmd_hash_builtin(cmd_buff_t *cmd, int out_fd);
+
+//per-stage resource accounting (see dsh_stats.c)
+#define TIME_CMD            "time"
+#define DSH_STATS_ENV       "DSH_STATS"         //set: report every pipeline
+#define DSH_STATS_FILE_ENV  "DSH_STATS_FILE"    //append JSON lines here
+
+typedef struct stage_stats {
+    pid_t  pid;
+    int    pidfd;
+    int    status;              //raw status from wait4()
+    bool   reaped;
+    struct timespec start;
+    double wall_ms;
+    double user_ms;
+    double sys_ms;
+    long   maxrss_kb;
+    long   nvcsw;               //voluntary context switches
+    long   nivcsw;              //involuntary context switches
+} stage_stats_t;
+
+typedef struct pipeline_stats {
+    command_list_t *clist;
+    int    num;
+    bool   precise;             //reap in exit order via pidfds
+    struct timespec start;
+    double wall_ms;
+    stage_stats_t stages[CMD_MAX];
+} pipeline_stats_t;
+
+void pipeline_stats_begin(pipeline_stats_t *ps, command_list_t *clist, bool precise);
+pid_t pipeline_stats_fork(pipeline_stats_t *ps, int stage);
+int  pipeline_stats_wait(pipeline_stats_t *ps);
+void pipeline_stats_finish(pipeline_stats_t *ps);
+void pipeline_stats_report(pipeline_stats_t *ps, FILE *out);
+int  pipeline_stats_append_json(pipeline_stats_t *ps, const char *path);
+
+//interactive line editor and history (see dsh_lineedit.c)
+#define DSH_HIST_MAX        100000
+#define DSH_HISTFILE_ENV    "DSH_HISTFILE"
+#define DSH_HISTFILE_DEF    ".dsh_history"      //relative to $HOME
+int   lineedit_init(void);
+char *lineedit_read(const char *prompt, char *buf, int buf_sz);
+void  lineedit_history_add(const char *line);
+void  lineedit_shutdown(void);
+
+//coprocesses (see dsh_coproc.c)
+#define COPROC_CMD              "coproc"
+#define DSH_COPROC_MAX          16
+#define DSH_COPROC_NAME_MAX     32
+#define DSH_COPROC_BUFF         4096
+#define DSH_COPROC_EOR          '\x1e'     //end of record marker line
+#define DSH_COPROC_TIMEOUT_MS   5000
+int  coproc_builtin(cmd_buff_t *cmd, int out_fd);
+void coproc_shutdown(void);
 
 //main execution context
 int exec_local_cmd_loop();
@@ -102,5 +193,8 @@ int execute_pipeline(command_list_t *clist);
 #define CMD_ERR_PIPE_LIMIT  "error: piping limited to %d commands\n"
 #define CMD_ERR_EXECUTE     "error: could not execute command\n"
 #define BI_NOT_IMPLEMENTED  "not implemented"
+#define STATS_HDR_FMT       "%-5s %7s %9s %9s %9s %9s %6s %6s %4s  %s\n"
+#define STATS_ROW_FMT       "%-5d %7d %9.3f %9.3f %9.3f %9ld %6ld %6ld %4d  %s\n"
+#define STATS_TOTAL_FMT     "total         %9.3f %9.3f %9.3f\n"
 
 #endif
\ No newline at end of file
@@ -0,0 +1,484 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+/*
+ * Connection agent (dsh -a).
+ *
+ * Every `dsh -c` run pays for a TCP connect, the HELLO exchange and, on a
+ * threaded server, a new handler thread, which adds up for scripts that
+ * run one short command per invocation.  The agent is a small local
+ * daemon that keeps connections to servers open between runs.  A client
+ * started with -A connects to the agent's Unix socket instead of the
+ * server and names the server it wants in the payload of its HELLO:
+ *
+ *      dsh -c -A ──HELLO "ip:port"──▶ agent ──warm connection──▶ server
+ *                ◀──────────── frames relayed as is ─────────────▶
+ *
+ * The agent takes an idle connection to that server from its pool, or
+ * opens one, answers the HELLO and then relays frames both ways until the
+ * client hangs up.  The client's `exit` is answered by the agent itself,
+ * so the server connection survives and goes back to the pool, as long
+ * as no command is still running on it.  Anything else (`stop-server`, a
+ * client that disconnects mid-command, an error) closes it instead.
+ *
+ * A pooled connection keeps its server side state: the working directory
+ * and what `rc` reports carry over from one client to the next, the same
+ * as commands typed one after another in a single session.
+ *
+ * The socket lives in a directory only its owner can enter, see
+ * rsh_agent_path(), and is mode 0600 itself.  Both ends check the other's
+ * uid with SO_PEERCRED: one user can't borrow another's connections, nor
+ * pose as their agent.
+ */
+
+typedef struct agent_conn {
+    char               addr[108];         //IP address or Unix socket, see rsh_sockaddr()
+    int                port;
+    int                sock;
+    uint16_t           hello_flags;       //what the server agreed to, RSH_HELLO_*
+    time_t             idle_since;
+    struct agent_conn *next;
+} agent_conn_t;
+
+static pthread_mutex_t g_agent_mutex = PTHREAD_MUTEX_INITIALIZER;
+static agent_conn_t   *g_idle_conns = NULL;
+static int             g_nidle = 0;
+
+static time_t now_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+// A directory only we can get into: not a symlink, ours, no access for others
+static bool agent_dir_private(const char *dir) {
+    struct stat sb;
+
+    if (lstat(dir, &sb) < 0) {
+        fprintf(stderr, "agent: %s: %s\n", dir, strerror(errno));
+        return false;
+    }
+    if (!S_ISDIR(sb.st_mode) || sb.st_uid != getuid() || (sb.st_mode & 077) != 0) {
+        fprintf(stderr, "agent: %s is not a private directory of this user\n", dir);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * rsh_agent_path(buff, len, create)
+ *      create:  make the directory if it doesn't exist yet, for the agent
+ *
+ *  Fills buff with the path of the current user's agent socket, in
+ *  $XDG_RUNTIME_DIR or else in a directory of its own under /tmp.  Never
+ *  the socket right in /tmp: anyone could create that path first, and the
+ *  sticky bit would then keep the real agent from replacing it, handing
+ *  the impostor every command and the output the client prints.  So the
+ *  directory must belong to us and be closed to everyone else, or nothing
+ *  in it is trusted.
+ *
+ *  Returns OK, or ERR_RDSH_COMMUNICATION if there is no such directory.
+ */
+int rsh_agent_path(char *buff, size_t len, bool create) {
+    char dir[108];
+    const char *xdg = getenv("XDG_RUNTIME_DIR");
+
+    if (xdg != NULL && xdg[0] == '/') {
+        snprintf(dir, sizeof(dir), "%s", xdg);
+    } else {
+        snprintf(dir, sizeof(dir), RSH_AGENT_DIR_FMT, (int)getuid());
+        if (create && mkdir(dir, 0700) < 0 && errno != EEXIST) {
+            fprintf(stderr, "agent: %s: %s\n", dir, strerror(errno));
+            return ERR_RDSH_COMMUNICATION;
+        }
+    }
+    if (!agent_dir_private(dir)) {
+        return ERR_RDSH_COMMUNICATION;
+    }
+
+    int n = snprintf(buff, len, "%s/" RSH_AGENT_SOCK_NAME, dir);
+    if (n < 0 || (size_t)n >= len) {
+        fprintf(stderr, "agent: socket path too long\n");
+        return ERR_RDSH_COMMUNICATION;
+    }
+    return OK;
+}
+
+/*
+ * A pooled connection is only worth reusing if the server hasn't hung up
+ * on it (server restarted, stop-server from another client, a heartbeat
+ * that went unanswered, ...).  An idle connection has nothing to read
+ * but the server's PINGs, which are answered here; anything else means
+ * EOF or junk.
+ */
+static bool conn_alive(int sock) {
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+    rsh_frame_hdr_t hdr;
+
+    while (poll(&pfd, 1, 0) > 0) {
+        if (rsh_recv_header(sock, &hdr) != OK || hdr.type != RSH_FRAME_PING || hdr.len != 0 ||
+            rsh_send_frame(sock, RSH_FRAME_PONG, hdr.stream, NULL, 0) != OK) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Takes a live idle connection to addr:port from the pool, or connects a
+ * new one and does the HELLO exchange.  Connections idle for longer than
+ * RSH_AGENT_IDLE_SECS are closed on the way.  New connections ask the server
+ * for everything the agent can relay, *flags gets the HELLO flags the
+ * server answered with.
+ *
+ * Returns the socket, or ERR_RDSH_CLIENT.
+ */
+static int agent_take(const char *addr, int port, bool *reused, uint16_t *flags) {
+    agent_conn_t *found = NULL, *stale = NULL;
+    time_t now = now_secs();
+
+    pthread_mutex_lock(&g_agent_mutex);
+    for (agent_conn_t **pp = &g_idle_conns; *pp != NULL; ) {
+        agent_conn_t *c = *pp;
+        bool expired = now - c->idle_since >= RSH_AGENT_IDLE_SECS;
+        if (found == NULL && !expired && c->port == port && strcmp(c->addr, addr) == 0) {
+            found = c;
+        } else if (!expired) {
+            pp = &c->next;
+            continue;
+        } else {
+            c->sock = -c->sock - 1;         //mark for closing below
+        }
+        *pp = c->next;
+        g_nidle--;
+        if (c != found) {
+            c->next = stale;
+            stale = c;
+        }
+    }
+    pthread_mutex_unlock(&g_agent_mutex);
+
+    while (stale != NULL) {
+        agent_conn_t *next = stale->next;
+        close(-stale->sock - 1);
+        free(stale);
+        stale = next;
+    }
+
+    if (found != NULL) {
+        int sock = found->sock;
+        *flags = found->hello_flags;
+        free(found);
+        if (conn_alive(sock)) {
+            *reused = true;
+            return sock;
+        }
+        close(sock);
+    }
+
+    *reused = false;
+    int sock = start_client((char *)addr, port);
+    if (sock < 0) {
+        return ERR_RDSH_CLIENT;
+    }
+
+    char *buff = malloc(RSH_FRAME_MAX);
+    rsh_frame_hdr_t hdr;
+    int rc = (buff == NULL) ? ERR_MEMORY : rsh_send_frame_flags(sock, RSH_FRAME_HELLO, RSH_HELLO_LZ, 0, NULL, 0);
+    if (rc == OK) {
+        rc = rsh_recv_frame(sock, &hdr, buff, RSH_FRAME_MAX);
+    }
+    free(buff);
+    if (rc != OK || hdr.type != RSH_FRAME_HELLO) {
+        close(sock);
+        return ERR_RDSH_CLIENT;
+    }
+    *flags = hdr.flags & RSH_HELLO_LZ;
+    return sock;
+}
+
+/*
+ * Returns a connection to the pool, or closes it if the pool is full.
+ */
+static void agent_put(const char *addr, int port, int sock, uint16_t flags) {
+    agent_conn_t *c = malloc(sizeof(agent_conn_t));
+
+    pthread_mutex_lock(&g_agent_mutex);
+    if (c != NULL && g_nidle < RSH_AGENT_MAX_IDLE) {
+        snprintf(c->addr, sizeof(c->addr), "%s", addr);
+        c->port = port;
+        c->sock = sock;
+        c->hello_flags = flags;
+        c->idle_since = now_secs();
+        c->next = g_idle_conns;
+        g_idle_conns = c;
+        g_nidle++;
+        c = NULL;
+        sock = -1;
+    }
+    pthread_mutex_unlock(&g_agent_mutex);
+
+    free(c);
+    if (sock >= 0) close(sock);
+}
+
+/*
+ * Relays frames between a client and its server connection until the
+ * client leaves.  Returns true if the server connection is clean, i.e.
+ * idle and still usable, and can go back to the pool.
+ */
+static bool agent_relay(int cli, int svr, char *buff) {
+    rsh_frame_hdr_t hdr;
+    int inflight = 0;           //commands sent without their END yet
+    bool reusable = true;
+    uint32_t exit_stream = 0;   //the client's `exit`, once it is sent
+
+    while (1) {
+        // After `exit` only the server has anything left to say
+        struct pollfd pfds[2] = {
+            { .fd = exit_stream ? -1 : cli, .events = POLLIN },
+            { .fd = svr, .events = POLLIN },
+        };
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+
+        // Server first, so replies go out before more commands come in
+        if (pfds[1].revents != 0) {
+            if (rsh_recv_frame(svr, &hdr, buff, RSH_FRAME_MAX) != OK) {
+                return false;
+            }
+            if (hdr.type == RSH_FRAME_END) {
+                inflight--;
+            }
+            if (rsh_send_frame_flags(cli, hdr.type, hdr.flags, hdr.stream, buff, hdr.len) != OK) {
+                return false;
+            }
+        } else if (pfds[0].revents != 0) {
+            int rc = rsh_recv_frame(cli, &hdr, buff, RSH_FRAME_MAX);
+            if (rc == WARN_RDSH_CLOSED) {
+                return reusable && inflight == 0;
+            } else if (rc != OK) {
+                return false;
+            }
+            // The file and its sum of a `put`, answers to the server's PINGs
+            if (hdr.type == RSH_FRAME_DATA || hdr.type == RSH_FRAME_SUM ||
+                hdr.type == RSH_FRAME_PONG) {
+                if (rsh_send_frame(svr, hdr.type, hdr.stream, buff, hdr.len) != OK) {
+                    return false;
+                }
+                continue;
+            } else if (hdr.type != RSH_FRAME_CMD) {
+                continue;
+            }
+
+            // The client is done, the connection is not; answered once
+            // the commands ahead of it are
+            if (hdr.len == strlen(EXIT_CMD) && memcmp(buff, EXIT_CMD, hdr.len) == 0) {
+                exit_stream = hdr.stream;
+            } else {
+                if (hdr.len == strlen("stop-server") && memcmp(buff, "stop-server", hdr.len) == 0) {
+                    reusable = false;
+                }
+                if (rsh_send_cmd(svr, hdr.stream, hdr.flags, buff, hdr.len) != OK) {
+                    return false;
+                }
+                inflight++;
+            }
+        }
+
+        if (exit_stream && inflight == 0) {
+            rsh_send_reply(cli, exit_stream, "exiting...\n", 0);
+            return reusable;
+        }
+    }
+}
+
+static void *agent_client(void *arg) {
+    int cli = *((int *)arg);
+    rsh_frame_hdr_t hdr;
+    char addr[108];
+    int port = 0;
+    bool reused = false;
+    int svr = -1;
+    uint16_t cli_flags = 0, svr_flags = 0;
+
+    free(arg);
+
+    char *buff = malloc(RSH_FRAME_MAX + 1);
+    if (buff == NULL) {
+        close(cli);
+        return NULL;
+    }
+
+    // The client's HELLO names the server, "ip:port"
+    if (rsh_recv_frame(cli, &hdr, buff, RSH_FRAME_MAX) == OK && hdr.type == RSH_FRAME_HELLO) {
+        cli_flags = hdr.flags;
+        buff[hdr.len] = '\0';
+        char *colon = strrchr(buff, ':');
+        if (colon != NULL && colon - buff < (long)sizeof(addr)) {
+            *colon = '\0';
+            snprintf(addr, sizeof(addr), "%s", buff);
+            port = atoi(colon + 1);
+        }
+    }
+    if (port > 0) {
+        svr = agent_take(addr, port, &reused, &svr_flags);
+    }
+
+    // No HELLO back tells the client the server couldn't be reached.
+    // Output frames are relayed as they are, so the client only gets
+    // compression if the server connection has it.
+    if (svr >= 0 && rsh_send_frame_flags(cli, RSH_FRAME_HELLO, cli_flags & svr_flags, 0, NULL, 0) == OK) {
+        printf("agent: %s:%d, %s connection\n", addr, port, reused ? "pooled" : "new");
+        fflush(stdout);
+        if (agent_relay(cli, svr, buff)) {
+            agent_put(addr, port, svr, svr_flags);
+            svr = -1;
+        }
+    }
+
+    if (svr >= 0) close(svr);
+    close(cli);
+    free(buff);
+    return NULL;
+}
+
+/*
+ * rsh_agent_run(path)
+ *      path:  Unix socket to listen on, see rsh_agent_path(), in a
+ *             directory the caller has checked
+ *
+ *  Runs the agent until it is killed.  Refuses to start if another agent
+ *  already answers on path; a stale socket file is replaced.
+ *
+ *  Returns ERR_RDSH_COMMUNICATION if the socket can't be set up.
+ */
+int rsh_agent_run(const char *path) {
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "agent: socket path too long\n");
+        return ERR_RDSH_COMMUNICATION;
+    }
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("socket");
+        return ERR_RDSH_COMMUNICATION;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "agent: already running on %s\n", path);
+        close(sock);
+        return ERR_RDSH_COMMUNICATION;
+    }
+    unlink(path);
+
+    // Only the owner may connect, SO_PEERCRED below double checks
+    mode_t old_mask = umask(0177);
+    int rc = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+    if (rc < 0 || listen(sock, 64) < 0) {
+        perror("agent");
+        close(sock);
+        return ERR_RDSH_COMMUNICATION;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    printf("agent listening on %s\n", path);
+    fflush(stdout);
+
+    while (1) {
+        int cli = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (cli < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            break;
+        }
+
+        struct ucred cred;
+        socklen_t cred_len = sizeof(cred);
+        if (getsockopt(cli, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 ||
+            cred.uid != getuid()) {
+            close(cli);
+            continue;
+        }
+
+        int *arg = malloc(sizeof(int));
+        pthread_t tid;
+        if (arg == NULL) {
+            close(cli);
+            continue;
+        }
+        *arg = cli;
+        if (pthread_create(&tid, NULL, agent_client, arg) != 0) {
+            perror("pthread_create");
+            close(cli);
+            free(arg);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+
+    close(sock);
+    unlink(path);
+    return ERR_RDSH_COMMUNICATION;
+}
+
+/*
+ * rsh_agent_connect()
+ *
+ *  Connects to the current user's agent.
+ *
+ *  Returns the socket, or ERR_RDSH_CLIENT if no agent is running.
+ */
+int rsh_agent_connect(void) {
+    struct sockaddr_un addr;
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (rsh_agent_path(addr.sun_path, sizeof(addr.sun_path), false) != OK) {
+        return ERR_RDSH_CLIENT;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("socket");
+        return ERR_RDSH_CLIENT;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "rdsh-error: no agent on %s\n", addr.sun_path);
+        close(sock);
+        return ERR_RDSH_CLIENT;
+    }
+
+    // Our commands and their output go through it, it had better be ours
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 ||
+        cred.uid != getuid()) {
+        fprintf(stderr, "rdsh-error: agent on %s is not run by this user\n", addr.sun_path);
+        close(sock);
+        return ERR_RDSH_CLIENT;
+    }
+    return sock;
+}
@@ -7,6 +7,11 @@
 #include <unistd.h>
 #include <sys/un.h>
 #include <fcntl.h>
+#include <ctype.h>
+#include <poll.h>
+#include <errno.h>
+#include <libgen.h>
+#include <sys/stat.h>
 
 #include "dshlib.h"
 #include "rshlib.h"
@@ -37,34 +42,51 @@
  *          2. Go into an infinite while(1) loop prompting the user for
  *             input commands. 
  * 
- *             a. Accept a command from the user via fgets()
- *             b. Send that command to the server using send() - it should
- *                be a null terminated string
- *             c. Go into a loop and receive client requests.  Note each
- *                receive might not be a C string so you need to print it
- *                out using:
- *                     printf("%.*s", (int)bytes_received, rsp_buff);
- *                this version of printf() uses the "%.*s" flag that indicates
- *                that the rsp_buff might be a null terminated string, or
- *                it might not be, if its not, print exactly bytes_received
- *                bytes. 
- *             d. In the recv() loop described above. Each time you receive
- *                data from the server, see if the last byte received is the
- *                EOF character. This indicates the server is done and you can
- *                send another command by going to the top of the loop.  The
- *                best way to do this is as follows assuming you are receiving
- *                data into a buffer called recv_buff, and you received
- *                recv_bytes in the call to recv:
- * 
- *                  recv_bytes = recv(sock, recv_buff, recv_buff_sz, 0)
- *                  
- *                if recv_bytes:
- *                  <negative_number>: communication error
- *                    0:    Didn't receive anything, likely server down
- *                  > 0:    Got some data. Check if the last byte is EOF
- *                          is_eof = (recv_buff[recv_bytes-1] == RDSH_EOF_CHAR) ? 1 : 0;
- *                    if is_eof is true, this is the last part of the transmission
- *                    from the server and you can break out of the recv() loop. 
+ *             a. Accept a command from the user, read from stdin while
+ *                also answering the server's PINGs (see client_read_cmd())
+ *             b. Send that command to the server as a CMD frame, tagged
+ *                with a new stream id.
+ *             c. Receive frames with rsh_recv_frame() until the END frame
+ *                for that stream arrives.  STDOUT and STDERR frames are
+ *                written to our own stdout and stderr as raw bytes, since
+ *                command output may hold any byte, including NULs and the
+ *                old RDSH_EOF_CHAR.  When stdout is a pipe or a file the
+ *                payload is spliced into it without being copied through
+ *                the client, see client_recv_frame().  A frame can span
+ *                several recv() calls; rsh_recv_frame() puts it back
+ *                together.  The END frame carries the command's exit
+ *                status.
+ *
+ *          Before the first command the client sends a HELLO frame and
+ *          waits for the server's HELLO, so a server speaking some other
+ *          protocol is caught right away.
+ *
+ *          A command ending in `&` runs in the background: it is sent and
+ *          the prompt comes straight back.  Up to RSH_MAX_STREAMS commands
+ *          can run at once on the one connection.  Their output frames
+ *          arrive interleaved and are printed as they come; when a
+ *          background command's END frame arrives the client prints
+ *          "[stream] done, exit STATUS".  `exit`, `stop-server` and end of
+ *          input wait for background commands to finish first.
+ *
+ *          When stdin is not a terminal (or with -b) the client runs in
+ *          batch mode instead: it keeps reading and sending commands
+ *          without waiting for each reply, up to a window of
+ *          RSH_BATCH_WINDOW commands, and prints the replies in input
+ *          order.  The server still runs them one after another, so a
+ *          script of 10k commands costs 10k commands rather than 10k
+ *          round trips.  See client_run_batch().
+ *
+ *          `get [-c] REMOTE [LOCAL]` and `put [-c] LOCAL [REMOTE]` copy a
+ *          file between the two working directories, checked end to end
+ *          with CRC-32C, and with -c carry on from what an interrupted
+ *          copy left behind.  They wait for everything else to finish and
+ *          then have the connection to themselves.  See rsh_xfer.c.
+ *
+ *          When input simply ends, like `echo make | dsh -c`, dsh exits
+ *          with the status of the last foreground command, the way
+ *          `ssh host cmd` does; see rsh_client_status().  An explicit
+ *          `exit` still exits 0.
  * 
  *   returns:
  *          OK:      The client executed all of its commands and is exiting
@@ -90,111 +112,844 @@
  *   function after cleaning things up.  See the documentation for client_cleanup()
  *      
  */
-int exec_remote_cmd_loop(char *address, int port) {
-    char *cmd_buff;
-    char *rsp_buff;
-    int cli_socket;
-    ssize_t io_size;
-    int is_eof;
+// Connection state for exec_remote_cmd_loop()
+typedef struct rsh_client {
+    int      sock;
+    char    *rsp_buff;
+    char    *lz_buff;                  //decompressed output, with RSH_CMD_LZ
+    uint16_t cmd_flags;                //RSH_CMD_LZ once the server agreed
+    uint32_t bg[RSH_MAX_STREAMS];      //background commands still running
+    int      nbg;
+    uint32_t stream;                   //id of the last command sent
+    int      last_status;              //of the last foreground command
+    char    *in_buff;                  //stdin read so far, see client_read_cmd()
+    int      in_len;
+    bool     in_eof;
+    int      out_mode;                 //CLIENT_OUT_*, see client_out_init()
+    int      out_pipe[2];              //splices output into a file, -1 if unused
+} rsh_client_t;
 
-    // Allocate buffers for sending and receiving data
-    cmd_buff = malloc(RDSH_COMM_BUFF_SZ);
-    rsp_buff = malloc(RDSH_COMM_BUFF_SZ);
-    
-    if (cmd_buff == NULL || rsp_buff == NULL) {
-        return client_cleanup(0, cmd_buff, rsp_buff, ERR_MEMORY);
+#define CLIENT_OUT_WRITE        0      //recv() then write() to stdout
+#define CLIENT_OUT_SPLICE       1      //splice() socket to stdout
+
+// A command sent in batch mode whose reply hasn't been printed yet
+typedef struct rsh_batch_cmd {
+    uint32_t stream;                   //0 for an empty line, just a prompt
+    bool     background;
+} rsh_batch_cmd_t;
+
+static int g_remote_status = 0;
+static int g_batch_window = -1;        //-1: batch mode if stdin isn't a tty
+static bool g_use_agent = false;
+static bool g_compress = false;
+
+/*
+ * set_client_batch(window)
+ *      window:  commands the client may have in flight in batch mode, 0
+ *               for the interactive loop, -1 to pick batch mode (with
+ *               RSH_BATCH_WINDOW) when stdin is not a terminal.
+ */
+void set_client_batch(int window) {
+    g_batch_window = window;
+}
+
+/*
+ * set_client_agent(use_agent)
+ *
+ *  Go through the local agent (dsh -a, see rsh_agent.c) instead of
+ *  connecting to the server directly.  The agent reuses a connection it
+ *  already has open to the server when it can.
+ */
+void set_client_agent(bool use_agent) {
+    g_use_agent = use_agent;
+}
+
+/*
+ * set_client_compress(compress)
+ *
+ *  Ask the server to compress command output (see rsh_lz.c).  Worth it
+ *  when the link is slower than the CPUs at either end.
+ */
+void set_client_compress(bool compress) {
+    g_compress = compress;
+}
+
+/*
+ * rsh_client_status()
+ *
+ *  Returns the exit status dsh should exit with after
+ *  exec_remote_cmd_loop(): the last foreground command's status if input
+ *  ran out, 0 after `exit` or `stop-server`.
+ */
+int rsh_client_status(void) {
+    return g_remote_status;
+}
+
+/*
+ * Picks how command output gets to our stdout.  A pipe takes the payload
+ * spliced straight from the socket, a file goes socket to out_pipe to
+ * file, never through user space either.  A terminal, a socket, or a
+ * file opened for append (which splice() refuses) gets the payload
+ * received into rsp_buff and write()n from there.
+ */
+static void client_out_init(rsh_client_t *cl) {
+    struct stat sb;
+    int fl = fcntl(STDOUT_FILENO, F_GETFL);
+
+    cl->out_mode = CLIENT_OUT_WRITE;
+    cl->out_pipe[0] = cl->out_pipe[1] = -1;
+    if (fl < 0 || (fl & O_NONBLOCK) || fstat(STDOUT_FILENO, &sb) < 0) {
+        return;
+    }
+    if (S_ISFIFO(sb.st_mode)) {
+        cl->out_mode = CLIENT_OUT_SPLICE;
+    } else if (S_ISREG(sb.st_mode) && !(fl & O_APPEND) && pipe(cl->out_pipe) == 0) {
+        cl->out_mode = CLIENT_OUT_SPLICE;
     }
+}
 
-    // Connect to the server
-    cli_socket = start_client(address, port);
-    if (cli_socket < 0) {
-        perror("start client");
-        return client_cleanup(cli_socket, cmd_buff, rsp_buff, ERR_RDSH_CLIENT);
+static void client_out_free(rsh_client_t *cl) {
+    if (cl->out_pipe[0] >= 0) {
+        close(cl->out_pipe[0]);
+        close(cl->out_pipe[1]);
+    }
+}
+
+/*
+ * Receives one frame and acts on it.  Output from any stream is written
+ * to our stdout or stderr as it arrives, straight to the file descriptor:
+ * prompts and messages go through stdio, which is flushed first to keep
+ * them in order.  A background command finishing is reported, a PING is
+ * answered.  *ended is set to the stream id of an END frame, 0 for
+ * anything else.
+ */
+static int client_recv_frame(rsh_client_t *cl, uint32_t *ended, int *status) {
+    rsh_frame_hdr_t hdr;
+
+    *ended = 0;
+    int rc = rsh_recv_header(cl->sock, &hdr);
+    if (rc == OK && hdr.type == RSH_FRAME_STDOUT && !(hdr.flags & RSH_OUT_LZ) &&
+        cl->out_mode == CLIENT_OUT_SPLICE && hdr.len <= RDSH_COMM_BUFF_SZ) {
+        fflush(stdout);
+        rc = rsh_recv_file(cl->sock, hdr.len, STDOUT_FILENO, -1,
+                           (cl->out_pipe[0] >= 0) ? cl->out_pipe : NULL);
+        // Like a failed write(), a stdout that went away doesn't end the session
+        return (rc == ERR_RDSH_CMD_EXEC) ? OK : rc;
+    }
+    if (rc == OK) {
+        rc = rsh_recv_payload(cl->sock, &hdr, cl->rsp_buff, RDSH_COMM_BUFF_SZ);
+    }
+    if (rc != OK) {
+        fflush(stdout);
+        return rc;
+    }
+
+    char *out = cl->rsp_buff;
+    int len = hdr.len;
+    if ((hdr.type == RSH_FRAME_STDOUT || hdr.type == RSH_FRAME_STDERR) &&
+        (hdr.flags & RSH_OUT_LZ)) {
+        len = (cl->lz_buff == NULL) ? ERR_RDSH_PROTOCOL :
+              rsh_lz_unpack(&hdr, cl->rsp_buff, cl->lz_buff, RSH_FRAME_MAX);
+        if (len < 0) {
+            fprintf(stderr, "rdsh-error: bad compressed output\n");
+            return ERR_RDSH_PROTOCOL;
+        }
+        out = cl->lz_buff;
+    }
+
+    if (hdr.type == RSH_FRAME_STDOUT) {
+        fflush(stdout);
+        rsh_write_all(STDOUT_FILENO, out, len);
+    } else if (hdr.type == RSH_FRAME_STDERR) {
+        fflush(stdout);             //keep the two in order on a terminal
+        rsh_write_all(STDERR_FILENO, out, len);
+    } else if (hdr.type == RSH_FRAME_PING) {
+        return rsh_send_frame(cl->sock, RSH_FRAME_PONG, hdr.stream, NULL, 0);
+    } else if (hdr.type == RSH_FRAME_END) {
+        *ended = hdr.stream;
+        *status = rsh_end_status(&hdr, cl->rsp_buff);
+        fflush(stdout);
+
+        for (int i = 0; i < cl->nbg; i++) {
+            if (cl->bg[i] == hdr.stream) {
+                cl->bg[i] = cl->bg[--cl->nbg];
+                printf("[%u] done, exit %d\n", hdr.stream, *status);
+                break;
+            }
+        }
+    }
+    return OK;
+}
+
+/*
+ * Prints frames until stream's END arrives.  Returns OK with the
+ * command's exit status in *status, or an error from rsh_recv_frame().
+ */
+static int client_wait_stream(rsh_client_t *cl, uint32_t stream, int *status) {
+    uint32_t ended;
+    int rc;
+
+    while ((rc = client_recv_frame(cl, &ended, status)) == OK) {
+        if (ended == stream) break;
+    }
+    return rc;
+}
+
+/*
+ * Prints frames until no more than `keep` background commands are left.
+ */
+static int client_wait_bg(rsh_client_t *cl, int keep) {
+    uint32_t ended;
+    int status;
+    int rc = OK;
+
+    while (cl->nbg > keep && rc == OK) {
+        rc = client_recv_frame(cl, &ended, &status);
+    }
+    return rc;
+}
+
+/*
+ * Prints whatever background output has already arrived, without waiting.
+ */
+static int client_poll_bg(rsh_client_t *cl) {
+    uint32_t ended;
+    int status;
+    int rc = OK;
+    struct pollfd pfd = { .fd = cl->sock, .events = POLLIN };
+
+    while (rc == OK && cl->nbg > 0 && poll(&pfd, 1, 0) > 0) {
+        rc = client_recv_frame(cl, &ended, &status);
+    }
+    return rc;
+}
+
+// Strips a trailing `&`, returns true if there was one
+static bool strip_background(char *cmd) {
+    int len = strlen(cmd);
+
+    while (len > 0 && isspace((unsigned char)cmd[len - 1])) len--;
+    if (len == 0 || cmd[len - 1] != '&') return false;
+
+    len--;
+    while (len > 0 && isspace((unsigned char)cmd[len - 1])) len--;
+    cmd[len] = '\0';
+    return true;
+}
+
+/*
+ * Whether client_read_cmd() has a line (or end of input) without waiting.
+ */
+static bool client_input_ready(rsh_client_t *cl) {
+    struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+
+    return cl->in_eof || memchr(cl->in_buff, '\n', cl->in_len) != NULL ||
+           poll(&pfd, 1, 0) > 0;
+}
+
+/*
+ * Reads a command line into cmd_buff, *more is false at end of input.
+ * *background tells whether it ended in `&`, which is stripped.
+ *
+ * stdin is read with read(2), not stdio, so that while it waits for the
+ * user it can also watch the socket (when watch_sock is set): background
+ * output is printed as it comes and the server's PINGs are answered, so
+ * a client left at its prompt isn't taken for dead.
+ *
+ * Returns OK, or an error from the connection.
+ */
+static int client_read_cmd(rsh_client_t *cl, char *cmd_buff, bool watch_sock, bool *more,
+                           bool *background) {
+    uint32_t ended;
+    int status;
+
+    fflush(stdout);
+    while (1) {
+        char *nl = memchr(cl->in_buff, '\n', cl->in_len);
+        if (nl != NULL || cl->in_eof || cl->in_len == RDSH_COMM_BUFF_SZ - 1) {
+            int len = (nl != NULL) ? nl - cl->in_buff : cl->in_len;
+            int used = len + (nl != NULL);
+            memcpy(cmd_buff, cl->in_buff, len);
+            cmd_buff[len] = '\0';
+            cl->in_len -= used;
+            memmove(cl->in_buff, cl->in_buff + used, cl->in_len);
+            *more = (used > 0);
+            *background = strip_background(cmd_buff);
+            return OK;
+        }
+
+        struct pollfd pfds[2] = {
+            { .fd = STDIN_FILENO, .events = POLLIN },
+            { .fd = watch_sock ? cl->sock : -1, .events = POLLIN },
+        };
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            return ERR_RDSH_CLIENT;
+        }
+        if (pfds[1].revents != 0) {
+            int rc = client_recv_frame(cl, &ended, &status);
+            if (rc != OK) return rc;
+        }
+        if (pfds[0].revents != 0) {
+            ssize_t n = read(STDIN_FILENO, cl->in_buff + cl->in_len,
+                             RDSH_COMM_BUFF_SZ - 1 - cl->in_len);
+            if (n > 0) {
+                cl->in_len += n;
+            } else if (n == 0 || errno != EINTR) {
+                cl->in_eof = true;
+            }
+        }
+    }
+}
+
+static bool is_leaving_cmd(const char *cmd) {
+    return strcmp(cmd, EXIT_CMD) == 0 || strcmp(cmd, "stop-server") == 0;
+}
+
+static bool is_transfer_cmd(const char *cmd) {
+    int len = strcspn(cmd, " ");
+    return (len == 3 && (strncmp(cmd, RSH_GET_CMD, 3) == 0 || strncmp(cmd, RSH_PUT_CMD, 3) == 0));
+}
+
+static double secs_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void transfer_done(const char *verb, const char *from, const char *to, long size,
+                          long resumed, const struct timespec *start) {
+    double secs = secs_since(start);
+    printf("%s: %s -> %s, %ld bytes", verb, from, to, size);
+    if (resumed > 0) printf(" (%ld resumed)", resumed);
+    printf(", %.1f MB/s\n", (size - resumed) / (secs > 0 ? secs : 1e-9) / (1024 * 1024));
+}
+
+// Creates (or, resuming, opens) local at the first STDOUT or SUM frame,
+// so a get the server turns down leaves nothing behind
+static int get_open(const char *local, long off, int *status) {
+    int fd = open(local, O_WRONLY | O_CREAT | O_CLOEXEC | (off > 0 ? 0 : O_TRUNC), 0644);
+    if (fd < 0) {
+        fprintf(stderr, "rdsh-error: get: %s: %s\n", local, strerror(errno));
+        *status = 1;
+    }
+    return fd;
+}
+
+/*
+ * Receives the reply to a `get`: the file as STDOUT frames spliced
+ * straight into local, the SUM frame and the END frame.  local is created
+ * (or, resuming, opened) only once the server has found the file.
+ */
+static int client_get_reply(rsh_client_t *cl, const char *local, long off, long *size,
+                            uint32_t *crc, int *status) {
+    rsh_frame_hdr_t hdr;
+    int pipe_fds[2];
+    bool opened = false;
+    int fd = -1;
+    int rc;
+
+    if (pipe(pipe_fds) < 0) {
+        return ERR_RDSH_CLIENT;
+    }
+
+    *size = -1;
+    while ((rc = rsh_recv_header(cl->sock, &hdr)) == OK) {
+        if (hdr.stream == cl->stream && !opened &&
+            (hdr.type == RSH_FRAME_STDOUT || hdr.type == RSH_FRAME_SUM)) {
+            fd = get_open(local, off, status);
+            opened = true;
+        }
+        if (hdr.stream == cl->stream && hdr.type == RSH_FRAME_STDOUT && fd >= 0 &&
+            !(hdr.flags & RSH_OUT_LZ)) {
+            rc = rsh_recv_file(cl->sock, hdr.len, fd, off, pipe_fds);
+            if (rc == ERR_RDSH_CMD_EXEC) {
+                fprintf(stderr, "rdsh-error: get: %s: %s\n", local, strerror(errno));
+                close(fd);
+                fd = -1;
+                *status = 1;
+            } else if (rc != OK) {
+                break;
+            }
+            off += hdr.len;
+            continue;
+        }
+
+        rc = rsh_recv_payload(cl->sock, &hdr, cl->rsp_buff, RDSH_COMM_BUFF_SZ);
+        if (rc != OK) break;
+        if (hdr.stream != cl->stream) continue;
+
+        if (hdr.type == RSH_FRAME_SUM) {
+            rc = rsh_sum_parse(&hdr, cl->rsp_buff, size, crc);
+            if (rc != OK) break;
+        } else if (hdr.type == RSH_FRAME_STDOUT && fd >= 0) {
+            int len = rsh_lz_unpack(&hdr, cl->rsp_buff, cl->lz_buff, RSH_FRAME_MAX);
+            if (cl->lz_buff == NULL || len < 0 || pwrite(fd, cl->lz_buff, len, off) != len) {
+                rc = ERR_RDSH_PROTOCOL;
+                break;
+            }
+            off += len;
+        } else if (hdr.type == RSH_FRAME_STDERR) {
+            fwrite(cl->rsp_buff, 1, hdr.len, stderr);
+        } else if (hdr.type == RSH_FRAME_END) {
+            int end_status = rsh_end_status(&hdr, cl->rsp_buff);
+            if (end_status != 0) *status = end_status;
+            break;
+        }
+    }
+
+    if (fd >= 0) close(fd);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    return rc;
+}
+
+/*
+ * get [-c] REMOTE [LOCAL]: copies a file from the server, into the
+ * current directory under its own name by default.  With -c a LOCAL left
+ * over from an interrupted get is continued rather than started over.
+ */
+static int client_get(rsh_client_t *cl, const char *remote, const char *local, bool resume) {
+    char cmd[RDSH_COMM_BUFF_SZ];
+    struct timespec start;
+    struct stat sb;
+    long off = 0, size;
+    uint32_t crc;
+    int status = 0;
+
+    if (resume && stat(local, &sb) == 0 && S_ISREG(sb.st_mode)) {
+        off = sb.st_size;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int len = snprintf(cmd, sizeof(cmd), "%s %s %ld", RSH_GET_CMD, remote, off);
+    int rc = rsh_send_cmd(cl->sock, ++cl->stream, 0, cmd, len);
+    if (rc == OK) {
+        rc = client_get_reply(cl, local, off, &size, &crc, &status);
+    }
+    if (rc != OK) {
+        return rc;
+    }
+
+    // The whole file is checked, so a LOCAL that was never a prefix of
+    // REMOTE is caught too
+    if (status == 0) {
+        uint32_t have_crc = 0;
+        int fd = open(local, O_RDONLY | O_CLOEXEC);
+        if (size < 0 || fd < 0 || fstat(fd, &sb) < 0 || sb.st_size != size ||
+            rsh_xfer_sum(fd, 0, size, &have_crc) != OK || have_crc != crc) {
+            fprintf(stderr, "rdsh-error: get: %s doesn't match %s, get it again%s\n",
+                    local, remote, resume ? " without -c" : "");
+            status = 1;
+        }
+        if (fd >= 0) close(fd);
+    }
+    if (status == 0) {
+        transfer_done(RSH_GET_CMD, remote, local, size, off, &start);
+    }
+    cl->last_status = status;
+    return OK;
+}
+
+/*
+ * put [-c] LOCAL [REMOTE]: copies a file to the server, into its working
+ * directory under the same name by default.  With -c the server keeps
+ * what it already has of REMOTE, as long as that is a prefix of LOCAL.
+ */
+static int client_put(rsh_client_t *cl, const char *local, const char *remote, bool resume) {
+    char cmd[RDSH_COMM_BUFF_SZ];
+    rsh_frame_hdr_t hdr;
+    struct timespec start;
+    struct stat sb;
+    long have = -1;
+    uint32_t crc = 0, have_crc = 0;
+    int status = 0;
+
+    int fd = open(local, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+        fprintf(stderr, "rdsh-error: put: %s: %s\n", local,
+                (fd < 0) ? strerror(errno) : "not a regular file");
+        if (fd >= 0) close(fd);
+        cl->last_status = 1;
+        return OK;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int len = snprintf(cmd, sizeof(cmd), "%s %s%s", RSH_PUT_CMD, resume ? "-c " : "", remote);
+    int rc = rsh_send_cmd(cl->sock, ++cl->stream, 0, cmd, len);
+
+    // The server says how much it has, or ENDs if it can't write REMOTE
+    while (rc == OK && have < 0) {
+        rc = rsh_recv_frame(cl->sock, &hdr, cl->rsp_buff, RDSH_COMM_BUFF_SZ);
+        if (rc != OK || hdr.stream != cl->stream) continue;
+        if (hdr.type == RSH_FRAME_SUM) {
+            rc = rsh_sum_parse(&hdr, cl->rsp_buff, &have, &have_crc);
+        } else if (hdr.type == RSH_FRAME_STDERR) {
+            fwrite(cl->rsp_buff, 1, hdr.len, stderr);
+        } else if (hdr.type == RSH_FRAME_END) {
+            close(fd);
+            cl->last_status = rsh_end_status(&hdr, cl->rsp_buff);
+            return OK;
+        }
+    }
+
+    // Only send the rest if what the server has is how LOCAL starts; if
+    // not, the sum of the whole file alone makes the server refuse it
+    bool prefix = (have <= sb.st_size && rsh_xfer_sum(fd, 0, have, &crc) == OK && crc == have_crc);
+    if (!prefix) {
+        fprintf(stderr, "rdsh-error: put: %s doesn't start like %s, put it again without -c\n",
+                remote, local);
+        crc = 0;
+        have = 0;
+    }
+    for (long off = have; rc == OK && prefix && off < sb.st_size; off += RSH_FRAME_MAX) {
+        long n = (sb.st_size - off < RSH_FRAME_MAX) ? sb.st_size - off : RSH_FRAME_MAX;
+        rc = rsh_send_file(cl->sock, RSH_FRAME_DATA, cl->stream, fd, off, (uint32_t)n);
+    }
+    if (rc == OK && rsh_xfer_sum(fd, have, sb.st_size - have, &crc) != OK) {
+        crc = ~crc;                 //the server will find it doesn't match
+    }
+    if (rc == OK) {
+        rc = rsh_send_sum(cl->sock, cl->stream, sb.st_size, crc);
+    }
+    close(fd);
+
+    if (rc == OK) {
+        rc = client_wait_stream(cl, cl->stream, &status);
+    }
+    if (rc == OK && status == 0) {
+        transfer_done(RSH_PUT_CMD, local, remote, sb.st_size, have, &start);
+    }
+    cl->last_status = status;
+    return rc;
+}
+
+/*
+ * Runs a `get` or `put` line.  Transfers go one at a time with nothing
+ * else in flight, the caller waits for background commands first.
+ */
+static int client_transfer(rsh_client_t *cl, char *cmd_buff) {
+    char *argv[4];
+    int argc = 0;
+    bool resume = false;
+
+    for (char *tok = strtok(cmd_buff, " \t"); tok != NULL; tok = strtok(NULL, " \t")) {
+        if (argc == 1 && !resume && strcmp(tok, "-c") == 0) {
+            resume = true;
+        } else if (argc < 4) {
+            argv[argc++] = tok;
+        } else {
+            argc++;
+        }
+    }
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s [-c] %s\n", argv[0],
+                strcmp(argv[0], RSH_GET_CMD) == 0 ? "remote [local]" : "local [remote]");
+        cl->last_status = 1;
+        return OK;
+    }
+
+    // Without a destination the file keeps its name, in the other side's
+    // working directory
+    const char *dst = (argc == 3) ? argv[2] : basename(argv[1]);
+    if (strcmp(argv[0], RSH_GET_CMD) == 0) {
+        return client_get(cl, argv[1], dst, resume);
+    }
+    return client_put(cl, argv[1], dst, resume);
+}
+
+/*
+ * Sends `exit` or `stop-server` and prints the reply, after background
+ * commands have finished.  The server hangs up after it.
+ */
+static int client_leave(rsh_client_t *cl, char *cmd_buff) {
+    int status;
+
+    int rc = client_wait_bg(cl, 0);
+    if (rc != OK) return rc;
+
+    rc = rsh_send_cmd(cl->sock, ++cl->stream, cl->cmd_flags, cmd_buff, strlen(cmd_buff));
+    if (rc != OK) {
+        perror("send");
+        return rc;
     }
+    rc = client_wait_stream(cl, cl->stream, &status);
+    return (strcmp(cmd_buff, EXIT_CMD) == 0) ? OK : rc;
+}
+
+/*
+ * One command at a time: prompt, send, print the reply, repeat.
+ */
+static int client_run_interactive(rsh_client_t *cl, char *cmd_buff) {
+    bool background;
+    int rc;
 
     while (1) {
+        // Report background commands that finished while we were idle
+        rc = client_poll_bg(cl);
+        if (rc != OK) return rc;
+
         // Print prompt to user
         printf("%s", SH_PROMPT);
         fflush(stdout);
 
         // Get input from user
-        if (fgets(cmd_buff, RDSH_COMM_BUFF_SZ, stdin) == NULL) {
+        bool more;
+        rc = client_read_cmd(cl, cmd_buff, true, &more, &background);
+        if (rc != OK) return rc;
+        if (!more) {
             printf("\n");
-            break;
+            rc = client_wait_bg(cl, 0);
+            g_remote_status = cl->last_status;
+            return rc;
         }
 
-        // Remove trailing newline
-        cmd_buff[strcspn(cmd_buff, "\n")] = '\0';
-
         // Check if command is empty
         if (strlen(cmd_buff) == 0) {
             continue;
         }
 
-        // Exit client if command is "exit"
-        if (strcmp(cmd_buff, EXIT_CMD) == 0) {
-            // Send exit command to server
-            io_size = send(cli_socket, cmd_buff, strlen(cmd_buff) + 1, 0);
-            if (io_size < 0) {
-                perror("send");
-                return client_cleanup(cli_socket, cmd_buff, rsp_buff, ERR_RDSH_COMMUNICATION);
-            }
-            
-            // Wait for server response and EOF
-            while ((io_size = recv(cli_socket, rsp_buff, RDSH_COMM_BUFF_SZ, 0)) > 0) {
-                is_eof = (rsp_buff[io_size - 1] == RDSH_EOF_CHAR) ? 1 : 0;
-                
-                if (is_eof) {
-                    // Replace EOF with null for proper string printing
-                    rsp_buff[io_size - 1] = '\0';
-                    printf("%.*s", (int)io_size - 1, rsp_buff);
-                } else {
-                    printf("%.*s", (int)io_size, rsp_buff);
-                }
-                
-                if (is_eof) break;
-            }
-            
-            break;  // Exit the command loop
+        // Let background work finish before leaving
+        if (is_leaving_cmd(cmd_buff)) {
+            return client_leave(cl, cmd_buff);
+        }
+
+        // A transfer has the connection to itself
+        if (is_transfer_cmd(cmd_buff)) {
+            rc = client_wait_bg(cl, 0);
+            if (rc == OK) rc = client_transfer(cl, cmd_buff);
+            if (rc != OK) return rc;
+            continue;
         }
 
-        // Send command to server (include null terminator)
-        io_size = send(cli_socket, cmd_buff, strlen(cmd_buff) + 1, 0);
-        if (io_size < 0) {
+        // Never have more commands in flight than the server will run
+        rc = client_wait_bg(cl, RSH_MAX_STREAMS - 1);
+        if (rc != OK) return rc;
+
+        // Send command to server, the frame carries its length
+        cl->stream++;
+        rc = rsh_send_cmd(cl->sock, cl->stream, cl->cmd_flags, cmd_buff, strlen(cmd_buff));
+        if (rc != OK) {
             perror("send");
-            return client_cleanup(cli_socket, cmd_buff, rsp_buff, ERR_RDSH_COMMUNICATION);
+            return rc;
+        }
+
+        if (background) {
+            cl->bg[cl->nbg++] = cl->stream;
+            printf("[%u]\n", cl->stream);
+            continue;
+        }
+
+        // Receive and print the reply until its END frame
+        rc = client_wait_stream(cl, cl->stream, &cl->last_status);
+        if (rc != OK) return rc;
+    }
+}
+
+/*
+ * Batch mode: the prompt, the "[id]" of a background command and the
+ * reply of each command are printed in input order, once the command
+ * reaches the head of the queue.
+ */
+static int client_batch_head(rsh_client_t *cl, rsh_batch_cmd_t *cmd) {
+    printf("%s", SH_PROMPT);
+    if (cmd->stream == 0) {
+        return OK;
+    } else if (cmd->background) {
+        printf("[%u]\n", cmd->stream);
+        return OK;
+    }
+    return client_wait_stream(cl, cmd->stream, &cl->last_status);
+}
+
+/*
+ * Sends commands without waiting for the replies, up to `window` of them
+ * ahead of the one whose reply is being printed.  Every CMD frame has the
+ * RSH_CMD_ORDERED flag, so the server still runs each command only after
+ * the foreground command before it has ended, and a script behaves just
+ * as it would typed in, only without a round trip per line.  Background
+ * commands also carry RSH_CMD_BACKGROUND so later commands don't wait on
+ * them.  Replies are matched to commands by stream id.
+ */
+static int client_run_batch(rsh_client_t *cl, char *cmd_buff, int window) {
+    rsh_batch_cmd_t *queue = calloc(window, sizeof(rsh_batch_cmd_t));
+    int head = 0, queued = 0;
+    bool background;
+    int rc = OK;
+
+    if (queue == NULL) {
+        return ERR_MEMORY;
+    }
+
+    while (rc == OK) {
+        // Nothing more to send yet: print the replies while we wait, and
+        // let client_read_cmd() answer PINGs, which it can only do with
+        // no reply left to print
+        if (queued > 0 && !client_input_ready(cl)) {
+            for (; queued > 0 && rc == OK; queued--, head = (head + 1) % window) {
+                rc = client_batch_head(cl, &queue[head]);
+            }
+            if (rc != OK) break;
         }
 
-        // Receive and process server responses until EOF
-        while ((io_size = recv(cli_socket, rsp_buff, RDSH_COMM_BUFF_SZ, 0)) > 0) {
-            // Check if this is the last chunk (ends with EOF char)
-            is_eof = (rsp_buff[io_size - 1] == RDSH_EOF_CHAR) ? 1 : 0;
-            
-            if (is_eof) {
-                // Replace EOF with null for proper string printing
-                rsp_buff[io_size - 1] = '\0';
-                printf("%.*s", (int)io_size - 1, rsp_buff);
+        bool more;
+        rc = client_read_cmd(cl, cmd_buff, queued == 0, &more, &background);
+        if (rc != OK) break;
+
+        // End of input, `exit`, `stop-server`, `get` or `put`: everything
+        // sent so far is printed first
+        if (!more || is_leaving_cmd(cmd_buff) || is_transfer_cmd(cmd_buff)) {
+            for (; queued > 0 && rc == OK; queued--, head = (head + 1) % window) {
+                rc = client_batch_head(cl, &queue[head]);
+            }
+            if (rc != OK) break;
+
+            printf("%s", SH_PROMPT);
+            if (more && is_transfer_cmd(cmd_buff)) {
+                fflush(stdout);
+                rc = client_wait_bg(cl, 0);
+                if (rc == OK) rc = client_transfer(cl, cmd_buff);
+                continue;
+            }
+            if (more) {
+                rc = client_leave(cl, cmd_buff);
             } else {
-                printf("%.*s", (int)io_size, rsp_buff);
+                printf("\n");
+                rc = client_wait_bg(cl, 0);
+                g_remote_status = cl->last_status;
             }
-            
-            // Break out of receive loop if EOF received
-            if (is_eof) break;
+            break;
+        }
+
+        // Make room in the window
+        if (queued == window) {
+            rc = client_batch_head(cl, &queue[head]);
+            head = (head + 1) % window;
+            queued--;
+            if (rc != OK) break;
+        }
+
+        rsh_batch_cmd_t *cmd = &queue[(head + queued) % window];
+        cmd->stream = 0;
+        cmd->background = background;
+        queued++;
+        if (strlen(cmd_buff) == 0) {
+            continue;
+        }
+
+        // The server runs at most RSH_MAX_STREAMS commands, one of them
+        // may be the foreground command at the head
+        if (background) {
+            rc = client_wait_bg(cl, RSH_MAX_STREAMS - 2);
+            if (rc != OK) break;
+        }
+
+        uint16_t flags = cl->cmd_flags | RSH_CMD_ORDERED | (background ? RSH_CMD_BACKGROUND : 0);
+        cmd->stream = ++cl->stream;
+        rc = rsh_send_cmd(cl->sock, cmd->stream, flags, cmd_buff, strlen(cmd_buff));
+        if (rc != OK) {
+            perror("send");
+            break;
+        }
+        if (background) {
+            cl->bg[cl->nbg++] = cmd->stream;
+        }
+    }
+
+    free(queue);
+    return rc;
+}
+
+int exec_remote_cmd_loop(char *address, int port) {
+    char *cmd_buff;
+    char *rsp_buff;
+    int cli_socket;
+    int rc;
+    rsh_frame_hdr_t hdr;
+    rsh_client_t cl;
+
+    // Allocate buffers for sending and receiving data
+    cmd_buff = malloc(RDSH_COMM_BUFF_SZ);
+    rsp_buff = malloc(RDSH_COMM_BUFF_SZ);
+    
+    if (cmd_buff == NULL || rsp_buff == NULL) {
+        return client_cleanup(0, cmd_buff, rsp_buff, ERR_MEMORY);
+    }
+
+    // Connect to the server, or to the agent which connects for us
+    if (g_use_agent) {
+        cli_socket = rsh_agent_connect();
+        if (cli_socket < 0) {
+            return client_cleanup(cli_socket, cmd_buff, rsp_buff, ERR_RDSH_CLIENT);
         }
-        
-        // Handle receive errors or server shutdown
-        if (io_size < 0) {
-            perror("recv");
-            return client_cleanup(cli_socket, cmd_buff, rsp_buff, ERR_RDSH_COMMUNICATION);
-        } else if (io_size == 0) {
-            printf("Server closed connection\n");
-            return client_cleanup(cli_socket, cmd_buff, rsp_buff, ERR_RDSH_COMMUNICATION);
+    } else {
+        cli_socket = start_client(address, port);
+        if (cli_socket < 0) {
+            perror("start client");
+            return client_cleanup(cli_socket, cmd_buff, rsp_buff, ERR_RDSH_CLIENT);
         }
-        
-        // Check if command was "stop-server"
-        if (strcmp(cmd_buff, "stop-server") == 0) {
-            break;  // Exit the command loop
+    }
+
+    // Both sides open with a HELLO, the agent needs to know which server
+    int hello_len = 0;
+    if (g_use_agent) {
+        hello_len = snprintf(cmd_buff, RDSH_COMM_BUFF_SZ, "%s:%d", address, port);
+    }
+    rc = rsh_send_frame_flags(cli_socket, RSH_FRAME_HELLO, g_compress ? RSH_HELLO_LZ : 0, 0,
+                              cmd_buff, hello_len);
+    if (rc == OK) {
+        rc = rsh_recv_frame(cli_socket, &hdr, rsp_buff, RDSH_COMM_BUFF_SZ);
+    }
+    if (rc != OK || hdr.type != RSH_FRAME_HELLO) {
+        fprintf(stderr, "rdsh-error: server did not answer HELLO\n");
+        return client_cleanup(cli_socket, cmd_buff, rsp_buff, ERR_RDSH_COMMUNICATION);
+    }
+
+    cl.sock = cli_socket;
+    cl.rsp_buff = rsp_buff;
+    cl.lz_buff = NULL;
+    cl.cmd_flags = 0;
+    if (g_compress && (hdr.flags & RSH_HELLO_LZ)) {
+        cl.lz_buff = malloc(RSH_FRAME_MAX);
+        if (cl.lz_buff == NULL) {
+            return client_cleanup(cli_socket, cmd_buff, rsp_buff, ERR_MEMORY);
         }
+        cl.cmd_flags = RSH_CMD_LZ;
+    }
+    cl.nbg = 0;
+    cl.stream = 0;
+    cl.last_status = 0;
+    cl.in_len = 0;
+    cl.in_eof = false;
+    cl.in_buff = malloc(RDSH_COMM_BUFF_SZ);
+    if (cl.in_buff == NULL) {
+        free(cl.lz_buff);
+        return client_cleanup(cli_socket, cmd_buff, rsp_buff, ERR_MEMORY);
+    }
+    client_out_init(&cl);
+
+    int window = g_batch_window;
+    if (window < 0) {
+        window = isatty(STDIN_FILENO) ? 0 : RSH_BATCH_WINDOW;
+    }
+    if (window > 0) {
+        rc = client_run_batch(&cl, cmd_buff, window);
+    } else {
+        rc = client_run_interactive(&cl, cmd_buff);
+    }
+    free(cl.lz_buff);
+    free(cl.in_buff);
+    client_out_free(&cl);
+
+    // Handle receive errors or server shutdown
+    if (rc == WARN_RDSH_CLOSED) {
+        printf("Server closed connection\n");
+        return client_cleanup(cli_socket, cmd_buff, rsp_buff, ERR_RDSH_COMMUNICATION);
+    } else if (rc == ERR_MEMORY) {
+        return client_cleanup(cli_socket, cmd_buff, rsp_buff, ERR_MEMORY);
+    } else if (rc != OK) {
+        perror("recv");
+        return client_cleanup(cli_socket, cmd_buff, rsp_buff, ERR_RDSH_COMMUNICATION);
     }
 
     return client_cleanup(cli_socket, cmd_buff, rsp_buff, OK);
@@ -224,37 +979,41 @@ int exec_remote_cmd_loop(char *address, int port) {
  * 
  */
 int start_client(char *server_ip, int port) {
-    struct sockaddr_in addr;
+    struct sockaddr_storage addr;
     int cli_socket;
     int ret;
 
+    // An IP address, or a Unix socket path or @name for a local server
+    int addr_len = rsh_sockaddr(server_ip, port, &addr);
+    if (addr_len < 0) {
+        return ERR_RDSH_CLIENT;
+    }
+
     // Create a socket
-    cli_socket = socket(AF_INET, SOCK_STREAM, 0);
+    cli_socket = socket(addr.ss_family, SOCK_STREAM, 0);
     if (cli_socket < 0) {
         perror("socket");
         return ERR_RDSH_CLIENT;
     }
 
-    // Set up the server address structure
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    
-    // Convert IP address from text to binary form
-    if (inet_pton(AF_INET, server_ip, &addr.sin_addr) <= 0) {
-        perror("inet_pton");
-        close(cli_socket);
-        return ERR_RDSH_CLIENT;
-    }
+    // Room for a full window of a large command's output in flight
+    rsh_sock_rcvbuf(cli_socket, RSH_CLIENT_RCVBUF);
 
     // Connect to the server
-    ret = connect(cli_socket, (struct sockaddr *)&addr, sizeof(addr));
+    ret = connect(cli_socket, (struct sockaddr *)&addr, addr_len);
     if (ret < 0) {
         perror("connect");
         close(cli_socket);
         return ERR_RDSH_CLIENT;
     }
 
+    // Frames are written whole, and in batch mode one right after the
+    // other; Nagle would hold them back waiting for delayed ACKs
+    rsh_sock_nodelay(cli_socket);
+
+    // Notice a server that vanished while a long command runs
+    rsh_sock_keepalive(cli_socket, RSH_KEEPALIVE_DEF);
+
     return cli_socket;
 }
 
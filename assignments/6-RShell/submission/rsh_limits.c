@@ -0,0 +1,186 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <sys/resource.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+/*
+ * Resource limits and admission control.
+ *
+ * Without limits one client can fork pipelines as fast as it can send
+ * CMD frames, and every other client's commands queue up behind them in
+ * the scheduler.  The -L flag of the server sets, with 0 (the default)
+ * meaning unlimited:
+ *
+ *      procs=N     stages one session may have running.  A command that
+ *                  would go over is held, just like an RSH_CMD_ORDERED one,
+ *                  until an earlier command of the same session ends.
+ *      total=N     stages running on the whole server.  A command that
+ *                  would go over is rejected right away with
+ *                  CMD_ERR_RDSH_OVERLOAD; queueing it would only move the
+ *                  wait into the latency of everything behind it.
+ *      cpu=SECS    RLIMIT_CPU of each stage, SIGXCPU and then SIGKILL.
+ *      mem=BYTES   RLIMIT_AS of each stage, allocations fail past it.
+ *      out=BYTES   output one command may send back, its stages are
+ *                  killed once it is exceeded.
+ *
+ * Sizes take a k, m or g suffix.  The rlimits are set in the child right
+ * before exec(), the pre-forked spawners inherit g_rsh_limits because
+ * they are forked after the flags are parsed.  cgroup v2 would also cap
+ * the children those commands fork, but needs a delegated hierarchy we
+ * can't count on having, so plain setrlimit() it is.
+ */
+
+rsh_limits_t g_rsh_limits;
+
+static atomic_int  g_running;           //stages started and not reaped yet
+static atomic_long g_rejected;          //commands turned away at total
+static atomic_long g_out_killed;        //commands killed at out
+
+static long parse_size(const char *s, bool *ok) {
+    char *end;
+    long v = strtol(s, &end, 10);
+
+    switch (*end) {
+    case 'k': case 'K': v *= 1024L; end++; break;
+    case 'm': case 'M': v *= 1024L * 1024; end++; break;
+    case 'g': case 'G': v *= 1024L * 1024 * 1024; end++; break;
+    }
+    *ok = (end != s && *end == '\0' && v >= 0);
+    return v;
+}
+
+/*
+ * rsh_limits_parse(spec)
+ *      spec:  comma separated key=value pairs, see the top of this file
+ *
+ *  Must be called before start_server().
+ *
+ *  Returns OK, or ERR_CMD_ARGS_BAD for an unknown key or a bad value.
+ */
+int rsh_limits_parse(const char *spec) {
+    char buff[256];
+
+    strncpy(buff, spec, sizeof(buff) - 1);
+    buff[sizeof(buff) - 1] = '\0';
+
+    for (char *tok = strtok(buff, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        char *val = strchr(tok, '=');
+        bool ok;
+        if (val == NULL) return ERR_CMD_ARGS_BAD;
+        *val++ = '\0';
+
+        long v = parse_size(val, &ok);
+        if (!ok) return ERR_CMD_ARGS_BAD;
+
+        if (strcmp(tok, "procs") == 0 && v <= RSH_LIMIT_PROCS_MAX) {
+            g_rsh_limits.procs = (int)v;
+        } else if (strcmp(tok, "total") == 0 && v <= RSH_LIMIT_PROCS_MAX) {
+            g_rsh_limits.total = (int)v;
+        } else if (strcmp(tok, "cpu") == 0) {
+            g_rsh_limits.cpu_secs = v;
+        } else if (strcmp(tok, "mem") == 0) {
+            g_rsh_limits.mem_bytes = v;
+        } else if (strcmp(tok, "out") == 0) {
+            g_rsh_limits.out_bytes = v;
+        } else {
+            return ERR_CMD_ARGS_BAD;
+        }
+    }
+    return OK;
+}
+
+/*
+ * rsh_limits_admit(nstages)
+ *
+ *  Reserves nstages against the server wide limit.  Every stage reserved
+ *  here is given back with rsh_limits_release(), once it is reaped or if
+ *  it never started.
+ *
+ *  Returns false if that would go over total.
+ */
+bool rsh_limits_admit(int nstages) {
+    int cur = atomic_load(&g_running);
+
+    do {
+        if (g_rsh_limits.total > 0 && cur + nstages > g_rsh_limits.total) {
+            atomic_fetch_add(&g_rejected, 1);
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak(&g_running, &cur, cur + nstages));
+    return true;
+}
+
+void rsh_limits_release(int nstages) {
+    atomic_fetch_sub(&g_running, nstages);
+}
+
+/*
+ * rsh_limits_running()
+ *
+ *  Returns the number of stages running on the whole server.
+ */
+int rsh_limits_running(void) {
+    return atomic_load(&g_running);
+}
+
+/*
+ * rsh_limits_output(st, n)
+ *
+ *  Counts n more bytes relayed for st.  The first time the command goes
+ *  over the out limit its stages are killed; what they already wrote into
+ *  the pipes is still relayed, the END frame then reports the SIGKILL.
+ */
+void rsh_limits_output(rsh_stream_t *st, int n) {
+    if (g_rsh_limits.out_bytes == 0 || st->nprocs == 0) return;
+
+    long before = st->out_bytes;
+    st->out_bytes += n;
+    if (before <= g_rsh_limits.out_bytes && st->out_bytes > g_rsh_limits.out_bytes) {
+        atomic_fetch_add(&g_out_killed, 1);
+        for (int i = 0; i < st->nprocs; i++) {
+            if (st->pids[i] > 0) kill(st->pids[i], SIGKILL);
+        }
+    }
+}
+
+/*
+ * rsh_limits_child()
+ *
+ *  Sets the per stage rlimits, called in a freshly forked stage.
+ */
+void rsh_limits_child(void) {
+    struct rlimit rl;
+
+    if (g_rsh_limits.cpu_secs > 0) {
+        rl.rlim_cur = g_rsh_limits.cpu_secs;
+        rl.rlim_max = g_rsh_limits.cpu_secs + 1;   //SIGXCPU first, then SIGKILL
+        setrlimit(RLIMIT_CPU, &rl);
+    }
+    if (g_rsh_limits.mem_bytes > 0) {
+        rl.rlim_cur = rl.rlim_max = g_rsh_limits.mem_bytes;
+        setrlimit(RLIMIT_AS, &rl);
+    }
+}
+
+/*
+ * rsh_limits_stats(out_fd)
+ *
+ *  Prints the limits and what they turned away for `stats`.
+ *
+ *  Returns 0.
+ */
+int rsh_limits_stats(int out_fd) {
+    dprintf(out_fd, "limits: procs %d, total %d, cpu %lds, mem %ld, out %ld (0 is unlimited)\n",
+            g_rsh_limits.procs, g_rsh_limits.total, g_rsh_limits.cpu_secs,
+            g_rsh_limits.mem_bytes, g_rsh_limits.out_bytes);
+    dprintf(out_fd, "admission: %d stages running, %ld rejected, %ld killed for output\n",
+            rsh_limits_running(), atomic_load(&g_rejected), atomic_load(&g_out_killed));
+    return 0;
+}
@@ -0,0 +1,202 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+/*
+ * Compression of command output, in the LZ4 block format.
+ *
+ * Output is sent in frames of at most RSH_FRAME_MAX bytes, so each frame
+ * is compressed on its own: no dictionary carries over from one frame to
+ * the next and a frame can be decompressed the moment it arrives.  That
+ * costs some ratio on small frames, which is why nothing under RSH_LZ_MIN
+ * bytes is compressed at all.
+ *
+ * A block is a run of sequences, each a token byte, literals, and a
+ * match to copy from earlier in the output:
+ *
+ *      token | [literal length bytes] | literals | offset (u16 LE) | [match length bytes]
+ *
+ * The high nibble of the token is the literal length, the low nibble the
+ * match length minus RSH_LZ_MINMATCH; 15 in either means more length
+ * bytes follow, each added on, until one is not 255.  The last sequence
+ * has only literals.  The compressor is the greedy single-probe one LZ4
+ * itself uses at its fastest setting: hash the next 4 bytes, look up the
+ * last place they were seen, take the match if it is real.  It goes
+ * through incompressible data faster the longer it finds nothing.
+ *
+ * The decompressor gets bytes straight off the network, so every length
+ * and offset is checked against both buffers before it is used.
+ */
+
+#define LZ_HASH_LOG         12
+#define LZ_LAST_LITERALS    5       //a block always ends in this many literals
+#define LZ_MFLIMIT          12      //no match starts closer than this to the end
+#define LZ_MAX_OFFSET       65535
+#define LZ_SKIP_TRIGGER     6       //step up the search after 2^6 misses
+
+static uint32_t lz_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+static uint8_t *lz_put_length(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Literals from anchor up to ip, then the match if mlen is not 0
+static uint8_t *lz_put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *anchor,
+                                const uint8_t *ip, uint16_t offset, size_t mlen) {
+    size_t lit = ip - anchor;
+    size_t need = 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1;
+
+    if (need > (size_t)(oend - op)) {
+        return NULL;
+    }
+
+    uint8_t *token = op++;
+    *token = (uint8_t)(((lit >= 15) ? 15 : lit) << 4);
+    if (lit >= 15) {
+        op = lz_put_length(op, lit - 15);
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    if (mlen > 0) {
+        size_t ml = mlen - RSH_LZ_MINMATCH;
+        *op++ = (uint8_t)(offset & 0xff);
+        *op++ = (uint8_t)(offset >> 8);
+        *token |= (uint8_t)((ml >= 15) ? 15 : ml);
+        if (ml >= 15) {
+            op = lz_put_length(op, ml - 15);
+        }
+    }
+    return op;
+}
+
+/*
+ * rsh_lz_compress(src, len, dst, cap)
+ *      src, len:  the data to compress
+ *      dst, cap:  where the block goes
+ *
+ *  Returns the size of the compressed block, or 0 if it would not fit in
+ *  cap bytes, in which case the data should be sent as it is.
+ */
+int rsh_lz_compress(const void *src, int len, void *dst, int cap) {
+    uint32_t table[1 << LZ_HASH_LOG];
+    const uint8_t *base = src;
+    const uint8_t *ip = base;
+    const uint8_t *anchor = base;
+    const uint8_t *end = base + len;
+    uint8_t *op = dst;
+    uint8_t *oend = op + cap;
+
+    if (len >= LZ_MFLIMIT + 1) {
+        const uint8_t *mflimit = end - LZ_MFLIMIT;
+        const uint8_t *match_limit = end - LZ_LAST_LITERALS;
+
+        memset(table, 0, sizeof(table));
+        while (ip < mflimit) {
+            uint32_t seq = lz_read32(ip);
+            uint32_t h = lz_hash(seq);
+            const uint8_t *ref = base + table[h];
+            table[h] = (uint32_t)(ip - base);
+
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != seq) {
+                ip += 1 + ((ip - anchor) >> LZ_SKIP_TRIGGER);
+                continue;
+            }
+
+            // Grow the match both ways
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *m = ip + RSH_LZ_MINMATCH;
+            const uint8_t *r = ref + RSH_LZ_MINMATCH;
+            while (m < match_limit && *m == *r) {
+                m++;
+                r++;
+            }
+
+            op = lz_put_sequence(op, oend, anchor, ip, (uint16_t)(ip - ref), m - ip);
+            if (op == NULL) {
+                return 0;
+            }
+            ip = anchor = m;
+        }
+    }
+
+    op = lz_put_sequence(op, oend, anchor, end, 0, 0);
+    return (op == NULL) ? 0 : (int)(op - (uint8_t *)dst);
+}
+
+static int lz_get_length(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+    uint8_t b;
+
+    do {
+        if (*ip >= iend) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+/*
+ * rsh_lz_decompress(src, len, dst, cap)
+ *      src, len:  a block from rsh_lz_compress(), or from the network
+ *      dst, cap:  where the data goes
+ *
+ *  Returns the size of the data, or -1 if the block is malformed or the
+ *  data would not fit in cap bytes.
+ */
+int rsh_lz_decompress(const void *src, int len, void *dst, int cap) {
+    const uint8_t *ip = src;
+    const uint8_t *iend = ip + len;
+    uint8_t *op = dst;
+    uint8_t *oend = op + cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        size_t lit = token >> 4;
+        if (lit == 15 && lz_get_length(&ip, iend, &lit) < 0) return -1;
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+
+        if (ip == iend) break;              //the last sequence has no match
+
+        if (iend - ip < 2) return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst)) return -1;
+
+        size_t mlen = token & 15;
+        if (mlen == 15 && lz_get_length(&ip, iend, &mlen) < 0) return -1;
+        mlen += RSH_LZ_MINMATCH;
+        if (mlen > (size_t)(oend - op)) return -1;
+
+        // A match may overlap what it is copying, e.g. a run of one byte
+        const uint8_t *ref = op - offset;
+        if (offset >= mlen) {
+            memcpy(op, ref, mlen);
+            op += mlen;
+        } else {
+            while (mlen-- > 0) *op++ = *ref++;
+        }
+    }
+    return (int)(op - (uint8_t *)dst);
+}
@@ -0,0 +1,367 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+/*
+ * Metrics registry.
+ *
+ * Counters and histograms are bumped on every command, from every thread
+ * the server runs, so they must not share anything that is written: each
+ * thread gets a shard of its own and only ever adds to that one, readers
+ * add the shards up.  Nothing is locked and no atomic read-modify-write
+ * is done on the hot path, a shard has exactly one writer, so a relaxed
+ * load and store is enough.
+ *
+ * A thread takes its shard on first use and hands it back when it exits,
+ * for the next thread to carry on counting in.  Shards are never freed,
+ * so the totals stay right and the threaded server, which starts a thread
+ * per client, keeps as many shards as it once had threads at the same
+ * time.
+ *
+ * Histograms have RSH_METRICS_BUCKETS log2 buckets of microseconds:
+ * bucket i counts values from 2^i to 2^(i+1) us, the last one anything
+ * above.
+ *
+ * The totals are shown by the `stats` builtin, and with -M every
+ * connection to a local socket gets them as plain text in the Prometheus
+ * exposition format and is then closed.
+ */
+
+typedef struct metrics_shard {
+    atomic_long counters[RSH_M_COUNT];
+    atomic_long hist[RSH_H_COUNT][RSH_METRICS_BUCKETS];
+    atomic_long hist_sum[RSH_H_COUNT];      //microseconds
+    atomic_bool in_use;
+    struct metrics_shard *next;
+} __attribute__((aligned(64))) metrics_shard_t;
+
+static _Atomic(metrics_shard_t *) g_shards = NULL;
+static __thread metrics_shard_t *t_shard = NULL;
+static pthread_key_t  g_shard_key;
+static pthread_once_t g_shard_once = PTHREAD_ONCE_INIT;
+
+static int       g_scrape_fd = -1;
+static pthread_t g_scrape_tid;
+
+static const char *g_counter_names[RSH_M_COUNT] = {
+    [RSH_M_CONNS]         = "rsh_connections_total",
+    [RSH_M_CONNS_CLOSED]  = "rsh_connections_closed_total",
+    [RSH_M_COMMANDS]      = "rsh_commands_total",
+    [RSH_M_BYTES_IN]      = "rsh_received_bytes_total",
+    [RSH_M_BYTES_OUT]     = "rsh_sent_bytes_total",
+    [RSH_M_SPAWNS_HELPER] = "rsh_spawns_total{via=\"spawner\"}",
+    [RSH_M_SPAWNS_DIRECT] = "rsh_spawns_total{via=\"server\"}",
+    [RSH_M_REAPED_DEAD]   = "rsh_sessions_reaped_total{why=\"dead\"}",
+    [RSH_M_REAPED_IDLE]   = "rsh_sessions_reaped_total{why=\"idle\"}",
+};
+
+static const char *g_hist_names[RSH_H_COUNT] = {
+    [RSH_H_SPAWN]   = "rsh_spawn_seconds",
+    [RSH_H_COMMAND] = "rsh_command_seconds",
+};
+
+static void shard_release(void *arg) {
+    metrics_shard_t *shard = arg;
+    atomic_store_explicit(&shard->in_use, false, memory_order_release);
+}
+
+static void shard_key_init(void) {
+    pthread_key_create(&g_shard_key, shard_release);
+}
+
+static metrics_shard_t *shard_get(void) {
+    if (t_shard != NULL) return t_shard;
+
+    pthread_once(&g_shard_once, shard_key_init);
+
+    // One left behind by a thread that has exited
+    for (metrics_shard_t *s = atomic_load(&g_shards); s != NULL; s = s->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&s->in_use, &expected, true)) {
+            t_shard = s;
+            break;
+        }
+    }
+
+    if (t_shard == NULL) {
+        metrics_shard_t *s = aligned_alloc(64, sizeof(metrics_shard_t));
+        if (s == NULL) return NULL;
+        memset(s, 0, sizeof(metrics_shard_t));
+        atomic_store(&s->in_use, true);
+        s->next = atomic_load(&g_shards);
+        while (!atomic_compare_exchange_weak(&g_shards, &s->next, s))
+            ;
+        t_shard = s;
+    }
+    pthread_setspecific(g_shard_key, t_shard);
+    return t_shard;
+}
+
+static void shard_add(atomic_long *v, long n) {
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+/*
+ * rsh_metrics_add(counter, n)
+ *      counter:  one of the RSH_M_* counters
+ */
+void rsh_metrics_add(int counter, long n) {
+    metrics_shard_t *shard = shard_get();
+    if (shard != NULL) shard_add(&shard->counters[counter], n);
+}
+
+/*
+ * rsh_metrics_observe(hist, usec)
+ *      hist:  one of the RSH_H_* histograms
+ */
+void rsh_metrics_observe(int hist, long usec) {
+    metrics_shard_t *shard = shard_get();
+    if (shard == NULL) return;
+
+    long v = usec;
+    int bucket = 0;
+    while (v > 1 && bucket < RSH_METRICS_BUCKETS - 1) {
+        v >>= 1;
+        bucket++;
+    }
+    shard_add(&shard->hist[hist][bucket], 1);
+    shard_add(&shard->hist_sum[hist], usec);
+}
+
+/*
+ * rsh_metrics_now_us()
+ *
+ *  CLOCK_MONOTONIC in microseconds, for timing what goes into a histogram.
+ */
+long rsh_metrics_now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/*
+ * rsh_metrics_read(counter)
+ *
+ *  Returns the counter summed over every shard.
+ */
+long rsh_metrics_read(int counter) {
+    long total = 0;
+
+    for (metrics_shard_t *s = atomic_load(&g_shards); s != NULL; s = s->next) {
+        total += atomic_load_explicit(&s->counters[counter], memory_order_relaxed);
+    }
+    return total;
+}
+
+/*
+ * rsh_metrics_hist(hist, buckets, sum)
+ *      buckets:  RSH_METRICS_BUCKETS counts, filled in
+ *      sum:      if not NULL, the sum of the values in microseconds
+ *
+ *  Returns the number of values, summed over every shard.
+ */
+long rsh_metrics_hist(int hist, long buckets[], long *sum) {
+    long total = 0;
+
+    memset(buckets, 0, RSH_METRICS_BUCKETS * sizeof(long));
+    if (sum != NULL) *sum = 0;
+    for (metrics_shard_t *s = atomic_load(&g_shards); s != NULL; s = s->next) {
+        for (int i = 0; i < RSH_METRICS_BUCKETS; i++) {
+            long n = atomic_load_explicit(&s->hist[hist][i], memory_order_relaxed);
+            buckets[i] += n;
+            total += n;
+        }
+        if (sum != NULL) {
+            *sum += atomic_load_explicit(&s->hist_sum[hist], memory_order_relaxed);
+        }
+    }
+    return total;
+}
+
+/*
+ * rsh_metrics_percentile(buckets, total, pct)
+ *
+ *  Returns the top of the bucket the pct percentile falls in, in
+ *  microseconds, or 0 for an empty histogram.
+ */
+long rsh_metrics_percentile(const long buckets[], long total, int pct) {
+    long seen = 0;
+
+    for (int i = 0; i < RSH_METRICS_BUCKETS && total > 0; i++) {
+        seen += buckets[i];
+        if (seen * 100 >= total * pct) return 2L << i;
+    }
+    return 0;
+}
+
+/*
+ * rsh_metrics_stats(out_fd)
+ *
+ *  Prints connection and command totals, the sessions the timeouts
+ *  reaped and the command duration percentiles for `stats`.
+ *
+ *  Returns 0.
+ */
+int rsh_metrics_stats(int out_fd) {
+    long buckets[RSH_METRICS_BUCKETS];
+    long conns = rsh_metrics_read(RSH_M_CONNS);
+
+    dprintf(out_fd, "connections: %ld accepted, %ld open\n",
+            conns, conns - rsh_metrics_read(RSH_M_CONNS_CLOSED));
+    dprintf(out_fd, "sessions reaped: %ld dead, %ld idle\n",
+            rsh_metrics_read(RSH_M_REAPED_DEAD), rsh_metrics_read(RSH_M_REAPED_IDLE));
+    dprintf(out_fd, "commands: %ld, %ld bytes in, %ld bytes out\n",
+            rsh_metrics_read(RSH_M_COMMANDS), rsh_metrics_read(RSH_M_BYTES_IN),
+            rsh_metrics_read(RSH_M_BYTES_OUT));
+
+    long total = rsh_metrics_hist(RSH_H_COMMAND, buckets, NULL);
+    if (total > 0) {
+        dprintf(out_fd, "command duration: p50 < %ld us, p99 < %ld us\n",
+                rsh_metrics_percentile(buckets, total, 50),
+                rsh_metrics_percentile(buckets, total, 99));
+    }
+    return 0;
+}
+
+/*
+ * rsh_metrics_write(out_fd)
+ *
+ *  Writes every metric in the Prometheus text exposition format.
+ *
+ *  Returns 0.
+ */
+int rsh_metrics_write(int out_fd) {
+    long buckets[RSH_METRICS_BUCKETS];
+    long sum;
+
+    for (int i = 0; i < RSH_M_COUNT; i++) {
+        // Both spawn counters are one metric with a label, so are both reaped
+        if (i != RSH_M_SPAWNS_DIRECT && i != RSH_M_REAPED_IDLE) {
+            int len = strcspn(g_counter_names[i], "{");
+            dprintf(out_fd, "# TYPE %.*s counter\n", len, g_counter_names[i]);
+        }
+        dprintf(out_fd, "%s %ld\n", g_counter_names[i], rsh_metrics_read(i));
+    }
+
+    long conns = rsh_metrics_read(RSH_M_CONNS);
+    dprintf(out_fd, "# TYPE rsh_connections_open gauge\n");
+    dprintf(out_fd, "rsh_connections_open %ld\n", conns - rsh_metrics_read(RSH_M_CONNS_CLOSED));
+    dprintf(out_fd, "# TYPE rsh_stages_running gauge\n");
+    dprintf(out_fd, "rsh_stages_running %d\n", rsh_limits_running());
+
+    for (int h = 0; h < RSH_H_COUNT; h++) {
+        long total = rsh_metrics_hist(h, buckets, &sum);
+        long seen = 0;
+
+        dprintf(out_fd, "# TYPE %s histogram\n", g_hist_names[h]);
+        for (int i = 0; i < RSH_METRICS_BUCKETS - 1; i++) {
+            seen += buckets[i];
+            dprintf(out_fd, "%s_bucket{le=\"%.6f\"} %ld\n", g_hist_names[h],
+                    (double)(2L << i) / 1e6, seen);
+        }
+        dprintf(out_fd, "%s_bucket{le=\"+Inf\"} %ld\n", g_hist_names[h], total);
+        dprintf(out_fd, "%s_sum %.6f\n", g_hist_names[h], (double)sum / 1e6);
+        dprintf(out_fd, "%s_count %ld\n", g_hist_names[h], total);
+    }
+    return 0;
+}
+
+static void *scrape_thread(void *arg) {
+    (void)arg;
+
+    while (1) {
+        int sock = accept4(g_scrape_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;                  //rsh_metrics_stop() shut the socket down
+        }
+        rsh_metrics_write(sock);
+        close(sock);
+    }
+    return NULL;
+}
+
+/*
+ * rsh_metrics_serve(addr)
+ *      addr:  a port number, served on 127.0.0.1, or a Unix socket path
+ *             or @name as for -i
+ *
+ *  Starts a thread answering scrapes on addr.  Nothing is read from the
+ *  scraper, the metrics are written as soon as it connects.
+ *
+ *  Returns OK, or ERR_RDSH_SERVER if the socket could not be set up.
+ */
+int rsh_metrics_serve(const char *addr) {
+    struct sockaddr_storage ss;
+    const char *host = addr;
+    int port = 0;
+    int enable = 1;
+
+    if (strspn(addr, "0123456789") == strlen(addr)) {
+        host = "127.0.0.1";
+        port = atoi(addr);
+    }
+    int len = rsh_sockaddr(host, port, &ss);
+    if (len < 0) {
+        fprintf(stderr, "metrics: bad address %s\n", addr);
+        return ERR_RDSH_SERVER;
+    }
+
+    g_scrape_fd = socket(ss.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (g_scrape_fd < 0) {
+        perror("metrics socket");
+        return ERR_RDSH_SERVER;
+    }
+    setsockopt(g_scrape_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    if (ss.ss_family == AF_UNIX && ((struct sockaddr_un *)&ss)->sun_path[0] != '\0') {
+        unlink(((struct sockaddr_un *)&ss)->sun_path);
+    }
+    if (bind(g_scrape_fd, (struct sockaddr *)&ss, len) < 0 || listen(g_scrape_fd, 16) < 0 ||
+        pthread_create(&g_scrape_tid, NULL, scrape_thread, NULL) != 0) {
+        perror("metrics");
+        close(g_scrape_fd);
+        g_scrape_fd = -1;
+        return ERR_RDSH_SERVER;
+    }
+    printf("Serving metrics on %s\n", addr);
+    return OK;
+}
+
+/*
+ * rsh_metrics_stop()
+ *
+ *  Stops the scrape thread, if there is one.
+ */
+void rsh_metrics_stop(void) {
+    struct sockaddr_un addr;
+    socklen_t addr_len = sizeof(addr);
+
+    if (g_scrape_fd < 0) return;
+
+    // shutdown() wakes the thread out of accept(), close() wouldn't
+    shutdown(g_scrape_fd, SHUT_RDWR);
+    pthread_join(g_scrape_tid, NULL);
+
+    if (getsockname(g_scrape_fd, (struct sockaddr *)&addr, &addr_len) == 0 &&
+        addr.sun_family == AF_UNIX && addr_len > offsetof(struct sockaddr_un, sun_path) &&
+        addr.sun_path[0] != '\0') {
+        unlink(addr.sun_path);
+    }
+    close(g_scrape_fd);
+    g_scrape_fd = -1;
+}
@@ -0,0 +1,730 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+/*
+ * Work-stealing worker pool server (dsh -s -w).
+ *
+ * A fixed set of workers (one per CPU unless -n says otherwise) runs
+ * every client session.  Nothing is created per connection except the
+ * session itself.
+ *
+ * Work is split into small tasks:
+ *
+ *      session read   recv whatever the client sent, split off the next
+ *                     CMD frame and parse it
+ *      command exec   run a parsed command, send its output and END frame
+ *
+ * Each worker owns a Chase-Lev deque.  It pushes and pops tasks at the
+ * bottom (LIFO, so a command usually runs on the worker that just parsed
+ * it), while idle workers steal from the top of somebody else's deque.
+ * Only the owner touches the bottom, so the common path is a couple of
+ * plain loads and stores and thieves only pay a CAS.
+ *
+ * The main thread is the acceptor.  It owns no deque; it watches the
+ * listening socket and every idle session with epoll and hands a session
+ * read task to the pool through a mutex protected injector queue when the
+ * client sends something.  Sessions are registered with EPOLLONESHOT, so
+ * a session is disarmed while one of its tasks is queued or running and
+ * only ever has one task in flight; session state therefore needs no lock.
+ * It also means a session's commands run one after another: a client that
+ * sends several CMD frames without waiting still gets correct, tagged
+ * replies, just not concurrently.
+ *
+ * Workers with nothing to run or steal sleep on a condition variable.
+ * Anyone who queues work checks the idle count afterwards and wakes a
+ * sleeper if there is one.
+ *
+ * Heartbeats and idle timeouts (see rsh_timer.c) run in the acceptor too,
+ * off one timer wheel with a timer per session.  A session's timer may
+ * fire while a worker has it, so the acceptor only touches sessions that
+ * aren't busy, i.e. are parked in epoll, and then never closes them
+ * itself: it shuts the socket down and the read task that the hangup
+ * wakes closes the session the usual way.  The wheel has a mutex only
+ * because session_close() on a worker has to take the timer off it.
+ */
+
+typedef struct pool_task {
+    void (*fn)(struct pool_task *task);
+    struct pool_task *next;             //injector queue link
+} pool_task_t;
+
+// Chase-Lev deque, see Le et al. "Correct and Efficient Work-Stealing for
+// Weak Memory Models" (PPoPP '13).  Fixed size; when it is full the task
+// goes to the injector instead.
+typedef struct pool_deque {
+    atomic_long top;
+    atomic_long bottom;
+    _Atomic(pool_task_t *) buf[RSH_POOL_DEQUE_SZ];
+} pool_deque_t;
+
+typedef struct pool_worker {
+    int          id;
+    pthread_t    tid;
+    pool_deque_t deque;
+    unsigned int seed;                  //victim selection
+
+    // Counters, only written by the owner, read by `stats`
+    atomic_long  executed;
+    atomic_long  local;                 //popped from our own deque
+    atomic_long  stolen;                //taken from another worker
+    atomic_long  steal_fail;            //lost a race with the owner/thief
+    atomic_long  injected;              //taken from the injector
+    atomic_long  max_depth;
+} pool_worker_t;
+
+typedef struct rsh_session {
+    int            sock;
+    atomic_bool    busy;            //a task is queued or running, not in epoll
+    rsh_live_t     live;            //heartbeat and idle timeout
+    int            last_rc;
+    rsh_shell_t    shell;           //cwd and environment, any worker may run it
+    int            in_len;
+    uint32_t       in_skip;         //bytes left of a frame too big to buffer
+    uint32_t       stream;          //stream id of the running command
+    uint16_t       flags;           //and the flags of its CMD frame
+    command_list_t cmd_list;
+    pool_task_t    read_task;
+    pool_task_t    exec_task;
+    char           in_buf[RSH_SESSION_INBUF];
+} rsh_session_t;
+
+static pool_worker_t  *g_workers = NULL;
+static int             g_nworkers = 0;
+static __thread pool_worker_t *t_self = NULL;
+
+static pthread_mutex_t g_inject_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_inject_cond = PTHREAD_COND_INITIALIZER;
+static pool_task_t    *g_inject_head = NULL;
+static pool_task_t    *g_inject_tail = NULL;
+static long            g_inject_depth = 0;
+static atomic_int      g_idle = 0;
+static atomic_bool     g_pool_stop = false;
+
+static int             g_epfd = -1;
+static int             g_wake_fd = -1;
+static atomic_long     g_sessions = 0;
+static atomic_long     g_accepted = 0;
+
+static pthread_mutex_t g_wheel_mutex = PTHREAD_MUTEX_INITIALIZER;
+static rsh_wheel_t     g_wheel;
+
+// epoll data for the two descriptors that aren't sessions
+static char g_listen_tag, g_wake_tag;
+
+/**************   deque   ***************/
+
+static bool deque_push(pool_deque_t *d, pool_task_t *task) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    if (b - t >= RSH_POOL_DEQUE_SZ) {
+        return false;
+    }
+    atomic_store_explicit(&d->buf[b & (RSH_POOL_DEQUE_SZ - 1)], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return true;
+}
+
+static pool_task_t *deque_pop(pool_deque_t *d) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+    if (t > b) {
+        // Empty
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    pool_task_t *task = atomic_load_explicit(&d->buf[b & (RSH_POOL_DEQUE_SZ - 1)], memory_order_relaxed);
+    if (t == b) {
+        // Last one, race any thief for it
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                memory_order_seq_cst, memory_order_relaxed)) {
+            task = NULL;
+        }
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+// Returns NULL if empty, sets *lost if we raced someone and lost
+static pool_task_t *deque_steal(pool_deque_t *d, bool *lost) {
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+
+    if (t >= b) {
+        return NULL;
+    }
+
+    pool_task_t *task = atomic_load_explicit(&d->buf[t & (RSH_POOL_DEQUE_SZ - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+            memory_order_seq_cst, memory_order_relaxed)) {
+        *lost = true;
+        return NULL;
+    }
+    return task;
+}
+
+static long deque_depth(pool_deque_t *d) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    return (b > t) ? b - t : 0;
+}
+
+/**************   pool   ***************/
+
+static void pool_wake_one(void) {
+    if (atomic_load(&g_idle) > 0) {
+        pthread_mutex_lock(&g_inject_mutex);
+        pthread_cond_signal(&g_inject_cond);
+        pthread_mutex_unlock(&g_inject_mutex);
+    }
+}
+
+/*
+ * Queues a task from outside the pool (the acceptor).
+ */
+static void pool_inject(pool_task_t *task) {
+    task->next = NULL;
+    pthread_mutex_lock(&g_inject_mutex);
+    if (g_inject_tail != NULL) g_inject_tail->next = task;
+    else g_inject_head = task;
+    g_inject_tail = task;
+    g_inject_depth++;
+    pthread_cond_signal(&g_inject_cond);
+    pthread_mutex_unlock(&g_inject_mutex);
+}
+
+static pool_task_t *pool_take_injected_locked(void) {
+    pool_task_t *task = g_inject_head;
+    if (task != NULL) {
+        g_inject_head = task->next;
+        if (g_inject_head == NULL) g_inject_tail = NULL;
+        g_inject_depth--;
+    }
+    return task;
+}
+
+/*
+ * Queues a task on the calling worker's own deque.  Falls back to the
+ * injector when called from outside the pool or when the deque is full.
+ */
+static void pool_push(pool_task_t *task) {
+    pool_worker_t *w = t_self;
+
+    if (w == NULL || !deque_push(&w->deque, task)) {
+        pool_inject(task);
+        return;
+    }
+
+    long depth = deque_depth(&w->deque);
+    if (depth > atomic_load_explicit(&w->max_depth, memory_order_relaxed)) {
+        atomic_store_explicit(&w->max_depth, depth, memory_order_relaxed);
+    }
+
+    // Somebody idle can steal it while we are busy
+    atomic_thread_fence(memory_order_seq_cst);
+    pool_wake_one();
+}
+
+static pool_task_t *pool_try_steal(pool_worker_t *w) {
+    if (g_nworkers < 2) return NULL;
+
+    int start = rand_r(&w->seed) % g_nworkers;
+    for (int i = 0; i < g_nworkers; i++) {
+        pool_worker_t *victim = &g_workers[(start + i) % g_nworkers];
+        if (victim == w) continue;
+
+        bool lost = false;
+        pool_task_t *task = deque_steal(&victim->deque, &lost);
+        if (task != NULL) {
+            atomic_fetch_add_explicit(&w->stolen, 1, memory_order_relaxed);
+            return task;
+        }
+        if (lost) {
+            atomic_fetch_add_explicit(&w->steal_fail, 1, memory_order_relaxed);
+        }
+    }
+    return NULL;
+}
+
+static bool pool_any_queued(void) {
+    for (int i = 0; i < g_nworkers; i++) {
+        if (deque_depth(&g_workers[i].deque) > 0) return true;
+    }
+    return false;
+}
+
+static pool_task_t *pool_next_task(pool_worker_t *w) {
+    while (!atomic_load(&g_pool_stop)) {
+        pool_task_t *task = deque_pop(&w->deque);
+        if (task != NULL) {
+            atomic_fetch_add_explicit(&w->local, 1, memory_order_relaxed);
+            return task;
+        }
+
+        if ((task = pool_try_steal(w)) != NULL) {
+            return task;
+        }
+
+        pthread_mutex_lock(&g_inject_mutex);
+        task = pool_take_injected_locked();
+        if (task == NULL) {
+            // Announce ourselves before the last look so a concurrent
+            // pool_push() either sees us idle or we see its task
+            atomic_fetch_add(&g_idle, 1);
+            if (!pool_any_queued() && !atomic_load(&g_pool_stop)) {
+                pthread_cond_wait(&g_inject_cond, &g_inject_mutex);
+            }
+            atomic_fetch_sub(&g_idle, 1);
+            task = pool_take_injected_locked();
+        }
+        pthread_mutex_unlock(&g_inject_mutex);
+
+        if (task != NULL) {
+            atomic_fetch_add_explicit(&w->injected, 1, memory_order_relaxed);
+            return task;
+        }
+    }
+    return NULL;
+}
+
+static void *pool_worker_main(void *arg) {
+    pool_worker_t *w = (pool_worker_t *)arg;
+    pool_task_t *task;
+
+    t_self = w;
+    while ((task = pool_next_task(w)) != NULL) {
+        task->fn(task);
+        atomic_fetch_add_explicit(&w->executed, 1, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+/**************   sessions   ***************/
+
+static void session_close(rsh_session_t *s) {
+    pthread_mutex_lock(&g_wheel_mutex);
+    rsh_timer_cancel(&g_wheel, &s->live.timer);
+    pthread_mutex_unlock(&g_wheel_mutex);
+
+    epoll_ctl(g_epfd, EPOLL_CTL_DEL, s->sock, NULL);
+    close(s->sock);
+    rsh_shell_free(&s->shell);
+    free(s);
+    atomic_fetch_sub(&g_sessions, 1);
+    rsh_metrics_add(RSH_M_CONNS_CLOSED, 1);
+    printf(RCMD_MSG_CLIENT_EXITED);
+}
+
+static void session_arm(rsh_session_t *s) {
+    struct epoll_event ev;
+
+    // Done with the socket, the acceptor's timer may have it from here
+    atomic_store(&s->busy, false);
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = s;
+    if (epoll_ctl(g_epfd, EPOLL_CTL_MOD, s->sock, &ev) < 0) {
+        perror("epoll_ctl");
+        session_close(s);
+    }
+}
+
+static void server_stop(void) {
+    printf(RCMD_MSG_SVR_STOP_REQ);
+    g_server_should_exit = 1;
+    uint64_t one = 1;
+    ssize_t unused = write(g_wake_fd, &one, sizeof(one));
+    (void)unused;
+}
+
+static void session_read_task(pool_task_t *task);
+
+static void session_exec_task(pool_task_t *task) {
+    rsh_session_t *s = (rsh_session_t *)((char *)task - offsetof(rsh_session_t, exec_task));
+
+    int cmd_rc = rsh_execute_pipeline(s->sock, &s->shell, &s->cmd_list, s->last_rc, s->stream,
+                                      s->flags);
+    free_cmd_list(&s->cmd_list);
+    rsh_live_active(&s->live, rsh_timer_now_ms());
+
+    if (cmd_rc == ERR_RDSH_COMMUNICATION) {
+        session_close(s);
+        return;
+    }
+    int rc = rsh_send_end(s->sock, s->stream, (cmd_rc >= 0) ? cmd_rc : 1);
+    if (rc != OK || cmd_rc == EXIT_SC) {
+        session_close(s);
+        return;
+    }
+    if (cmd_rc == STOP_SERVER_SC) {
+        session_close(s);
+        server_stop();
+        return;
+    }
+    if (cmd_rc >= 0) {
+        s->last_rc = cmd_rc;
+    }
+
+    // More may be buffered already, look before going back to epoll
+    s->read_task.fn = session_read_task;
+    pool_push(&s->read_task);
+}
+
+/*
+ * Pulls the next complete frame out of in_buf.  Returns OK once a
+ * command is ready to run in s->cmd_list, WARN_NO_CMDS if nothing is
+ * ready, or OK_EXIT if the session is finished.
+ */
+static int session_next_command(rsh_session_t *s) {
+    char error_msg[100];
+    rsh_frame_hdr_t hdr;
+
+    while (1) {
+        // Drop the rest of a frame that didn't fit in in_buf
+        if (s->in_skip > 0) {
+            int n = (s->in_skip < (uint32_t)s->in_len) ? (int)s->in_skip : s->in_len;
+            s->in_skip -= n;
+            s->in_len -= n;
+            memmove(s->in_buf, s->in_buf + n, s->in_len);
+            if (s->in_skip > 0) return WARN_NO_CMDS;
+        }
+
+        int total = rsh_frame_parse(s->in_buf, s->in_len, &hdr);
+        if (total < 0) {
+            return OK_EXIT;                 //can't resync, drop the client
+        } else if (total == 0) {
+            return WARN_NO_CMDS;
+        } else if (total > RSH_SESSION_INBUF) {
+            if (hdr.type == RSH_FRAME_CMD) {
+                rsh_send_reply(s->sock, hdr.stream, CMD_ERR_RDSH_TOO_LONG, 1);
+            }
+            s->in_skip = total;
+            continue;
+        } else if (total > s->in_len) {
+            return WARN_NO_CMDS;
+        }
+
+        char cmd_line[RSH_SESSION_INBUF];
+        memcpy(cmd_line, s->in_buf + RSH_FRAME_HDR_SZ, hdr.len);
+        cmd_line[hdr.len] = '\0';
+        s->in_len -= total;
+        memmove(s->in_buf, s->in_buf + total, s->in_len);
+
+        if (hdr.type == RSH_FRAME_HELLO) {
+            rsh_send_frame_flags(s->sock, RSH_FRAME_HELLO, hdr.flags & RSH_HELLO_LZ, 0, NULL, 0);
+            continue;
+        } else if (hdr.type != RSH_FRAME_CMD) {
+            continue;
+        }
+        s->stream = hdr.stream;
+        s->flags = hdr.flags;
+        rsh_live_active(&s->live, rsh_timer_now_ms());
+
+        if (g_server_verbose) {
+            printf(RCMD_MSG_SVR_EXEC_REQ, cmd_line);
+        }
+
+        if (strcmp(cmd_line, EXIT_CMD) == 0) {
+            rsh_send_reply(s->sock, s->stream, "exiting...\n", 0);
+            return OK_EXIT;
+        }
+        if (strcmp(cmd_line, "stop-server") == 0) {
+            rsh_send_reply(s->sock, s->stream, "stopping server...\n", 0);
+            server_stop();
+            return OK_EXIT;
+        }
+
+        memset(&s->cmd_list, 0, sizeof(command_list_t));
+        int rc = build_cmd_list(cmd_line, &s->cmd_list);
+        if (rc == OK) {
+            return OK;
+        }
+
+        if (rc == WARN_NO_CMDS) {
+            rsh_send_reply(s->sock, s->stream, CMD_WARN_NO_CMD, 0);
+        } else if (rc == ERR_TOO_MANY_COMMANDS) {
+            snprintf(error_msg, sizeof(error_msg), CMD_ERR_PIPE_LIMIT, CMD_MAX);
+            rsh_send_reply(s->sock, s->stream, error_msg, 1);
+        } else {
+            snprintf(error_msg, sizeof(error_msg), "Error parsing command: %d\n", rc);
+            rsh_send_reply(s->sock, s->stream, error_msg, 1);
+        }
+    }
+}
+
+static void session_read_task(pool_task_t *task) {
+    rsh_session_t *s = (rsh_session_t *)((char *)task - offsetof(rsh_session_t, read_task));
+    bool peer_closed = false;
+
+    // The socket stays blocking for the commands we run, so only this
+    // read is nonblocking
+    while (s->in_len < RSH_SESSION_INBUF) {
+        ssize_t n = recv(s->sock, s->in_buf + s->in_len, RSH_SESSION_INBUF - s->in_len, MSG_DONTWAIT);
+        if (n > 0) {
+            s->in_len += n;
+            rsh_metrics_add(RSH_M_BYTES_IN, n);
+            rsh_live_rx(&s->live, rsh_timer_now_ms());
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            peer_closed = (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK));
+            break;
+        }
+    }
+
+    int rc = session_next_command(s);
+    if (rc == OK) {
+        s->exec_task.fn = session_exec_task;
+        pool_push(&s->exec_task);
+    } else if (rc == OK_EXIT || peer_closed) {
+        session_close(s);
+    } else {
+        session_arm(s);
+    }
+}
+
+/**************   acceptor   ***************/
+
+/*
+ * A session's timer fired, called with g_wheel_mutex held.  A busy
+ * session just gets its timer back.
+ */
+static void session_check_live(rsh_session_t *s, long now) {
+    long next;
+
+    int live_rc = rsh_live_check(&s->live, now, atomic_load(&s->busy), &next);
+    if (live_rc == RSH_LIVE_PING) {
+        rsh_send_frame_nowait(s->sock, RSH_FRAME_PING, 0, NULL, 0);
+    } else if (live_rc == RSH_LIVE_DEAD || live_rc == RSH_LIVE_IDLE) {
+        if (live_rc == RSH_LIVE_IDLE) {
+            rsh_send_frame_nowait(s->sock, RSH_FRAME_STDERR, 0, CMD_ERR_RDSH_IDLE,
+                                  strlen(CMD_ERR_RDSH_IDLE));
+        }
+        rsh_metrics_add((live_rc == RSH_LIVE_DEAD) ? RSH_M_REAPED_DEAD : RSH_M_REAPED_IDLE, 1);
+        shutdown(s->sock, SHUT_RDWR);
+        return;
+    }
+    if (next > 0) {
+        rsh_timer_arm(&g_wheel, &s->live.timer, next);
+    }
+}
+
+static void pool_accept(int svr_socket) {
+    while (1) {
+        int sock = accept4(svr_socket, NULL, NULL, SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+                errno != ECONNABORTED) {
+                perror("accept");
+            }
+            return;
+        }
+        rsh_sock_nodelay(sock);
+        rsh_timeouts_sock(sock);
+
+        rsh_session_t *s = calloc(1, sizeof(rsh_session_t));
+        if (s == NULL) {
+            close(sock);
+            continue;
+        }
+        s->sock = sock;
+        s->read_task.fn = session_read_task;
+        rsh_shell_init(&s->shell);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        ev.data.ptr = s;
+        if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+            perror("epoll_ctl");
+            close(sock);
+            rsh_shell_free(&s->shell);
+            free(s);
+            continue;
+        }
+        atomic_fetch_add(&g_sessions, 1);
+        atomic_fetch_add(&g_accepted, 1);
+        rsh_metrics_add(RSH_M_CONNS, 1);
+
+        long now = rsh_timer_now_ms();
+        pthread_mutex_lock(&g_wheel_mutex);
+        rsh_live_init(&s->live, now);
+        session_check_live(s, now);
+        pthread_mutex_unlock(&g_wheel_mutex);
+    }
+}
+
+/*
+ * rsh_pool_run(svr_socket, nthreads)
+ *      svr_socket:  listening socket from boot_server()
+ *      nthreads:    number of workers, 0 means one per CPU
+ *
+ *  Serves clients until one of them sends `stop-server`.  Workers finish
+ *  the command they are running before the pool shuts down.
+ *
+ *  Returns:
+ *      OK_EXIT:          the server was asked to stop
+ *      ERR_RDSH_SERVER:  the pool could not be set up
+ */
+int rsh_pool_run(int svr_socket, int nthreads) {
+    struct epoll_event events[RSH_REACTOR_EVENTS];
+    int rc = OK_EXIT;
+    int started = 0;
+
+    if (nthreads <= 0) nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0) nthreads = 1;
+    if (nthreads > RSH_MAX_THREADS) nthreads = RSH_MAX_THREADS;
+
+    g_epfd = epoll_create1(EPOLL_CLOEXEC);
+    g_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    g_workers = calloc(nthreads, sizeof(pool_worker_t));
+    if (g_epfd < 0 || g_wake_fd < 0 || g_workers == NULL) {
+        perror("rsh_pool_run");
+        rc = ERR_RDSH_SERVER;
+        goto out;
+    }
+
+    int flags = fcntl(svr_socket, F_GETFL);
+    fcntl(svr_socket, F_SETFL, flags | O_NONBLOCK);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &g_listen_tag;
+    epoll_ctl(g_epfd, EPOLL_CTL_ADD, svr_socket, &ev);
+    ev.data.ptr = &g_wake_tag;
+    epoll_ctl(g_epfd, EPOLL_CTL_ADD, g_wake_fd, &ev);
+
+    atomic_store(&g_pool_stop, false);
+    for (started = 0; started < nthreads; started++) {
+        pool_worker_t *w = &g_workers[started];
+        w->id = started;
+        w->seed = (unsigned int)(started * 2654435761u + 1);
+        g_nworkers = started + 1;
+        if (pthread_create(&w->tid, NULL, pool_worker_main, w) != 0) {
+            perror("pthread_create");
+            g_nworkers = started;
+            break;
+        }
+    }
+    if (started == 0) {
+        rc = ERR_RDSH_SERVER;
+        goto out;
+    }
+
+    printf("worker pool threads: %d\n", started);
+    fflush(stdout);
+
+    rsh_wheel_init(&g_wheel, rsh_timer_now_ms());
+    while (!g_server_should_exit) {
+        pthread_mutex_lock(&g_wheel_mutex);
+        int timeout = rsh_wheel_timeout(&g_wheel, rsh_timer_now_ms());
+        pthread_mutex_unlock(&g_wheel_mutex);
+
+        int n = epoll_wait(g_epfd, events, RSH_REACTOR_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            rc = ERR_RDSH_COMMUNICATION;
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &g_listen_tag) {
+                pool_accept(svr_socket);
+            } else if (tag != &g_wake_tag) {
+                rsh_session_t *s = (rsh_session_t *)tag;
+                atomic_store(&s->busy, true);
+                s->read_task.fn = session_read_task;
+                pool_inject(&s->read_task);
+            }
+        }
+
+        long now = rsh_timer_now_ms();
+        pthread_mutex_lock(&g_wheel_mutex);
+        rsh_timer_t *due = rsh_wheel_expire(&g_wheel, now);
+        while (due != NULL) {
+            rsh_timer_t *next = due->next;
+            due->next = NULL;
+            session_check_live((rsh_session_t *)((char *)due - offsetof(rsh_session_t, live.timer)),
+                               now);
+            due = next;
+        }
+        pthread_mutex_unlock(&g_wheel_mutex);
+    }
+
+    pthread_mutex_lock(&g_inject_mutex);
+    atomic_store(&g_pool_stop, true);
+    pthread_cond_broadcast(&g_inject_cond);
+    pthread_mutex_unlock(&g_inject_mutex);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(g_workers[i].tid, NULL);
+    }
+
+out:
+    g_nworkers = 0;
+    free(g_workers);
+    g_workers = NULL;
+    if (g_wake_fd >= 0) close(g_wake_fd);
+    if (g_epfd >= 0) close(g_epfd);
+    g_wake_fd = g_epfd = -1;
+    return rc;
+}
+
+/*
+ * rsh_pool_stats(out_fd)
+ *
+ *  Prints the pool size, per-worker queue depths and task/steal counters
+ *  for the `stats` builtin.
+ *
+ *  Returns 0.
+ */
+int rsh_pool_stats(int out_fd) {
+    pthread_mutex_lock(&g_inject_mutex);
+    long inject_depth = g_inject_depth;
+    pthread_mutex_unlock(&g_inject_mutex);
+
+    dprintf(out_fd, "pool: %d workers, %d idle, %ld sessions (%ld accepted), injector depth %ld\n",
+            g_nworkers, atomic_load(&g_idle), atomic_load(&g_sessions),
+            atomic_load(&g_accepted), inject_depth);
+    dprintf(out_fd, "%6s %6s %9s %9s %9s %9s %9s %9s\n", "worker", "depth", "max-depth",
+            "executed", "local", "stolen", "steal-cas", "injected");
+
+    long total_exec = 0, total_stolen = 0;
+    for (int i = 0; i < g_nworkers; i++) {
+        pool_worker_t *w = &g_workers[i];
+        long executed = atomic_load_explicit(&w->executed, memory_order_relaxed);
+        long stolen = atomic_load_explicit(&w->stolen, memory_order_relaxed);
+
+        dprintf(out_fd, "%6d %6ld %9ld %9ld %9ld %9ld %9ld %9ld\n", w->id,
+                deque_depth(&w->deque),
+                atomic_load_explicit(&w->max_depth, memory_order_relaxed),
+                executed,
+                atomic_load_explicit(&w->local, memory_order_relaxed),
+                stolen,
+                atomic_load_explicit(&w->steal_fail, memory_order_relaxed),
+                atomic_load_explicit(&w->injected, memory_order_relaxed));
+        total_exec += executed;
+        total_stolen += stolen;
+    }
+    dprintf(out_fd, "%6s %6s %9s %9ld %9s %9ld\n", "total", "", "", total_exec, "", total_stolen);
+    return 0;
+}
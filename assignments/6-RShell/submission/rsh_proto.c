@@ -0,0 +1,773 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/sockios.h>
+#include <fcntl.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+/*
+ * Framing for the rsh protocol, shared by the client and every server
+ * mode.  See the frame layout in rshlib.h.
+ *
+ * Blocking callers use rsh_send_frame() and rsh_recv_frame(), which keep
+ * going across short reads and writes until a whole frame has moved.  The
+ * event-driven server reads into its own buffer and uses
+ * rsh_frame_parse() to see whether a complete frame has arrived yet.
+ */
+
+/*
+ * rsh_frame_pack(hdr, type, flags, stream, len)
+ *
+ *  Writes a RSH_FRAME_HDR_SZ byte header into hdr.
+ */
+void rsh_frame_pack(char *hdr, int type, uint16_t flags, uint32_t stream, uint32_t len) {
+    uint16_t n_flags = htons(flags);
+    uint32_t n_stream = htonl(stream);
+    uint32_t n_len = htonl(len);
+
+    hdr[0] = RSH_PROTO_VERSION;
+    hdr[1] = (char)type;
+    memcpy(hdr + 2, &n_flags, 2);
+    memcpy(hdr + 4, &n_stream, 4);
+    memcpy(hdr + 8, &n_len, 4);
+}
+
+/*
+ * rsh_frame_parse(buff, len, hdr)
+ *      buff, len:  bytes received so far
+ *      hdr:        receives the decoded header
+ *
+ *  Returns:
+ *      0:                  not even a full header yet
+ *      > 0:                size of the header plus payload; the frame is
+ *                          complete once len reaches it
+ *      ERR_RDSH_PROTOCOL:  wrong version or a payload over RSH_FRAME_MAX
+ */
+int rsh_frame_parse(const char *buff, size_t len, rsh_frame_hdr_t *hdr) {
+    uint16_t n_flags;
+    uint32_t n_stream, n_len;
+
+    if (len < RSH_FRAME_HDR_SZ) {
+        return 0;
+    }
+
+    hdr->version = (uint8_t)buff[0];
+    hdr->type = (uint8_t)buff[1];
+    memcpy(&n_flags, buff + 2, 2);
+    memcpy(&n_stream, buff + 4, 4);
+    memcpy(&n_len, buff + 8, 4);
+    hdr->flags = ntohs(n_flags);
+    hdr->stream = ntohl(n_stream);
+    hdr->len = ntohl(n_len);
+
+    if (hdr->version != RSH_PROTO_VERSION || hdr->len > RSH_FRAME_MAX) {
+        return ERR_RDSH_PROTOCOL;
+    }
+    return RSH_FRAME_HDR_SZ + (int)hdr->len;
+}
+
+static int send_all_iov(int sock, struct iovec *iov, int iovcnt, int flags) {
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    while (iovcnt > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+
+        ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL | flags);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return ERR_RDSH_COMMUNICATION;
+        }
+
+        // Skip whatever went out, possibly part way into an iovec
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return OK;
+}
+
+static int send_frame(int sock, int type, uint16_t flags, uint32_t stream,
+                      const void *payload, uint32_t len) {
+    char hdr[RSH_FRAME_HDR_SZ];
+    struct iovec iov[2];
+
+    rsh_frame_pack(hdr, type, flags, stream, len);
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = RSH_FRAME_HDR_SZ;
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = len;
+
+    return send_all_iov(sock, iov, (len > 0) ? 2 : 1, 0);
+}
+
+/*
+ * rsh_send_frame(sock, type, stream, payload, len)
+ *
+ *  Sends one frame; header and payload go out in a single sendmsg() when
+ *  the socket has room.
+ *
+ *  Returns OK or ERR_RDSH_COMMUNICATION.
+ */
+int rsh_send_frame(int sock, int type, uint32_t stream, const void *payload, uint32_t len) {
+    return send_frame(sock, type, 0, stream, payload, len);
+}
+
+/*
+ * rsh_send_frame_flags(sock, type, flags, stream, payload, len)
+ *
+ *  rsh_send_frame() for the frames that carry flags: a HELLO with
+ *  RSH_HELLO_* or output passed along as it came, RSH_OUT_LZ and all.
+ *
+ *  Returns OK or ERR_RDSH_COMMUNICATION.
+ */
+int rsh_send_frame_flags(int sock, int type, uint16_t flags, uint32_t stream,
+                         const void *payload, uint32_t len) {
+    return send_frame(sock, type, flags, stream, payload, len);
+}
+
+/*
+ * rsh_send_cmd(sock, stream, flags, cmd, len)
+ *
+ *  Sends a CMD frame with RSH_CMD_* flags.
+ *
+ *  Returns OK or ERR_RDSH_COMMUNICATION.
+ */
+int rsh_send_cmd(int sock, uint32_t stream, uint16_t flags, const char *cmd, uint32_t len) {
+    return send_frame(sock, RSH_FRAME_CMD, flags, stream, cmd, len);
+}
+
+static int recv_all(int sock, char *buff, size_t len, int *got) {
+    *got = 0;
+    while ((size_t)*got < len) {
+        ssize_t n = recv(sock, buff + *got, len - *got, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return ERR_RDSH_COMMUNICATION;
+        }
+        if (n == 0) {
+            return (*got == 0) ? WARN_RDSH_CLOSED : ERR_RDSH_COMMUNICATION;
+        }
+        *got += n;
+    }
+    return OK;
+}
+
+/*
+ * rsh_recv_frame(sock, hdr, payload, payload_sz)
+ *      hdr:         receives the decoded header
+ *      payload:     receives hdr->len bytes of payload
+ *      payload_sz:  size of the payload buffer
+ *
+ *  Blocks until a whole frame has arrived, however many recv() calls that
+ *  takes.
+ *
+ *  Returns:
+ *      OK:                      hdr and payload are filled in
+ *      WARN_RDSH_CLOSED:        the peer closed the connection cleanly
+ *      ERR_RDSH_PROTOCOL:       bad version or a payload bigger than
+ *                               payload_sz; the stream can't be resynced
+ *      ERR_RDSH_COMMUNICATION:  recv() failed or the peer vanished mid-frame
+ */
+int rsh_recv_frame(int sock, rsh_frame_hdr_t *hdr, void *payload, size_t payload_sz) {
+    int rc = rsh_recv_header(sock, hdr);
+    if (rc != OK) {
+        return rc;
+    }
+    return rsh_recv_payload(sock, hdr, payload, payload_sz);
+}
+
+/*
+ * rsh_recv_header(sock, hdr)
+ * rsh_recv_payload(sock, hdr, payload, payload_sz)
+ *
+ *  rsh_recv_frame() in two halves, for callers that look at the header
+ *  before they decide where the payload goes, see rsh_recv_file().
+ *
+ *  Returns OK, or as rsh_recv_frame().
+ */
+int rsh_recv_header(int sock, rsh_frame_hdr_t *hdr) {
+    char raw[RSH_FRAME_HDR_SZ];
+    int got;
+
+    int rc = recv_all(sock, raw, RSH_FRAME_HDR_SZ, &got);
+    if (rc != OK) {
+        return rc;
+    }
+    return (rsh_frame_parse(raw, RSH_FRAME_HDR_SZ, hdr) < 0) ? ERR_RDSH_PROTOCOL : OK;
+}
+
+int rsh_recv_payload(int sock, const rsh_frame_hdr_t *hdr, void *payload, size_t payload_sz) {
+    int got;
+
+    if (hdr->len > payload_sz) {
+        return ERR_RDSH_PROTOCOL;
+    }
+    int rc = recv_all(sock, payload, hdr->len, &got);
+    return (rc == WARN_RDSH_CLOSED) ? ERR_RDSH_COMMUNICATION : rc;
+}
+
+/*
+ * rsh_send_file(sock, type, stream, fd, off, len)
+ *      fd, off:  regular file and where in it the payload starts
+ *      len:      payload size, at most RSH_FRAME_MAX
+ *
+ *  Sends one frame whose payload comes straight out of the page cache
+ *  with sendfile().  The file position of fd is not used or moved.
+ *
+ *  Returns OK or ERR_RDSH_COMMUNICATION.
+ */
+int rsh_send_file(int sock, int type, uint32_t stream, int fd, off_t off, uint32_t len) {
+    char hdr[RSH_FRAME_HDR_SZ];
+    struct iovec iov;
+
+    rsh_frame_pack(hdr, type, 0, stream, len);
+    iov.iov_base = hdr;
+    iov.iov_len = RSH_FRAME_HDR_SZ;
+    if (send_all_iov(sock, &iov, 1, MSG_MORE) != OK) {
+        return ERR_RDSH_COMMUNICATION;
+    }
+
+    while (len > 0) {
+        ssize_t n = sendfile(sock, fd, &off, len);
+        if (n > 0) {
+            len -= n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            break;
+        } else {
+            return ERR_RDSH_COMMUNICATION;      //n == 0: the file shrank
+        }
+    }
+
+    // Same as relay_zero_copy(), the frame is promised so finish it
+    while (len > 0) {
+        char buff[RSH_FRAME_MAX];
+        ssize_t n = pread(fd, buff, len, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return ERR_RDSH_COMMUNICATION;
+        iov.iov_base = buff;
+        iov.iov_len = n;
+        if (send_all_iov(sock, &iov, 1, 0) != OK) {
+            return ERR_RDSH_COMMUNICATION;
+        }
+        off += n;
+        len -= n;
+    }
+    return OK;
+}
+
+/*
+ * rsh_recv_file(sock, len, fd, off, pipe_fds)
+ *      len:       payload size from the frame header
+ *      fd, off:   file to write it into, and where; off -1 writes at (and
+ *                 moves) fd's own position, e.g. to a redirected stdout
+ *      pipe_fds:  a pipe owned by the caller, empty between calls, or NULL
+ *                 if fd is itself a pipe, which then gets the payload
+ *                 spliced straight in (any other fd gets the recv()
+ *                 fallback below)
+ *
+ *  Moves the payload of a frame whose header was just received with
+ *  rsh_recv_header() into fd, socket to pipe to file with splice(), so
+ *  the data never comes up into user space.  Sockets or files that can't
+ *  splice (EINVAL) get a recv() and pwrite() or write() instead.
+ *
+ *  Returns OK, or ERR_RDSH_COMMUNICATION if the socket failed and
+ *  ERR_RDSH_CMD_EXEC if the file couldn't be written; the rest of the
+ *  payload is then still taken off the socket.
+ */
+int rsh_recv_file(int sock, uint32_t len, int fd, off_t off, int pipe_fds[2]) {
+    loff_t *offp = (off >= 0) ? &off : NULL;
+    int rc = OK;
+
+    while (len > 0 && rc == OK) {
+        int to = (pipe_fds != NULL) ? pipe_fds[1] : fd;
+        ssize_t n = splice(sock, NULL, to, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EINVAL) {
+            break;
+        } else if (n < 0 && errno == EPIPE && pipe_fds == NULL) {
+            rc = ERR_RDSH_CMD_EXEC;
+            break;
+        } else if (n <= 0) {
+            return ERR_RDSH_COMMUNICATION;
+        }
+        len -= n;
+
+        while (n > 0 && pipe_fds != NULL) {
+            ssize_t w = splice(pipe_fds[0], NULL, fd, offp, n, SPLICE_F_MOVE);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) {
+                // Empty the pipe, the frame still has to be consumed
+                char buff[RSH_FRAME_MAX];
+                while (n > 0) {
+                    ssize_t d = read(pipe_fds[0], buff, (n < RSH_FRAME_MAX) ? n : RSH_FRAME_MAX);
+                    if (d <= 0) return ERR_RDSH_COMMUNICATION;
+                    n -= d;
+                }
+                rc = ERR_RDSH_CMD_EXEC;
+                break;
+            }
+            n -= w;
+        }
+    }
+
+    while (len > 0) {
+        char buff[RSH_FRAME_MAX];
+        ssize_t n = recv(sock, buff, (len < RSH_FRAME_MAX) ? len : RSH_FRAME_MAX, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return ERR_RDSH_COMMUNICATION;
+        if (rc == OK && offp != NULL && pwrite(fd, buff, n, off) != n) {
+            rc = ERR_RDSH_CMD_EXEC;
+        } else if (rc == OK && offp == NULL && rsh_write_all(fd, buff, n) != OK) {
+            rc = ERR_RDSH_CMD_EXEC;
+        }
+        off += n;
+        len -= n;
+    }
+    return rc;
+}
+
+/*
+ * rsh_write_all(fd, buff, len)
+ *
+ *  write() until all of buff is out, across short writes to a terminal or
+ *  a pipe.
+ *
+ *  Returns OK or ERR_RDSH_CMD_EXEC.
+ */
+int rsh_write_all(int fd, const void *buff, size_t len) {
+    const char *p = buff;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return ERR_RDSH_CMD_EXEC;
+        p += n;
+        len -= n;
+    }
+    return OK;
+}
+
+/*
+ * rsh_lz_pack(frame, type, stream, data, len, cap)
+ *      frame, cap:  where the whole frame goes, header included
+ *      data, len:   output to send, not inside frame
+ *
+ *  Builds a STDOUT or STDERR frame, compressed with RSH_OUT_LZ if len is
+ *  at least RSH_LZ_MIN and that makes it smaller, as it is otherwise.
+ *  cap must leave room for len bytes of payload.
+ *
+ *  Returns the size of the frame.
+ */
+int rsh_lz_pack(char *frame, int type, uint32_t stream, const char *data, int len, int cap) {
+    char *payload = frame + RSH_FRAME_HDR_SZ;
+    uint32_t n_len = htonl((uint32_t)len);
+
+    if (len >= RSH_LZ_MIN) {
+        int room = cap - RSH_FRAME_HDR_SZ - (int)sizeof(n_len);
+        if (room >= len - (int)sizeof(n_len)) {
+            room = len - sizeof(n_len) - 1;         //only if it gets smaller
+        }
+        int clen = rsh_lz_compress(data, len, payload + sizeof(n_len), room);
+        if (clen > 0) {
+            memcpy(payload, &n_len, sizeof(n_len));
+            rsh_frame_pack(frame, type, RSH_OUT_LZ, stream, sizeof(n_len) + clen);
+            return RSH_FRAME_HDR_SZ + sizeof(n_len) + clen;
+        }
+    }
+    memcpy(payload, data, len);
+    rsh_frame_pack(frame, type, 0, stream, (uint32_t)len);
+    return RSH_FRAME_HDR_SZ + len;
+}
+
+/*
+ * rsh_lz_unpack(hdr, payload, out, cap)
+ *
+ *  Decompresses the payload of a STDOUT or STDERR frame with RSH_OUT_LZ
+ *  into out.
+ *
+ *  Returns the size of the output, or ERR_RDSH_PROTOCOL if the payload
+ *  doesn't hold what its size says or would not fit in cap bytes.
+ */
+int rsh_lz_unpack(const rsh_frame_hdr_t *hdr, const char *payload, char *out, int cap) {
+    uint32_t n_len;
+
+    if (hdr->len < sizeof(n_len)) {
+        return ERR_RDSH_PROTOCOL;
+    }
+    memcpy(&n_len, payload, sizeof(n_len));
+    uint32_t len = ntohl(n_len);
+    if (len > (uint32_t)cap) {
+        return ERR_RDSH_PROTOCOL;
+    }
+
+    int n = rsh_lz_decompress(payload + sizeof(n_len), hdr->len - sizeof(n_len), out, len);
+    return (n == (int)len) ? n : ERR_RDSH_PROTOCOL;
+}
+
+static int relay_copy(int src_fd, int sock, int type, uint32_t stream, bool compress) {
+    char buff[RSH_FRAME_HDR_SZ + RSH_FRAME_MAX];
+    char raw[RSH_FRAME_MAX];
+    char *data = compress ? raw : buff + RSH_FRAME_HDR_SZ;
+    struct iovec iov;
+    ssize_t n;
+    int frame_len;
+
+    do {
+        n = read(src_fd, data, RSH_FRAME_MAX);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return WARN_RDSH_AGAIN;
+    } else if (n <= 0) {
+        return 0;                       //read errors end the output too
+    }
+
+    if (compress) {
+        frame_len = rsh_lz_pack(buff, type, stream, raw, n, sizeof(buff));
+    } else {
+        rsh_frame_pack(buff, type, 0, stream, (uint32_t)n);
+        frame_len = RSH_FRAME_HDR_SZ + n;
+    }
+    iov.iov_base = buff;
+    iov.iov_len = frame_len;
+    if (send_all_iov(sock, &iov, 1, 0) != OK) {
+        return ERR_RDSH_COMMUNICATION;
+    }
+    return (int)n;
+}
+
+/*
+ * Moves len bytes, already known to be waiting in src_fd, into the socket
+ * without bringing them into user space.  The header was sent with
+ * MSG_MORE, so it still leaves in the same segment as the payload.
+ *
+ * Once the header is out exactly len bytes have to follow, so if the
+ * kernel turns the zero-copy call down we finish the frame by copying.
+ */
+static int relay_zero_copy(int src_fd, bool is_pipe, int sock, size_t len) {
+    while (len > 0) {
+        ssize_t n;
+        if (is_pipe) {
+            n = splice(src_fd, NULL, sock, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        } else {
+            n = sendfile(sock, src_fd, NULL, len);
+        }
+
+        if (n > 0) {
+            len -= n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            break;
+        } else {
+            return ERR_RDSH_COMMUNICATION;
+        }
+    }
+
+    while (len > 0) {
+        char buff[RSH_FRAME_MAX];
+        struct iovec iov;
+
+        ssize_t n = read(src_fd, buff, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return ERR_RDSH_COMMUNICATION;
+        iov.iov_base = buff;
+        iov.iov_len = n;
+        if (send_all_iov(sock, &iov, 1, 0) != OK) {
+            return ERR_RDSH_COMMUNICATION;
+        }
+        len -= n;
+    }
+    return OK;
+}
+
+/*
+ * rsh_relay_chunk(src_fd, sock, type, stream, compress)
+ *      src_fd:    pipe or file holding a command's output
+ *      type:      RSH_FRAME_STDOUT or RSH_FRAME_STDERR
+ *      compress:  the stream has RSH_CMD_LZ, see rsh_lz_pack()
+ *
+ *  Moves what is waiting in src_fd, up to RSH_FRAME_MAX bytes, to the client
+ *  as one frame, so output shows up on the client as soon as the command
+ *  writes it.
+ *
+ *  The payload goes straight from the pipe (or the builtin's memfd) into
+ *  the socket with splice() or sendfile(), so streaming a large file costs
+ *  no copy through our own buffers.  The size of the frame has to be known
+ *  before its header goes out, so that comes from FIONREAD on a pipe and
+ *  from the file size otherwise.  When nothing is waiting yet, or sock is
+ *  -1 and the output is only being drained, it falls back on read() so that
+ *  end of file and an empty nonblocking pipe are told apart.  Compressed
+ *  output has to pass through our buffers anyway, so it always takes the
+ *  read() path.
+ *
+ *  Returns:
+ *      > 0:                     bytes relayed
+ *      0:                       end of file
+ *      WARN_RDSH_AGAIN:         src_fd is nonblocking and empty right now
+ *      ERR_RDSH_COMMUNICATION:  the send failed, the data is lost
+ */
+int rsh_relay_chunk(int src_fd, int sock, int type, uint32_t stream, bool compress) {
+    char hdr[RSH_FRAME_HDR_SZ];
+    struct iovec iov;
+    struct stat sb;
+    off_t avail = 0;
+
+    if (compress && sock >= 0) {
+        return relay_copy(src_fd, sock, type, stream, true);
+    }
+    if (sock >= 0 && fstat(src_fd, &sb) == 0) {
+        if (S_ISFIFO(sb.st_mode)) {
+            int queued = 0;
+            if (ioctl(src_fd, FIONREAD, &queued) == 0) avail = queued;
+        } else if (S_ISREG(sb.st_mode)) {
+            off_t pos = lseek(src_fd, 0, SEEK_CUR);
+            if (pos >= 0 && pos < sb.st_size) avail = sb.st_size - pos;
+        }
+    }
+    if (avail <= 0) {
+        return relay_copy(src_fd, sock, type, stream, false);
+    }
+    if (avail > RSH_FRAME_MAX) {
+        avail = RSH_FRAME_MAX;
+    }
+
+    rsh_frame_pack(hdr, type, 0, stream, (uint32_t)avail);
+    iov.iov_base = hdr;
+    iov.iov_len = RSH_FRAME_HDR_SZ;
+    if (send_all_iov(sock, &iov, 1, MSG_MORE) != OK ||
+        relay_zero_copy(src_fd, S_ISFIFO(sb.st_mode), sock, avail) != OK) {
+        return ERR_RDSH_COMMUNICATION;
+    }
+    return (int)avail;
+}
+
+/*
+ * rsh_send_end(sock, stream, status)
+ *
+ *  Sends the END frame for stream with the command's exit status.
+ *
+ *  Returns OK or ERR_RDSH_COMMUNICATION.
+ */
+int rsh_send_end(int sock, uint32_t stream, int status) {
+    uint32_t n_status = htonl((uint32_t)status);
+
+    return rsh_send_frame(sock, RSH_FRAME_END, stream, &n_status, sizeof(n_status));
+}
+
+/*
+ * rsh_end_status(hdr, payload)
+ *
+ *  Returns the exit status carried by an END frame.
+ */
+int rsh_end_status(const rsh_frame_hdr_t *hdr, const void *payload) {
+    uint32_t n_status;
+
+    if (hdr->len < sizeof(n_status)) {
+        return 0;
+    }
+    memcpy(&n_status, payload, sizeof(n_status));
+    return (int)ntohl(n_status);
+}
+
+/*
+ * rsh_send_reply(sock, stream, msg, status)
+ *
+ *  Sends a complete reply made of a single message followed by the END
+ *  frame.  msg goes out as STDERR when status is nonzero, since it is then
+ *  an error message, and as STDOUT otherwise.
+ *
+ *  Returns OK or ERR_RDSH_COMMUNICATION.
+ */
+int rsh_send_reply(int sock, uint32_t stream, const char *msg, int status) {
+    size_t len = strlen(msg);
+
+    int type = (status != 0) ? RSH_FRAME_STDERR : RSH_FRAME_STDOUT;
+
+    if (len > 0 && rsh_send_frame(sock, type, stream, msg, len) != OK) {
+        return ERR_RDSH_COMMUNICATION;
+    }
+    return rsh_send_end(sock, stream, status);
+}
+
+/*
+ * rsh_sockaddr(addr, port, ss)
+ *      addr:  -i argument: an IPv4 address, a Unix socket path (anything
+ *             with a '/'), or @name for a socket in the abstract namespace
+ *      port:  TCP port, unused for Unix sockets
+ *      ss:    filled in with the address to bind() or connect() to
+ *
+ *  Same host clients don't need TCP, and a Unix socket skips the loopback
+ *  TCP stack on every frame.  Abstract sockets have no file to clean up
+ *  and go away with the server.
+ *
+ *  Returns the length of the address in ss, ss->ss_family is the family to
+ *  create the socket with, or ERR_RDSH_COMMUNICATION if addr is neither.
+ */
+int rsh_sockaddr(const char *addr, int port, struct sockaddr_storage *ss) {
+    memset(ss, 0, sizeof(*ss));
+
+    if (addr[0] == '@' || strchr(addr, '/') != NULL) {
+        struct sockaddr_un *un = (struct sockaddr_un *)ss;
+        size_t len = strlen(addr);
+
+        if (len >= sizeof(un->sun_path)) {
+            fprintf(stderr, "rdsh-error: socket path too long: %s\n", addr);
+            errno = ENAMETOOLONG;
+            return ERR_RDSH_COMMUNICATION;
+        }
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path, addr, len);
+        if (addr[0] == '@') {
+            un->sun_path[0] = '\0';           //abstract, the length is all there is
+            return (int)(offsetof(struct sockaddr_un, sun_path) + len);
+        }
+        return (int)sizeof(*un);
+    }
+
+    struct sockaddr_in *in = (struct sockaddr_in *)ss;
+    in->sin_family = AF_INET;
+    in->sin_port = htons(port);
+    if (inet_pton(AF_INET, addr, &in->sin_addr) <= 0) {
+        fprintf(stderr, "rdsh-error: not an IPv4 address or socket path: %s\n", addr);
+        errno = EINVAL;
+        return ERR_RDSH_COMMUNICATION;
+    }
+    return (int)sizeof(*in);
+}
+
+/*
+ * rsh_sock_nodelay(sock)
+ *
+ *  Turns Nagle off on a TCP connection, a no-op on a Unix socket.  Every
+ *  frame is written whole (the zero-copy relay corks its header with
+ *  MSG_MORE), so nothing is gained by holding small writes back, and a
+ *  lot is lost: a reply's END frame would sit behind the unacked output
+ *  frame until the peer's delayed ACK, up to 40ms per command.
+ */
+void rsh_sock_nodelay(int sock) {
+    int enable = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+}
+
+/*
+ * rsh_sock_keepalive(sock, secs)
+ *      secs:  quiet time before the first probe, 0 leaves keepalive off
+ *
+ *  Turns TCP keepalive on, probing every secs / RSH_KEEPALIVE_PROBES
+ *  after that, so a peer that vanished is given up on within about twice
+ *  secs instead of the two hours the kernel defaults to.  A no-op on a
+ *  Unix socket, whose peer can't vanish without the kernel knowing.
+ */
+void rsh_sock_keepalive(int sock, int secs) {
+    if (secs <= 0) {
+        return;
+    }
+    int enable = 1;
+    int intvl = (secs >= RSH_KEEPALIVE_PROBES) ? secs / RSH_KEEPALIVE_PROBES : 1;
+    int probes = RSH_KEEPALIVE_PROBES;
+    if (setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable)) == 0) {
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &secs, sizeof(secs));
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+    }
+}
+
+// Last number in a /proc/sys file, -1 if it can't be read
+static long proc_sys_last(const char *path) {
+    FILE *f = fopen(path, "r");
+    long v = -1, n;
+
+    if (f == NULL) {
+        return -1;
+    }
+    while (fscanf(f, "%ld", &n) == 1) {
+        v = n;
+    }
+    fclose(f);
+    return v;
+}
+
+/*
+ * rsh_sock_rcvbuf(sock, bytes)
+ *
+ *  Asks for a receive buffer of bytes on a TCP socket before connect(),
+ *  so the window it allows is offered from the SYN on.  Setting SO_RCVBUF
+ *  turns the kernel's own receive buffer autotuning off, which already
+ *  grows the buffer up to the last field of tcp_rmem; so the buffer is
+ *  only set when the kernel would let it be bigger than that (rmem_max
+ *  caps it), and left alone on a stock system.  A no-op on a Unix socket.
+ */
+void rsh_sock_rcvbuf(int sock, int bytes) {
+    int domain = 0;
+    socklen_t len = sizeof(domain);
+
+    if (getsockopt(sock, SOL_SOCKET, SO_DOMAIN, &domain, &len) < 0 ||
+        (domain != AF_INET && domain != AF_INET6)) {
+        return;
+    }
+
+    long cap = proc_sys_last("/proc/sys/net/core/rmem_max");
+    long autotune = proc_sys_last("/proc/sys/net/ipv4/tcp_rmem");
+    if (cap < 0 || autotune < 0) {
+        return;
+    }
+    if (cap < bytes) {
+        bytes = (int)cap;
+    }
+    // The kernel doubles what it is given, for its own bookkeeping
+    if (2L * bytes > autotune) {
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes));
+    }
+}
+
+/*
+ * rsh_send_frame_nowait(sock, type, stream, payload, len)
+ *
+ *  Sends a short frame, such as a PING, from a thread that must not block
+ *  on the socket: only when nothing is still queued on it, so the frame
+ *  goes out whole and can't end up between the halves of another one.
+ *
+ *  Returns OK, WARN_RDSH_AGAIN if the socket still had data queued, or
+ *  ERR_RDSH_COMMUNICATION.
+ */
+int rsh_send_frame_nowait(int sock, int type, uint32_t stream, const void *payload, uint32_t len) {
+    char hdr[RSH_FRAME_HDR_SZ];
+    struct iovec iov[2];
+    int queued = 0;
+
+    if (ioctl(sock, SIOCOUTQ, &queued) < 0 || queued > 0) {
+        return WARN_RDSH_AGAIN;
+    }
+    rsh_frame_pack(hdr, type, 0, stream, len);
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = RSH_FRAME_HDR_SZ;
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = len;
+    return send_all_iov(sock, iov, (len > 0) ? 2 : 1, MSG_DONTWAIT);
+}
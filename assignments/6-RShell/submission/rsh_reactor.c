@@ -0,0 +1,711 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+/*
+ * Event-driven rsh server (dsh -s -e).
+ *
+ * A thread per client costs a stack and a 64K buffer per connection and
+ * tops out at a few hundred clients.  Here a handful of threads each run
+ * their own epoll loop instead.  The listening socket is registered in
+ * every loop with EPOLLEXCLUSIVE, so only one thread wakes per incoming
+ * connection.  A connection stays on the thread that accepted it for its
+ * whole life, so its state is never shared and needs no locks.
+ *
+ * Every connection is in one of two states:
+ *
+ *      OPEN      reading CMD frames, running up to RSH_MAX_STREAMS
+ *                commands at once and relaying their output
+ *      CLOSING   flushing a final message before the socket is closed
+ *
+ * Each running command sits in a stream slot (see rsh_stream.c).  Output
+ * from all of a connection's commands is framed into one out_buf, a
+ * chunk per pipe per pass so one chatty command can't starve the others.
+ * stdout and stderr have a pipe each and go out as STDOUT and STDERR
+ * frames, and every command gets its END frame once it has exited.
+ *
+ * All descriptors are nonblocking and edge triggered.  An edge only tells
+ * us that a descriptor *became* ready, so the connection remembers it
+ * (sock_rd, sock_wr, pipe_rd) until a read or write returns EAGAIN, and
+ * conn_drive() keeps making progress until nothing more can be done.
+ *
+ * Buffers are bounded.  When a client reads slower than its commands
+ * write, out_buf fills up and we simply stop reading their pipes; the
+ * commands then block on a full pipe instead of the server growing
+ * without limit.  Output from external commands comes through a pipe,
+ * output from builtins is written to a memfd and relayed the same way.
+ * Child exit is noticed through a pidfd, so nothing ever blocks in
+ * waitpid().
+ *
+ * Commands started here read /dev/null instead of the client socket, the
+ * socket belongs to the event loop.  For the same reason `put` is turned
+ * away here, while `get` is just a stream whose output is a file.
+ *
+ * Each loop has a timer wheel with a timer per connection for heartbeats
+ * and idle timeouts (see rsh_timer.c); epoll_wait() sleeps until the next
+ * one is due.
+ */
+
+typedef enum {
+    EV_LISTEN,
+    EV_WAKE,
+    EV_SOCK,
+    EV_PIPE,
+    EV_PID,
+} ev_kind_t;
+
+struct rsh_conn;
+
+// What epoll hands back for each registered descriptor
+typedef struct ev_src {
+    ev_kind_t        kind;
+    struct rsh_conn *conn;
+    int              idx;           //EV_PIPE: slot * 2, plus 1 for stderr
+                                    //EV_PID: slot * CMD_MAX + stage
+} ev_src_t;
+
+typedef enum {
+    CONN_OPEN,
+    CONN_CLOSING,
+} conn_state_t;
+
+typedef struct rsh_conn {
+    int          sock;
+    conn_state_t state;
+    bool         sock_rd;           //readable edge seen, not yet drained
+    bool         sock_wr;           //writable edge seen, not yet filled
+    bool         dead;
+    bool         stop_server;       //stop the server once CLOSING is done
+    ev_src_t     sock_src;
+
+    // Commands that are currently running
+    rsh_stream_t streams[RSH_MAX_STREAMS];
+    bool         pipe_rd[RSH_MAX_STREAMS][2];   //stdout, stderr
+    ev_src_t     pipe_src[RSH_MAX_STREAMS][2];
+    ev_src_t     pid_src[RSH_MAX_STREAMS][CMD_MAX];
+    int          last_rc;           //what `rc` reports
+    rsh_shell_t  shell;             //cwd and environment of the session
+    rsh_live_t   live;              //heartbeat and idle timeout
+
+    int          in_len;
+    uint32_t     in_skip;           //bytes left of a frame too big to buffer
+    char         in_buf[RSH_SESSION_INBUF];
+    int          out_off;
+    int          out_len;
+    char         out_buf[RSH_REACTOR_OUTBUF];
+
+    struct rsh_conn *prev;
+    struct rsh_conn *next;
+} rsh_conn_t;
+
+typedef struct reactor {
+    int         id;
+    int         epfd;
+    pthread_t   tid;
+    rsh_conn_t *conns;              //live connections on this thread
+    rsh_conn_t *dead;               //closed this batch, freed after it
+    rsh_wheel_t wheel;              //a timer per connection
+} reactor_t;
+
+static int g_listen_fd = -1;
+static int g_wake_fd = -1;          //eventfd, readable once we should stop
+static int g_devnull = -1;
+static ev_src_t g_listen_src = { EV_LISTEN, NULL, 0 };
+static ev_src_t g_wake_src = { EV_WAKE, NULL, 0 };
+
+static int reactor_add(reactor_t *r, int fd, uint32_t events, ev_src_t *src) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = src;
+    return epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void set_nonblock(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+ * Queues bytes for the client.  Only ever used for short messages, which
+ * are sent with out_buf otherwise empty, so they always fit.
+ */
+static void conn_queue(rsh_conn_t *c, const char *buff, int len) {
+    if (c->out_off > 0) {
+        memmove(c->out_buf, c->out_buf + c->out_off, c->out_len);
+        c->out_off = 0;
+    }
+    if (len > RSH_REACTOR_OUTBUF - c->out_len) {
+        len = RSH_REACTOR_OUTBUF - c->out_len;
+    }
+    memcpy(c->out_buf + c->out_len, buff, len);
+    c->out_len += len;
+}
+
+static void conn_queue_frame(rsh_conn_t *c, int type, uint16_t flags, uint32_t stream,
+                             const void *payload, int len) {
+    char hdr[RSH_FRAME_HDR_SZ];
+
+    rsh_frame_pack(hdr, type, flags, stream, len);
+    conn_queue(c, hdr, RSH_FRAME_HDR_SZ);
+    if (len > 0) conn_queue(c, payload, len);
+}
+
+static void conn_queue_end(rsh_conn_t *c, uint32_t stream, int status) {
+    uint32_t n_status = htonl((uint32_t)status);
+
+    conn_queue_frame(c, RSH_FRAME_END, 0, stream, &n_status, sizeof(n_status));
+}
+
+/*
+ * Queues a whole reply: msg, then the END frame.  Like rsh_send_reply(),
+ * msg is STDERR when status says it is an error.
+ */
+static void conn_queue_msg(rsh_conn_t *c, uint32_t stream, const char *msg, int status) {
+    int len = strlen(msg);
+
+    if (len > 0) {
+        int type = (status != 0) ? RSH_FRAME_STDERR : RSH_FRAME_STDOUT;
+        conn_queue_frame(c, type, 0, stream, msg, len);
+    }
+    conn_queue_end(c, stream, status);
+}
+
+static void conn_close(reactor_t *r, rsh_conn_t *c) {
+    if (c->dead) return;
+
+    // A client that goes away takes its running commands with it
+    for (int i = 0; i < RSH_MAX_STREAMS; i++) {
+        rsh_stream_close(&c->streams[i]);
+    }
+    rsh_shell_free(&c->shell);
+    rsh_timer_cancel(&r->wheel, &c->live.timer);
+    close(c->sock);
+    rsh_metrics_add(RSH_M_CONNS_CLOSED, 1);
+
+    if (c->prev != NULL) c->prev->next = c->next;
+    else r->conns = c->next;
+    if (c->next != NULL) c->next->prev = c->prev;
+
+    c->dead = true;
+    c->next = r->dead;
+    r->dead = c;
+
+    if (c->stop_server) {
+        printf(RCMD_MSG_SVR_STOP_REQ);
+        g_server_should_exit = 1;
+        uint64_t one = 1;
+        ssize_t unused = write(g_wake_fd, &one, sizeof(one));
+        (void)unused;
+    } else {
+        printf(RCMD_MSG_CLIENT_EXITED);
+    }
+}
+
+/*
+ * Parses and starts the command from a CMD frame.  Mirrors what
+ * rsh_start_command() does for a blocking connection.
+ */
+static void conn_start_command(reactor_t *r, rsh_conn_t *c, uint32_t stream, uint16_t flags,
+                               char *cmd_line) {
+    command_list_t cmd_list;
+    char error_msg[100];
+
+    if (g_server_verbose) {
+        printf(RCMD_MSG_SVR_EXEC_REQ, cmd_line);
+    }
+    rsh_live_active(&c->live, rsh_timer_now_ms());
+
+    if (strcmp(cmd_line, EXIT_CMD) == 0) {
+        conn_queue_msg(c, stream, "exiting...\n", 0);
+        c->state = CONN_CLOSING;
+        return;
+    }
+    if (strcmp(cmd_line, "stop-server") == 0) {
+        conn_queue_msg(c, stream, "stopping server...\n", 0);
+        c->stop_server = true;
+        c->state = CONN_CLOSING;
+        return;
+    }
+
+    memset(&cmd_list, 0, sizeof(command_list_t));
+    int rc = build_cmd_list(cmd_line, &cmd_list);
+    if (rc == WARN_NO_CMDS) {
+        conn_queue_msg(c, stream, CMD_WARN_NO_CMD, 0);
+        return;
+    } else if (rc == ERR_TOO_MANY_COMMANDS) {
+        snprintf(error_msg, sizeof(error_msg), CMD_ERR_PIPE_LIMIT, CMD_MAX);
+        conn_queue_msg(c, stream, error_msg, 1);
+        return;
+    } else if (rc != OK) {
+        snprintf(error_msg, sizeof(error_msg), "Error parsing command: %d\n", rc);
+        conn_queue_msg(c, stream, error_msg, 1);
+        return;
+    }
+
+    // The socket is the loop's, a put would have to block on it
+    if (strcmp(cmd_list.commands[0].argv[0], RSH_PUT_CMD) == 0) {
+        conn_queue_msg(c, stream, CMD_ERR_RDSH_PUT, 1);
+        free_cmd_list(&cmd_list);
+        return;
+    }
+
+    rsh_stream_t *st = rsh_stream_slot(c->streams, RSH_MAX_STREAMS);
+    if (st == NULL) {
+        conn_queue_msg(c, stream, CMD_ERR_RDSH_BUSY, 1);
+        free_cmd_list(&cmd_list);
+        return;
+    }
+
+    int slot = st - c->streams;
+    rc = rsh_stream_start(st, stream, &c->shell, &cmd_list, c->last_rc, g_devnull);
+    st->ordered = (flags & RSH_CMD_ORDERED) && !(flags & RSH_CMD_BACKGROUND);
+    st->compress = (flags & RSH_CMD_LZ) != 0;
+    if (rc == EXIT_SC || rc == STOP_SERVER_SC) {
+        // `exit` or `stop-server` with arguments or a redirection
+        conn_queue_msg(c, stream, (rc == EXIT_SC) ? "exiting...\n" : "stopping server...\n", 0);
+        c->stop_server = (rc == STOP_SERVER_SC);
+        c->state = CONN_CLOSING;
+    } else if (rc != OK) {
+        c->last_rc = 1;
+        conn_queue_msg(c, stream, rsh_stream_error(rc, &cmd_list), 1);
+    } else {
+        // A builtin's memfds (or a get's file) are always readable and
+        // epoll won't take them
+        c->pipe_rd[slot][0] = c->pipe_rd[slot][1] = true;
+        if (st->nprocs > 0) {
+            reactor_add(r, st->out_fd, EPOLLIN | EPOLLET, &c->pipe_src[slot][0]);
+            reactor_add(r, st->err_fd, EPOLLIN | EPOLLET, &c->pipe_src[slot][1]);
+        }
+        for (int i = 0; i < st->nprocs; i++) {
+            if (st->pidfds[i] >= 0) {
+                reactor_add(r, st->pidfds[i], EPOLLIN, &c->pid_src[slot][i]);
+            }
+        }
+    }
+
+    free_cmd_list(&cmd_list);
+}
+
+/*
+ * Frames one read() of a command's stdout (which 0) or stderr (which 1)
+ * into out_buf.  Returns false if out_buf has no room for it.
+ */
+static bool conn_read_output(rsh_conn_t *c, int slot, int which) {
+    rsh_stream_t *st = &c->streams[slot];
+    int *fd = (which == 0) ? &st->out_fd : &st->err_fd;
+
+    if (c->out_off > 0 && c->out_off + c->out_len + RSH_FRAME_HDR_SZ >= RSH_REACTOR_OUTBUF) {
+        memmove(c->out_buf, c->out_buf + c->out_off, c->out_len);
+        c->out_off = 0;
+    }
+    int space = RSH_REACTOR_OUTBUF - (c->out_off + c->out_len) - RSH_FRAME_HDR_SZ;
+    if (space <= 0) {
+        return false;
+    }
+
+    // Compressed output is read aside and packed into out_buf
+    char raw[RSH_REACTOR_OUTBUF];
+    char *hdr = c->out_buf + c->out_off + c->out_len;
+    ssize_t n = read(*fd, st->compress ? raw : hdr + RSH_FRAME_HDR_SZ, space);
+    if (n > 0) {
+        int type = (which == 0) ? RSH_FRAME_STDOUT : RSH_FRAME_STDERR;
+        if (st->compress) {
+            c->out_len += rsh_lz_pack(hdr, type, st->id, raw, n, RSH_FRAME_HDR_SZ + space);
+        } else {
+            rsh_frame_pack(hdr, type, 0, st->id, (uint32_t)n);
+            c->out_len += RSH_FRAME_HDR_SZ + n;
+        }
+        rsh_stream_sent(st, st->compress ? raw : hdr + RSH_FRAME_HDR_SZ, (int)n);
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        c->pipe_rd[slot][which] = false;
+    } else if (n < 0 && errno == EINTR) {
+        // try again next pass
+    } else {
+        close(*fd);
+        *fd = -1;
+    }
+    return true;
+}
+
+/*
+ * Moves the connection along as far as it can go without blocking.
+ */
+static void conn_drive(reactor_t *r, rsh_conn_t *c) {
+    bool progress = true;
+
+    while (progress && !c->dead) {
+        progress = false;
+
+        // Output to the client
+        if (c->out_len > 0 && c->sock_wr) {
+            ssize_t n = send(c->sock, c->out_buf + c->out_off, c->out_len, MSG_NOSIGNAL);
+            if (n > 0) {
+                c->out_off += n;
+                c->out_len -= n;
+                if (c->out_len == 0) c->out_off = 0;
+                progress = true;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                c->sock_wr = false;
+            } else if (n < 0 && errno == EINTR) {
+                progress = true;
+            } else {
+                conn_close(r, c);
+                return;
+            }
+        }
+
+        if (c->state == CONN_CLOSING) {
+            if (c->out_len == 0) {
+                conn_close(r, c);
+                return;
+            }
+            continue;
+        }
+
+        // Command output into out_buf, a chunk from each pipe in turn,
+        // stops when out_buf is full
+        bool full = false;
+        for (int i = 0; i < RSH_MAX_STREAMS && !full; i++) {
+            rsh_stream_t *st = &c->streams[i];
+            if (!st->active) continue;
+            for (int w = 0; w < 2 && !full; w++) {
+                int fd = (w == 0) ? st->out_fd : st->err_fd;
+                if (fd < 0 || !c->pipe_rd[i][w]) continue;
+                full = !conn_read_output(c, i, w);
+                progress = progress || !full;
+            }
+        }
+
+        // Output is drained and the children are gone, send END, after a
+        // get's SUM
+        for (int i = 0; i < RSH_MAX_STREAMS; i++) {
+            rsh_stream_t *st = &c->streams[i];
+            if (c->out_len + 2 * RSH_FRAME_HDR_SZ + RSH_SUM_SZ + 4 > RSH_REACTOR_OUTBUF) break;
+            if (rsh_stream_done(st)) {
+                c->last_rc = st->status;
+                if (st->get) {
+                    char sum[RSH_SUM_SZ];
+                    rsh_sum_pack(sum, st->get_size, st->get_crc);
+                    conn_queue_frame(c, RSH_FRAME_SUM, 0, st->id, sum, RSH_SUM_SZ);
+                }
+                conn_queue_end(c, st->id, st->status);
+                rsh_stream_close(st);
+                rsh_live_active(&c->live, rsh_timer_now_ms());
+                progress = true;
+            }
+        }
+
+        // Next command from the client
+        if (c->sock_rd && c->in_len < RSH_SESSION_INBUF) {
+            ssize_t n = recv(c->sock, c->in_buf + c->in_len, RSH_SESSION_INBUF - c->in_len, 0);
+            if (n > 0) {
+                c->in_len += n;
+                rsh_metrics_add(RSH_M_BYTES_IN, n);
+                rsh_live_rx(&c->live, rsh_timer_now_ms());
+                progress = true;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                c->sock_rd = false;
+            } else if (n < 0 && errno == EINTR) {
+                progress = true;
+            } else {
+                conn_close(r, c);
+                return;
+            }
+        }
+
+        // Drop the rest of a frame that didn't fit in in_buf
+        if (c->in_skip > 0 && c->in_len > 0) {
+            int n = (c->in_skip < (uint32_t)c->in_len) ? (int)c->in_skip : c->in_len;
+            c->in_skip -= n;
+            c->in_len -= n;
+            memmove(c->in_buf, c->in_buf + n, c->in_len);
+            progress = true;
+            continue;
+        }
+
+        // Start it once it is complete and there's room for a short reply
+        if (c->out_len <= RSH_REACTOR_OUTBUF / 2 && c->in_len > 0 && c->in_skip == 0) {
+            rsh_frame_hdr_t hdr;
+            int total = rsh_frame_parse(c->in_buf, c->in_len, &hdr);
+            if (total < 0) {
+                conn_close(r, c);           //can't resync
+                return;
+            } else if (total > RSH_SESSION_INBUF) {
+                if (hdr.type == RSH_FRAME_CMD) {
+                    conn_queue_msg(c, hdr.stream, CMD_ERR_RDSH_TOO_LONG, 1);
+                }
+                c->in_skip = total;
+                progress = true;
+            } else if (total > 0 && total <= c->in_len && hdr.type == RSH_FRAME_CMD &&
+                       rsh_stream_must_wait(c->streams, RSH_MAX_STREAMS, hdr.flags,
+                                            rsh_stream_stages(c->in_buf + RSH_FRAME_HDR_SZ,
+                                                              hdr.len))) {
+                // Batched, stays in in_buf until the command before it ends
+            } else if (total > 0 && total <= c->in_len) {
+                char cmd_line[RSH_SESSION_INBUF];
+                memcpy(cmd_line, c->in_buf + RSH_FRAME_HDR_SZ, hdr.len);
+                cmd_line[hdr.len] = '\0';
+                c->in_len -= total;
+                memmove(c->in_buf, c->in_buf + total, c->in_len);
+
+                if (hdr.type == RSH_FRAME_HELLO) {
+                    conn_queue_frame(c, RSH_FRAME_HELLO, hdr.flags & RSH_HELLO_LZ, 0, NULL, 0);
+                } else if (hdr.type == RSH_FRAME_CMD) {
+                    conn_start_command(r, c, hdr.stream, hdr.flags, cmd_line);
+                }
+                progress = true;
+            }
+        }
+    }
+}
+
+/*
+ * The connection's timer fired: PING a quiet client, drop one that didn't
+ * answer or has been idle too long, and set the timer for the next look.
+ * The PING and the idle message only go out if out_buf is empty, so they
+ * can't land in the middle of a frame.
+ */
+static void conn_check_live(reactor_t *r, rsh_conn_t *c, long now) {
+    bool busy = false;
+    long next;
+
+    for (int i = 0; i < RSH_MAX_STREAMS; i++) {
+        busy = busy || c->streams[i].active;
+    }
+
+    int live_rc = rsh_live_check(&c->live, now, busy, &next);
+    if (live_rc == RSH_LIVE_PING && c->out_len == 0) {
+        rsh_send_frame_nowait(c->sock, RSH_FRAME_PING, 0, NULL, 0);
+    } else if (live_rc == RSH_LIVE_DEAD || live_rc == RSH_LIVE_IDLE) {
+        if (live_rc == RSH_LIVE_IDLE && c->out_len == 0) {
+            rsh_send_frame_nowait(c->sock, RSH_FRAME_STDERR, 0, CMD_ERR_RDSH_IDLE,
+                                  strlen(CMD_ERR_RDSH_IDLE));
+        }
+        rsh_metrics_add((live_rc == RSH_LIVE_DEAD) ? RSH_M_REAPED_DEAD : RSH_M_REAPED_IDLE, 1);
+        conn_close(r, c);
+        return;
+    }
+    if (next > 0) {
+        rsh_timer_arm(&r->wheel, &c->live.timer, next);
+    }
+}
+
+static void reactor_accept(reactor_t *r) {
+    for (int i = 0; i < RSH_REACTOR_ACCEPT_MAX; i++) {
+        int sock = accept4(g_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+                errno != ECONNABORTED) {
+                perror("accept");
+            }
+            return;
+        }
+        rsh_sock_nodelay(sock);
+        rsh_timeouts_sock(sock);
+
+        rsh_conn_t *c = calloc(1, sizeof(rsh_conn_t));
+        if (c == NULL) {
+            close(sock);
+            continue;
+        }
+        c->sock = sock;
+        c->state = CONN_OPEN;
+        c->sock_src = (ev_src_t){ EV_SOCK, c, 0 };
+        rsh_stream_init(c->streams, RSH_MAX_STREAMS);
+        for (int j = 0; j < RSH_MAX_STREAMS; j++) {
+            c->pipe_src[j][0] = (ev_src_t){ EV_PIPE, c, j * 2 };
+            c->pipe_src[j][1] = (ev_src_t){ EV_PIPE, c, j * 2 + 1 };
+            for (int k = 0; k < CMD_MAX; k++) {
+                c->pid_src[j][k] = (ev_src_t){ EV_PID, c, j * CMD_MAX + k };
+            }
+        }
+
+        if (reactor_add(r, sock, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, &c->sock_src) < 0) {
+            perror("epoll_ctl");
+            close(sock);
+            free(c);
+            continue;
+        }
+        rsh_shell_init(&c->shell);
+        rsh_metrics_add(RSH_M_CONNS, 1);
+
+        c->next = r->conns;
+        if (r->conns != NULL) r->conns->prev = c;
+        r->conns = c;
+
+        long now = rsh_timer_now_ms();
+        rsh_live_init(&c->live, now);
+        conn_check_live(r, c, now);
+    }
+}
+
+static void *reactor_main(void *arg) {
+    reactor_t *r = (reactor_t *)arg;
+    struct epoll_event events[RSH_REACTOR_EVENTS];
+
+    rsh_wheel_init(&r->wheel, rsh_timer_now_ms());
+    while (!g_server_should_exit) {
+        int timeout = rsh_wheel_timeout(&r->wheel, rsh_timer_now_ms());
+        int n = epoll_wait(r->epfd, events, RSH_REACTOR_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            ev_src_t *src = (ev_src_t *)events[i].data.ptr;
+            rsh_conn_t *c = src->conn;
+            uint32_t ev = events[i].events;
+
+            switch (src->kind) {
+            case EV_LISTEN:
+                reactor_accept(r);
+                break;
+            case EV_WAKE:
+                break;
+            case EV_SOCK:
+                if (c->dead) break;
+                if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) c->sock_rd = true;
+                if (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR)) c->sock_wr = true;
+                conn_drive(r, c);
+                break;
+            case EV_PIPE:
+                if (c->dead) break;
+                c->pipe_rd[src->idx / 2][src->idx % 2] = true;
+                conn_drive(r, c);
+                break;
+            case EV_PID: {
+                // May be stale if the command already finished
+                rsh_stream_t *st = &c->streams[src->idx / CMD_MAX];
+                int stage = src->idx % CMD_MAX;
+                if (c->dead || !st->active || st->pidfds[stage] < 0) break;
+                rsh_stream_reap(st, stage, WNOHANG);
+                conn_drive(r, c);
+                break;
+            }
+            }
+        }
+
+        long now = rsh_timer_now_ms();
+        rsh_timer_t *due = rsh_wheel_expire(&r->wheel, now);
+        while (due != NULL) {
+            rsh_timer_t *next = due->next;
+            rsh_conn_t *c = (rsh_conn_t *)((char *)due - offsetof(rsh_conn_t, live.timer));
+            due->next = NULL;
+            conn_check_live(r, c, now);
+            due = next;
+        }
+
+        // Nothing from this batch refers to a closed connection any more
+        while (r->dead != NULL) {
+            rsh_conn_t *next = r->dead->next;
+            free(r->dead);
+            r->dead = next;
+        }
+    }
+
+    while (r->conns != NULL) {
+        conn_close(r, r->conns);
+    }
+    while (r->dead != NULL) {
+        rsh_conn_t *next = r->dead->next;
+        free(r->dead);
+        r->dead = next;
+    }
+    return NULL;
+}
+
+/*
+ * rsh_reactor_run(svr_socket, nthreads)
+ *      svr_socket:  listening socket from boot_server()
+ *      nthreads:    number of event loop threads, 0 means one per CPU
+ *
+ *  Serves clients until one of them sends `stop-server`.
+ *
+ *  Returns:
+ *      OK_EXIT:          the server was asked to stop
+ *      ERR_RDSH_SERVER:  the event loops could not be set up
+ */
+int rsh_reactor_run(int svr_socket, int nthreads) {
+    reactor_t reactors[RSH_MAX_THREADS];
+    int started = 0;
+    int rc = OK_EXIT;
+
+    if (nthreads <= 0) nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0) nthreads = 1;
+    if (nthreads > RSH_MAX_THREADS) nthreads = RSH_MAX_THREADS;
+
+    g_listen_fd = svr_socket;
+    set_nonblock(g_listen_fd);
+    g_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    g_devnull = open("/dev/null", O_RDWR | O_CLOEXEC);
+    if (g_wake_fd < 0 || g_devnull < 0) {
+        perror("rsh_reactor_run");
+        rc = ERR_RDSH_SERVER;
+        goto out;
+    }
+
+    printf("event loop threads: %d\n", nthreads);
+    fflush(stdout);
+
+    for (started = 0; started < nthreads; started++) {
+        reactor_t *r = &reactors[started];
+        memset(r, 0, sizeof(reactor_t));
+        r->id = started;
+        r->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (r->epfd < 0) {
+            perror("epoll_create1");
+            break;
+        }
+
+        // Exclusive wakeups keep every thread from racing for each accept
+        if (reactor_add(r, g_listen_fd, EPOLLIN | EPOLLEXCLUSIVE, &g_listen_src) < 0 &&
+            reactor_add(r, g_listen_fd, EPOLLIN, &g_listen_src) < 0) {
+            perror("epoll_ctl");
+            close(r->epfd);
+            break;
+        }
+        reactor_add(r, g_wake_fd, EPOLLIN, &g_wake_src);
+
+        if (pthread_create(&r->tid, NULL, reactor_main, r) != 0) {
+            perror("pthread_create");
+            close(r->epfd);
+            break;
+        }
+    }
+
+    if (started == 0) {
+        rc = ERR_RDSH_SERVER;
+    } else if (started < nthreads) {
+        // Run with what we have rather than not at all
+        printf("event loop threads: only %d started\n", started);
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(reactors[i].tid, NULL);
+        close(reactors[i].epfd);
+    }
+
+out:
+    if (g_wake_fd >= 0) close(g_wake_fd);
+    if (g_devnull >= 0) close(g_devnull);
+    g_wake_fd = g_devnull = -1;
+    return rc;
+}
@@ -1,4 +1,4 @@
-
+#define _GNU_SOURCE
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <arpa/inet.h>
@@ -7,8 +7,16 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/un.h>
+#include <sys/stat.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
 
 //INCLUDES for extra credit
 #include <signal.h>
@@ -26,6 +34,66 @@ int g_is_threaded = 0;  // Flag indicating if server is threaded
 pthread_mutex_t g_client_mutex = PTHREAD_MUTEX_INITIALIZER;  // Mutex for thread safety
 int g_active_clients = 0;  // Count of active client connections
 volatile int g_server_should_exit = 0;  // Flag to signal server shutdown
+int g_server_threads = 0;  // Event loop threads for -e, 0 means one per core
+int g_server_spawners = RSH_SPAWNER_DEF;  // Spawner processes, 0 forks in the server
+int g_server_acceptors = 1;  // Accept loops for -x, each on its own SO_REUSEPORT socket
+int g_server_verbose = 0;  // -v, print every command received
+static const char *g_metrics_addr = NULL;  // -M, where metrics are scraped
+long g_acceptor_conns[RSH_ACCEPTORS_MAX];  // Connections per accept loop, under g_client_mutex
+
+// Shutdown of the single and threaded servers.  Nothing is read from the
+// eventfd, it just stays readable once the server is stopping, which
+// wakes the acceptor and every session out of poll().
+static int g_stop_fd = -1;
+static bool g_stop_fd_orphaned = false;    // sessions outlived the drain, the last closes it
+static pthread_cond_t g_clients_done = PTHREAD_COND_INITIALIZER;
+
+/*
+ * set_server_threads(nthreads)
+ *      nthreads:  number of threads the reactor server runs, 0 picks one
+ *                 per online CPU.  Must be called before start_server().
+ */
+void set_server_threads(int nthreads) {
+    g_server_threads = nthreads;
+}
+
+/*
+ * set_server_acceptors(nacceptors)
+ *      nacceptors:  accept loops the threaded server runs, each in its own
+ *                   thread with its own SO_REUSEPORT listening socket.
+ *                   Must be called before start_server().
+ */
+void set_server_acceptors(int nacceptors) {
+    g_server_acceptors = nacceptors;
+}
+
+/*
+ * set_server_verbose(verbose)
+ *      verbose:  print each command as it is received.  That is a write to
+ *                stdout per command, so it is off unless asked for.
+ */
+void set_server_verbose(int verbose) {
+    g_server_verbose = verbose;
+}
+
+/*
+ * set_server_metrics(addr)
+ *      addr:  port or local socket to serve metrics on, see
+ *             rsh_metrics_serve().  Must be called before start_server().
+ */
+void set_server_metrics(const char *addr) {
+    g_metrics_addr = addr;
+}
+
+/*
+ * set_server_spawners(nspawners)
+ *      nspawners:  most pre-forked spawner processes to keep, 0 makes the
+ *                  server fork commands itself.  Must be called before
+ *                  start_server().
+ */
+void set_server_spawners(int nspawners) {
+    g_server_spawners = nspawners;
+}
 
 /*
  * start_server(ifaces, port, is_threaded)
@@ -33,6 +101,9 @@ volatile int g_server_should_exit = 0;  // Flag to signal server shutdown
  *              where the server will bind.  In almost all cases it will
  *              be the default "0.0.0.0" which binds to all interfaces.
  *              note the constant RDSH_DEF_SVR_INTFACE in rshlib.h
+ *              A Unix socket path (containing a '/') or @name for the
+ *              abstract namespace listens on AF_UNIX instead, see
+ *              rsh_sockaddr().
  * 
  *      port:   The port the server will use.  Note the constant 
  *              RDSH_DEF_PORT which is 1234 in rshlib.h.  If you are using
@@ -61,25 +132,56 @@ int start_server(char *ifaces, int port, int is_threaded) {
 
     // Set up threading mode if requested
     g_is_threaded = is_threaded;
-    if (g_is_threaded) {
+    if (g_is_threaded == RSH_SVR_REACTOR) {
+        printf("Starting server in event-driven mode\n");
+    } else if (g_is_threaded == RSH_SVR_POOL) {
+        printf("Starting server in worker pool mode\n");
+    } else if (g_is_threaded) {
         printf("Starting server in threaded mode\n");
     } else {
         printf("Starting server in single-threaded mode\n");
     }
 
+    // A client that disconnects mid-reply must not take the server down,
+    // writes to it fail with EPIPE instead.  Children get SIGPIPE back
+    // in rsh_child_setup().
+    signal(SIGPIPE, SIG_IGN);
+
+    // Before anything else is opened, the spawners inherit it all; the
+    // stale path pipe is one thing they should inherit
+    cmd_hash_init();
+    rsh_spawner_init(g_server_spawners);
+
     svr_socket = boot_server(ifaces, port);
     if (svr_socket < 0) {
         int err_code = svr_socket;
+        rsh_spawner_shutdown();
         return err_code;
     }
+    if (g_metrics_addr != NULL && rsh_metrics_serve(g_metrics_addr) != OK) {
+        stop_server(svr_socket);
+        rsh_spawner_shutdown();
+        return ERR_RDSH_SERVER;
+    }
 
     rc = process_cli_requests(svr_socket);
 
     stop_server(svr_socket);
+    rsh_metrics_stop();
+    rsh_spawner_shutdown();
 
     return rc;
 }
 
+/*
+ * Undoes server-only process state in a freshly forked command.  Ignored
+ * signals survive exec(), and `yes | head` relies on SIGPIPE.
+ */
+static void rsh_child_setup(void) {
+    signal(SIGPIPE, SIG_DFL);
+    rsh_limits_child();
+}
+
 /*
  * stop_server(svr_socket)
  *      svr_socket: The socket that was created in the boot_server()
@@ -89,9 +191,24 @@ int start_server(char *ifaces, int port, int is_threaded) {
  *      the socket.  
  */
 int stop_server(int svr_socket) {
-    // Clean up threading resources
+    struct sockaddr_un addr;
+    socklen_t addr_len = sizeof(addr);
+
+    // Clean up threading resources, unless a session never drained
     if (g_is_threaded) {
-        pthread_mutex_destroy(&g_client_mutex);
+        pthread_mutex_lock(&g_client_mutex);
+        int active = g_active_clients;
+        pthread_mutex_unlock(&g_client_mutex);
+        if (active == 0) {
+            pthread_mutex_destroy(&g_client_mutex);
+        }
+    }
+
+    // A Unix socket file outlives the socket, abstract names don't
+    if (getsockname(svr_socket, (struct sockaddr *)&addr, &addr_len) == 0 &&
+        addr.sun_family == AF_UNIX && addr_len > offsetof(struct sockaddr_un, sun_path) &&
+        addr.sun_path[0] != '\0') {
+        unlink(addr.sun_path);
     }
     
     return close(svr_socket);
@@ -133,33 +250,40 @@ int stop_server(int svr_socket) {
 int boot_server(char *ifaces, int port) {
     int svr_socket;
     int ret;
-    struct sockaddr_in addr;
+    struct sockaddr_storage addr;
+
+    // A Unix socket path or @name instead of an IP address selects AF_UNIX
+    int addr_len = rsh_sockaddr(ifaces, port, &addr);
+    if (addr_len < 0) {
+        return ERR_RDSH_COMMUNICATION;
+    }
 
     // Create a socket
-    svr_socket = socket(AF_INET, SOCK_STREAM, 0);
+    svr_socket = socket(addr.ss_family, SOCK_STREAM, 0);
     if (svr_socket < 0) {
         perror("socket");
         return ERR_RDSH_COMMUNICATION;
     }
 
-    // Set socket to reuse address
+    // Set socket to reuse address, a Unix socket file left behind by an
+    // earlier server is replaced
     int enable = 1;
     setsockopt(svr_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
-
-    // Set up the server address structure
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    
-    // Convert IP address from text to binary form
-    if (inet_pton(AF_INET, ifaces, &addr.sin_addr) <= 0) {
-        perror("inet_pton");
-        close(svr_socket);
-        return ERR_RDSH_COMMUNICATION;
+    if (g_server_acceptors > 1 && addr.ss_family == AF_UNIX) {
+        printf("-k needs a TCP address, running one acceptor\n");
+        g_server_acceptors = 1;
+    } else if (g_server_acceptors > 1) {
+        setsockopt(svr_socket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int));
+    }
+    if (addr.ss_family == AF_UNIX && ifaces[0] != '@') {
+        struct stat sb;
+        if (stat(ifaces, &sb) == 0 && S_ISSOCK(sb.st_mode)) {
+            unlink(ifaces);
+        }
     }
 
     // Bind the socket to the address
-    if (bind(svr_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    if (bind(svr_socket, (struct sockaddr *)&addr, addr_len) < 0) {
         perror("bind");
         close(svr_socket);
         return ERR_RDSH_COMMUNICATION;
@@ -177,69 +301,91 @@ int boot_server(char *ifaces, int port) {
 }
 
 /*
- * process_cli_requests(svr_socket)
- *      svr_socket:  The server socket that was obtained from boot_server()
- *   
- *  This function handles managing client connections.  It does this using
- *  the following logic
- * 
- *      1.  Starts a while(1) loop:
- *  
- *          a. Calls accept() to wait for a client connection. Recall that 
- *             the accept() function returns another socket specifically
- *             bound to a client connection. 
- *          b. Calls exec_client_requests() to handle executing commands
- *             sent by the client. It will use the socket returned from
- *             accept().
- *          c. Loops back to the top (step 2) to accept connecting another
- *             client.  
- * 
- *          note that the exec_client_requests() return code should be
- *          negative if the client requested the server to stop by sending
- *          the `stop-server` command.  If this is the case step 2b breaks
- *          out of the while(1) loop. 
- * 
- *      2.  After we exit the loop, we need to cleanup.  Dont forget to 
- *          free the buffer you allocated in step #1.  Then call stop_server()
- *          to close the server socket. 
- * 
- *  Returns:
- * 
- *      OK_EXIT:  When the client sends the `stop-server` command this function
- *                should return OK_EXIT. 
- * 
- *      ERR_RDSH_COMMUNICATION:  This error code terminates the loop and is
- *                returned from this function in the case of the accept() 
- *                function failing. 
- * 
- *      OTHERS:   See exec_client_requests() for return codes.  Note that positive
- *                values will keep the loop running to accept additional client
- *                connections, and negative values terminate the server. 
- * 
+ * Starts the shutdown of the single and threaded servers, from anywhere:
+ * stop-server in a session thread, the acceptor, or a signal handler
+ * (write() is async-signal-safe).
  */
-int process_cli_requests(int svr_socket) {
+static void server_stop(void) {
+    uint64_t one = 1;
+
+    if (g_stop_fd >= 0) {
+        ssize_t unused = write(g_stop_fd, &one, sizeof(one));
+        (void)unused;
+    }
+}
+
+static void server_stop_signal(int sig) {
+    (void)sig;
+    server_stop();
+}
+
+/*
+ * Waits for the session threads to drain.  They give up on commands still
+ * running after RSH_DRAIN_SECS, so this only takes longer if one is stuck
+ * writing to a client that doesn't read.
+ */
+static void server_drain(void) {
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += RSH_DRAIN_SECS + 2;
+
+    pthread_mutex_lock(&g_client_mutex);
+    if (g_active_clients > 0) {
+        printf("draining %d clients\n", g_active_clients);
+        fflush(stdout);
+    }
+    while (g_active_clients > 0) {
+        if (pthread_cond_timedwait(&g_clients_done, &g_client_mutex, &deadline) == ETIMEDOUT) {
+            printf("%d clients did not drain in time\n", g_active_clients);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_client_mutex);
+}
+
+/*
+ * One accept loop.  The threaded server runs g_server_acceptors of them,
+ * each on its own listening socket; idx is which one, for the counters.
+ */
+static int accept_loop(int svr_socket, int idx) {
     int cli_socket;
     int rc = OK;
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
+    struct sockaddr_storage client_addr;
+    socklen_t client_len;
     pthread_t thread_id;
 
     while (1) {
-        // Check if we should stop the server
-        if (g_server_should_exit) {
-            return OK_EXIT;
+        // Wait for a client, or to be told to stop
+        struct pollfd pfds[2] = {
+            { .fd = svr_socket, .events = POLLIN },
+            { .fd = g_stop_fd, .events = POLLIN },
+        };
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            rc = ERR_RDSH_COMMUNICATION;
+            break;
+        }
+        if (pfds[1].revents != 0) {
+            rc = OK_EXIT;
+            break;
         }
         
-        // Accept connection from client
+        // Accept connection from client, accept() shrinks client_len to fit
+        client_len = sizeof(client_addr);
         cli_socket = accept(svr_socket, (struct sockaddr *)&client_addr, &client_len);
         if (cli_socket < 0) {
-            // If we were interrupted by a signal, check if server should exit
-            if (errno == EINTR && g_server_should_exit) {
-                return OK_EXIT;
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
             }
             perror("accept");
-            return ERR_RDSH_COMMUNICATION;
+            rc = ERR_RDSH_COMMUNICATION;
+            break;
         }
+        rsh_sock_nodelay(cli_socket);
+        rsh_timeouts_sock(cli_socket);
+        rsh_metrics_add(RSH_M_CONNS, 1);
         
         if (g_is_threaded) {
             // Handle client in a new thread
@@ -255,6 +401,7 @@ int process_cli_requests(int svr_socket) {
             // Update active client count
             pthread_mutex_lock(&g_client_mutex);
             g_active_clients++;
+            g_acceptor_conns[idx]++;
             pthread_mutex_unlock(&g_client_mutex);
             
             // Create new thread to handle client
@@ -262,6 +409,7 @@ int process_cli_requests(int svr_socket) {
                 perror("pthread_create");
                 close(cli_socket);
                 free(client_sock);
+                rsh_metrics_add(RSH_M_CONNS_CLOSED, 1);
                 
                 pthread_mutex_lock(&g_client_mutex);
                 g_active_clients--;
@@ -274,21 +422,187 @@ int process_cli_requests(int svr_socket) {
             pthread_detach(thread_id);
         } else {
             // Handle client in main thread (non-threaded mode)
+            g_acceptor_conns[idx]++;
             rc = exec_client_requests(cli_socket);
             close(cli_socket);
+            rsh_metrics_add(RSH_M_CONNS_CLOSED, 1);
             
             if (rc == OK_EXIT) {
                 printf(RCMD_MSG_SVR_STOP_REQ);
-                return OK_EXIT;
+                break;
             } else if (rc == OK) {
                 printf(RCMD_MSG_CLIENT_EXITED);
             } else {
                 printf(CMD_ERR_RDSH_ITRNL, rc);
-                return rc;
+                break;
             }
         }
     }
 
+    // No new sessions from here on, connecting clients are refused rather
+    // than left in the backlog
+    server_stop();
+    shutdown(svr_socket, SHUT_RDWR);
+    return rc;
+}
+
+typedef struct acceptor {
+    pthread_t tid;
+    int       sock;
+    int       idx;
+} acceptor_t;
+
+static void *acceptor_thread(void *arg) {
+    acceptor_t *a = arg;
+
+    accept_loop(a->sock, a->idx);
+    return NULL;
+}
+
+/*
+ * Another listening socket on the address svr_socket is bound to.  Both
+ * have SO_REUSEPORT, so the kernel spreads new connections over them.
+ */
+static int listen_again(int svr_socket) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    int enable = 1;
+
+    if (getsockname(svr_socket, (struct sockaddr *)&addr, &addr_len) < 0) {
+        perror("getsockname");
+        return -1;
+    }
+    int sock = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int));
+    if (bind(sock, (struct sockaddr *)&addr, addr_len) < 0 || listen(sock, 20) < 0) {
+        perror("bind");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/*
+ * process_cli_requests(svr_socket)
+ *      svr_socket:  The server socket that was obtained from boot_server()
+ *   
+ *  This function handles managing client connections.  It does this using
+ *  the following logic
+ * 
+ *      1.  Starts a while(1) loop:
+ *  
+ *          a. Calls accept() to wait for a client connection. Recall that 
+ *             the accept() function returns another socket specifically
+ *             bound to a client connection. 
+ *          b. Calls exec_client_requests() to handle executing commands
+ *             sent by the client. It will use the socket returned from
+ *             accept().
+ *          c. Loops back to the top (step 2) to accept connecting another
+ *             client.  
+ * 
+ *          note that the exec_client_requests() return code should be
+ *          negative if the client requested the server to stop by sending
+ *          the `stop-server` command.  If this is the case step 2b breaks
+ *          out of the while(1) loop. 
+ * 
+ *          The loop poll()s the server socket together with an eventfd
+ *          that stop-server, SIGTERM and SIGINT write to, so stopping
+ *          doesn't wait for one more client to connect.  The threaded
+ *          server then waits for its sessions to drain, see
+ *          exec_client_requests().
+ * 
+ *      2.  After we exit the loop, we need to cleanup.  Dont forget to 
+ *          free the buffer you allocated in step #1.  Then call stop_server()
+ *          to close the server socket. 
+ * 
+ *  Returns:
+ * 
+ *      OK_EXIT:  When the client sends the `stop-server` command this function
+ *                should return OK_EXIT. 
+ * 
+ *      ERR_RDSH_COMMUNICATION:  This error code terminates the loop and is
+ *                returned from this function in the case of the accept() 
+ *                function failing. 
+ * 
+ *      OTHERS:   See exec_client_requests() for return codes.  Note that positive
+ *                values will keep the loop running to accept additional client
+ *                connections, and negative values terminate the server. 
+ * 
+ */
+int process_cli_requests(int svr_socket) {
+    acceptor_t acceptors[RSH_ACCEPTORS_MAX];
+    int nacceptors = 1;
+    int rc;
+
+    // The reactor and the pool run their own accept loops
+    if (g_is_threaded == RSH_SVR_REACTOR) {
+        return rsh_reactor_run(svr_socket, g_server_threads);
+    } else if (g_is_threaded == RSH_SVR_POOL) {
+        return rsh_pool_run(svr_socket, g_server_threads);
+    }
+
+    // stop-server, SIGTERM and SIGINT all stop the server the same way
+    g_stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (g_stop_fd < 0) {
+        perror("eventfd");
+        return ERR_RDSH_SERVER;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = server_stop_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    // Extra accept loops for -k, this thread runs the first one
+    for (int i = 1; i < g_server_acceptors && g_is_threaded; i++) {
+        acceptor_t *a = &acceptors[nacceptors];
+        a->idx = nacceptors;
+        a->sock = listen_again(svr_socket);
+        if (a->sock < 0) break;
+        if (pthread_create(&a->tid, NULL, acceptor_thread, a) != 0) {
+            perror("pthread_create");
+            close(a->sock);
+            break;
+        }
+        nacceptors++;
+    }
+    g_server_acceptors = nacceptors;
+    if (nacceptors > 1) {
+        printf("%d acceptors on SO_REUSEPORT sockets\n", nacceptors);
+    }
+
+    rc = accept_loop(svr_socket, 0);
+
+    // The sessions running finish the commands they have in flight, at
+    // most RSH_DRAIN_SECS, then hang up
+    g_server_should_exit = 1;
+    for (int i = 1; i < nacceptors; i++) {
+        pthread_join(acceptors[i].tid, NULL);
+        close(acceptors[i].sock);
+    }
+    if (g_is_threaded) {
+        server_drain();
+    }
+
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+
+    // Sessions that didn't drain still poll the eventfd, its number must
+    // not be reused under them
+    pthread_mutex_lock(&g_client_mutex);
+    if (g_active_clients == 0) {
+        close(g_stop_fd);
+        g_stop_fd = -1;
+    } else {
+        g_stop_fd_orphaned = true;
+    }
+    pthread_mutex_unlock(&g_client_mutex);
     return rc;
 }
 
@@ -305,6 +619,7 @@ void *handle_client(void *arg) {
     
     // Close the client socket
     close(cli_socket);
+    rsh_metrics_add(RSH_M_CONNS_CLOSED, 1);
     
     // Update active client count
     pthread_mutex_lock(&g_client_mutex);
@@ -312,12 +627,21 @@ void *handle_client(void *arg) {
     
     // Check if server should exit
     if (rc == OK_EXIT) {
-        // Signal the main thread to stop the server
+        // Wake the main thread out of poll() to stop the server
         printf(RCMD_MSG_SVR_STOP_REQ);
         g_server_should_exit = 1;
+        server_stop();
     } else if (rc == OK) {
         printf(RCMD_MSG_CLIENT_EXITED);
     }
+    if (g_active_clients == 0) {
+        pthread_cond_signal(&g_clients_done);
+        if (g_stop_fd_orphaned) {
+            close(g_stop_fd);
+            g_stop_fd = -1;
+            g_stop_fd_orphaned = false;
+        }
+    }
     
     pthread_mutex_unlock(&g_client_mutex);
     
@@ -325,6 +649,32 @@ void *handle_client(void *arg) {
     return NULL;
 }
 
+/*
+ * Answers the CMD in hdr, and every CMD already waiting on the socket,
+ * with CMD_ERR_RDSH_STOPPING before a stopping server hangs up.  Frames
+ * that aren't commands, like the data of a queued put, are dropped.
+ */
+static void refuse_queued(int cli_socket, rsh_frame_hdr_t *hdr, char *io_buff) {
+    struct pollfd pfd = { .fd = cli_socket, .events = POLLIN };
+
+    if (rsh_send_reply(cli_socket, hdr->stream, CMD_ERR_RDSH_STOPPING, 1) != OK) {
+        return;
+    }
+    while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+        if (rsh_recv_frame(cli_socket, hdr, io_buff, RSH_FRAME_MAX) != OK) {
+            break;
+        }
+        if (hdr->type == RSH_FRAME_CMD &&
+            rsh_send_reply(cli_socket, hdr->stream, CMD_ERR_RDSH_STOPPING, 1) != OK) {
+            break;
+        }
+    }
+}
+
+// pfd_stage[] values for a command's output pipes
+#define PFD_STDOUT  -1
+#define PFD_STDERR  -2
+
 /*
  * exec_client_requests(cli_socket)
  *      cli_socket:  The server-side socket that is connected to the client
@@ -346,10 +696,32 @@ void *handle_client(void *arg) {
  *  arrive over the recv() socket call rather than reading a string from the
  *  keyboard. 
  * 
- *  This function also must send the EOF character after a command is
- *  successfully executed to let the client know that the output from the
- *  command it sent is finished.  Use the send_message_eof() to accomplish 
- *  this. 
+ *  Commands arrive as CMD frames after the HELLO exchange.  A command's
+ *  output is sent back as STDOUT frames followed by an END frame carrying
+ *  the same stream id, which tells the client the command is finished.
+ *  recv() may return a command in pieces; rsh_recv_frame() waits for all
+ *  of it.
+ *
+ *  A client doesn't have to wait for one command to finish before sending
+ *  the next, up to RSH_MAX_STREAMS may run at once.  So rather than
+ *  blocking on one command, this loop poll()s the socket, every running
+ *  command's stdout and stderr pipes and every stage's pidfd, relays
+ *  output as it shows up (STDOUT and STDERR frames) and sends each
+ *  command's END frame with its exit status once it has exited.
+ *
+ *  Each connection is its own shell session: `cd`, `export` and `unset`
+ *  change its rsh_shell_t and nothing else, so with -x one client's `cd`
+ *  doesn't move another's commands (see rsh_shell.c).
+ *
+ *  A client that has gone quiet with nothing running is sent a PING, and
+ *  the connection is dropped if no answer comes, or once it has been idle
+ *  longer than -T allows (see rsh_timer.c).  The poll() timeout is the
+ *  next of those deadlines; one connection has one timer, no wheel.
+ *
+ *  When the server is stopping (stop-server from another client, SIGTERM)
+ *  the commands already running get up to RSH_DRAIN_SECS to finish, new
+ *  ones are turned away, and the connection is closed once the last one
+ *  has ended.  Anything still running after that is killed.
  * 
  *  Of final note, this function must allocate a buffer for storage to 
  *  store the data received by the client. For example:
@@ -367,126 +739,319 @@ void *handle_client(void *arg) {
  *                or receive errors. 
  */
 int exec_client_requests(int cli_socket) {
-    int io_size;
-    command_list_t cmd_list;
-    int rc;
-    int cmd_rc;
+    rsh_stream_t streams[RSH_MAX_STREAMS];
+    rsh_shell_t shell;
+    struct pollfd pfds[1 + RSH_MAX_STREAMS * (CMD_MAX + 2)];
+    rsh_stream_t *pfd_stream[1 + RSH_MAX_STREAMS * (CMD_MAX + 2)];
+    int pfd_stage[1 + RSH_MAX_STREAMS * (CMD_MAX + 2)];    //or PFD_STDOUT/ERR
+    rsh_frame_hdr_t hdr;
+    int rc = OK;
+    int last_rc = 0;        // what `rc` reports for this connection
+    bool held = false;      // hdr and io_buff hold a CMD that must wait
+    bool draining = false;  // the server is stopping, no new commands
+    struct timespec drain_end;
+    rsh_live_t live;        // when we last heard from the client
+    long live_due = 0;      // when to look at live again, 0 each pass
     char *io_buff;
 
-    // Allocate input/output buffer
-    io_buff = malloc(RDSH_COMM_BUFF_SZ);
+    // Allocate input/output buffer, one byte more for the NUL
+    io_buff = malloc(RSH_FRAME_MAX + 1);
     if (io_buff == NULL) {
         return ERR_RDSH_SERVER;
     }
 
-    while (1) {
-        // Clear buffer
-        memset(io_buff, 0, RDSH_COMM_BUFF_SZ);
-        
-        // Receive command from client
-        io_size = recv(cli_socket, io_buff, RDSH_COMM_BUFF_SZ - 1, 0);
-        
-        // Check for errors or closed connection
-        if (io_size <= 0) {
-            if (io_size < 0) {
-                perror("recv");
+    // Commands read /dev/null, the socket only carries frames
+    int devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (devnull < 0) {
+        free(io_buff);
+        return ERR_RDSH_SERVER;
+    }
+    rsh_stream_init(streams, RSH_MAX_STREAMS);
+    rsh_shell_init(&shell);
+    rsh_live_init(&live, rsh_timer_now_ms());
+
+    while (rc == OK) {
+        int n = 0;
+        int timeout = -1;
+        bool busy = false;
+        pfds[n].fd = held ? -1 : cli_socket;    //no reading past a held CMD
+        pfds[n++].events = POLLIN;
+        for (int i = 0; i < RSH_MAX_STREAMS; i++) {
+            rsh_stream_t *st = &streams[i];
+            if (!st->active) continue;
+            busy = true;
+            if (st->out_fd >= 0) {
+                pfd_stream[n] = st;
+                pfd_stage[n] = PFD_STDOUT;
+                pfds[n].fd = st->out_fd;
+                pfds[n++].events = POLLIN;
+            }
+            if (st->err_fd >= 0) {
+                pfd_stream[n] = st;
+                pfd_stage[n] = PFD_STDERR;
+                pfds[n].fd = st->err_fd;
+                pfds[n++].events = POLLIN;
+            }
+            for (int j = 0; j < st->nprocs; j++) {
+                if (st->pidfds[j] < 0) continue;
+                pfd_stream[n] = st;
+                pfd_stage[n] = j;
+                pfds[n].fd = st->pidfds[j];
+                pfds[n++].events = POLLIN;
             }
-            free(io_buff);
-            return ERR_RDSH_COMMUNICATION;
         }
-        
-        // Make sure buffer is null-terminated
-        io_buff[io_size] = '\0';
-        
-        // Print received command for debugging
-        printf(RCMD_MSG_SVR_EXEC_REQ, io_buff);
-        
-        // Check for exit command
-        if (strcmp(io_buff, EXIT_CMD) == 0) {
-            char *exit_msg = "exiting...\n";
-            send_message_string(cli_socket, exit_msg);
-            free(io_buff);
-            return OK;
+
+        int nstreams = n;
+        if (draining) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long ms = (drain_end.tv_sec - now.tv_sec) * 1000 +
+                      (drain_end.tv_nsec - now.tv_nsec) / 1000000;
+            if (nstreams == 1 || ms <= 0) {
+                break;          // drained, or out of time: the rest is killed
+            }
+            timeout = (int)ms;
+        } else {
+            pfds[n].fd = g_stop_fd;
+            pfds[n++].events = POLLIN;
         }
-        
-        // Check for stop-server command
-        if (strcmp(io_buff, "stop-server") == 0) {
-            char *stop_msg = "stopping server...\n";
-            send_message_string(cli_socket, stop_msg);
-            free(io_buff);
-            return OK_EXIT;
+
+        // Heartbeat and idle timeout, see rsh_timer.c
+        long now = rsh_timer_now_ms();
+        if (!draining && (live_due == 0 || now >= live_due)) {
+            int live_rc = rsh_live_check(&live, now, busy, &live_due);
+            if (live_rc == RSH_LIVE_PING) {
+                rsh_send_frame_nowait(cli_socket, RSH_FRAME_PING, 0, NULL, 0);
+            } else if (live_rc == RSH_LIVE_DEAD || live_rc == RSH_LIVE_IDLE) {
+                if (live_rc == RSH_LIVE_IDLE) {
+                    rsh_send_frame_nowait(cli_socket, RSH_FRAME_STDERR, 0, CMD_ERR_RDSH_IDLE,
+                                          strlen(CMD_ERR_RDSH_IDLE));
+                }
+                rsh_metrics_add((live_rc == RSH_LIVE_DEAD) ? RSH_M_REAPED_DEAD : RSH_M_REAPED_IDLE, 1);
+                break;
+            }
         }
-        
-        // Build command list from input
-        memset(&cmd_list, 0, sizeof(command_list_t));
-        rc = build_cmd_list(io_buff, &cmd_list);
-        
-        // Handle parsing errors
-        if (rc == WARN_NO_CMDS) {
-            send_message_string(cli_socket, CMD_WARN_NO_CMD);
-            continue;
-        } else if (rc == ERR_TOO_MANY_COMMANDS) {
-            char error_msg[100];
-            sprintf(error_msg, CMD_ERR_PIPE_LIMIT, CMD_MAX);
-            send_message_string(cli_socket, error_msg);
-            continue;
-        } else if (rc != OK) {
-            char error_msg[100];
-            sprintf(error_msg, "Error parsing command: %d\n", rc);
-            send_message_string(cli_socket, error_msg);
-            continue;
+        if (!draining && live_due > 0) {
+            timeout = (live_due > now) ? (int)(live_due - now) : 0;
+        }
+
+        if (poll(pfds, n, timeout) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            rc = ERR_RDSH_COMMUNICATION;
+            break;
+        }
+        if (n > nstreams && pfds[nstreams].revents != 0) {
+            draining = true;
+            clock_gettime(CLOCK_MONOTONIC, &drain_end);
+            drain_end.tv_sec += RSH_DRAIN_SECS;
+        }
+
+        // Output and exits first, so replies go out before new work starts
+        for (int k = 1; k < nstreams && rc == OK; k++) {
+            rsh_stream_t *st = pfd_stream[k];
+            if (pfds[k].revents == 0) continue;
+
+            if (pfd_stage[k] >= 0) {
+                rsh_stream_reap(st, pfd_stage[k], WNOHANG);
+                continue;
+            }
+            int *fd = (pfd_stage[k] == PFD_STDOUT) ? &st->out_fd : &st->err_fd;
+            int type = (pfd_stage[k] == PFD_STDOUT) ? RSH_FRAME_STDOUT : RSH_FRAME_STDERR;
+            int relayed = rsh_relay_chunk(*fd, cli_socket, type, st->id, st->compress);
+            rsh_stream_sent(st, NULL, relayed);
+            if (relayed == 0) {
+                close(*fd);
+                *fd = -1;
+            } else if (relayed == ERR_RDSH_COMMUNICATION) {
+                rc = relayed;
+            }
+        }
+        for (int i = 0; i < RSH_MAX_STREAMS && rc == OK; i++) {
+            if (rsh_stream_done(&streams[i])) {
+                if (streams[i].get) {
+                    rc = rsh_send_sum(cli_socket, streams[i].id, streams[i].get_size,
+                                      streams[i].get_crc);
+                }
+                if (rc == OK) {
+                    rc = rsh_send_end(cli_socket, streams[i].id, streams[i].status);
+                }
+                last_rc = streams[i].status;
+                rsh_stream_close(&streams[i]);
+                rsh_live_active(&live, rsh_timer_now_ms());
+            }
         }
-        
-        // Execute command pipeline
-        cmd_rc = rsh_execute_pipeline(cli_socket, &cmd_list);
-        
-        // Send EOF to indicate command completion
-        rc = send_message_eof(cli_socket);
         if (rc != OK) {
-            printf(CMD_ERR_RDSH_COMM);
-            free(io_buff);
-            free_cmd_list(&cmd_list);
-            return ERR_RDSH_COMMUNICATION;
+            continue;
         }
-        
-        // Free command list resources
-        free_cmd_list(&cmd_list);
-        
-        // Check for special built-in command results
-        if (cmd_rc == EXIT_SC) {
-            free(io_buff);
-            return OK_EXIT;
+
+        if (!held) {
+            if (pfds[0].revents == 0) {
+                continue;
+            }
+            rc = rsh_recv_frame(cli_socket, &hdr, io_buff, RSH_FRAME_MAX);
+            if (rc == WARN_RDSH_CLOSED) {
+                break;          // Client went away without saying exit
+            } else if (rc != OK) {
+                printf(CMD_ERR_RDSH_COMM);
+                rc = ERR_RDSH_COMMUNICATION;
+                break;
+            }
+            rsh_metrics_add(RSH_M_BYTES_IN, RSH_FRAME_HDR_SZ + hdr.len);
+            rsh_live_rx(&live, rsh_timer_now_ms());
         }
+
+        if (hdr.type == RSH_FRAME_HELLO) {
+            // Offer compression back if the client asked for it
+            rc = rsh_send_frame_flags(cli_socket, RSH_FRAME_HELLO, hdr.flags & RSH_HELLO_LZ, 0,
+                                      NULL, 0);
+        } else if (hdr.type == RSH_FRAME_CMD && draining) {
+            // Running commands may finish, new ones don't start
+            held = false;
+            rc = rsh_send_reply(cli_socket, hdr.stream, CMD_ERR_RDSH_STOPPING, 1);
+        } else if (hdr.type == RSH_FRAME_CMD) {
+            // A batched command waits for the one before it to end
+            held = rsh_stream_must_wait(streams, RSH_MAX_STREAMS, hdr.flags,
+                                        rsh_stream_stages(io_buff, hdr.len));
+            if (held) {
+                continue;
+            }
+            // Commands are text, the frame length tells us where it ends
+            io_buff[hdr.len] = '\0';
+            rsh_live_active(&live, rsh_timer_now_ms());
+            rc = rsh_start_command(cli_socket, streams, &shell, hdr.stream, hdr.flags, io_buff,
+                                   &last_rc, devnull);
+        }
+    }
+
+    // A CMD held for its turn when the drain ran out, and any the client
+    // queued behind it, still get their END instead of silence
+    if (held && rc == OK) {
+        refuse_queued(cli_socket, &hdr, io_buff);
     }
 
-    // Should never reach here, but clean up just in case
+    // Commands still running die with the connection
+    for (int i = 0; i < RSH_MAX_STREAMS; i++) {
+        rsh_stream_close(&streams[i]);
+    }
+    rsh_shell_free(&shell);
+    close(devnull);
     free(io_buff);
-    return OK;
+
+    if (rc == STOP_SERVER_SC) {
+        return OK_EXIT;
+    } else if (rc == EXIT_SC || rc == WARN_RDSH_CLOSED) {
+        return OK;
+    }
+    return rc;
+}
+
+/*
+ * rsh_start_command(cli_socket, streams, sh, stream, flags, cmd_line, last_rc, in_fd)
+ *      streams:   the connection's stream slots
+ *      sh:        the connection's working directory and environment
+ *      stream:    id from the CMD frame
+ *      flags:     RSH_CMD_* flags from the CMD frame
+ *      cmd_line:  NUL terminated command from the CMD frame
+ *      last_rc:   the connection's last exit status, updated for
+ *                 commands that finish right away
+ *      in_fd:     stdin for pipelines
+ *
+ *  Parses cmd_line and starts it in a free slot.  Anything that finishes
+ *  right away (errors, `exit`, `stop-server`, a full stream table) gets its
+ *  whole reply here, and so does a `put`, which holds the connection until
+ *  the file is in.  Builtins also finish right away, but their output
+ *  is relayed from the slot like any other command.
+ *
+ *  Returns:
+ *      OK:                       keep serving the connection
+ *      EXIT_SC, STOP_SERVER_SC:  the client is done / the server should stop
+ *      ERR_RDSH_COMMUNICATION:   a reply could not be sent
+ */
+int rsh_start_command(int cli_socket, rsh_stream_t *streams, rsh_shell_t *sh, uint32_t stream,
+                      uint16_t flags, char *cmd_line, int *last_rc, int in_fd) {
+    command_list_t cmd_list;
+    char error_msg[100];
+    int rc;
+
+    // Print received command for debugging, with -v
+    if (g_server_verbose) {
+        printf(RCMD_MSG_SVR_EXEC_REQ, cmd_line);
+    }
+
+    // Check for exit command
+    if (strcmp(cmd_line, EXIT_CMD) == 0) {
+        rsh_send_reply(cli_socket, stream, "exiting...\n", 0);
+        return EXIT_SC;
+    }
+
+    // Check for stop-server command
+    if (strcmp(cmd_line, "stop-server") == 0) {
+        rsh_send_reply(cli_socket, stream, "stopping server...\n", 0);
+        return STOP_SERVER_SC;
+    }
+
+    // Build command list from input
+    memset(&cmd_list, 0, sizeof(command_list_t));
+    rc = build_cmd_list(cmd_line, &cmd_list);
+
+    // Handle parsing errors
+    if (rc == WARN_NO_CMDS) {
+        return rsh_send_reply(cli_socket, stream, CMD_WARN_NO_CMD, 0);
+    } else if (rc == ERR_TOO_MANY_COMMANDS) {
+        snprintf(error_msg, sizeof(error_msg), CMD_ERR_PIPE_LIMIT, CMD_MAX);
+        return rsh_send_reply(cli_socket, stream, error_msg, 1);
+    } else if (rc != OK) {
+        snprintf(error_msg, sizeof(error_msg), "Error parsing command: %d\n", rc);
+        return rsh_send_reply(cli_socket, stream, error_msg, 1);
+    }
+
+    // A put takes the file off the socket right here, see rsh_xfer.c
+    if (cmd_list.num == 1 && strcmp(cmd_list.commands[0].argv[0], RSH_PUT_CMD) == 0) {
+        rc = rsh_xfer_put(cli_socket, stream, &cmd_list.commands[0], sh->cwd_fd);
+        if (rc >= 0) {
+            *last_rc = rc;
+            rc = rsh_send_end(cli_socket, stream, rc);
+        }
+        free_cmd_list(&cmd_list);
+        return rc;
+    }
+
+    rsh_stream_t *st = rsh_stream_slot(streams, RSH_MAX_STREAMS);
+    if (st == NULL) {
+        rc = rsh_send_reply(cli_socket, stream, CMD_ERR_RDSH_BUSY, 1);
+    } else {
+        rc = rsh_stream_start(st, stream, sh, &cmd_list, *last_rc, in_fd);
+        st->ordered = (flags & RSH_CMD_ORDERED) && !(flags & RSH_CMD_BACKGROUND);
+        st->compress = (flags & RSH_CMD_LZ) != 0;
+        if (rc == EXIT_SC) {
+            rsh_send_reply(cli_socket, stream, "exiting...\n", 0);
+        } else if (rc == STOP_SERVER_SC) {
+            rsh_send_reply(cli_socket, stream, "stopping server...\n", 0);
+        } else if (rc != OK) {
+            *last_rc = 1;
+            rc = rsh_send_reply(cli_socket, stream, rsh_stream_error(rc, &cmd_list), 1);
+        }
+    }
+
+    free_cmd_list(&cmd_list);
+    return rc;
 }
 
 /*
  * send_message_eof(cli_socket)
  *      cli_socket:  The server-side socket that is connected to the client
 
- *  Sends the EOF character to the client to indicate that the server is
- *  finished executing the command that it sent. 
+ *  Sends the END frame for stream 0, marking the end of a reply.
  * 
  *  Returns:
  * 
- *      OK:  The EOF character was sent successfully. 
+ *      OK:  The END frame was sent successfully. 
  * 
- *      ERR_RDSH_COMMUNICATION:  The send() socket call returned an error or if
- *           we were unable to send the EOF character. 
+ *      ERR_RDSH_COMMUNICATION:  The send() socket call returned an error.
  */
 int send_message_eof(int cli_socket){
-    int send_len = (int)sizeof(RDSH_EOF_CHAR);
-    int sent_len;
-    sent_len = send(cli_socket, &RDSH_EOF_CHAR, send_len, 0);
-
-    if (sent_len != send_len){
-        return ERR_RDSH_COMMUNICATION;
-    }
-    return OK;
+    return rsh_send_end(cli_socket, 0, 0);
 }
 
 
@@ -496,70 +1061,55 @@ int send_message_eof(int cli_socket){
  *      buff:        A C string (aka null terminated) of a message we want
  *                   to send to the client. 
  *   
- *  Sends a message to the client.  Note this command executes both a send()
- *  to send the message and a send_message_eof() to send the EOF character to
- *  the client to indicate command execution terminated. 
+ *  Sends a message to the client on stream 0, followed by the END frame
+ *  to indicate command execution terminated.  See rsh_send_reply() for
+ *  other streams.
  * 
  *  Returns:
  * 
- *      OK:  The message in buff followed by the EOF character was 
- *           sent successfully. 
+ *      OK:  The message in buff followed by the END frame was sent
+ *           successfully. 
  * 
- *      ERR_RDSH_COMMUNICATION:  The send() socket call returned an error or if
- *           we were unable to send the message followed by the EOF character. 
+ *      ERR_RDSH_COMMUNICATION:  The send() socket call returned an error.
  */
 int send_message_string(int cli_socket, char *buff) {
-    ssize_t sent_len;
-    size_t msg_len;
-    
     if (buff == NULL) {
         return ERR_RDSH_COMMUNICATION;
     }
-    
-    // Get message length
-    msg_len = strlen(buff);
-    
-    // Send the message
-    sent_len = send(cli_socket, buff, msg_len, 0);
-    if (sent_len < 0 || (size_t)sent_len != msg_len) {
-        printf(CMD_ERR_RDSH_SEND, (int)sent_len, (int)msg_len);
-        return ERR_RDSH_COMMUNICATION;
-    }
-    
-    // Send EOF character
-    return send_message_eof(cli_socket);
+    return rsh_send_reply(cli_socket, 0, buff, 0);
 }
 
 
 /*
- * rsh_execute_pipeline(int cli_sock, command_list_t *clist)
+ * rsh_execute_pipeline(int cli_sock, rsh_shell_t *sh, command_list_t *clist,
+ *                      int last_rc, uint32_t stream, uint16_t flags)
  *      cli_sock:    The server-side socket that is connected to the client
+ *      sh:          The session's working directory and environment, which
+ *                   builtins may change.
  *      clist:       The command_list_t structure that we implemented in
  *                   the last shell. 
+ *      last_rc:     Exit status of the previous command on this connection,
+ *                   printed by the `rc` builtin.
+ *      stream:      Stream id of the CMD frame, output frames carry it too.
+ *      flags:       RSH_CMD_* flags of the CMD frame, RSH_CMD_LZ matters here.
  *   
- *  This function executes the command pipeline.  It should basically be a
- *  replica of the execute_pipeline() function from the last deliverable. 
- *  The only thing different is that you will be using the cli_sock as the
- *  main file descriptor on the first executable in the pipeline for STDIN,
- *  and the cli_sock for the file descriptor for STDOUT, and STDERR for the
- *  last executable in the pipeline.  See picture below:  
- * 
- *      
- *┌───────────┐                                                    ┌───────────┐
- *│ cli_sock  │                                                    │ cli_sock  │
- *└─────┬─────┘                                                    └────▲──▲───┘
- *      │   ┌──────────────┐     ┌──────────────┐     ┌──────────────┐  │  │    
- *      │   │   Process 1  │     │   Process 2  │     │   Process N  │  │  │    
- *      │   │              │     │              │     │              │  │  │    
- *      └───▶stdin   stdout├─┬──▶│stdin   stdout├─┬──▶│stdin   stdout├──┘ │    
- *          │              │ │   │              │ │   │              │     │    
- *          │        stderr├─┘   │        stderr├─┘   │        stderr├─────┘    
- *          └──────────────┘     └──────────────┘     └──────────────┘   
- *                                                      WEXITSTATUS()
- *                                                      of this last
- *                                                      process to get
- *                                                      the return code
- *                                                      for this function       
+ *  This function executes the command pipeline.  The socket carries
+ *  frames, so commands can't write to it directly any more.  Instead the
+ *  last stage's stdout goes into one pipe and every stage's stderr into
+ *  another, and the server relays them to the client as STDOUT and STDERR
+ *  frames.  The first stage reads /dev/null.  Builtins write into a pair
+ *  of memfds that are relayed the same way.
+ * 
+ *┌───────────┐                                        ┌──────────┐  STDOUT
+ *│ /dev/null │                                   ┌────▶ out pipe ├─────────┐
+ *└─────┬─────┘                                   │    └──────────┘    ┌────▼─────┐
+ *      │   ┌──────────────┐     ┌──────────────┐ │                    │ cli_sock │
+ *      └───▶stdin   stdout├────▶│stdin   stdout├─┘    ┌──────────┐    └────▲─────┘
+ *          │        stderr├──┐  │        stderr├──┬───▶ err pipe ├─────────┘
+ *          └──────────────┘  │  └──────────────┘  │   └──────────┘  STDERR
+ *                            └────────────────────┘
+ * 
+ *  The caller sends the END frame.
  * 
  *  Returns:
  * 
@@ -568,207 +1118,248 @@ int send_message_string(int cli_socket, char *buff) {
  *                  that value is returned.  Remember, use the WEXITSTATUS()
  *                  macro that we discussed during our fork/exec lecture to
  *                  get this value. 
+ *      EXIT_SC, STOP_SERVER_SC:  `exit` or `stop-server` were run as builtins
+ *      ERR_RDSH_CMD_EXEC:        the pipeline could not be started
+ *      ERR_RDSH_COMMUNICATION:   a `put` lost the client part way, see
+ *                                rsh_xfer_put(), or a `get` its SUM
+ *                                frame; drop the connection
  */
-int rsh_execute_pipeline(int cli_sock, command_list_t *clist) {
-    int pipes[clist->num - 1][2];  // Array of pipes
-    pid_t pids[clist->num];
-    int pids_st[clist->num];      // Array to store process status
-    Built_In_Cmds bi_cmd;
-    int exit_code;
+int rsh_execute_pipeline(int cli_sock, rsh_shell_t *sh, command_list_t *clist, int last_rc,
+                         uint32_t stream, uint16_t flags) {
+    rsh_stream_t st;
 
     // Check for empty command list
     if (clist == NULL || clist->num == 0) {
         return WARN_NO_CMDS;
     }
-    
-    // For single command (no pipeline)
-    if (clist->num == 1) {
-        // Check for built-in commands
-        bi_cmd = rsh_built_in_cmd(&clist->commands[0]);
-        
-        if (bi_cmd == BI_CMD_EXIT) {
-            return EXIT_SC;
-        } else if (bi_cmd == BI_CMD_STOP_SVR) {
-            return STOP_SERVER_SC;
-        } else if (bi_cmd == BI_EXECUTED) {
-            // Built-in command was executed
-            return OK;
-        }
-        
-        // Non-built-in command, execute using fork/exec
-        pid_t pid = fork();
-        
-        if (pid < 0) {
-            // Fork failed
-            perror("fork");
-            return ERR_RDSH_CMD_EXEC;
-        } else if (pid == 0) {
-            // Child process
-            
-            // Set up redirection
-            if (clist->commands[0].input_file == NULL) {
-                // No input redirection, use socket for stdin
-                dup2(cli_sock, STDIN_FILENO);
-            } else {
-                // Input redirection from file
-                int fd = open(clist->commands[0].input_file, O_RDONLY);
-                if (fd < 0) {
-                    perror(clist->commands[0].input_file);
-                    exit(EXIT_FAILURE);
-                }
-                dup2(fd, STDIN_FILENO);
-                close(fd);
-            }
-            
-            if (clist->commands[0].output_file == NULL) {
-                // No output redirection, use socket for stdout and stderr
-                dup2(cli_sock, STDOUT_FILENO);
-                dup2(cli_sock, STDERR_FILENO);
-            } else {
-                // Output redirection to file
-                int flags = O_WRONLY | O_CREAT;
-                if (clist->commands[0].append_mode) {
-                    flags |= O_APPEND;
-                } else {
-                    flags |= O_TRUNC;
-                }
-                
-                int fd = open(clist->commands[0].output_file, flags, 0644);
-                if (fd < 0) {
-                    perror(clist->commands[0].output_file);
-                    exit(EXIT_FAILURE);
-                }
-                dup2(fd, STDOUT_FILENO);
-                close(fd);
-                
-                // Redirect stderr to socket
-                dup2(cli_sock, STDERR_FILENO);
-            }
-            
-            // Execute command
-            execvp(clist->commands[0].argv[0], clist->commands[0].argv);
-            
-            // If we get here, execvp failed
-            perror(clist->commands[0].argv[0]);
-            exit(EXIT_FAILURE);
-        } else {
-            // Parent process
-            int status;
-            waitpid(pid, &status, 0);
-            
-            return WEXITSTATUS(status);
+
+    // The file comes in on the socket, nothing is relayed
+    if (clist->num == 1 && strcmp(clist->commands[0].argv[0], RSH_PUT_CMD) == 0) {
+        return rsh_xfer_put(cli_sock, stream, &clist->commands[0], sh->cwd_fd);
+    }
+
+    int devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (devnull < 0) {
+        perror("rsh_execute_pipeline");
+        return ERR_RDSH_CMD_EXEC;
+    }
+
+    rsh_stream_init(&st, 1);
+    int rc = rsh_stream_start(&st, stream, sh, clist, last_rc, devnull);
+    close(devnull);
+    if (rc == EXIT_SC || rc == STOP_SERVER_SC) {
+        return rc;
+    } else if (rc != OK) {
+        const char *msg = rsh_stream_error(rc, clist);
+        rsh_send_frame(cli_sock, RSH_FRAME_STDERR, stream, msg, strlen(msg));
+        return ERR_RDSH_CMD_EXEC;
+    }
+
+    // Ends once every stage has closed both pipes and has been reaped,
+    // the exit code comes from the last one
+    st.compress = (flags & RSH_CMD_LZ) != 0;
+    rsh_stream_relay(&st, cli_sock);
+    rc = st.status;
+    if (st.get && rsh_send_sum(cli_sock, stream, st.get_size, st.get_crc) != OK) {
+        rc = ERR_RDSH_COMMUNICATION;
+    }
+    rsh_stream_close(&st);
+    return rc;
+}
+
+/*
+ * rsh_spawn_pipeline(clist, sh, in_fd, out_fd, err_fd, pids)
+ *      clist:   parsed pipeline, builtins are not handled here
+ *      sh:      session the stages run in, its directory and environment
+ *      in_fd:   stdin of the first stage
+ *      out_fd:  stdout of the last stage
+ *      err_fd:  stderr of every stage
+ *      pids:    receives one pid per stage
+ *
+ *  Starts every stage of clist without waiting for any of them, so an
+ *  event loop can keep serving other clients while they run.  The stages
+ *  are forked by one of the pre-forked spawner processes when one is
+ *  available (see rsh_spawner.c) and by this process otherwise; either way
+ *  they end up as our children.  How long it took goes into the spawn
+ *  latency histogram shown by `stats`.
+ *
+ *  Returns the number of processes started, or ERR_RDSH_CMD_EXEC if a pipe
+ *  or fork failed (any stages already started are killed and reaped).
+ */
+int rsh_spawn_pipeline(command_list_t *clist, rsh_shell_t *sh, int in_fd, int out_fd, int err_fd,
+                       pid_t pids[]) {
+    char exe_paths[CMD_MAX][PATH_MAX];
+    const char *exe[CMD_MAX];
+    long start_us = rsh_metrics_now_us();
+
+    // The hash holds what the server's PATH finds, a session with its own
+    // PATH has execvp() search it in the child
+    for (int i = 0; i < clist->num; i++) {
+        exe_paths[i][0] = '\0';
+        if (!sh->own_path) {
+            cmd_hash_resolve(clist->commands[i].argv[0], exe_paths[i], PATH_MAX);
         }
+        exe[i] = exe_paths[i];
     }
 
-    // Multiple commands - need pipes
-    
-    // Create all necessary pipes
+    bool via_spawner = true;
+    int n = rsh_spawner_spawn(clist, exe, in_fd, out_fd, err_fd, sh->cwd_fd, sh->env, pids);
+    if (n == WARN_RDSH_AGAIN) {
+        via_spawner = false;
+        n = rsh_spawn_stages(clist, exe, in_fd, out_fd, err_fd, sh->cwd_fd, sh->env, pids, false);
+    }
+
+    if (n > 0) {
+        rsh_spawner_record(start_us, via_spawner);
+    }
+    return n;
+}
+
+/*
+ * rsh_spawn_stages(clist, exe, in_fd, out_fd, err_fd, cwd_fd, env, pids, sibling)
+ *      exe:      resolved path of each stage, see cmd_hash_resolve()
+ *      cwd_fd:   directory the stages start in, negative for our own
+ *      env:      environment of the stages, NULL for our own
+ *      sibling:  fork the stages as children of our parent instead of our
+ *                own, which is how a spawner hands them to the server
+ *
+ *  Does the actual work for rsh_spawn_pipeline(), in the server or in a
+ *  spawner.  File redirections in a stage take precedence over the
+ *  descriptors passed in.  The pipes between stages are close-on-exec so
+ *  commands started at the same time by other threads never inherit them.
+ *
+ *  Returns the number of processes started, or ERR_RDSH_CMD_EXEC.  On
+ *  failure the stages that were started have been killed; a sibling can't
+ *  reap them, so their pids are left in pids, ending with a 0.
+ */
+int rsh_spawn_stages(command_list_t *clist, const char *exe[], int in_fd, int out_fd,
+                     int err_fd, int cwd_fd, char **env, pid_t pids[], bool sibling) {
+    extern char **environ;
+    int pipes[CMD_MAX][2];
+
+    pids[0] = 0;
     for (int i = 0; i < clist->num - 1; i++) {
-        if (pipe(pipes[i]) == -1) {
+        if (pipe2(pipes[i], O_CLOEXEC) < 0) {
             perror("pipe");
+            for (int j = 0; j < i; j++) {
+                close(pipes[j][0]);
+                close(pipes[j][1]);
+            }
             return ERR_RDSH_CMD_EXEC;
         }
     }
 
-    // Fork processes for each command
-    for (int i = 0; i < clist->num; i++) {
-        // Check if first command is built-in
-        if (i == 0) {
-            bi_cmd = rsh_match_command(clist->commands[i].argv[0]);
-            if (bi_cmd != BI_NOT_BI) {
-                // Built-in commands don't support piping
-                char error_msg[] = "Built-in commands don't support piping\n";
-                write(cli_sock, error_msg, strlen(error_msg));
-                
-                // Close all pipes
-                for (int j = 0; j < clist->num - 1; j++) {
-                    close(pipes[j][0]);
-                    close(pipes[j][1]);
-                }
-                
-                return ERR_RDSH_CMD_EXEC;
-            }
+    int started;
+    for (started = 0; started < clist->num; started++) {
+        cmd_buff_t *cmd = &clist->commands[started];
+        int i = started;
+
+        // clone() without a new stack behaves just like fork()
+        if (sibling) {
+            pids[i] = (pid_t)syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, 0);
+        } else {
+            pids[i] = fork();
         }
-        
-        // Fork child process
-        pids[i] = fork();
-        
         if (pids[i] < 0) {
-            // Fork failed
             perror("fork");
-            
-            // Close all pipes
-            for (int j = 0; j < clist->num - 1; j++) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
+            break;
+        } else if (pids[i] == 0) {
+            rsh_child_setup();
+            int fd_in = (i == 0) ? in_fd : pipes[i - 1][0];
+            int fd_out = (i == clist->num - 1) ? out_fd : pipes[i][1];
+
+            if (cwd_fd >= 0 && fchdir(cwd_fd) < 0) {
+                dprintf(err_fd, "%s: %s\n", cmd->argv[0], strerror(errno));
+                _exit(EXIT_FAILURE);
             }
-            
-            // Kill any already created children
-            for (int j = 0; j < i; j++) {
-                kill(pids[j], SIGTERM);
-                waitpid(pids[j], NULL, 0);
+            if (env != NULL) {
+                environ = env;      //our own copy of the address space
             }
-            
-            return ERR_RDSH_CMD_EXEC;
-        } else if (pids[i] == 0) {
-            // Child process
-            
-            // Set up stdin from previous pipe or socket (for first command)
-            if (i == 0) {
-                // First command gets input from socket
-                dup2(cli_sock, STDIN_FILENO);
-            } else {
-                // Other commands get input from previous pipe
-                dup2(pipes[i - 1][0], STDIN_FILENO);
+            if (cmd->input_file != NULL) {
+                fd_in = open(cmd->input_file, O_RDONLY);
+                if (fd_in < 0) {
+                    dprintf(err_fd, "%s: %s\n", cmd->input_file, strerror(errno));
+                    _exit(EXIT_FAILURE);
+                }
             }
-            
-            // Set up stdout to next pipe or socket (for last command)
-            if (i == clist->num - 1) {
-                // Last command outputs to socket
-                dup2(cli_sock, STDOUT_FILENO);
-                dup2(cli_sock, STDERR_FILENO);
-            } else {
-                // Other commands output to next pipe
-                dup2(pipes[i][1], STDOUT_FILENO);
+            if (cmd->output_file != NULL) {
+                int flags = O_WRONLY | O_CREAT | (cmd->append_mode ? O_APPEND : O_TRUNC);
+                fd_out = open(cmd->output_file, flags, 0644);
+                if (fd_out < 0) {
+                    dprintf(err_fd, "%s: %s\n", cmd->output_file, strerror(errno));
+                    _exit(EXIT_FAILURE);
+                }
             }
-            
-            // Close all pipe file descriptors
-            for (int j = 0; j < clist->num - 1; j++) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
+
+            // stderr first, err_fd may be the same descriptor as fd_out
+            dup2(err_fd, STDERR_FILENO);
+            dup2(fd_in, STDIN_FILENO);
+            dup2(fd_out, STDOUT_FILENO);
+
+            // The redirect files are open twice now, the command only needs 0 and 1
+            if (cmd->input_file != NULL && fd_in != STDIN_FILENO) {
+                close(fd_in);
             }
-            
-            // Execute command
-            execvp(clist->commands[i].argv[0], clist->commands[i].argv);
-            
-            // If execvp returns, there was an error
-            perror(clist->commands[i].argv[0]);
-            exit(EXIT_FAILURE);
+            if (cmd->output_file != NULL && fd_out != STDOUT_FILENO) {
+                close(fd_out);
+            }
+
+            cmd_hash_exec(exe[i], cmd->argv);
+            dprintf(STDERR_FILENO, "%s: %s\n", cmd->argv[0], strerror(errno));
+            _exit(EXIT_FAILURE);
         }
     }
 
-    // Parent process: close all pipe ends
     for (int i = 0; i < clist->num - 1; i++) {
         close(pipes[i][0]);
         close(pipes[i][1]);
     }
 
-    // Wait for all children
-    for (int i = 0; i < clist->num; i++) {
-        waitpid(pids[i], &pids_st[i], 0);
+    if (started < clist->num) {
+        for (int i = 0; i < started; i++) {
+            kill(pids[i], SIGKILL);
+            if (!sibling) waitpid(pids[i], NULL, 0);
+        }
+        pids[started] = 0;
+        return ERR_RDSH_CMD_EXEC;
     }
 
-    // Get exit code from last command
-    exit_code = WEXITSTATUS(pids_st[clist->num - 1]);
-    
-    // Check for special exit codes
-    for (int i = 0; i < clist->num; i++) {
-        if (WEXITSTATUS(pids_st[i]) == EXIT_SC) {
-            exit_code = EXIT_SC;
+    return started;
+}
+
+/*
+ * rsh_server_stats(out_fd)
+ *      out_fd:  where the report is written, normally the client socket
+ *
+ *  Implements the `stats` builtin: the server mode plus whatever counters
+ *  that mode keeps, then connection and command totals, the limits, the
+ *  spawners and spawn latency.
+ *
+ *  Returns the exit status of the builtin.
+ */
+int rsh_server_stats(int out_fd) {
+    switch (g_is_threaded) {
+    case RSH_SVR_POOL:
+        rsh_pool_stats(out_fd);
+        break;
+    case RSH_SVR_REACTOR:
+        dprintf(out_fd, "server: event-driven\n");
+        break;
+    case RSH_SVR_THREADED:
+        pthread_mutex_lock(&g_client_mutex);
+        dprintf(out_fd, "server: thread per client, %d active clients\n", g_active_clients);
+        for (int i = 0; i < g_server_acceptors; i++) {
+            dprintf(out_fd, "acceptor %d: %ld connections\n", i, g_acceptor_conns[i]);
         }
+        pthread_mutex_unlock(&g_client_mutex);
+        break;
+    default:
+        dprintf(out_fd, "server: single-threaded\n");
+        break;
     }
-    
-    return exit_code;
+    rsh_metrics_stats(out_fd);
+    rsh_limits_stats(out_fd);
+    return rsh_spawner_stats(out_fd);
 }
 
 /**************   OPTIONAL STUFF  ***************/
@@ -816,13 +1407,26 @@ Built_In_Cmds rsh_match_command(const char *input)
         return BI_CMD_STOP_SVR;
     if (strcmp(input, "rc") == 0)
         return BI_CMD_RC;
+    if (strcmp(input, HASH_CMD) == 0)
+        return BI_CMD_HASH;
+    if (strcmp(input, STATS_CMD) == 0)
+        return BI_CMD_STATS;
+    if (strcmp(input, EXPORT_CMD) == 0)
+        return BI_CMD_EXPORT;
+    if (strcmp(input, UNSET_CMD) == 0)
+        return BI_CMD_UNSET;
     return BI_NOT_BI;
 }
 
 /*
- * rsh_built_in_cmd(cmd_buff_t *cmd)
+ * rsh_built_in_cmd(cmd_buff_t *cmd, bi_ctx_t *ctx, rsh_shell_t *sh)
  *      cmd:  The cmd_buff_t of the command, remember, this is the 
  *            parsed version fo the command
+ *      ctx:  Where the builtin reads and writes (normally the client
+ *            socket), see bi_ctx_open().  Several sessions run builtins
+ *            at once, so nothing here may dup2() over fd 0/1/2.
+ *      sh:   The session's shell state, which `cd`, `export` and `unset`
+ *            change instead of the server process.
  *   
  *  This optional function accepts a parsed cmd and then checks to see if
  *  the cmd is built in or not.  It calls rsh_match_command to see if the 
@@ -840,8 +1444,9 @@ Built_In_Cmds rsh_match_command(const char *input)
  *      BI_EXECUTED: Indicates that this function handled the direct execution
  *                   of the command and there is nothing else to do, consider
  *                   it executed.  For example the cmd of "cd" gets the value of
- *                   BI_CMD_CD from rsh_match_command().  It then makes the libc
- *                   call to chdir(cmd->argv[1]); and finally returns BI_EXECUTED
+ *                   BI_CMD_CD from rsh_match_command().  It then opens
+ *                   cmd->argv[1] as the session's new directory with
+ *                   rsh_shell_cd() and finally returns BI_EXECUTED
  *      BI_CMD_*     Indicates that a built-in command was matched and the caller
  *                   is responsible for executing it.  For example if this function
  *                   returns BI_CMD_STOP_SVR the caller of this function is
@@ -851,24 +1456,28 @@ Built_In_Cmds rsh_match_command(const char *input)
  *   AGAIN - THIS IS TOTALLY OPTIONAL IF YOU HAVE OR WANT TO HANDLE BUILT-IN
  *   COMMANDS DIFFERENTLY. 
  */
-Built_In_Cmds rsh_built_in_cmd(cmd_buff_t *cmd)
+Built_In_Cmds rsh_built_in_cmd(cmd_buff_t *cmd, bi_ctx_t *ctx, rsh_shell_t *sh)
 {
     Built_In_Cmds ctype = BI_NOT_BI;
     ctype = rsh_match_command(cmd->argv[0]);
 
     switch (ctype)
     {
-    // case BI_CMD_DRAGON:
-    //     print_dragon();
-    //     return BI_EXECUTED;
     case BI_CMD_EXIT:
         return BI_CMD_EXIT;
     case BI_CMD_STOP_SVR:
         return BI_CMD_STOP_SVR;
+    case BI_CMD_DRAGON:
     case BI_CMD_RC:
-        return BI_CMD_RC;
+    case BI_CMD_HASH:
+        // Same implementation as the local shell, just other descriptors
+        return exec_built_in_cmd(cmd, ctx);
     case BI_CMD_CD:
-        chdir(cmd->argv[1]);
+    case BI_CMD_EXPORT:
+    case BI_CMD_UNSET:
+        return rsh_shell_builtin(sh, cmd, ctx);
+    case BI_CMD_STATS:
+        ctx->last_rc = rsh_server_stats(ctx->out_fd);
         return BI_EXECUTED;
     default:
         return BI_NOT_BI;
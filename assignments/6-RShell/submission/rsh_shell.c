@@ -0,0 +1,285 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+/*
+ * Per-session shell state: the working directory and the environment.
+ *
+ * The server runs many sessions in one process, so neither can live in
+ * the process itself: a chdir() for one client would move every other
+ * client's next command too, and setenv() isn't safe while other threads
+ * fork.  Instead each session keeps
+ *
+ *      cwd_fd   the directory opened O_PATH, which `cd` replaces.  Its
+ *               stages fchdir() to it after fork(), builtin redirections
+ *               and get/put open relative to it with openat().
+ *      env      a NULL terminated "NAME=value" array that `export` and
+ *               `unset` edit in place.  A child just points environ at
+ *               it before exec, nothing is rebuilt per command.
+ *
+ * The environment is copied from the server's on the first `export` or
+ * `unset`; until then env is NULL and children inherit the server's own,
+ * which is what most sessions do and keeps spawner requests small.  While
+ * PATH is still the server's, commands resolve through the shared hash
+ * (see dsh_hash.c); a session with its own PATH leaves the search to
+ * execvp() in the child, under its PATH.
+ */
+
+#define SHELL_ENV_MIN       32
+
+extern char **environ;
+
+/*
+ * rsh_shell_init(sh)
+ *
+ *  Starts a session in the server's working directory with the server's
+ *  environment.
+ *
+ *  Returns OK, or ERR_RDSH_SERVER if the working directory can't be
+ *  opened (commands then run in the server's, wherever that is).
+ */
+int rsh_shell_init(rsh_shell_t *sh) {
+    sh->env = NULL;
+    sh->nenv = 0;
+    sh->env_cap = 0;
+    sh->own_path = false;
+    sh->cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (sh->cwd_fd < 0) {
+        sh->cwd_fd = AT_FDCWD;
+        return ERR_RDSH_SERVER;
+    }
+    return OK;
+}
+
+/*
+ * rsh_shell_free(sh)
+ *
+ *  Releases the directory and the environment of a finished session.
+ */
+void rsh_shell_free(rsh_shell_t *sh) {
+    if (sh->cwd_fd >= 0) {
+        close(sh->cwd_fd);
+    }
+    sh->cwd_fd = AT_FDCWD;
+    for (int i = 0; i < sh->nenv; i++) {
+        free(sh->env[i]);
+    }
+    free(sh->env);
+    sh->env = NULL;
+    sh->nenv = 0;
+    sh->env_cap = 0;
+}
+
+// Index of NAME in env, or -1; name ends at len or at '='
+static int shell_env_find(rsh_shell_t *sh, const char *name, size_t len) {
+    for (int i = 0; i < sh->nenv; i++) {
+        if (strncmp(sh->env[i], name, len) == 0 && sh->env[i][len] == '=') {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * rsh_shell_getenv(sh, name)
+ *
+ *  getenv() for the session.  Returns NULL if name isn't set.
+ */
+const char *rsh_shell_getenv(rsh_shell_t *sh, const char *name) {
+    if (sh->env == NULL) {
+        return getenv(name);
+    }
+    int i = shell_env_find(sh, name, strlen(name));
+    return (i < 0) ? NULL : sh->env[i] + strlen(name) + 1;
+}
+
+// Copy-on-write: the session gets its own environment before the first change
+static int shell_env_own(rsh_shell_t *sh) {
+    if (sh->env != NULL) {
+        return OK;
+    }
+
+    int n = 0;
+    while (environ[n] != NULL) n++;
+    int cap = (n + 1 > SHELL_ENV_MIN) ? n + 1 : SHELL_ENV_MIN;
+    char **env = calloc(cap, sizeof(char *));
+    if (env == NULL) {
+        return ERR_MEMORY;
+    }
+    for (int i = 0; i < n; i++) {
+        if ((env[i] = strdup(environ[i])) == NULL) {
+            while (i-- > 0) free(env[i]);
+            free(env);
+            return ERR_MEMORY;
+        }
+    }
+    sh->env = env;
+    sh->nenv = n;
+    sh->env_cap = cap;
+    return OK;
+}
+
+static void shell_path_changed(rsh_shell_t *sh) {
+    const char *mine = rsh_shell_getenv(sh, "PATH");
+    const char *server = getenv("PATH");
+
+    if (mine == NULL || server == NULL) {
+        sh->own_path = (mine != server);
+    } else {
+        sh->own_path = strcmp(mine, server) != 0;
+    }
+}
+
+/*
+ * rsh_shell_setenv(sh, assignment)
+ *      assignment:  "NAME=value"
+ *
+ *  Returns OK, ERR_CMD_ARGS_BAD if there is no NAME, or ERR_MEMORY.
+ */
+int rsh_shell_setenv(rsh_shell_t *sh, const char *assignment) {
+    const char *eq = strchr(assignment, '=');
+    if (eq == NULL || eq == assignment) {
+        return ERR_CMD_ARGS_BAD;
+    }
+    if (shell_env_own(sh) != OK) {
+        return ERR_MEMORY;
+    }
+
+    char *copy = strdup(assignment);
+    if (copy == NULL) {
+        return ERR_MEMORY;
+    }
+
+    int i = shell_env_find(sh, assignment, eq - assignment);
+    if (i >= 0) {
+        free(sh->env[i]);
+        sh->env[i] = copy;
+    } else {
+        // Always room for the NULL at the end
+        if (sh->nenv + 1 >= sh->env_cap) {
+            char **env = realloc(sh->env, sizeof(char *) * sh->env_cap * 2);
+            if (env == NULL) {
+                free(copy);
+                return ERR_MEMORY;
+            }
+            sh->env = env;
+            sh->env_cap *= 2;
+        }
+        sh->env[sh->nenv++] = copy;
+        sh->env[sh->nenv] = NULL;
+    }
+    if (eq - assignment == 4 && strncmp(assignment, "PATH", 4) == 0) {
+        shell_path_changed(sh);
+    }
+    return OK;
+}
+
+/*
+ * rsh_shell_unsetenv(sh, name)
+ *
+ *  Returns OK, or ERR_MEMORY.
+ */
+int rsh_shell_unsetenv(rsh_shell_t *sh, const char *name) {
+    if (shell_env_own(sh) != OK) {
+        return ERR_MEMORY;
+    }
+
+    int i = shell_env_find(sh, name, strlen(name));
+    if (i >= 0) {
+        free(sh->env[i]);
+        sh->env[i] = sh->env[--sh->nenv];
+        sh->env[sh->nenv] = NULL;
+    }
+    if (strcmp(name, "PATH") == 0) {
+        shell_path_changed(sh);
+    }
+    return OK;
+}
+
+/*
+ * rsh_shell_cd(sh, dir, err_fd)
+ *      dir:  relative to the session's directory, NULL for $HOME
+ *
+ *  The `cd` builtin of a remote session.  The directory has to be
+ *  searchable, as for chdir(), even though it is only opened O_PATH.
+ *
+ *  Returns the exit status of the builtin.
+ */
+int rsh_shell_cd(rsh_shell_t *sh, const char *dir, int err_fd) {
+    if (dir == NULL) {
+        dir = rsh_shell_getenv(sh, "HOME");
+        if (dir == NULL) return 0;
+    }
+
+    int fd = openat(sh->cwd_fd, dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0 && faccessat(fd, ".", X_OK, 0) < 0) {
+        int err = errno;
+        close(fd);
+        fd = -1;
+        errno = err;
+    }
+    if (fd < 0) {
+        int err = errno;
+        dprintf(err_fd, "cd: %s: %s\n", dir, strerror(err));
+        return err;
+    }
+
+    if (sh->cwd_fd >= 0) {
+        close(sh->cwd_fd);
+    }
+    sh->cwd_fd = fd;
+    return 0;
+}
+
+/*
+ * rsh_shell_builtin(sh, cmd, ctx)
+ *
+ *  Runs `cd`, `export` or `unset` against the session.  `export` with no
+ *  arguments lists the environment; `export NAME` without a value is
+ *  accepted and changes nothing, every variable here is exported.
+ *
+ *  Returns BI_EXECUTED with the status in ctx->last_rc, or BI_NOT_BI.
+ */
+Built_In_Cmds rsh_shell_builtin(rsh_shell_t *sh, cmd_buff_t *cmd, bi_ctx_t *ctx) {
+    Built_In_Cmds bi = rsh_match_command(cmd->argv[0]);
+    int rc = 0;
+
+    if (bi == BI_CMD_CD) {
+        rc = rsh_shell_cd(sh, (cmd->argc > 1) ? cmd->argv[1] : NULL, ctx->err_fd);
+    } else if (bi == BI_CMD_EXPORT && cmd->argc == 1) {
+        char **env = (sh->env != NULL) ? sh->env : environ;
+        for (int i = 0; env[i] != NULL; i++) {
+            dprintf(ctx->out_fd, "export %s\n", env[i]);
+        }
+    } else if (bi == BI_CMD_EXPORT) {
+        for (int i = 1; i < cmd->argc; i++) {
+            if (strchr(cmd->argv[i], '=') == NULL) continue;
+            int err = rsh_shell_setenv(sh, cmd->argv[i]);
+            if (err != OK) {
+                dprintf(ctx->err_fd, "export: %s: %s\n", cmd->argv[i],
+                        (err == ERR_MEMORY) ? strerror(ENOMEM) : "not a valid identifier");
+                rc = 1;
+            }
+        }
+    } else if (bi == BI_CMD_UNSET) {
+        for (int i = 1; i < cmd->argc; i++) {
+            if (rsh_shell_unsetenv(sh, cmd->argv[i]) != OK) {
+                dprintf(ctx->err_fd, "unset: %s: %s\n", cmd->argv[i], strerror(ENOMEM));
+                rc = 1;
+            }
+        }
+    } else {
+        return BI_NOT_BI;
+    }
+
+    ctx->last_rc = rc;
+    return BI_EXECUTED;
+}
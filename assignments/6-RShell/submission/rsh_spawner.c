@@ -0,0 +1,671 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+/*
+ * Pre-forked spawners.
+ *
+ * fork() has to copy the page tables of whoever calls it, so starting a
+ * command gets slower as the server grows: every client thread adds a
+ * stack, every session its buffers.  Under a burst of commands that shows
+ * up as fork latency spikes exactly when it hurts most.
+ *
+ * So the server forks a zygote right at startup, while it is still small.
+ * The zygote runs no commands, it only forks spawners, which are just as
+ * small.  A spawner waits on a SOCK_SEQPACKET socketpair for a request:
+ * the command line with the resolved path of each stage and the session's
+ * environment if it has its own, plus the stdin, stdout and stderr
+ * descriptors and the session's working directory passed along with
+ * SCM_RIGHTS.  It forks the stages with CLONE_PARENT, so they are the
+ * server's children exactly as before: the server reaps them, watches
+ * their pidfds and gets their exit status.  The reply is their pids.
+ *
+ *      server ──request + fds──▶ spawner ──clone(CLONE_PARENT)──▶ stages
+ *         ▲◀────── pids ────────┘                                  │
+ *         └──────────────────── SIGCHLD, pidfd ────────────────────┘
+ *
+ * A spawner serves one request at a time.  When a command finds them all
+ * busy the zygote forks another one (its end of the new socketpair comes
+ * back over SCM_RIGHTS), up to the -f limit.  One that has sat idle for
+ * RSH_SPAWNER_IDLE_SECS is retired the next time a spawner is released,
+ * as long as RSH_SPAWNER_MIN are left.  If no spawner can be used at all
+ * the server just forks the command itself.
+ */
+
+#define SPAWN_OP_RUN        1
+#define SPAWN_OP_GROW       2
+#define SPAWN_MSG_MAX       (1024*64)
+#define SPAWN_NFDS          4           //stdin, stdout, stderr, cwd
+
+#define SPAWN_HAS_INPUT     0x01
+#define SPAWN_HAS_OUTPUT    0x02
+#define SPAWN_APPEND        0x04
+
+// Request: this header, then per stage argc, flags and the strings exe,
+// argv[0..argc-1], input_file and output_file (the last two if flagged),
+// then nenv environment strings
+typedef struct spawn_req {
+    uint32_t op;
+    uint32_t nstages;
+    uint32_t nenv;                  //0: the stages get the spawner's own
+} spawn_req_t;
+
+typedef struct spawn_rsp {
+    int32_t rc;                     //stages started, or an error code
+    int32_t npids;                  //pids left for the server to reap
+    pid_t   pids[CMD_MAX];
+} spawn_rsp_t;
+
+typedef struct rsh_spawner {
+    pid_t  pid;                     //0 when the slot is free
+    int    chan;
+    bool   busy;
+    time_t idle_since;
+} rsh_spawner_t;
+
+static pthread_mutex_t g_spawn_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_spawn_cond = PTHREAD_COND_INITIALIZER;
+static rsh_spawner_t   g_spawners[RSH_SPAWNER_LIMIT];
+static rsh_spawner_t   g_zygote = { 0, -1, false, 0 };
+static int             g_nspawners = 0;
+static int             g_max_spawners = 0;
+static int             g_peak_spawners = 0;
+static bool            g_growing = false;
+
+// Counters for `stats`, spawn latency is kept in rsh_metrics.c
+static atomic_long     g_spawners_grown = 0;
+static atomic_long     g_spawners_retired = 0;
+
+static time_t now_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static int chan_send(int chan, const void *buf, size_t len, const int *fds, int nfds) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * SPAWN_NFDS)];
+        struct cmsghdr align;
+    } ctrl;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (nfds > 0) {
+        msg.msg_control = ctrl.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(c), fds, sizeof(int) * nfds);
+    }
+
+    do {
+        n = sendmsg(chan, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    return (n == (ssize_t)len) ? OK : ERR_RDSH_COMMUNICATION;
+}
+
+/*
+ * Receives one message and any descriptors that came with it, already
+ * close-on-exec.  Returns the message size, 0 when the other end closed,
+ * or -1.
+ */
+static ssize_t chan_recv(int chan, void *buf, size_t len, int *fds, int *nfds) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * SPAWN_NFDS)];
+        struct cmsghdr align;
+    } ctrl;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+
+    do {
+        n = recvmsg(chan, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+
+    *nfds = 0;
+    if (n < 0) return -1;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            int count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (int i = 0; i < count; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(c) + sizeof(int) * i, sizeof(int));
+                if (*nfds < SPAWN_NFDS) {
+                    fds[(*nfds)++] = fd;
+                } else {
+                    close(fd);
+                }
+            }
+        }
+    }
+    return n;
+}
+
+static int pack_str(char *buf, size_t *off, const char *s) {
+    size_t len = strlen(s) + 1;
+    if (*off + len > SPAWN_MSG_MAX) return -1;
+    memcpy(buf + *off, s, len);
+    *off += len;
+    return 0;
+}
+
+static const char *unpack_str(char *buf, size_t len, size_t *off) {
+    char *s = buf + *off;
+    size_t n = strnlen(s, len - *off);
+    if (*off + n >= len) return NULL;
+    *off += n + 1;
+    return s;
+}
+
+/*
+ * Flattens clist, the stage paths and env (if not NULL) into a request.
+ * Returns its size, or 0 if it doesn't fit.
+ */
+static size_t pack_request(char *buf, command_list_t *clist, const char *exe[], char **env) {
+    spawn_req_t req = { SPAWN_OP_RUN, (uint32_t)clist->num, 0 };
+    size_t off = sizeof(req);
+
+    for (int i = 0; i < clist->num; i++) {
+        cmd_buff_t *cmd = &clist->commands[i];
+        if (off + 2 > SPAWN_MSG_MAX) return 0;
+        buf[off++] = (char)cmd->argc;
+        buf[off++] = (char)((cmd->input_file ? SPAWN_HAS_INPUT : 0) |
+                            (cmd->output_file ? SPAWN_HAS_OUTPUT : 0) |
+                            (cmd->append_mode ? SPAWN_APPEND : 0));
+        if (pack_str(buf, &off, exe[i]) < 0) return 0;
+        for (int a = 0; a < cmd->argc; a++) {
+            if (pack_str(buf, &off, cmd->argv[a]) < 0) return 0;
+        }
+        if (cmd->input_file && pack_str(buf, &off, cmd->input_file) < 0) return 0;
+        if (cmd->output_file && pack_str(buf, &off, cmd->output_file) < 0) return 0;
+    }
+    for (; env != NULL && env[req.nenv] != NULL; req.nenv++) {
+        if (pack_str(buf, &off, env[req.nenv]) < 0) return 0;
+    }
+    memcpy(buf, &req, sizeof(req));
+    return off;
+}
+
+/*
+ * The reverse of pack_request(), in the spawner.  The strings stay in buf,
+ * *env is NULL or a malloc()ed array of them for the caller to free().
+ */
+static int unpack_request(char *buf, size_t len, command_list_t *clist, const char *exe[],
+                          char ***env) {
+    spawn_req_t req;
+    size_t off = sizeof(req);
+
+    memcpy(&req, buf, sizeof(req));
+    if (req.nstages < 1 || req.nstages > CMD_MAX) return ERR_RDSH_PROTOCOL;
+
+    memset(clist, 0, sizeof(*clist));
+    clist->num = (int)req.nstages;
+    for (int i = 0; i < clist->num; i++) {
+        cmd_buff_t *cmd = &clist->commands[i];
+        if (off + 2 > len) return ERR_RDSH_PROTOCOL;
+        cmd->argc = (unsigned char)buf[off++];
+        int flags = (unsigned char)buf[off++];
+        if (cmd->argc < 1 || cmd->argc >= CMD_ARGV_MAX) return ERR_RDSH_PROTOCOL;
+
+        if ((exe[i] = unpack_str(buf, len, &off)) == NULL) return ERR_RDSH_PROTOCOL;
+        for (int a = 0; a < cmd->argc; a++) {
+            if ((cmd->argv[a] = (char *)unpack_str(buf, len, &off)) == NULL) {
+                return ERR_RDSH_PROTOCOL;
+            }
+        }
+        cmd->argv[cmd->argc] = NULL;
+        if (flags & SPAWN_HAS_INPUT) {
+            if ((cmd->input_file = (char *)unpack_str(buf, len, &off)) == NULL) {
+                return ERR_RDSH_PROTOCOL;
+            }
+        }
+        if (flags & SPAWN_HAS_OUTPUT) {
+            if ((cmd->output_file = (char *)unpack_str(buf, len, &off)) == NULL) {
+                return ERR_RDSH_PROTOCOL;
+            }
+        }
+        cmd->append_mode = (flags & SPAWN_APPEND) != 0;
+    }
+
+    *env = NULL;
+    if (req.nenv == 0) {
+        return OK;
+    }
+    if (req.nenv > len / 2 || (*env = calloc(req.nenv + 1, sizeof(char *))) == NULL) {
+        return ERR_RDSH_PROTOCOL;
+    }
+    for (uint32_t i = 0; i < req.nenv; i++) {
+        if (((*env)[i] = (char *)unpack_str(buf, len, &off)) == NULL) {
+            free(*env);
+            *env = NULL;
+            return ERR_RDSH_PROTOCOL;
+        }
+    }
+    return OK;
+}
+
+static void spawner_main(int chan);
+
+/*
+ * Zygote side of SPAWN_OP_GROW: fork a fresh spawner as a sibling (so the
+ * server is its parent and can reap it) and hand the server its socket.
+ */
+static void spawner_grow(int chan) {
+    spawn_rsp_t rsp = { ERR_RDSH_SERVER, 0, { 0 } };
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        chan_send(chan, &rsp, sizeof(rsp), NULL, 0);
+        return;
+    }
+
+    pid_t pid = (pid_t)syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, 0);
+    if (pid == 0) {
+        close(chan);
+        close(sv[0]);
+        spawner_main(sv[1]);
+    }
+    close(sv[1]);
+
+    if (pid > 0) {
+        rsp.rc = OK;
+        rsp.npids = 1;
+        rsp.pids[0] = pid;
+    }
+    chan_send(chan, &rsp, sizeof(rsp), sv, (pid > 0) ? 1 : 0);
+    close(sv[0]);
+}
+
+static void spawner_run(int chan, char *msg, size_t len, int fds[]) {
+    spawn_rsp_t rsp = { ERR_RDSH_PROTOCOL, 0, { 0 } };
+    command_list_t clist;
+    const char *exe[CMD_MAX];
+    char **env;
+
+    if (unpack_request(msg, len, &clist, exe, &env) == OK) {
+        rsp.rc = rsh_spawn_stages(&clist, exe, fds[0], fds[1], fds[2], fds[3], env, rsp.pids,
+                                  true);
+        if (rsp.rc > 0) {
+            rsp.npids = rsp.rc;
+        } else {
+            while (rsp.npids < clist.num && rsp.pids[rsp.npids] > 0) rsp.npids++;
+        }
+        free(env);
+    }
+    chan_send(chan, &rsp, sizeof(rsp), NULL, 0);
+}
+
+/*
+ * Request loop of the zygote and of every spawner.  Exits when the server
+ * closes its end.
+ */
+static void spawner_main(int chan) {
+    static char msg[SPAWN_MSG_MAX];
+
+    for (;;) {
+        int fds[SPAWN_NFDS];
+        int nfds;
+
+        ssize_t n = chan_recv(chan, msg, sizeof(msg), fds, &nfds);
+        if (n <= 0) {
+            _exit(0);
+        }
+
+        spawn_req_t req;
+        memcpy(&req, msg, sizeof(req));
+        if ((size_t)n >= sizeof(req) && req.op == SPAWN_OP_GROW) {
+            spawner_grow(chan);
+        } else if ((size_t)n >= sizeof(req) && req.op == SPAWN_OP_RUN && nfds == SPAWN_NFDS) {
+            spawner_run(chan, msg, n, fds);
+        } else {
+            spawn_rsp_t rsp = { ERR_RDSH_PROTOCOL, 0, { 0 } };
+            chan_send(chan, &rsp, sizeof(rsp), NULL, 0);
+        }
+
+        // Our copies must go, or the server never sees end of file
+        for (int i = 0; i < nfds; i++) {
+            close(fds[i]);
+        }
+    }
+}
+
+static void spawner_retire(pid_t pid, int chan) {
+    close(chan);
+    waitpid(pid, NULL, 0);
+    atomic_fetch_add(&g_spawners_retired, 1);
+}
+
+/*
+ * Asks the zygote for another spawner and files it in a free slot, marked
+ * busy for the caller.  Only one thread grows the pool at a time.
+ *
+ * Returns the slot, or -1 if the zygote is gone.
+ */
+static int spawner_add(void) {
+    spawn_req_t req = { SPAWN_OP_GROW, 0, 0 };
+    spawn_rsp_t rsp;
+    int fds[SPAWN_NFDS];
+    int nfds = 0;
+
+    if (chan_send(g_zygote.chan, &req, sizeof(req), NULL, 0) != OK ||
+        chan_recv(g_zygote.chan, &rsp, sizeof(rsp), fds, &nfds) != sizeof(rsp) ||
+        rsp.rc != OK || nfds != 1) {
+        for (int i = 0; i < nfds; i++) close(fds[i]);
+        return -1;
+    }
+
+    pthread_mutex_lock(&g_spawn_mutex);
+    int slot = 0;
+    while (g_spawners[slot].pid != 0) slot++;
+    g_spawners[slot].pid = rsp.pids[0];
+    g_spawners[slot].chan = fds[0];
+    g_spawners[slot].busy = true;
+    if (++g_nspawners > g_peak_spawners) g_peak_spawners = g_nspawners;
+    pthread_mutex_unlock(&g_spawn_mutex);
+
+    atomic_fetch_add(&g_spawners_grown, 1);
+    return slot;
+}
+
+/*
+ * Takes an idle spawner, grows the pool if they are all busy, or waits
+ * for one to come free once the pool is at its limit.
+ *
+ * Returns the slot, or -1 if there are no spawners to use.
+ */
+static int spawner_acquire(void) {
+    pthread_mutex_lock(&g_spawn_mutex);
+    for (;;) {
+        if (g_nspawners == 0 && (g_zygote.chan < 0 || g_max_spawners == 0)) {
+            pthread_mutex_unlock(&g_spawn_mutex);
+            return -1;
+        }
+
+        for (int i = 0; i < RSH_SPAWNER_LIMIT; i++) {
+            if (g_spawners[i].pid != 0 && !g_spawners[i].busy) {
+                g_spawners[i].busy = true;
+                pthread_mutex_unlock(&g_spawn_mutex);
+                return i;
+            }
+        }
+
+        if (g_nspawners < g_max_spawners && !g_growing && g_zygote.chan >= 0) {
+            g_growing = true;
+            pthread_mutex_unlock(&g_spawn_mutex);
+            int slot = spawner_add();
+            pthread_mutex_lock(&g_spawn_mutex);
+            g_growing = false;
+            pthread_cond_broadcast(&g_spawn_cond);
+            if (slot >= 0) {
+                pthread_mutex_unlock(&g_spawn_mutex);
+                return slot;
+            }
+
+            // No more growing, carry on with what we have
+            pid_t pid = g_zygote.pid;
+            int chan = g_zygote.chan;
+            g_zygote.chan = -1;
+            pthread_mutex_unlock(&g_spawn_mutex);
+            spawner_retire(pid, chan);
+            pthread_mutex_lock(&g_spawn_mutex);
+        } else {
+            pthread_cond_wait(&g_spawn_cond, &g_spawn_mutex);
+        }
+    }
+}
+
+/*
+ * Puts a spawner back, or drops it if it failed us.  Also retires one
+ * spawner that has been idle too long while above RSH_SPAWNER_MIN.
+ */
+static void spawner_release(int slot, bool ok) {
+    pid_t retire_pid[2] = { 0, 0 };
+    int retire_chan[2] = { -1, -1 };
+    time_t now = now_secs();
+
+    pthread_mutex_lock(&g_spawn_mutex);
+    rsh_spawner_t *sp = &g_spawners[slot];
+    if (!ok) {
+        retire_pid[0] = sp->pid;
+        retire_chan[0] = sp->chan;
+        sp->pid = 0;
+        g_nspawners--;
+    } else {
+        sp->busy = false;
+        sp->idle_since = now;
+    }
+
+    for (int i = 0; i < RSH_SPAWNER_LIMIT && g_nspawners > RSH_SPAWNER_MIN; i++) {
+        rsh_spawner_t *idle = &g_spawners[i];
+        if (i != slot && idle->pid != 0 && !idle->busy &&
+            now - idle->idle_since >= RSH_SPAWNER_IDLE_SECS) {
+            retire_pid[1] = idle->pid;
+            retire_chan[1] = idle->chan;
+            idle->pid = 0;
+            g_nspawners--;
+            break;
+        }
+    }
+    pthread_cond_signal(&g_spawn_cond);
+    pthread_mutex_unlock(&g_spawn_mutex);
+
+    for (int i = 0; i < 2; i++) {
+        if (retire_pid[i] > 0) spawner_retire(retire_pid[i], retire_chan[i]);
+    }
+}
+
+/*
+ * rsh_spawner_init(max)
+ *      max:  most spawners to keep, 0 leaves the server forking commands
+ *            itself
+ *
+ *  Forks the zygote and the first RSH_SPAWNER_MIN spawners.  Call it
+ *  before the server opens any sockets or starts threads: everything open
+ *  in this process right now is inherited by the zygote and every spawner.
+ *
+ *  Returns OK, or ERR_RDSH_SERVER if the zygote could not be started (the
+ *  server still works, it just forks commands itself).
+ */
+int rsh_spawner_init(int max) {
+    int sv[2];
+
+    if (max <= 0) {
+        return OK;
+    }
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("socketpair");
+        return ERR_RDSH_SERVER;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(sv[0]);
+        close(sv[1]);
+        return ERR_RDSH_SERVER;
+    } else if (pid == 0) {
+        close(sv[0]);
+        spawner_main(sv[1]);
+    }
+    close(sv[1]);
+
+    g_zygote.pid = pid;
+    g_zygote.chan = sv[0];
+    g_max_spawners = (max > RSH_SPAWNER_LIMIT) ? RSH_SPAWNER_LIMIT : max;
+
+    int initial = (g_max_spawners < RSH_SPAWNER_MIN) ? g_max_spawners : RSH_SPAWNER_MIN;
+    for (int i = 0; i < initial; i++) {
+        int slot = spawner_add();
+        if (slot < 0) break;
+        spawner_release(slot, true);
+    }
+    return OK;
+}
+
+/*
+ * rsh_spawner_shutdown()
+ *
+ *  Stops the zygote and every idle spawner.  Commands asked for after
+ *  this are forked by the server.
+ */
+void rsh_spawner_shutdown(void) {
+    pthread_mutex_lock(&g_spawn_mutex);
+    g_max_spawners = 0;
+    for (int i = 0; i < RSH_SPAWNER_LIMIT; i++) {
+        rsh_spawner_t *sp = &g_spawners[i];
+        if (sp->pid != 0 && !sp->busy) {
+            spawner_retire(sp->pid, sp->chan);
+            sp->pid = 0;
+            g_nspawners--;
+        }
+    }
+    if (g_zygote.chan >= 0) {
+        spawner_retire(g_zygote.pid, g_zygote.chan);
+        g_zygote.chan = -1;
+    }
+    pthread_mutex_unlock(&g_spawn_mutex);
+}
+
+/*
+ * rsh_spawner_spawn(clist, exe, in_fd, out_fd, err_fd, cwd_fd, env, pids)
+ *
+ *  rsh_spawn_stages() done by a spawner.  The stages start in cwd_fd, or
+ *  the directory we are in now if it is negative, with env as their
+ *  environment, or the server's if it is NULL.  An environment too big
+ *  for one request is left to the server to fork.
+ *
+ *  Returns:
+ *      > 0:                the number of stages started, pids filled in
+ *      ERR_RDSH_CMD_EXEC:  the spawner couldn't start the pipeline
+ *      WARN_RDSH_AGAIN:    no spawner available, fork it yourself
+ */
+int rsh_spawner_spawn(command_list_t *clist, const char *exe[], int in_fd, int out_fd,
+                      int err_fd, int cwd_fd, char **env, pid_t pids[]) {
+    char msg[SPAWN_MSG_MAX];
+    spawn_rsp_t rsp;
+    int rsp_fds[SPAWN_NFDS];
+    int nfds;
+
+    size_t len = pack_request(msg, clist, exe, env);
+    if (len == 0) {
+        return WARN_RDSH_AGAIN;
+    }
+
+    // SCM_RIGHTS hands over a copy, the session keeps its own
+    int own_cwd = -1;
+    if (cwd_fd < 0) {
+        own_cwd = cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (cwd_fd < 0) {
+            return WARN_RDSH_AGAIN;
+        }
+    }
+
+    int slot = spawner_acquire();
+    if (slot < 0) {
+        if (own_cwd >= 0) close(own_cwd);
+        return WARN_RDSH_AGAIN;
+    }
+
+    int fds[SPAWN_NFDS] = { in_fd, out_fd, err_fd, cwd_fd };
+    int chan = g_spawners[slot].chan;
+    bool ok = chan_send(chan, msg, len, fds, SPAWN_NFDS) == OK &&
+              chan_recv(chan, &rsp, sizeof(rsp), rsp_fds, &nfds) == sizeof(rsp);
+    if (own_cwd >= 0) close(own_cwd);
+    spawner_release(slot, ok);
+    if (!ok) {
+        return WARN_RDSH_AGAIN;
+    }
+
+    if (rsp.rc <= 0) {
+        // The spawner killed whatever it got going, but they are ours to reap
+        for (int i = 0; i < rsp.npids && i < CMD_MAX; i++) {
+            waitpid(rsp.pids[i], NULL, 0);
+        }
+        return ERR_RDSH_CMD_EXEC;
+    }
+
+    memcpy(pids, rsp.pids, sizeof(pid_t) * rsp.rc);
+    return rsp.rc;
+}
+
+/*
+ * rsh_spawner_record(start_us, via_spawner)
+ *      start_us:  rsh_metrics_now_us() when the spawn was asked for
+ *
+ *  Adds one spawn to the RSH_H_SPAWN latency histogram.
+ */
+void rsh_spawner_record(long start_us, bool via_spawner) {
+    rsh_metrics_observe(RSH_H_SPAWN, rsh_metrics_now_us() - start_us);
+    rsh_metrics_add(via_spawner ? RSH_M_SPAWNS_HELPER : RSH_M_SPAWNS_DIRECT, 1);
+}
+
+/*
+ * rsh_spawner_stats(out_fd)
+ *
+ *  Prints the spawner pool and the spawn latency histogram for `stats`.
+ *
+ *  Returns 0.
+ */
+int rsh_spawner_stats(int out_fd) {
+    long hist[RSH_METRICS_BUCKETS];
+
+    pthread_mutex_lock(&g_spawn_mutex);
+    int idle = 0;
+    for (int i = 0; i < RSH_SPAWNER_LIMIT; i++) {
+        if (g_spawners[i].pid != 0 && !g_spawners[i].busy) idle++;
+    }
+    dprintf(out_fd, "spawners: %d (%d idle, peak %d, limit %d), %ld started, %ld retired\n",
+            g_nspawners, idle, g_peak_spawners, g_max_spawners,
+            atomic_load(&g_spawners_grown), atomic_load(&g_spawners_retired));
+    pthread_mutex_unlock(&g_spawn_mutex);
+
+    dprintf(out_fd, "spawns: %ld by spawners, %ld forked by the server\n",
+            rsh_metrics_read(RSH_M_SPAWNS_HELPER), rsh_metrics_read(RSH_M_SPAWNS_DIRECT));
+
+    long total = rsh_metrics_hist(RSH_H_SPAWN, hist, NULL);
+    if (total == 0) {
+        return 0;
+    }
+
+    // Percentiles are reported as the top of the bucket they fall in
+    dprintf(out_fd, "spawn latency: p50 < %ld us, p99 < %ld us\n",
+            rsh_metrics_percentile(hist, total, 50), rsh_metrics_percentile(hist, total, 99));
+    dprintf(out_fd, "%19s %9s\n", "us", "spawns");
+    for (int i = 0; i < RSH_METRICS_BUCKETS; i++) {
+        if (hist[i] == 0) continue;
+        dprintf(out_fd, "%9ld - %-7ld %9ld\n", (i == 0) ? 0L : 1L << i, (2L << i) - 1, hist[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,417 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+/*
+ * Command streams: one command line in flight on a connection.
+ *
+ * A client may have up to RSH_MAX_STREAMS commands running at once on a
+ * single socket, each tagged with the stream id of its CMD frame.  The
+ * server modes differ in how they wait for output and child exit, but
+ * starting and finishing a command is the same everywhere, so it lives
+ * here:
+ *
+ *      rsh_stream_start()   run a builtin into a pair of memfds, spawn a
+ *                           pipeline whose output goes into pipes, or
+ *                           open the file of a `get` (see rsh_xfer.c)
+ *      rsh_stream_reap()    collect one stage once its pidfd is readable
+ *      rsh_stream_done()    output drained and every stage reaped
+ *      rsh_stream_relay()   blocking callers: relay all output in one go
+ *      rsh_stream_sent()    count output relayed to the client
+ *      rsh_stream_close()   kill whatever is left, release the slot
+ *      rsh_stream_stages()  stages of a command line not parsed yet
+ *      rsh_stream_must_wait()  an RSH_CMD_ORDERED command has to wait, or
+ *                              its stages would take the session over its
+ *                              procs limit
+ *
+ * stdout and stderr are kept apart so the client can tell them apart:
+ * the last stage's stdout goes to out_fd, every stage's stderr goes to
+ * err_fd, and each is relayed as its own frame type.  Both pipes are
+ * nonblocking.
+ */
+
+static void stream_reset(rsh_stream_t *st) {
+    st->active = false;
+    st->out_fd = -1;
+    st->err_fd = -1;
+    st->nprocs = 0;
+    st->running = 0;
+    st->ordered = false;
+    st->out_bytes = 0;
+    st->compress = false;
+    st->get = false;
+    for (int i = 0; i < CMD_MAX; i++) {
+        st->pids[i] = 0;
+        st->pidfds[i] = -1;
+    }
+}
+
+/*
+ * rsh_stream_init(streams, n)
+ *
+ *  Marks every slot free, call once before first use.
+ */
+void rsh_stream_init(rsh_stream_t *streams, int n) {
+    for (int i = 0; i < n; i++) {
+        stream_reset(&streams[i]);
+    }
+}
+
+/*
+ * rsh_stream_slot(streams, n)
+ *
+ *  Returns a free slot, or NULL when n commands are already running.
+ */
+rsh_stream_t *rsh_stream_slot(rsh_stream_t *streams, int n) {
+    for (int i = 0; i < n; i++) {
+        if (!streams[i].active) return &streams[i];
+    }
+    return NULL;
+}
+
+static int stream_run_builtin(rsh_stream_t *st, rsh_shell_t *sh, cmd_buff_t *cmd, int last_rc) {
+    bi_ctx_t ctx;
+
+    int out_fd = memfd_create("rsh-builtin-out", MFD_CLOEXEC);
+    int err_fd = memfd_create("rsh-builtin-err", MFD_CLOEXEC);
+    if (out_fd < 0 || err_fd < 0) {
+        perror("memfd_create");
+        if (out_fd >= 0) close(out_fd);
+        if (err_fd >= 0) close(err_fd);
+        return ERR_RDSH_CMD_EXEC;
+    }
+
+    Built_In_Cmds bi = BI_EXECUTED;
+    st->status = 1;
+    if (bi_ctx_openat(&ctx, cmd, sh->cwd_fd, -1, out_fd, err_fd) == OK) {
+        ctx.last_rc = last_rc;
+        bi = rsh_built_in_cmd(cmd, &ctx, sh);
+        st->status = ctx.last_rc;
+        bi_ctx_close(&ctx);
+    }
+
+    // `exit` or `stop-server` with arguments or a redirection
+    if (bi == BI_CMD_EXIT || bi == BI_CMD_STOP_SVR) {
+        close(out_fd);
+        close(err_fd);
+        return (bi == BI_CMD_EXIT) ? EXIT_SC : STOP_SERVER_SC;
+    }
+
+    lseek(out_fd, 0, SEEK_SET);
+    lseek(err_fd, 0, SEEK_SET);
+    st->out_fd = out_fd;
+    st->err_fd = err_fd;
+    return OK;
+}
+
+static int stream_run_pipeline(rsh_stream_t *st, rsh_shell_t *sh, command_list_t *clist, int in_fd) {
+    int out[2], err[2];
+
+    // Each stage is released again as it is reaped
+    if (!rsh_limits_admit(clist->num)) {
+        return WARN_RDSH_AGAIN;
+    }
+
+    if (pipe2(out, O_CLOEXEC) < 0) {
+        perror("pipe");
+        rsh_limits_release(clist->num);
+        return ERR_RDSH_CMD_EXEC;
+    }
+    if (pipe2(err, O_CLOEXEC) < 0) {
+        perror("pipe");
+        close(out[0]);
+        close(out[1]);
+        rsh_limits_release(clist->num);
+        return ERR_RDSH_CMD_EXEC;
+    }
+    fcntl(out[0], F_SETFL, O_NONBLOCK);
+    fcntl(err[0], F_SETFL, O_NONBLOCK);
+
+    int n = rsh_spawn_pipeline(clist, sh, in_fd, out[1], err[1], st->pids);
+    close(out[1]);
+    close(err[1]);
+    if (n < 0) {
+        close(out[0]);
+        close(err[0]);
+        rsh_limits_release(clist->num);
+        return ERR_RDSH_CMD_EXEC;
+    }
+
+    st->out_fd = out[0];
+    st->err_fd = err[0];
+    st->nprocs = n;
+    st->running = n;
+    st->status = 0;
+    for (int i = 0; i < n; i++) {
+        st->pidfds[i] = (int)syscall(SYS_pidfd_open, st->pids[i], 0);
+        if (st->pidfds[i] >= 0) {
+            fcntl(st->pidfds[i], F_SETFD, FD_CLOEXEC);
+        }
+    }
+    return OK;
+}
+
+/*
+ * rsh_stream_start(st, id, sh, clist, last_rc, in_fd)
+ *      st:       free slot from rsh_stream_slot()
+ *      id:       stream id of the CMD frame
+ *      sh:       the session, whose directory and environment the command
+ *                runs in and whose state builtins change
+ *      clist:    parsed command line
+ *      last_rc:  what the `rc` builtin should print
+ *      in_fd:    stdin for the first stage of a pipeline
+ *
+ *  Builtins run to completion right away with their output in memfds;
+ *  pipelines are started and left running; a `get` relays its file, and
+ *  the caller sends the SUM frame from st->get_size and st->get_crc after
+ *  it.  Either way st->out_fd and st->err_fd then hold the output to relay.  A pidfd is opened for each
+ *  stage when the kernel supports it, otherwise pidfds[i] stays -1 and the
+ *  caller has to fall back on waitpid().
+ *
+ *  Returns:
+ *      OK:                       st is active
+ *      EXIT_SC, STOP_SERVER_SC:  `exit` or `stop-server` ran as a builtin,
+ *                                st is left free
+ *      ERR_RDSH_CMD_EXEC:        a builtin in a pipeline, or the pipeline
+ *                                could not be started; st is left free
+ *      ERR_RDSH_LIMIT:           the pipeline has more stages than the
+ *                                procs or total limit, st is left free
+ *      WARN_RDSH_AGAIN:          the server is at its total limit, st is
+ *                                left free
+ */
+int rsh_stream_start(rsh_stream_t *st, uint32_t id, rsh_shell_t *sh, command_list_t *clist,
+                     int last_rc, int in_fd) {
+    int rc;
+
+    stream_reset(st);
+    if (strcmp(clist->commands[0].argv[0], RSH_GET_CMD) == 0) {
+        rc = (clist->num > 1) ? ERR_RDSH_CMD_EXEC :
+             rsh_xfer_get(st, &clist->commands[0], sh->cwd_fd);
+    } else if (rsh_match_command(clist->commands[0].argv[0]) != BI_NOT_BI) {
+        if (clist->num > 1) {
+            return ERR_RDSH_CMD_EXEC;
+        }
+        rc = stream_run_builtin(st, sh, &clist->commands[0], last_rc);
+    } else if ((g_rsh_limits.procs > 0 && clist->num > g_rsh_limits.procs) ||
+               (g_rsh_limits.total > 0 && clist->num > g_rsh_limits.total)) {
+        rc = ERR_RDSH_LIMIT;
+    } else {
+        rc = stream_run_pipeline(st, sh, clist, in_fd);
+    }
+
+    if (rc == OK) {
+        st->id = id;
+        st->active = true;
+        st->started_us = rsh_metrics_now_us();
+        rsh_metrics_add(RSH_M_COMMANDS, 1);
+    }
+    return rc;
+}
+
+/*
+ * rsh_stream_reap(st, idx, flags)
+ *
+ *  waitpid()s stage idx, flags as for waitpid().  Once the last stage is
+ *  collected st->status holds the exit code of the command line, or 128
+ *  plus the signal number like the shells do.
+ */
+void rsh_stream_reap(rsh_stream_t *st, int idx, int flags) {
+    int status;
+    pid_t rc;
+
+    if (st->pids[idx] <= 0) return;
+
+    do {
+        rc = waitpid(st->pids[idx], &status, flags);
+    } while (rc < 0 && errno == EINTR);
+    if (rc == 0) return;                //still running
+
+    if (rc > 0 && idx == st->nprocs - 1) {
+        st->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+    st->pids[idx] = 0;
+    if (st->pidfds[idx] >= 0) {
+        close(st->pidfds[idx]);
+        st->pidfds[idx] = -1;
+    }
+    st->running--;
+    rsh_limits_release(1);
+}
+
+/*
+ * rsh_stream_done(st)
+ *
+ *  Returns true once the output has hit end of file and every stage has
+ *  been reaped, i.e. the END frame can go out.  Stages without a pidfd
+ *  are waited for here, after their output is done.
+ */
+bool rsh_stream_done(rsh_stream_t *st) {
+    if (!st->active || st->out_fd >= 0 || st->err_fd >= 0) return false;
+
+    for (int i = 0; i < st->nprocs && st->running > 0; i++) {
+        if (st->pids[i] > 0 && st->pidfds[i] < 0) {
+            rsh_stream_reap(st, i, 0);
+        }
+    }
+    return st->running == 0;
+}
+
+/*
+ * rsh_stream_relay(st, sock)
+ *
+ *  Relays stdout and stderr as STDOUT and STDERR frames until both hit
+ *  end of file, then reaps every stage.  Both pipes are read as data
+ *  shows up, so a command that fills one of them while we wait on the
+ *  other doesn't stall.
+ *
+ *  Returns OK, or ERR_RDSH_COMMUNICATION if the client went away (the
+ *  output is still drained so the command can finish).
+ */
+int rsh_stream_relay(rsh_stream_t *st, int sock) {
+    int *fds[2] = { &st->out_fd, &st->err_fd };
+    int types[2] = { RSH_FRAME_STDOUT, RSH_FRAME_STDERR };
+    int rc = OK;
+
+    while (st->out_fd >= 0 || st->err_fd >= 0) {
+        struct pollfd pfds[2];
+        for (int i = 0; i < 2; i++) {
+            pfds[i].fd = *fds[i];           //poll() skips the negative ones
+            pfds[i].events = POLLIN;
+            pfds[i].revents = 0;
+        }
+        if (poll(pfds, 2, -1) < 0 && errno != EINTR) {
+            break;
+        }
+
+        for (int i = 0; i < 2; i++) {
+            if (pfds[i].revents == 0) continue;
+            int n = rsh_relay_chunk(*fds[i], (rc == OK) ? sock : -1, types[i], st->id,
+                                    st->compress);
+            rsh_stream_sent(st, NULL, n);
+            if (n == 0) {
+                close(*fds[i]);
+                *fds[i] = -1;
+            } else if (n == ERR_RDSH_COMMUNICATION) {
+                rc = n;
+            }
+        }
+    }
+
+    for (int i = 0; i < st->nprocs; i++) {
+        rsh_stream_reap(st, i, 0);
+    }
+    return rc;
+}
+
+/*
+ * rsh_stream_stages(cmd_line, len)
+ *
+ *  Counts the stages of a command line still sitting in a CMD frame, the
+ *  way build_cmd_list() splits it: on every '|' outside double quotes.
+ *  Empty stages are counted too, so it may be one high but never low.
+ */
+int rsh_stream_stages(const char *cmd_line, int len) {
+    bool in_quotes = false;
+    int stages = 1;
+
+    for (int i = 0; i < len; i++) {
+        if (cmd_line[i] == '"') {
+            in_quotes = !in_quotes;
+        } else if (cmd_line[i] == PIPE_CHAR && !in_quotes) {
+            stages++;
+        }
+    }
+    return stages;
+}
+
+/*
+ * rsh_stream_must_wait(streams, n, cmd_flags, nstages)
+ *      cmd_flags:  flags of the CMD frame about to be started
+ *      nstages:    its stages, from rsh_stream_stages()
+ *
+ *  Returns true if the command has RSH_CMD_ORDERED and an earlier ordered
+ *  foreground command is still running, or if its stages would take the
+ *  session over procs (see rsh_limits.c).  A command with more stages than
+ *  procs never fits, it isn't held but rejected by rsh_stream_start().
+ *  The caller leaves the frame where it is and tries again after the next
+ *  END frame; it must not read further commands meanwhile, they would
+ *  overtake this one.
+ */
+bool rsh_stream_must_wait(rsh_stream_t *streams, int n, uint16_t cmd_flags, int nstages) {
+    int running = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (!streams[i].active) continue;
+        if ((cmd_flags & RSH_CMD_ORDERED) && streams[i].ordered) return true;
+        running += streams[i].running;
+    }
+    return g_rsh_limits.procs > 0 && nstages <= g_rsh_limits.procs &&
+           running + nstages > g_rsh_limits.procs;
+}
+
+/*
+ * rsh_stream_error(rc, clist)
+ *
+ *  The message sent to the client when rsh_stream_start() returned rc,
+ *  other than OK, EXIT_SC and STOP_SERVER_SC.
+ */
+const char *rsh_stream_error(int rc, command_list_t *clist) {
+    if (rc == WARN_RDSH_AGAIN) {
+        return CMD_ERR_RDSH_OVERLOAD;
+    } else if (rc == ERR_RDSH_LIMIT) {
+        return CMD_ERR_RDSH_LIMIT;
+    }
+    return (clist->num > 1) ? CMD_ERR_RDSH_PIPE_BI : CMD_ERR_RDSH_EXEC;
+}
+
+/*
+ * rsh_stream_sent(st, data, n)
+ *      data:  the bytes if the caller read() them, NULL after
+ *             rsh_relay_chunk()
+ *
+ *  Called with what rsh_relay_chunk() or a read() of st's output returned,
+ *  counts the bytes for the metrics and the out limit, and a get's sum.
+ */
+void rsh_stream_sent(rsh_stream_t *st, const char *data, int n) {
+    if (n <= 0) return;
+
+    rsh_metrics_add(RSH_M_BYTES_OUT, n);
+    rsh_limits_output(st, n);
+    rsh_xfer_sent(st, data, n);
+}
+
+/*
+ * rsh_stream_close(st)
+ *
+ *  Releases the slot.  Stages still running are killed, which is what
+ *  happens to a client's commands when it disconnects.  The time since
+ *  rsh_stream_start() goes into the command duration histogram.
+ */
+void rsh_stream_close(rsh_stream_t *st) {
+    if (!st->active) return;
+
+    rsh_metrics_observe(RSH_H_COMMAND, rsh_metrics_now_us() - st->started_us);
+
+    for (int i = 0; i < st->nprocs; i++) {
+        if (st->pids[i] > 0) {
+            kill(st->pids[i], SIGKILL);
+            rsh_stream_reap(st, i, 0);
+        }
+    }
+    if (st->out_fd >= 0) close(st->out_fd);
+    if (st->err_fd >= 0) close(st->err_fd);
+    stream_reset(st);
+}
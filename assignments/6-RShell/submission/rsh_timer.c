@@ -0,0 +1,331 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+/*
+ * Liveness of client sessions: heartbeats, idle timeouts and the timer
+ * wheel that schedules them.
+ *
+ * A client that vanishes without a FIN (laptop lid closed, NAT mapping
+ * dropped, cable pulled) leaves a half-open connection behind, and a
+ * server blocked on it waits forever.  The -T flag of the server sets
+ * how they are caught, 0 turns any of these off:
+ *
+ *      keepalive=SECS  TCP keepalive on every connection, probes start
+ *                      after SECS quiet and the kernel gives up after
+ *                      RSH_KEEPALIVE_PROBES unanswered ones.  Catches the
+ *                      dead peer even while a command is running, but only
+ *                      once the kernel has noticed.
+ *      ping=SECS       a session with nothing running that has been quiet
+ *                      this long gets a PING frame, which a client answers
+ *                      with PONG.  Also keeps NAT mappings alive.
+ *      dead=SECS       a session that hasn't answered a PING within this
+ *                      long is reaped.  A partial frame stuck in the
+ *                      socket counts as no answer, so this is also the
+ *                      read timeout; blocking reads get SO_RCVTIMEO of
+ *                      ping + dead for the same reason.
+ *      idle=SECS       a session that hasn't run a command for this long is
+ *                      told so and closed, however alive the client is.
+ *
+ * Sessions with a command running are never pinged or reaped here: their
+ * client may well be busy reading the output through a pager.
+ *
+ * Each session keeps an rsh_live_t with when it last heard from its
+ * client and when it last ran something.  Receiving bytes only stores a
+ * timestamp; the session's single timer is not moved on every frame.
+ * When the timer fires, rsh_live_check() looks at the timestamps and says
+ * what to do and when to look again, so a busy session costs one timer
+ * expiry per ping interval, not one wheel operation per frame.
+ *
+ * The timers live on a hashed timer wheel: RSH_WHEEL_SLOTS lists, one per
+ * RSH_WHEEL_TICK_MS tick, a timer hashed to the slot of the first tick at
+ * or after its expiry.  Arming and cancelling are O(1) list operations;
+ * advancing only looks at the slots of the ticks that passed, and a timer
+ * further out than one turn of the wheel just stays in its slot until its
+ * round comes.  The event-driven server runs a wheel per event loop, the
+ * worker pool one in the acceptor.  A thread-per-client connection has a
+ * single timer, so it just computes its next poll() timeout from its own
+ * rsh_live_t.
+ */
+
+rsh_timeouts_t g_rsh_timeouts = {
+    .keepalive_secs = RSH_KEEPALIVE_DEF,
+    .ping_secs = RSH_PING_DEF,
+    .dead_secs = RSH_DEAD_DEF,
+    .idle_secs = 0,
+};
+
+/*
+ * rsh_timeouts_parse(spec)
+ *      spec:  comma separated key=SECS pairs, see the top of this file
+ *
+ *  Must be called before start_server().
+ *
+ *  Returns OK, or ERR_CMD_ARGS_BAD for an unknown key or a bad value.
+ */
+int rsh_timeouts_parse(const char *spec) {
+    char buff[256];
+
+    strncpy(buff, spec, sizeof(buff) - 1);
+    buff[sizeof(buff) - 1] = '\0';
+
+    for (char *tok = strtok(buff, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        char *val = strchr(tok, '=');
+        char *end;
+        if (val == NULL) return ERR_CMD_ARGS_BAD;
+        *val++ = '\0';
+
+        long v = strtol(val, &end, 10);
+        if (end == val || *end != '\0' || v < 0 || v > RSH_TIMEOUT_MAX) return ERR_CMD_ARGS_BAD;
+
+        if (strcmp(tok, "keepalive") == 0) {
+            g_rsh_timeouts.keepalive_secs = (int)v;
+        } else if (strcmp(tok, "ping") == 0) {
+            g_rsh_timeouts.ping_secs = (int)v;
+        } else if (strcmp(tok, "dead") == 0) {
+            g_rsh_timeouts.dead_secs = (int)v;
+        } else if (strcmp(tok, "idle") == 0) {
+            g_rsh_timeouts.idle_secs = (int)v;
+        } else {
+            return ERR_CMD_ARGS_BAD;
+        }
+    }
+    return OK;
+}
+
+/*
+ * rsh_timeouts_sock(sock)
+ *
+ *  Sets up an accepted client socket: TCP keepalive, and a receive
+ *  timeout so a blocking read of a frame the client never finishes
+ *  fails instead of hanging.
+ */
+void rsh_timeouts_sock(int sock) {
+    rsh_sock_keepalive(sock, g_rsh_timeouts.keepalive_secs);
+
+    if (g_rsh_timeouts.ping_secs > 0 && g_rsh_timeouts.dead_secs > 0) {
+        struct timeval tv = { .tv_sec = g_rsh_timeouts.ping_secs + g_rsh_timeouts.dead_secs };
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+}
+
+/*
+ * rsh_timer_now_ms()
+ *
+ *  CLOCK_MONOTONIC in milliseconds, the clock of every deadline here.
+ */
+long rsh_timer_now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/**************   session liveness   ***************/
+
+/*
+ * rsh_live_init(lv, now)
+ *
+ *  A new session, heard from and active as of now.
+ */
+void rsh_live_init(rsh_live_t *lv, long now) {
+    lv->last_rx = now;
+    lv->last_active = now;
+    lv->pinged = 0;
+    lv->timer.next = lv->timer.prev = NULL;
+}
+
+/*
+ * rsh_live_rx(lv, now)
+ *
+ *  The client sent something, which answers any PING.
+ */
+void rsh_live_rx(rsh_live_t *lv, long now) {
+    lv->last_rx = now;
+    lv->pinged = 0;
+}
+
+/*
+ * rsh_live_active(lv, now)
+ *
+ *  A command started or ended.  Also restarts the quiet time before the
+ *  next PING, the client was busy with the command until now.
+ */
+void rsh_live_active(rsh_live_t *lv, long now) {
+    lv->last_active = now;
+    rsh_live_rx(lv, now);
+}
+
+// The earlier of two deadlines, 0 is none
+static long live_due(long due, long next) {
+    if (due == 0) return next;
+    return (next == 0 || due < next) ? due : next;
+}
+
+/*
+ * rsh_live_check(lv, now, busy, next)
+ *      busy:  the session has a command running
+ *      next:  set to when to check again, 0 if never
+ *
+ *  Decides what a session's timer firing means.  RSH_LIVE_PING records
+ *  that the PING went out, the caller sends it (or not, if the socket
+ *  has no room, which a dead client's doesn't either).
+ *
+ *  Returns RSH_LIVE_OK, RSH_LIVE_PING, RSH_LIVE_DEAD or RSH_LIVE_IDLE.
+ */
+int rsh_live_check(rsh_live_t *lv, long now, bool busy, long *next) {
+    long ping = g_rsh_timeouts.ping_secs * 1000L;
+    long dead = g_rsh_timeouts.dead_secs * 1000L;
+    long idle = g_rsh_timeouts.idle_secs * 1000L;
+    long quiet_since = (lv->last_rx > lv->last_active) ? lv->last_rx : lv->last_active;
+
+    *next = 0;
+    if (busy) {
+        // Look again later, whatever is shortest
+        long period = live_due(live_due(ping, dead), idle);
+        *next = (period > 0) ? now + period : 0;
+        return RSH_LIVE_OK;
+    }
+
+    if (lv->pinged != 0 && dead > 0) {
+        if (now - lv->pinged >= dead) return RSH_LIVE_DEAD;
+        *next = lv->pinged + dead;
+    }
+    if (idle > 0) {
+        if (now - lv->last_active >= idle) return RSH_LIVE_IDLE;
+        *next = live_due(lv->last_active + idle, *next);
+    }
+    if (lv->pinged == 0 && ping > 0) {
+        if (now - quiet_since >= ping) {
+            lv->pinged = now;
+            if (dead > 0) *next = live_due(now + dead, *next);
+            return RSH_LIVE_PING;
+        }
+        *next = live_due(quiet_since + ping, *next);
+    }
+    return RSH_LIVE_OK;
+}
+
+/**************   timer wheel   ***************/
+
+static long wheel_tick(long ms) {
+    return ms / RSH_WHEEL_TICK_MS;
+}
+
+// First tick at or after ms, a timer must not fire early
+static long wheel_tick_up(long ms) {
+    return (ms + RSH_WHEEL_TICK_MS - 1) / RSH_WHEEL_TICK_MS;
+}
+
+static void timer_link(rsh_timer_t *head, rsh_timer_t *t) {
+    t->prev = head;
+    t->next = head->next;
+    head->next->prev = t;
+    head->next = t;
+}
+
+static void timer_unlink(rsh_timer_t *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+/*
+ * rsh_wheel_init(w, now)
+ */
+void rsh_wheel_init(rsh_wheel_t *w, long now) {
+    w->tick = wheel_tick(now);
+    w->count = 0;
+    for (int i = 0; i < RSH_WHEEL_SLOTS; i++) {
+        w->slots[i].next = w->slots[i].prev = &w->slots[i];
+    }
+}
+
+/*
+ * rsh_timer_arm(w, t, expires)
+ *
+ *  (Re)arms t to fire at expires, in ms of rsh_timer_now_ms().  A time
+ *  already past fires on the next rsh_wheel_expire().
+ */
+void rsh_timer_arm(rsh_wheel_t *w, rsh_timer_t *t, long expires) {
+    rsh_timer_cancel(w, t);
+
+    long tick = wheel_tick_up(expires);
+    if (tick <= w->tick) tick = w->tick + 1;
+    t->expires = expires;
+    timer_link(&w->slots[tick % RSH_WHEEL_SLOTS], t);
+    w->count++;
+}
+
+/*
+ * rsh_timer_cancel(w, t)
+ *
+ *  Safe on a timer that isn't armed.
+ */
+void rsh_timer_cancel(rsh_wheel_t *w, rsh_timer_t *t) {
+    if (t->prev != NULL) {
+        timer_unlink(t);
+        w->count--;
+    }
+}
+
+/*
+ * rsh_wheel_expire(w, now)
+ *
+ *  Advances the wheel to now.
+ *
+ *  Returns the timers that are due, disarmed and chained through their
+ *  next pointer, NULL if none are.  Handlers may re-arm them.
+ */
+rsh_timer_t *rsh_wheel_expire(rsh_wheel_t *w, long now) {
+    rsh_timer_t *due = NULL;
+    long to = wheel_tick(now);
+
+    // More than a turn behind, every slot once is enough
+    long from = (to - w->tick > RSH_WHEEL_SLOTS) ? to - RSH_WHEEL_SLOTS + 1 : w->tick + 1;
+    for (long tick = from; tick <= to && w->count > 0; tick++) {
+        rsh_timer_t *head = &w->slots[tick % RSH_WHEEL_SLOTS];
+        for (rsh_timer_t *t = head->next; t != head; ) {
+            rsh_timer_t *next = t->next;
+            if (t->expires <= now) {
+                timer_unlink(t);
+                w->count--;
+                t->next = due;
+                due = t;
+            }
+            t = next;
+        }
+    }
+    if (to > w->tick) w->tick = to;
+    return due;
+}
+
+/*
+ * rsh_wheel_timeout(w, now)
+ *
+ *  Returns how many ms an event loop may sleep before the next timer is
+ *  due, or -1 if there are no timers.  May wake a little early for a
+ *  timer that is more than one turn of the wheel away.
+ */
+int rsh_wheel_timeout(rsh_wheel_t *w, long now) {
+    if (w->count == 0) {
+        return -1;
+    }
+    for (long tick = w->tick + 1; tick <= w->tick + RSH_WHEEL_SLOTS; tick++) {
+        rsh_timer_t *head = &w->slots[tick % RSH_WHEEL_SLOTS];
+        for (rsh_timer_t *t = head->next; t != head; t = t->next) {
+            if (wheel_tick_up(t->expires) <= tick) {
+                long ms = tick * RSH_WHEEL_TICK_MS - now;
+                return (ms > 0) ? (int)ms : 0;
+            }
+        }
+    }
+    return RSH_WHEEL_SLOTS * RSH_WHEEL_TICK_MS;
+}
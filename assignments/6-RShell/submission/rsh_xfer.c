@@ -0,0 +1,437 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+/*
+ * File transfer: `get` and `put`.
+ *
+ * `cat file` through the remote shell works for text, but the client
+ * can't tell the file from anything else the command prints, and a pipe
+ * and a fork sit in the middle.  get and put move files as frames, each
+ * end doing its part without the data coming up into user space:
+ *
+ *      get:  file ──sendfile──▶ socket ──splice──▶ pipe ──splice──▶ file
+ *      put:  the same, the other way round
+ *
+ * Sending is rsh_relay_chunk() for get (the stream's out_fd is simply the
+ * file) and rsh_send_file() for put, receiving is rsh_recv_file().  The
+ * data goes in frames of up to RSH_FRAME_MAX bytes, so on the server a get
+ * is relayed like any other command's output.
+ *
+ * Transfers resume: `get -c` asks for the file from where the local copy
+ * ends, `put -c` has the server say how much it already has.  Either way
+ * the check at the end is a CRC-32C of the whole file, so a partial copy
+ * that wasn't a prefix of the file after all is caught too.  A get's sum
+ * is carried along as the file is relayed and goes out after the data,
+ * so the file is read once and the event-driven server isn't stuck
+ * summing it before the first frame; only the part a resumed get skips
+ * is summed up front.  Bytes that went out through sendfile() are summed
+ * from the page cache right behind it, where they still are.  The sums
+ * are read through the page cache rather than mmap()ed, a file truncated
+ * under us would otherwise be a SIGBUS in the server.
+ *
+ * A put reads the socket until the client's SUM frame, so it only runs
+ * where a command may block on the client: the single and threaded
+ * servers and the worker pool.  The event-driven server only does get.
+ */
+
+#define XFER_READ_SZ        (1024*256)  //read size when summing a file
+
+/**************   CRC-32C   ***************/
+
+// Castagnoli polynomial, reflected; what iSCSI, ext4 and SSE 4.2 use
+#define CRC32C_POLY         0x82F63B78u
+
+static uint32_t g_crc_table[8][256];
+static pthread_once_t g_crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c >> 1) ^ (CRC32C_POLY & -(c & 1));
+        }
+        g_crc_table[0][i] = c;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            uint32_t prev = g_crc_table[t - 1][i];
+            g_crc_table[t][i] = (prev >> 8) ^ g_crc_table[0][prev & 0xff];
+        }
+    }
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+// The crc32 instruction does 8 bytes in one go, several times faster than
+// the tables; picked at run time so the build needs no -msse4.2
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c = crc;
+
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)c;
+    while (len-- > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+// Slicing-by-8, eight table lookups per 8 bytes instead of a loop per byte
+static uint32_t crc_sw(uint32_t crc, const uint8_t *p, size_t len) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        v ^= crc;
+        crc = g_crc_table[7][v & 0xff] ^ g_crc_table[6][(v >> 8) & 0xff] ^
+              g_crc_table[5][(v >> 16) & 0xff] ^ g_crc_table[4][(v >> 24) & 0xff] ^
+              g_crc_table[3][(v >> 32) & 0xff] ^ g_crc_table[2][(v >> 40) & 0xff] ^
+              g_crc_table[1][(v >> 48) & 0xff] ^ g_crc_table[0][v >> 56];
+        p += 8;
+        len -= 8;
+    }
+#endif
+    while (len-- > 0) {
+        crc = (crc >> 8) ^ g_crc_table[0][(crc ^ *p++) & 0xff];
+    }
+    return crc;
+}
+
+/*
+ * rsh_crc32c(crc, buff, len)
+ *
+ *  Returns the CRC-32C of buff carried on from crc, so a file can be
+ *  summed in pieces: start from 0 and pass each result to the next call.
+ */
+uint32_t rsh_crc32c(uint32_t crc, const void *buff, size_t len) {
+    pthread_once(&g_crc_once, crc_init);
+
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return ~crc_hw(~crc, buff, len);
+    }
+#endif
+    return ~crc_sw(~crc, buff, len);
+}
+
+/*
+ * rsh_xfer_sum(fd, off, len, crc)
+ *
+ *  Carries *crc on over len bytes of fd starting at off.
+ *
+ *  Returns OK, or ERR_RDSH_CMD_EXEC if fd can't be read that far.
+ */
+int rsh_xfer_sum(int fd, long off, long len, uint32_t *crc) {
+    char *buff = malloc(XFER_READ_SZ);
+    int rc = OK;
+
+    if (buff == NULL) {
+        return ERR_MEMORY;
+    }
+    posix_fadvise(fd, off, len, POSIX_FADV_SEQUENTIAL);
+    while (len > 0) {
+        ssize_t n = pread(fd, buff, (len < XFER_READ_SZ) ? len : XFER_READ_SZ, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            rc = ERR_RDSH_CMD_EXEC;
+            break;
+        }
+        *crc = rsh_crc32c(*crc, buff, n);
+        off += n;
+        len -= n;
+    }
+    free(buff);
+    return rc;
+}
+
+/**************   SUM frames   ***************/
+
+/*
+ * rsh_sum_pack(payload, size, crc)
+ *
+ *  Fills in the RSH_SUM_SZ byte payload of a SUM frame.
+ */
+void rsh_sum_pack(char *payload, long size, uint32_t crc) {
+    uint32_t hi = htonl((uint32_t)((uint64_t)size >> 32));
+    uint32_t lo = htonl((uint32_t)size);
+    uint32_t n_crc = htonl(crc);
+
+    memcpy(payload, &hi, 4);
+    memcpy(payload + 4, &lo, 4);
+    memcpy(payload + 8, &n_crc, 4);
+}
+
+/*
+ * rsh_sum_parse(hdr, payload, size, crc)
+ *
+ *  Returns OK, or ERR_RDSH_PROTOCOL if the frame is not a SUM frame.
+ */
+int rsh_sum_parse(const rsh_frame_hdr_t *hdr, const char *payload, long *size, uint32_t *crc) {
+    uint32_t hi, lo, n_crc;
+
+    if (hdr->type != RSH_FRAME_SUM || hdr->len != RSH_SUM_SZ) {
+        return ERR_RDSH_PROTOCOL;
+    }
+    memcpy(&hi, payload, 4);
+    memcpy(&lo, payload + 4, 4);
+    memcpy(&n_crc, payload + 8, 4);
+    *size = (long)(((uint64_t)ntohl(hi) << 32) | ntohl(lo));
+    *crc = ntohl(n_crc);
+    return (*size < 0) ? ERR_RDSH_PROTOCOL : OK;
+}
+
+/*
+ * rsh_send_sum(sock, stream, size, crc)
+ *
+ *  Sends a SUM frame.
+ *
+ *  Returns OK or ERR_RDSH_COMMUNICATION.
+ */
+int rsh_send_sum(int sock, uint32_t stream, long size, uint32_t crc) {
+    char sum[RSH_SUM_SZ];
+
+    rsh_sum_pack(sum, size, crc);
+    return rsh_send_frame(sock, RSH_FRAME_SUM, stream, sum, RSH_SUM_SZ);
+}
+
+/**************   server side   ***************/
+
+// Like a builtin that failed: the message goes out as STDERR, status 1.
+// path is NULL for a usage message.
+static int get_error(rsh_stream_t *st, const char *path, const char *why) {
+    int err_fd = memfd_create("rsh-get-err", MFD_CLOEXEC);
+    if (err_fd < 0) {
+        perror("memfd_create");
+        return ERR_RDSH_CMD_EXEC;
+    }
+    if (path == NULL) {
+        dprintf(err_fd, "usage: get path [offset]\n");
+    } else {
+        dprintf(err_fd, "get: %s: %s\n", path, why);
+    }
+    lseek(err_fd, 0, SEEK_SET);
+    st->err_fd = err_fd;
+    st->status = 1;
+    return OK;
+}
+
+/*
+ * rsh_xfer_get(st, cmd, dir_fd)
+ *      cmd:     `get PATH [OFFSET]`
+ *      dir_fd:  the session's directory, a relative PATH starts there
+ *
+ *  Sets st up to relay PATH from OFFSET on as its stdout, with the first
+ *  OFFSET bytes summed into st->get_size and st->get_crc; rsh_xfer_sent()
+ *  sums the rest as it goes out, for the SUM frame the caller sends after
+ *  the output.  Errors become the stream's stderr.
+ *
+ *  Returns OK, or ERR_RDSH_CMD_EXEC if not even the error could be set up.
+ */
+int rsh_xfer_get(rsh_stream_t *st, cmd_buff_t *cmd, int dir_fd) {
+    struct stat sb;
+    long off = 0;
+    char *end = NULL;
+
+    if (cmd->argc == 3) {
+        off = strtol(cmd->argv[2], &end, 10);
+    }
+    if (cmd->argc < 2 || cmd->argc > 3 || (end != NULL && (*end != '\0' || off < 0))) {
+        return get_error(st, NULL, NULL);
+    }
+
+    const char *path = cmd->argv[1];
+    int fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return get_error(st, path, strerror(errno));
+    }
+    if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+        close(fd);
+        return get_error(st, path, "not a regular file");
+    }
+    if (off > sb.st_size) {
+        close(fd);
+        return get_error(st, path, "offset past the end of the file");
+    }
+
+    uint32_t crc = 0;
+    if (rsh_xfer_sum(fd, 0, off, &crc) != OK) {
+        close(fd);
+        return get_error(st, path, "read error");
+    }
+
+    lseek(fd, off, SEEK_SET);
+    st->out_fd = fd;
+    st->status = 0;
+    st->get = true;
+    st->get_size = off;
+    st->get_crc = crc;
+    return OK;
+}
+
+/*
+ * rsh_xfer_sent(st, data, n)
+ *      data:  the n bytes, or NULL if they went out without passing
+ *             through our buffers
+ *
+ *  Carries a get's sum on over the n bytes of its file just relayed,
+ *  which end at the file position.  Without data they are read back from
+ *  the page cache.  Does nothing for other streams.
+ */
+void rsh_xfer_sent(rsh_stream_t *st, const char *data, int n) {
+    if (!st->get || st->get_size < 0 || n <= 0) return;
+
+    if (data != NULL) {
+        st->get_crc = rsh_crc32c(st->get_crc, data, n);
+    } else {
+        off_t pos = lseek(st->out_fd, 0, SEEK_CUR);
+        if (pos != st->get_size + n ||
+            rsh_xfer_sum(st->out_fd, st->get_size, n, &st->get_crc) != OK) {
+            st->get_size = -1;              //the client's check fails
+            return;
+        }
+    }
+    st->get_size += n;
+}
+
+static int put_error(int sock, uint32_t stream, const char *path, const char *why) {
+    char msg[512];
+
+    if (path == NULL) {
+        snprintf(msg, sizeof(msg), "usage: put [-c] path\n");
+    } else {
+        snprintf(msg, sizeof(msg), "put: %s: %s\n", path, why);
+    }
+    return (rsh_send_frame(sock, RSH_FRAME_STDERR, stream, msg, strlen(msg)) == OK) ?
+           1 : ERR_RDSH_COMMUNICATION;
+}
+
+// Takes DATA frames into fd from off on until the client's SUM frame
+static int put_receive(int sock, int fd, long *off, long *size, uint32_t *crc, bool *write_failed) {
+    rsh_frame_hdr_t hdr;
+    char sum[RSH_SUM_SZ];
+    int pipe_fds[2];
+
+    // Without a pipe rsh_recv_file() falls back to recv() and pwrite(); the
+    // client is already sending, so the frames have to be taken either way
+    int *pipep = (pipe2(pipe_fds, O_CLOEXEC) == 0) ? pipe_fds : NULL;
+
+    int rc;
+    while ((rc = rsh_recv_header(sock, &hdr)) == OK) {
+        rsh_metrics_add(RSH_M_BYTES_IN, RSH_FRAME_HDR_SZ + hdr.len);
+        if (hdr.type == RSH_FRAME_DATA) {
+            rc = rsh_recv_file(sock, hdr.len, fd, *off, pipep);
+            if (rc == ERR_RDSH_CMD_EXEC) {
+                *write_failed = true;       //keep reading, the frames must be consumed
+                rc = OK;
+            } else if (rc != OK) {
+                break;
+            }
+            *off += hdr.len;
+        } else if (hdr.type == RSH_FRAME_SUM) {
+            rc = rsh_recv_payload(sock, &hdr, sum, sizeof(sum));
+            if (rc == OK) {
+                rc = rsh_sum_parse(&hdr, sum, size, crc);
+            }
+            break;
+        } else {
+            rc = ERR_RDSH_PROTOCOL;         //no way to tell where the file ends
+            break;
+        }
+    }
+
+    if (pipep != NULL) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+    }
+    return rc;
+}
+
+/*
+ * rsh_xfer_put(sock, stream, cmd, dir_fd)
+ *      cmd:     `put [-c] PATH`
+ *      dir_fd:  the session's directory, a relative PATH starts there
+ *
+ *  Receives a file from the client into PATH, blocking on sock until the
+ *  client's SUM frame.  Error messages are sent as STDERR, the caller
+ *  sends the END frame.
+ *
+ *  Returns:
+ *      0, 1:                    exit status for the END frame
+ *      ERR_RDSH_COMMUNICATION:  the client went away or sent something
+ *                               other than the file, drop the connection
+ */
+int rsh_xfer_put(int sock, uint32_t stream, cmd_buff_t *cmd, int dir_fd) {
+    struct stat sb;
+    long started = rsh_metrics_now_us();
+    bool resume = (cmd->argc == 3 && strcmp(cmd->argv[1], "-c") == 0);
+
+    rsh_metrics_add(RSH_M_COMMANDS, 1);
+    if (cmd->argc != 2 && !resume) {
+        return put_error(sock, stream, NULL, NULL);
+    }
+
+    const char *path = cmd->argv[cmd->argc - 1];
+    int fd = openat(dir_fd, path, O_RDWR | O_CREAT | O_CLOEXEC | (resume ? 0 : O_TRUNC), 0644);
+    if (fd < 0) {
+        return put_error(sock, stream, path, strerror(errno));
+    }
+    if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+        close(fd);
+        return put_error(sock, stream, path, "not a regular file");
+    }
+
+    // Tell the client how much we have, it sends the rest
+    long have = resume ? sb.st_size : 0;
+    uint32_t crc = 0;
+    if (rsh_xfer_sum(fd, 0, have, &crc) != OK) {
+        close(fd);
+        return put_error(sock, stream, path, "read error");
+    }
+    if (rsh_send_sum(sock, stream, have, crc) != OK) {
+        close(fd);
+        return ERR_RDSH_COMMUNICATION;
+    }
+
+    long off = have, size = 0;
+    uint32_t want = 0;
+    bool write_failed = false;
+    int rc = put_receive(sock, fd, &off, &size, &want, &write_failed);
+    if (rc != OK) {
+        close(fd);
+        return ERR_RDSH_COMMUNICATION;
+    }
+
+    // What arrived is summed from the page cache, on top of what we had
+    int status = 0;
+    if (write_failed) {
+        status = put_error(sock, stream, path, "write error");
+    } else if (off != size || rsh_xfer_sum(fd, have, off - have, &crc) != OK || crc != want) {
+        status = put_error(sock, stream, path, "checksum mismatch");
+    }
+    close(fd);
+
+    rsh_metrics_observe(RSH_H_COMMAND, rsh_metrics_now_us() - started);
+    return status;
+}
@@ -1,6 +1,8 @@
 #ifndef __RSH_LIB_H__
     #define __RSH_LIB_H__
 
+#include <stdint.h>
+
 #include "dshlib.h"
 
 //common remote shell client and server constants and definitions
@@ -16,6 +18,7 @@
 
 //constants for buffer sizes
 #define RDSH_COMM_BUFF_SZ       (1024*64)   //64K
+#define RSH_CLIENT_RCVBUF       (1024*1024*8)   //client SO_RCVBUF, see rsh_sock_rcvbuf()
 #define STOP_SERVER_SC          200         //returned from pipeline excution
                                             //if the command is to stop the
                                             //server.  See documentation for 
@@ -29,11 +32,90 @@
 //linux based systems. 
 static const char RDSH_EOF_CHAR = 0x04;    
 
+//framed protocol (see rsh_proto.c).  The EOF marker above can't tell a
+//0x04 in a command's output from the end of it, so every message is now a
+//frame: a fixed 12 byte header followed by `len` bytes of payload.
+//
+//      u8 version | u8 type | u16 flags | u32 stream | u32 len | payload
+//
+//all header fields are in network byte order.  Each side opens with a
+//HELLO, then the client sends CMD frames and the server answers each one
+//with any number of STDOUT and STDERR frames and a single END frame, all
+//carrying the CMD's stream id.  A client may have several commands
+//running at once; frames from different streams arrive interleaved.  The
+//END frame is the status frame: its payload is the command's exit status
+//as a 4 byte integer.  Error replies from the server itself are STDERR.
+//At any time between frames the server may send a PING, which the client
+//answers with a PONG of the same stream id; anything else unknown to a
+//receiver is skipped.
+#define RSH_PROTO_VERSION       1
+#define RSH_FRAME_HDR_SZ        12
+#define RSH_FRAME_MAX           (1024*64)   //largest payload we accept
+
+#define RSH_FRAME_HELLO         1           //first frame in each direction
+#define RSH_FRAME_CMD           2           //client: command line
+#define RSH_FRAME_STDOUT        3           //server: command output
+#define RSH_FRAME_END           4           //server: command finished
+#define RSH_FRAME_STDERR        5           //server: command error output
+#define RSH_FRAME_DATA          6           //client: part of a file being put
+#define RSH_FRAME_SUM           7           //either: size and checksum of a file
+#define RSH_FRAME_PING          8           //server: still there? (see rsh_timer.c)
+#define RSH_FRAME_PONG          9           //client: yes, the PING's stream id
+#define RSH_MAX_STREAMS         16          //commands in flight per client
+
+//CMD frame flags.  A client that sends commands without waiting for each
+//reply (batch mode, see rsh_cli.c) marks them ORDERED: such a command
+//doesn't start while an earlier ORDERED command that isn't BACKGROUND is
+//still running on the connection, so a script runs the way it would
+//typed in.  Commands without flags start right away, like `cmd &`.
+#define RSH_CMD_ORDERED         0x0001
+#define RSH_CMD_BACKGROUND      0x0002
+#define RSH_CMD_LZ              0x0004      //compress this command's output
+#define RSH_BATCH_WINDOW        64          //commands in flight in batch mode
+
+//output compression (see rsh_lz.c).  A client that wants it sets
+//RSH_HELLO_LZ on its HELLO, a server that can do it sets it on the HELLO
+//it answers with.  Once both have, the client may set RSH_CMD_LZ on a
+//command, and then any STDOUT or STDERR frame of that stream with
+//RSH_OUT_LZ set carries the size of the output as a 4 byte integer
+//followed by the LZ4 block.  Frames under RSH_LZ_MIN bytes, or that
+//don't get smaller, are sent as they are.
+#define RSH_HELLO_LZ            0x0001
+#define RSH_OUT_LZ              0x0001
+#define RSH_LZ_MIN              512
+#define RSH_LZ_MINMATCH         4
+int rsh_lz_compress(const void *src, int len, void *dst, int cap);
+int rsh_lz_decompress(const void *src, int len, void *dst, int cap);
+
+//file transfer (see rsh_xfer.c).  `get PATH OFFSET` is answered with the
+//file from OFFSET on as STDOUT frames, a SUM frame for the whole file as
+//sent and the END frame.  `put [-c] PATH` is answered with a SUM frame
+//for what the server already has (nothing without -c), the client then
+//sends the rest as DATA frames and a SUM frame for the whole file, and
+//the server ENDs with 0 if its copy matches.  A SUM payload is the file
+//size as 8 bytes and its CRC-32C as 4, network byte order.
+#define RSH_GET_CMD             "get"
+#define RSH_PUT_CMD             "put"
+#define RSH_SUM_SZ              12
+uint32_t rsh_crc32c(uint32_t crc, const void *buff, size_t len);
+
+typedef struct rsh_frame_hdr {
+    uint8_t  version;
+    uint8_t  type;
+    uint16_t flags;
+    uint32_t stream;
+    uint32_t len;
+} rsh_frame_hdr_t;
+
 //rdsh specific error codes for functions
 #define ERR_RDSH_COMMUNICATION  -50     //Used for communication errors
 #define ERR_RDSH_SERVER         -51     //General server errors
 #define ERR_RDSH_CLIENT         -52     //General client errors
 #define ERR_RDSH_CMD_EXEC       -53     //RSH command execution errors
+#define ERR_RDSH_PROTOCOL       -54     //Malformed frame or wrong version
+#define WARN_RDSH_CLOSED        -55     //Peer closed between frames
+#define WARN_RDSH_AGAIN         -56     //Nothing to read right now
+#define ERR_RDSH_LIMIT          -57     //Command can never fit the -L limits
 #define WARN_RDSH_NOT_IMPL      -99     //Not Implemented yet warning
 
 //Output message constants for server
@@ -52,6 +134,10 @@ static const char RDSH_EOF_CHAR = 0x04;
 //client prototypes for rsh_cli.c - - see documentation for each function to
 //see what they do
 int start_client(char *address, int port);
+int rsh_client_status(void);
+void set_client_batch(int window);
+void set_client_agent(bool use_agent);
+void set_client_compress(bool compress);
 int client_cleanup(int cli_socket, char *cmd_buff, char *rsp_buff, int rc);
 int exec_remote_cmd_loop(char *address, int port);
     
@@ -65,10 +151,257 @@ int send_message_eof(int cli_socket);
 int send_message_string(int cli_socket, char *buff);
 int process_cli_requests(int svr_socket);
 int exec_client_requests(int cli_socket);
-int rsh_execute_pipeline(int socket_fd, command_list_t *clist);
 
+//per-session working directory and environment (see rsh_shell.c)
+typedef struct rsh_shell {
+    int      cwd_fd;                //O_PATH, AT_FDCWD for the server's own
+    char   **env;                   //NULL until changed: the server's environ
+    int      nenv;
+    int      env_cap;
+    bool     own_path;              //PATH isn't the server's, don't hash
+} rsh_shell_t;
+int  rsh_shell_init(rsh_shell_t *sh);
+void rsh_shell_free(rsh_shell_t *sh);
+const char *rsh_shell_getenv(rsh_shell_t *sh, const char *name);
+int  rsh_shell_setenv(rsh_shell_t *sh, const char *assignment);
+int  rsh_shell_unsetenv(rsh_shell_t *sh, const char *name);
+int  rsh_shell_cd(rsh_shell_t *sh, const char *dir, int err_fd);
+Built_In_Cmds rsh_shell_builtin(rsh_shell_t *sh, cmd_buff_t *cmd, bi_ctx_t *ctx);
+
+int rsh_execute_pipeline(int socket_fd, rsh_shell_t *sh, command_list_t *clist, int last_rc,
+                         uint32_t stream, uint16_t flags);
 Built_In_Cmds rsh_match_command(const char *input);
-Built_In_Cmds rsh_built_in_cmd(cmd_buff_t *cmd);
+Built_In_Cmds rsh_built_in_cmd(cmd_buff_t *cmd, bi_ctx_t *ctx, rsh_shell_t *sh);
+int rsh_spawn_pipeline(command_list_t *clist, rsh_shell_t *sh, int in_fd, int out_fd, int err_fd,
+                       pid_t pids[]);
+int rsh_spawn_stages(command_list_t *clist, const char *exe[], int in_fd, int out_fd,
+                     int err_fd, int cwd_fd, char **env, pid_t pids[], bool sibling);
+
+//frame helpers (see rsh_proto.c)
+void rsh_frame_pack(char *hdr, int type, uint16_t flags, uint32_t stream, uint32_t len);
+int  rsh_frame_parse(const char *buff, size_t len, rsh_frame_hdr_t *hdr);
+int  rsh_send_frame(int sock, int type, uint32_t stream, const void *payload, uint32_t len);
+int  rsh_send_cmd(int sock, uint32_t stream, uint16_t flags, const char *cmd, uint32_t len);
+int  rsh_recv_frame(int sock, rsh_frame_hdr_t *hdr, void *payload, size_t payload_sz);
+int  rsh_recv_header(int sock, rsh_frame_hdr_t *hdr);
+int  rsh_recv_payload(int sock, const rsh_frame_hdr_t *hdr, void *payload, size_t payload_sz);
+int  rsh_send_file(int sock, int type, uint32_t stream, int fd, off_t off, uint32_t len);
+int  rsh_recv_file(int sock, uint32_t len, int fd, off_t off, int pipe_fds[2]);
+int  rsh_write_all(int fd, const void *buff, size_t len);
+int  rsh_send_frame_flags(int sock, int type, uint16_t flags, uint32_t stream,
+                         const void *payload, uint32_t len);
+int  rsh_relay_chunk(int src_fd, int sock, int type, uint32_t stream, bool compress);
+int  rsh_lz_pack(char *frame, int type, uint32_t stream, const char *data, int len, int cap);
+int  rsh_lz_unpack(const rsh_frame_hdr_t *hdr, const char *payload, char *out, int cap);
+int  rsh_send_end(int sock, uint32_t stream, int status);
+int  rsh_send_reply(int sock, uint32_t stream, const char *msg, int status);
+int  rsh_end_status(const rsh_frame_hdr_t *hdr, const void *payload);
+struct sockaddr_storage;
+int  rsh_sockaddr(const char *addr, int port, struct sockaddr_storage *ss);
+void rsh_sock_nodelay(int sock);
+void rsh_sock_keepalive(int sock, int secs);
+void rsh_sock_rcvbuf(int sock, int bytes);
+int  rsh_send_frame_nowait(int sock, int type, uint32_t stream, const void *payload, uint32_t len);
+
+//a command running on behalf of a client (see rsh_stream.c)
+typedef struct rsh_stream {
+    bool     active;
+    uint32_t id;                    //stream id of the CMD frame
+    int      out_fd;                //pipe or builtin memfd, -1 at end of file
+    int      err_fd;                //same for stderr
+    int      nprocs;
+    int      running;
+    pid_t    pids[CMD_MAX];
+    int      pidfds[CMD_MAX];
+    int      status;                //exit status of the last stage
+    bool     ordered;               //holds up later RSH_CMD_ORDERED commands
+    long     out_bytes;             //output relayed so far, for the out limit
+    long     started_us;            //see rsh_metrics_now_us()
+    bool     compress;              //RSH_CMD_LZ, output is sent compressed
+    bool     get;                   //out_fd is a file for `get`, summed as sent:
+    long     get_size;              //bytes summed so far, -1 on a read error
+    uint32_t get_crc;
+} rsh_stream_t;
+
+void rsh_stream_init(rsh_stream_t *streams, int n);
+rsh_stream_t *rsh_stream_slot(rsh_stream_t *streams, int n);
+int  rsh_stream_start(rsh_stream_t *st, uint32_t id, rsh_shell_t *sh, command_list_t *clist,
+                      int last_rc, int in_fd);
+void rsh_stream_reap(rsh_stream_t *st, int idx, int flags);
+bool rsh_stream_done(rsh_stream_t *st);
+int  rsh_stream_relay(rsh_stream_t *st, int sock);
+void rsh_stream_close(rsh_stream_t *st);
+int  rsh_stream_stages(const char *cmd_line, int len);
+bool rsh_stream_must_wait(rsh_stream_t *streams, int n, uint16_t cmd_flags, int nstages);
+const char *rsh_stream_error(int rc, command_list_t *clist);
+int  rsh_xfer_sum(int fd, long off, long len, uint32_t *crc);
+void rsh_sum_pack(char *payload, long size, uint32_t crc);
+int  rsh_send_sum(int sock, uint32_t stream, long size, uint32_t crc);
+int  rsh_sum_parse(const rsh_frame_hdr_t *hdr, const char *payload, long *size, uint32_t *crc);
+int  rsh_xfer_get(rsh_stream_t *st, cmd_buff_t *cmd, int dir_fd);
+int  rsh_xfer_put(int sock, uint32_t stream, cmd_buff_t *cmd, int dir_fd);
+void rsh_xfer_sent(rsh_stream_t *st, const char *data, int n);
+void rsh_stream_sent(rsh_stream_t *st, const char *data, int n);
+int rsh_start_command(int cli_socket, rsh_stream_t *streams, rsh_shell_t *sh, uint32_t stream,
+                      uint16_t flags, char *cmd_line, int *last_rc, int in_fd);
+#define CMD_ERR_RDSH_BUSY       "rdsh-error: too many commands running\n"
+#define CMD_ERR_RDSH_STOPPING   "rdsh-error: server is shutting down\n"
+#define CMD_ERR_RDSH_OVERLOAD   "rdsh-error: server is at its process limit, try again\n"
+#define CMD_ERR_RDSH_LIMIT      "rdsh-error: pipeline has more stages than the process limit\n"
+#define CMD_ERR_RDSH_PUT        "rdsh-error: put is not available on a server run with -e\n"
+#define CMD_ERR_RDSH_IDLE       "rdsh-error: session idle too long, closing it\n"
+
+//server concurrency modes, passed to start_server() as is_threaded
+#define RSH_SVR_SINGLE          0           //one client at a time
+#define RSH_SVR_THREADED        1           //-x: a thread per client
+#define RSH_SVR_REACTOR         2           //-e: epoll event loops
+#define RSH_SVR_POOL            3           //-w: work-stealing worker pool
+#define RSH_ACCEPTORS_MAX       16          //largest -k
+#define RSH_MAX_THREADS         64
+void set_server_threads(int nthreads);
+void set_server_acceptors(int nacceptors);
+extern volatile int g_server_should_exit;
+
+//epoll reactor (see rsh_reactor.c)
+#define RSH_SESSION_INBUF       4096        //pending command bytes per client
+#define RSH_REACTOR_OUTBUF      (1024*16)   //unsent output per client
+#define RSH_REACTOR_EVENTS      64          //epoll_wait() batch
+#define RSH_REACTOR_ACCEPT_MAX  16          //accepts per wakeup, spreads load
+#define CMD_ERR_RDSH_TOO_LONG   "rdsh-error: command too long\n"
+#define CMD_ERR_RDSH_PIPE_BI    "Built-in commands don't support piping\n"
+int rsh_reactor_run(int svr_socket, int nthreads);
+
+//work-stealing worker pool (see rsh_pool.c)
+#define RSH_POOL_DEQUE_SZ       256         //per worker, must be a power of 2
+#define STATS_CMD               "stats"
+int rsh_pool_run(int svr_socket, int nthreads);
+int rsh_pool_stats(int out_fd);
+int rsh_server_stats(int out_fd);
+
+//how long sessions of a stopping server get to finish running commands
+#define RSH_DRAIN_SECS          5
+
+//pre-forked spawners that fork commands for the server (see rsh_spawner.c)
+#define RSH_SPAWNER_DEF         8           //-f default, most spawners kept
+#define RSH_SPAWNER_LIMIT       64          //largest -f
+#define RSH_SPAWNER_MIN         2           //the pool never shrinks below this
+#define RSH_SPAWNER_IDLE_SECS   5           //idle time before a spawner retires
+void set_server_spawners(int nspawners);
+int  rsh_spawner_init(int max);
+void rsh_spawner_shutdown(void);
+int  rsh_spawner_spawn(command_list_t *clist, const char *exe[], int in_fd, int out_fd,
+                       int err_fd, int cwd_fd, char **env, pid_t pids[]);
+void rsh_spawner_record(long start_us, bool via_spawner);
+int  rsh_spawner_stats(int out_fd);
+
+//per-session and global resource limits, -L (see rsh_limits.c)
+#define RSH_LIMIT_PROCS_MAX     4096
+typedef struct rsh_limits {
+    int      procs;                 //running stages per session, 0 is unlimited
+    int      total;                 //running stages on the whole server
+    long     cpu_secs;              //RLIMIT_CPU of each stage
+    long     mem_bytes;             //RLIMIT_AS of each stage
+    long     out_bytes;             //output relayed per command
+} rsh_limits_t;
+extern rsh_limits_t g_rsh_limits;
+int  rsh_limits_parse(const char *spec);
+bool rsh_limits_admit(int nstages);
+void rsh_limits_release(int nstages);
+void rsh_limits_output(rsh_stream_t *st, int n);
+void rsh_limits_child(void);
+int  rsh_limits_stats(int out_fd);
+int  rsh_limits_running(void);
+
+//heartbeats, idle timeouts and the timer wheel, -T (see rsh_timer.c)
+#define RSH_KEEPALIVE_DEF       60          //TCP keepalive idle time, seconds
+#define RSH_KEEPALIVE_PROBES    4           //unanswered probes before it gives up
+#define RSH_PING_DEF            30          //quiet time before a PING, seconds
+#define RSH_DEAD_DEF            30          //time to answer it
+#define RSH_TIMEOUT_MAX         86400
+#define RSH_WHEEL_SLOTS         512         //a turn is 51.2s
+#define RSH_WHEEL_TICK_MS       100
+typedef struct rsh_timeouts {
+    int      keepalive_secs;
+    int      ping_secs;
+    int      dead_secs;
+    int      idle_secs;
+} rsh_timeouts_t;
+extern rsh_timeouts_t g_rsh_timeouts;
+
+typedef struct rsh_timer {
+    long     expires;               //ms, rsh_timer_now_ms()
+    struct rsh_timer *next;         //NULL while not armed
+    struct rsh_timer *prev;
+} rsh_timer_t;
+
+typedef struct rsh_wheel {
+    long        tick;               //last tick expired
+    int         count;              //timers armed
+    rsh_timer_t slots[RSH_WHEEL_SLOTS];
+} rsh_wheel_t;
+
+typedef struct rsh_live {
+    long        last_rx;            //ms, last bytes from the client
+    long        last_active;        //ms, last command started or ended
+    long        pinged;             //ms, PING not answered yet, or 0
+    rsh_timer_t timer;
+} rsh_live_t;
+
+enum { RSH_LIVE_OK, RSH_LIVE_PING, RSH_LIVE_DEAD, RSH_LIVE_IDLE };
+int  rsh_timeouts_parse(const char *spec);
+void rsh_timeouts_sock(int sock);
+long rsh_timer_now_ms(void);
+void rsh_live_init(rsh_live_t *lv, long now);
+void rsh_live_rx(rsh_live_t *lv, long now);
+void rsh_live_active(rsh_live_t *lv, long now);
+int  rsh_live_check(rsh_live_t *lv, long now, bool busy, long *next);
+void rsh_wheel_init(rsh_wheel_t *w, long now);
+void rsh_timer_arm(rsh_wheel_t *w, rsh_timer_t *t, long expires);
+void rsh_timer_cancel(rsh_wheel_t *w, rsh_timer_t *t);
+rsh_timer_t *rsh_wheel_expire(rsh_wheel_t *w, long now);
+int  rsh_wheel_timeout(rsh_wheel_t *w, long now);
+
+//lock-free server metrics, `stats` and the -M scrape socket (see rsh_metrics.c)
+#define RSH_METRICS_BUCKETS     32          //log2(us) buckets, up to ~36 min
+enum {
+    RSH_M_CONNS,                            //connections accepted
+    RSH_M_CONNS_CLOSED,
+    RSH_M_COMMANDS,                         //commands started
+    RSH_M_BYTES_IN,                         //bytes received from clients
+    RSH_M_BYTES_OUT,                        //command output relayed
+    RSH_M_SPAWNS_HELPER,                    //pipelines started by a spawner
+    RSH_M_SPAWNS_DIRECT,                    //or forked by the server itself
+    RSH_M_REAPED_DEAD,                      //sessions that stopped answering PINGs
+    RSH_M_REAPED_IDLE,                      //sessions closed for running nothing
+    RSH_M_COUNT
+};
+enum {
+    RSH_H_SPAWN,                            //fork/spawn latency
+    RSH_H_COMMAND,                          //CMD start to END
+    RSH_H_COUNT
+};
+extern int g_server_verbose;
+void set_server_verbose(int verbose);
+void set_server_metrics(const char *addr);
+void rsh_metrics_add(int counter, long n);
+void rsh_metrics_observe(int hist, long usec);
+long rsh_metrics_now_us(void);
+long rsh_metrics_read(int counter);
+long rsh_metrics_hist(int hist, long buckets[], long *sum);
+long rsh_metrics_percentile(const long buckets[], long total, int pct);
+int  rsh_metrics_stats(int out_fd);
+int  rsh_metrics_write(int out_fd);
+int  rsh_metrics_serve(const char *addr);
+void rsh_metrics_stop(void);
+
+//local agent that keeps server connections warm for clients (see rsh_agent.c)
+#define RSH_AGENT_DIR_FMT       "/tmp/dsh-agent-%d"     //per uid, 0700, without $XDG_RUNTIME_DIR
+#define RSH_AGENT_SOCK_NAME     "dsh-agent.sock"
+#define RSH_AGENT_MAX_IDLE      32          //idle server connections kept
+#define RSH_AGENT_IDLE_SECS     60          //closed after this long unused
+int  rsh_agent_path(char *buff, size_t len, bool create);
+int  rsh_agent_run(const char *path);
+int  rsh_agent_connect(void);
 
 //eliminate from template, for extra credit
 // void set_threaded_server(int val);